@@ -5,8 +5,13 @@
  */
 
 #include "apps/kapi.h"
+#include "fs/poll.h"
+#include "fs/vfs.h"
 #include "printk.h"
 #include "mm/kmalloc.h"
+#include "sync/wait.h"
+#include "time/hrtimer.h"
+#include "time/vdso.h"
 
 /* Display structure from window.c - MUST match exactly! */
 struct display {
@@ -48,6 +53,7 @@ static void kapi_puts(const char *s) {
 static volatile int k_input_buf[KAPI_INPUT_BUF_SIZE];
 static volatile int k_input_r = 0;
 static volatile int k_input_w = 0;
+static DECLARE_WAIT_QUEUE_HEAD(k_input_wait);
 
 void kapi_sys_key_event(int key) {
     int next = (k_input_w + 1) % KAPI_INPUT_BUF_SIZE;
@@ -55,6 +61,36 @@ void kapi_sys_key_event(int key) {
         k_input_buf[k_input_w] = key;
         k_input_w = next;
     }
+    wake_up(&k_input_wait);
+}
+
+void kapi_wait_key(void) {
+    wait_event(k_input_wait, k_input_r != k_input_w);
+}
+
+int kapi_input_waiting(void) {
+    return waitqueue_active(&k_input_wait);
+}
+
+static unsigned int kapi_input_poll(struct file *file, struct poll_table *pt) {
+    poll_wait(file, &k_input_wait, pt);
+    return k_input_r != k_input_w ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations kapi_input_fops = {
+    .poll = kapi_input_poll,
+};
+
+/* Never freed: it starts with a reference nobody drops */
+static struct file kapi_input = {
+    .f_op = &kapi_input_fops,
+    .f_flags = O_RDONLY,
+    .f_count = {.counter = 1},
+};
+
+struct file *kapi_input_file(void) {
+    atomic_inc(&kapi_input.f_count);
+    return &kapi_input;
 }
 
 static int kapi_getc(void) {
@@ -138,28 +174,17 @@ static void kapi_sound_pause(void) {}
 static int kapi_sound_resume(void) { return 0; }
 static int kapi_sound_is_paused(void) { return 0; }
 
+/* The constant divides compile to multiplies */
 static unsigned long kapi_get_uptime_ticks(void) {
-    /* Read timer counter - architecture specific */
-#ifdef ARCH_ARM64
-    uint64_t cnt, freq;
-    asm volatile("mrs %0, cntvct_el0" : "=r"(cnt));
-    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
-    return (unsigned long)((cnt * 100ULL) / freq);
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-    /* Use arch timer abstraction */
-    extern uint64_t arch_timer_get_ticks(void);
-    extern uint64_t arch_timer_get_frequency(void);
-    uint64_t cnt = arch_timer_get_ticks();
-    uint64_t freq = arch_timer_get_frequency();
-    return (unsigned long)((cnt * 100ULL) / freq);
-#else
-    return 0;
-#endif
+    return (unsigned long)(vdso_clock_ns() / (NSEC_PER_SEC / 100));
+}
+
+static unsigned long kapi_get_uptime_ms(void) {
+    return (unsigned long)(vdso_clock_ns() / NSEC_PER_MSEC);
 }
 
 static void kapi_sleep_ms(uint32_t ms) {
-    /* Simple busy-wait sleep */
-    for (volatile uint32_t i = 0; i < ms * 10000; i++) { }
+    hrtimer_sleep((ktime_t)ms * NSEC_PER_MSEC);
 }
 
 static void *kapi_malloc(size_t size) {
@@ -431,6 +456,7 @@ void kapi_init(kapi_t *api) {
 
     extern void input_poll(void);
     api->input_poll = input_poll;
+    api->get_uptime_ms = kapi_get_uptime_ms;
 
     /* System info */
     api->get_uptime_ticks = kapi_get_uptime_ticks;
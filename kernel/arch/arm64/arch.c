@@ -5,6 +5,7 @@
 #include "arch/arch.h"
 #include "arch/arm64/gic.h"
 #include "arch/arm64/timer.h"
+#include "mm/kmalloc.h"
 #include "printk.h"
 #include "types.h"
 
@@ -16,8 +17,6 @@ extern uint64_t timer_get_frequency(void);
 /* SMP (Symmetric Multi-Processing) Support */
 /* ===================================================================== */
 
-#define MAX_CPUS 8
-
 /* Per-CPU data */
 struct cpu_data {
     uint32_t cpu_id;
@@ -30,83 +29,99 @@ static struct cpu_data cpu_info[MAX_CPUS];
 static volatile uint32_t num_cpus_online = 1;  /* Boot CPU is online */
 static volatile uint32_t smp_initialized = 0;
 
-/* Spinlock for SMP synchronization */
-typedef struct {
-    volatile uint32_t lock;
-} spinlock_t;
-
-#define SPINLOCK_INIT { 0 }
-
-static inline void spin_lock(spinlock_t *lock)
+/* Get current CPU ID */
+uint32_t smp_processor_id(void)
 {
-    uint32_t tmp;
-    asm volatile(
-        "sevl\n"
-        "1: wfe\n"
-        "2: ldaxr %w0, [%1]\n"
-        "   cbnz %w0, 1b\n"
-        "   stxr %w0, %w2, [%1]\n"
-        "   cbnz %w0, 2b\n"
-        : "=&r" (tmp)
-        : "r" (&lock->lock), "r" (1)
-        : "memory"
-    );
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r" (mpidr));
+    return mpidr & 0xFF;  /* Aff0 is the CPU ID on most systems */
 }
 
-static inline void spin_unlock(spinlock_t *lock)
+/* Get number of online CPUs */
+uint32_t smp_num_cpus(void)
 {
-    asm volatile("stlr wzr, [%0]" :: "r" (&lock->lock) : "memory");
+    return num_cpus_online;
 }
 
-/* Global kernel lock for SMP safety */
-static spinlock_t kernel_lock = SPINLOCK_INIT;
+/*
+ * Handoff from the boot CPU to secondary_entry in boot.S. Secondaries
+ * start with the MMU off, so they copy the boot CPU's translation setup
+ * from here. Field offsets are hard-coded in boot.S.
+ */
+struct secondary_boot_data {
+    uint64_t mair;              /* 0x00 */
+    uint64_t tcr;               /* 0x08 */
+    uint64_t ttbr0;             /* 0x10 */
+    uint64_t sctlr;             /* 0x18 */
+    uint64_t stack[MAX_CPUS];   /* 0x20: initial SP of each CPU */
+};
+
+struct secondary_boot_data secondary_boot_data;
 
-void smp_lock(void)
-{
-    spin_lock(&kernel_lock);
-}
+extern void secondary_entry(void);
+
+/* Kernel stack of a secondary CPU's idle context */
+#define SMP_STACK_SIZE      (16 * 1024)
+
+/* How long to wait for a started CPU to report in */
+#define SMP_BOOT_TIMEOUT_MS 100
 
-void smp_unlock(void)
+/* PSCI function IDs */
+#define PSCI_CPU_ON_64      0xC4000003
+
+/* Reschedule IPI: the IRQ return path switches to the new current */
+static void smp_reschedule_handler(uint32_t irq, void *data)
 {
-    spin_unlock(&kernel_lock);
+    (void)irq;
+    (void)data;
+    
+    extern void process_schedule_from_irq(void);
+    process_schedule_from_irq();
 }
 
-/* Get current CPU ID */
-uint32_t smp_processor_id(void)
+void arch_smp_send_reschedule(uint32_t cpu)
 {
-    uint64_t mpidr;
-    asm volatile("mrs %0, mpidr_el1" : "=r" (mpidr));
-    return mpidr & 0xFF;  /* Aff0 is the CPU ID on most systems */
+    if (cpu >= MAX_CPUS || !cpu_info[cpu].online) return;
+    gic_send_sgi(1U << cpu, SGI_RESCHEDULE);
 }
 
-/* Get number of online CPUs */
-uint32_t smp_num_cpus(void)
+/* Enable the per-CPU interrupts this CPU needs for scheduling */
+static void smp_cpu_irq_init(void)
 {
-    return num_cpus_online;
+    gic_set_priority(SGI_RESCHEDULE, GIC_PRIO_DEFAULT);
+    gic_enable_irq(SGI_RESCHEDULE);
 }
 
-/* Secondary CPU entry point (called from assembly) */
+/* Secondary CPU entry point (called from secondary_entry in boot.S) */
 void secondary_cpu_init(void)
 {
     uint32_t cpu_id = smp_processor_id();
     
+    extern void process_cpu_init(int cpu);
+    extern void sched_init_cpu(int cpu);
+    extern void process_schedule(void);
+    
     printk(KERN_INFO "SMP: CPU %u coming online\n", cpu_id);
     
-    /* Initialize GIC for this CPU */
+    /* Per-CPU scheduler state must exist before the first interrupt */
+    process_cpu_init(cpu_id);
+    sched_init_cpu(cpu_id);
+    
+    /* Initialize GIC for this CPU, then its tick and reschedule IPI */
     gic_cpu_init();
+    smp_cpu_irq_init();
+    timer_cpu_init();
     
     /* Mark CPU as online */
     cpu_info[cpu_id].online = 1;
     __atomic_add_fetch(&num_cpus_online, 1, __ATOMIC_SEQ_CST);
     
-    /* Enable interrupts */
-    arch_irq_enable();
-    
     printk(KERN_INFO "SMP: CPU %u online\n", cpu_id);
     
-    /* Enter idle loop - wait for work */
+    /* Enter the scheduler; it idles in wfi when nothing is runnable */
+    arch_irq_enable();
     while (1) {
-        asm volatile("wfe");  /* Wait for event */
+        process_schedule();
     }
 }
 
@@ -121,9 +136,6 @@ int smp_boot_secondary(uint32_t cpu_id, void (*entry)(void), void *stack)
     cpu_info[cpu_id].stack = stack;
     
     /* Use PSCI CPU_ON to start the secondary CPU */
-    /* PSCI function IDs */
-    #define PSCI_CPU_ON_64 0xC4000003
-    
     uint64_t target_cpu = cpu_id;
     uint64_t entry_point = (uint64_t)entry;
     uint64_t context_id = cpu_id;
@@ -152,7 +164,19 @@ int smp_boot_secondary(uint32_t cpu_id, void (*entry)(void), void *stack)
     }
 }
 
-/* Initialize SMP subsystem */
+/* Write the handoff block back to memory for CPUs running with caches off */
+static void smp_publish_boot_data(void)
+{
+    uint64_t start = (uint64_t)&secondary_boot_data & ~63ULL;
+    uint64_t end = (uint64_t)&secondary_boot_data + sizeof(secondary_boot_data);
+    
+    for (uint64_t p = start; p < end; p += 64) {
+        asm volatile("dc cvac, %0" :: "r" (p) : "memory");
+    }
+    asm volatile("dsb sy" ::: "memory");
+}
+
+/* Initialize SMP subsystem and bring up the secondary CPUs */
 void smp_init(void)
 {
     if (smp_initialized) return;
@@ -163,14 +187,53 @@ void smp_init(void)
     cpu_info[0].cpu_id = 0;
     cpu_info[0].online = 1;
     
+    gic_register_handler(SGI_RESCHEDULE, smp_reschedule_handler, NULL);
+    smp_cpu_irq_init();
+    
     smp_initialized = 1;
     
     printk(KERN_INFO "SMP: Boot CPU (CPU 0) initialized\n");
     
-    /* Note: Secondary CPUs are not auto-booted.
-     * Call smp_boot_secondary() to start them when ready.
-     * For QEMU virt with -smp N, CPUs wait for PSCI CPU_ON.
+    /* Secondaries run on the boot CPU's page tables */
+    asm volatile("mrs %0, mair_el1" : "=r" (secondary_boot_data.mair));
+    asm volatile("mrs %0, tcr_el1" : "=r" (secondary_boot_data.tcr));
+    asm volatile("mrs %0, ttbr0_el1" : "=r" (secondary_boot_data.ttbr0));
+    asm volatile("mrs %0, sctlr_el1" : "=r" (secondary_boot_data.sctlr));
+    
+    /*
+     * CPUs are numbered contiguously; the first one PSCI refuses to
+     * start marks the end of the machine.
      */
+    for (uint32_t cpu = 1; cpu < MAX_CPUS; cpu++) {
+        void *stack = kmalloc(SMP_STACK_SIZE);
+        if (!stack) {
+            printk(KERN_WARNING "SMP: No memory for CPU %u stack\n", cpu);
+            break;
+        }
+        
+        secondary_boot_data.stack[cpu] = ((uint64_t)stack + SMP_STACK_SIZE) & ~0xFULL;
+        smp_publish_boot_data();
+        
+        if (smp_boot_secondary(cpu, secondary_entry, stack) < 0) {
+            kfree(stack);
+            break;
+        }
+        
+        /* Wait for it so CPU IDs stay contiguous in num_cpus_online */
+        uint64_t start = timer_get_ms();
+        while (!__atomic_load_n(&cpu_info[cpu].online, __ATOMIC_ACQUIRE)) {
+            if (timer_get_ms() - start > SMP_BOOT_TIMEOUT_MS) {
+                break;
+            }
+            asm volatile("yield");
+        }
+        if (!cpu_info[cpu].online) {
+            printk(KERN_WARNING "SMP: CPU %u did not come online\n", cpu);
+            break;
+        }
+    }
+    
+    printk(KERN_INFO "SMP: %u CPUs online\n", num_cpus_online);
 }
 
 /* ===================================================================== */
@@ -248,6 +311,12 @@ uint64_t arch_timer_get_ms(void)
     return (ticks * 1000) / freq;
 }
 
+int arch_timer_set_event(uint64_t deadline)
+{
+    timer_set_event(deadline);
+    return 0;
+}
+
 /* ===================================================================== */
 /* Memory Management */
 /* ===================================================================== */
@@ -397,8 +466,7 @@ uint32_t arch_cpu_id(void)
 
 uint32_t arch_cpu_count(void)
 {
-    /* TODO: Parse device tree for CPU count */
-    return 1;
+    return num_cpus_online;
 }
 
 void arch_cpu_info(char *buf, size_t size)
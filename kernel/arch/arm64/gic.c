@@ -3,6 +3,7 @@
  */
 
 #include "arch/arm64/gic.h"
+#include "arch/arch.h"
 #include "printk.h"
 
 /* ===================================================================== */
@@ -16,6 +17,13 @@
 /* GICv3 stride between redistributors (each CPU has 64KB + 64KB) */
 #define GICR_STRIDE         (2 * 0x10000)
 
+/* GICR_TYPER: affinity of the frame's CPU and last-frame marker */
+#define GICR_TYPER_LAST     (1ULL << 4)
+#define GICR_TYPER_AFF_SHIFT 32
+
+/* Redistributor frame of each CPU, filled in by gic_find_redistributor() */
+static uint64_t gicr_base[MAX_CPUS];
+
 /* ===================================================================== */
 /* Interrupt handler table */
 /* ===================================================================== */
@@ -41,14 +49,21 @@ static inline uint32_t gicd_read(uint32_t offset)
     return *(volatile uint32_t *)(GICD_BASE + offset);
 }
 
+/* Redistributor of the calling CPU (frame 0 until it has been located) */
+static inline uint64_t gicr_this_cpu(void)
+{
+    uint64_t base = gicr_base[arch_cpu_id()];
+    return base ? base : GICR_BASE;
+}
+
 static inline void gicr_write(uint32_t offset, uint32_t val)
 {
-    *(volatile uint32_t *)(GICR_BASE + offset) = val;
+    *(volatile uint32_t *)(gicr_this_cpu() + offset) = val;
 }
 
 static inline uint32_t gicr_read(uint32_t offset)
 {
-    return *(volatile uint32_t *)(GICR_BASE + offset);
+    return *(volatile uint32_t *)(gicr_this_cpu() + offset);
 }
 
 /* ===================================================================== */
@@ -126,8 +141,39 @@ static void gic_init_distributor(void)
     printk(KERN_INFO "GIC: Distributor initialized\n");
 }
 
+/*
+ * Each CPU has its own redistributor frame. Walk the frames and pick the
+ * one whose GICR_TYPER affinity matches this CPU's MPIDR.
+ */
+static void gic_find_redistributor(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r" (mpidr));
+    uint32_t aff = (uint32_t)((mpidr & 0xFFFFFF) | ((mpidr >> 8) & 0xFF000000));
+    
+    for (int i = 0; i < MAX_CPUS; i++) {
+        uint64_t base = GICR_BASE + (uint64_t)i * GICR_STRIDE;
+        uint64_t typer = *(volatile uint64_t *)(base + GICR_TYPER);
+        
+        if ((uint32_t)(typer >> GICR_TYPER_AFF_SHIFT) == aff) {
+            gicr_base[cpu] = base;
+            return;
+        }
+        if (typer & GICR_TYPER_LAST) {
+            break;
+        }
+    }
+    
+    printk(KERN_WARNING "GIC: No redistributor for CPU %u, using frame %u\n",
+           cpu, cpu);
+    gicr_base[cpu] = GICR_BASE + (uint64_t)cpu * GICR_STRIDE;
+}
+
 static void gic_init_redistributor(void)
 {
+    gic_find_redistributor();
+    
     /* Wake up redistributor */
     uint32_t waker = gicr_read(GICR_WAKER);
     waker &= ~GICR_WAKER_PROCESSOR_SLEEP;
@@ -139,7 +185,7 @@ static void gic_init_redistributor(void)
     }
     
     /* Configure PPIs and SGIs in SGI_base */
-    uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+    uint64_t sgi_base = gicr_this_cpu() + GICR_SGI_BASE;
     
     /* All PPIs/SGIs to Group 1 */
     *(volatile uint32_t *)(sgi_base + GICR_IGROUPR0) = 0xFFFFFFFF;
@@ -213,8 +259,8 @@ void gic_enable_irq(uint32_t irq)
     }
     
     if (irq < GIC_SPI_START) {
-        /* SGI/PPI - use redistributor */
-        uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+        /* SGI/PPI - banked per CPU in this CPU's redistributor */
+        uint64_t sgi_base = gicr_this_cpu() + GICR_SGI_BASE;
         *(volatile uint32_t *)(sgi_base + GICR_ISENABLER0) = (1 << irq);
     } else {
         /* SPI - use distributor */
@@ -231,7 +277,7 @@ void gic_disable_irq(uint32_t irq)
     }
     
     if (irq < GIC_SPI_START) {
-        uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+        uint64_t sgi_base = gicr_this_cpu() + GICR_SGI_BASE;
         *(volatile uint32_t *)(sgi_base + GICR_ICENABLER0) = (1 << irq);
     } else {
         uint32_t reg = irq / 32;
@@ -251,7 +297,7 @@ void gic_set_priority(uint32_t irq, uint8_t priority)
     uint32_t mask = 0xFF << shift;
     
     if (irq < GIC_SPI_START) {
-        uint64_t sgi_base = GICR_BASE + GICR_SGI_BASE;
+        uint64_t sgi_base = gicr_this_cpu() + GICR_SGI_BASE;
         uint32_t val = *(volatile uint32_t *)(sgi_base + GICR_IPRIORITYR + reg * 4);
         val = (val & ~mask) | (priority << shift);
         *(volatile uint32_t *)(sgi_base + GICR_IPRIORITYR + reg * 4) = val;
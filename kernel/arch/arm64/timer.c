@@ -1,12 +1,16 @@
 /*
  * UnixOS Kernel - Timer Implementation
  * 
- * ARM Generic Timer using virtual timer for OS timing.
+ * ARM Generic Timer using virtual timer for OS timing. The timer runs
+ * one-shot against an absolute compare value (CNTV_CVAL) programmed by the
+ * hrtimer code for the next deadline, so there is no fixed-rate interrupt.
  */
 
 #include "arch/arm64/timer.h"
 #include "arch/arm64/gic.h"
-#include "sched/sched.h"
+#include "arch/arch.h"
+#include "time/hrtimer.h"
+#include "time/tick.h"
 #include "printk.h"
 
 /* ===================================================================== */
@@ -17,12 +21,6 @@ static uint64_t timer_frequency;
 static uint64_t ticks_per_ms;
 static uint64_t ticks_per_us;
 
-/* Scheduler tick rate (100Hz = 10ms period) */
-#define HZ                  100
-#define TICK_PERIOD_MS      (1000 / HZ)
-
-static uint64_t jiffies = 0;  /* Tick counter */
-
 /* ===================================================================== */
 /* System register helpers */
 /* ===================================================================== */
@@ -53,6 +51,12 @@ static inline void write_cntv_tval(uint64_t val)
     asm volatile("msr cntv_tval_el0, %0" : : "r" (val));
 }
 
+static inline void write_cntv_cval(uint64_t val)
+{
+    asm volatile("msr cntv_cval_el0, %0" : : "r" (val));
+    asm volatile("isb");
+}
+
 static inline void write_cntv_ctl(uint64_t val)
 {
     asm volatile("msr cntv_ctl_el0, %0" : : "r" (val));
@@ -65,6 +69,17 @@ static inline uint64_t __attribute__((unused)) read_cntv_ctl(void)
     return val;
 }
 
+/* Let EL0 read the virtual counter (for the vDSO), but nothing else */
+static inline void enable_el0_cntvct(void)
+{
+    uint64_t val;
+    asm volatile("mrs %0, cntkctl_el1" : "=r" (val));
+    val &= ~(CNTKCTL_EL0PCTEN | CNTKCTL_EL0PTEN | CNTKCTL_EL0VTEN);
+    val |= CNTKCTL_EL0VCTEN;
+    asm volatile("msr cntkctl_el1, %0" : : "r" (val));
+    asm volatile("isb");
+}
+
 /* ===================================================================== */
 /* Timer interrupt handler */
 /* ===================================================================== */
@@ -74,15 +89,9 @@ static void timer_irq_handler(uint32_t irq, void *data)
     (void)irq;
     (void)data;
     
-    /* Increment jiffies */
-    jiffies++;
-    
-    /* Set up next timer interrupt */
-    write_cntv_tval(timer_frequency / HZ);
-    
-    /* Invoke scheduler for preemptive multitasking */
-    extern void process_schedule_from_irq(void);
-    process_schedule_from_irq();
+    /* Runs the tick and any other expired timers, then programs the
+     * next deadline (which also deasserts this level interrupt) */
+    hrtimer_interrupt();
 }
 
 /* ===================================================================== */
@@ -122,18 +131,31 @@ void timer_init(void)
     
     printk("TIMER: Priority set (IRQ not enabled yet)\n");
     
-    /* Set up first timer tick value but don't enable timer */
-    write_cntv_tval(timer_frequency / HZ);
-    
-    printk("TIMER: TVAL set\n");
+    /* Nothing to fire until the tick is started below */
+    write_cntv_cval(~0ULL);
     
     /* Enable timer and IRQ now */
     write_cntv_ctl(TIMER_CTL_ENABLE);
     gic_enable_irq(TIMER_IRQ_VIRT);
+    enable_el0_cntvct();
+    
+    tick_cpu_init();
     
     printk(KERN_INFO "TIMER: Initialized and IRQ enabled\n");
 }
 
+void timer_cpu_init(void)
+{
+    /* The virtual timer PPI is banked: enable it in this CPU's redistributor */
+    gic_set_priority(TIMER_IRQ_VIRT, 0x80);
+    write_cntv_cval(~0ULL);
+    write_cntv_ctl(TIMER_CTL_ENABLE);
+    gic_enable_irq(TIMER_IRQ_VIRT);
+    enable_el0_cntvct();
+    
+    tick_cpu_init();
+}
+
 uint64_t timer_get_frequency(void)
 {
     return timer_frequency;
@@ -149,6 +171,11 @@ void timer_set_next(uint64_t ticks)
     write_cntv_tval(ticks);
 }
 
+void timer_set_event(uint64_t deadline)
+{
+    write_cntv_cval(deadline);
+}
+
 uint64_t timer_get_ms(void)
 {
     return read_cntvct() / ticks_per_ms;
@@ -4,6 +4,7 @@
 
 #include "arch/arch.h"
 #include "printk.h"
+#include "time/tick.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -23,6 +24,8 @@ void arch_timer_init(void)
 {
     extern void pit_init(void);
     pit_init();
+    
+    tick_cpu_init();
 }
 
 uint64_t arch_timer_get_ticks(void)
@@ -45,6 +48,13 @@ void arch_timer_tick(void)
     timer_ticks++;
 }
 
+int arch_timer_set_event(uint64_t deadline)
+{
+    /* Only the periodic PIT is driven for now */
+    (void)deadline;
+    return -1;
+}
+
 /* ===================================================================== */
 /* Interrupts */
 /* ===================================================================== */
@@ -59,6 +69,18 @@ void arch_irq_disable(void)
     asm volatile("cli");
 }
 
+unsigned long arch_irq_save(void)
+{
+    unsigned long flags;
+    asm volatile("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+void arch_irq_restore(unsigned long flags)
+{
+    asm volatile("pushl %0; popfl" :: "r"(flags) : "memory", "cc");
+}
+
 void arch_irq_init(void)
 {
     extern void pic_init(void);
@@ -84,6 +106,11 @@ void arch_memory_barrier(void)
     asm volatile("" ::: "memory");
 }
 
+void arch_barrier(void)
+{
+    asm volatile("lock; addl $0, (%%esp)" ::: "memory", "cc");
+}
+
 /* Legacy function names for compatibility */
 void arch_halt(void)
 {
@@ -100,6 +127,31 @@ void arch_dsb(void)
     arch_memory_barrier();
 }
 
+/* ===================================================================== */
+/* CPU Information */
+/* ===================================================================== */
+
+uint32_t arch_cpu_id(void)
+{
+    /* BIOS boot path is uniprocessor */
+    return 0;
+}
+
+uint32_t arch_cpu_count(void)
+{
+    return 1;
+}
+
+void smp_init(void)
+{
+    /* Uniprocessor: nothing to bring up */
+}
+
+void arch_smp_send_reschedule(uint32_t cpu)
+{
+    (void)cpu;
+}
+
 /* ===================================================================== */
 /* MMU/Paging */
 /* ===================================================================== */
@@ -77,3 +77,14 @@ int64_t __moddi3(int64_t n, int64_t d)
     
     return neg ? -(int64_t)r : (int64_t)r;
 }
+
+/* Count trailing zeros of a 64-bit value (result undefined for 0) */
+int __ctzdi2(uint64_t a)
+{
+    uint32_t lo = (uint32_t)a;
+    
+    if (lo) {
+        return __builtin_ctz(lo);
+    }
+    return 32 + __builtin_ctz((uint32_t)(a >> 32));
+}
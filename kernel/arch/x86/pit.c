@@ -3,6 +3,7 @@
  * 8253/8254 PIT for x86 32-bit
  */
 
+#include "time/hrtimer.h"
 #include "types.h"
 
 /* PIT ports */
@@ -52,6 +53,9 @@ void pit_handler(void)
     extern void arch_timer_tick(void);
     arch_timer_tick();
     
+    /* No one-shot event to program: poll the timer queue every tick */
+    hrtimer_interrupt();
+    
     /* Send EOI to PIC */
     extern void pic_send_eoi(uint8_t irq);
     pic_send_eoi(0);
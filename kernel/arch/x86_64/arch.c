@@ -4,6 +4,7 @@
 
 #include "arch/arch.h"
 #include "printk.h"
+#include "time/tick.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -69,6 +70,8 @@ void arch_timer_init(void)
     /* Initialize PIT/APIC timer - implemented in separate driver */
     extern void pit_init(void);
     pit_init();
+    
+    tick_cpu_init();
 }
 
 uint64_t arch_timer_get_ticks(void)
@@ -91,6 +94,13 @@ void arch_timer_tick(void)
     timer_ticks++;
 }
 
+int arch_timer_set_event(uint64_t deadline)
+{
+    /* Only the periodic PIT is driven for now */
+    (void)deadline;
+    return -1;
+}
+
 /* ===================================================================== */
 /* Memory Management */
 /* ===================================================================== */
@@ -236,6 +246,12 @@ void smp_init(void)
     printk(KERN_INFO "SMP: Boot CPU (CPU 0) initialized\n");
 }
 
+void arch_smp_send_reschedule(uint32_t cpu)
+{
+    /* Application processors are not started yet */
+    (void)cpu;
+}
+
 /* ===================================================================== */
 /* Userspace Entry */
 /* ===================================================================== */
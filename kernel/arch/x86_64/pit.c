@@ -6,6 +6,7 @@
 
 #include "arch/arch.h"
 #include "printk.h"
+#include "time/hrtimer.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -70,6 +71,9 @@ void pit_handler(void)
     pit_ticks++;
     extern void arch_timer_tick(void);
     arch_timer_tick();
+    
+    /* No one-shot event to program: poll the timer queue every tick */
+    hrtimer_interrupt();
 }
 
 uint64_t pit_get_ticks(void)
@@ -15,6 +15,7 @@
 #include "mm/vmm.h"
 #include "printk.h"
 #include "sched/sched.h"
+#include "time/vdso.h"
 #include "types.h"
 
 /* Kernel version */
@@ -96,9 +97,8 @@ static void init_subsystems(void *dtb) {
 
   printk(KERN_INFO "[INIT] Phase 1: Core Hardware\n");
 
-  /* Parse device tree for hardware information */
-  printk(KERN_INFO "  Parsing device tree...\n");
-  (void)dtb; /* TODO: dtb_parse(dtb); */
+  /* Device tree memory banks are parsed by pmm_init() below */
+  printk(KERN_INFO "  Device tree at %p\n", dtb);
 
   /* Initialize interrupt controller */
   printk(KERN_INFO "  Initializing interrupt controller...\n");
@@ -116,7 +116,7 @@ static void init_subsystems(void *dtb) {
 
   /* Initialize physical memory manager */
   printk(KERN_INFO "  Initializing physical memory manager...\n");
-  ret = pmm_init();
+  ret = pmm_init(dtb);
   if (ret < 0) {
     panic("Failed to initialize physical memory manager!");
   }
@@ -134,6 +134,12 @@ static void init_subsystems(void *dtb) {
   extern void kmalloc_init(void);
   kmalloc_init();
 
+  /* Time data page read by userspace clock_gettime() */
+  printk(KERN_INFO "  Initializing vDSO time data...\n");
+  if (vdso_init() < 0) {
+    panic("Failed to initialize vDSO time data!");
+  }
+
   /* ================================================================= */
   /* Phase 3: Process Management */
   /* ================================================================= */
@@ -399,6 +405,10 @@ static void init_subsystems(void *dtb) {
   /* Phase 6: Enable Interrupts */
   /* ================================================================= */
 
+  /* Bring up the secondary CPUs; each enters the scheduler on its own */
+  printk(KERN_INFO "[INIT] Starting secondary CPUs...\n");
+  smp_init();
+
   printk(KERN_INFO "[INIT] Enabling interrupts...\n");
   /* Enable interrupts */
   arch_irq_enable();
@@ -479,8 +489,13 @@ static void start_init_process(void) {
     extern void gui_handle_key_event(int key);
     int c = uart_getc_nonblock();
     if (c >= 0) {
-      /* Route to focused window */
+      /* Route to focused window. Stdin only gets the key while a reader is
+       * waiting, so keys typed into windows don't pile up for read(0). */
       gui_handle_key_event(c);
+      extern int kapi_input_waiting(void);
+      extern void kapi_sys_key_event(int key);
+      if (kapi_input_waiting())
+        kapi_sys_key_event(c);
       needs_redraw = 1;
     }
 
@@ -517,6 +532,9 @@ static void start_init_process(void) {
       needs_redraw = 1;
     }
 
+    /* Nothing happened this pass: sleep until the next interrupt below */
+    int idle = !needs_redraw;
+
     /* Redraw when needed - compose includes cursor drawing */
     if (needs_redraw) {
       gui_compose(); /* Cursor is drawn inside compose, before blit */
@@ -533,8 +551,11 @@ static void start_init_process(void) {
     // User processes run preemptively via timer IRQ, so we just loop here
     // But we should yield to be nice if not rendering
 
-    /* Short yield - allows input polling without slowing mouse */
-    for (volatile int i = 0; i < 500; i++) {
+    /* Nothing to draw or handle: sleep until the next interrupt (the timer
+     * tick at the latest) instead of spinning. Processes still run on the
+     * tick via preemption. */
+    if (idle) {
+      arch_idle();
     }
   }
 }
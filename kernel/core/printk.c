@@ -268,3 +268,23 @@ int early_printk(const char *fmt, ...)
     
     return ret;
 }
+
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
+{
+    if (!buf || size == 0) {
+        return 0;
+    }
+    return kvsnprintf(buf, size, fmt, args);
+}
+
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+    
+    va_start(args, fmt);
+    ret = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    
+    return ret;
+}
@@ -4,6 +4,13 @@
  * Preemptive multitasking - timer IRQ forces context switches.
  * Programs run in kernel space and call kernel functions directly.
  * No memory protection, but full preemption via timer interrupt.
+ *
+ * Every CPU has its own current process and kernel context and picks
+ * READY processes from a shared ready queue: one FIFO list per priority
+ * plus a bitmap of non-empty lists, kept up to date on every state change
+ * so picking the next process is O(1) instead of a proc_table scan.
+ * A process whose registers are still live on one CPU (on_cpu) is never
+ * picked up by another.
  */
 
 #include "process.h"
@@ -13,7 +20,10 @@
 #include "../include/mm/aslr.h"
 #include "../include/mm/kmalloc.h"
 #include "../include/printk.h"
+#include "../include/sync/rcu.h"
 #include "../include/sync/spinlock.h"
+#include "../include/sync/wait.h"
+#include "../include/time/tick.h"
 
 /* Forward declare strncpy and strlen from our kernel */
 extern char *strncpy(char *dst, const char *src, size_t n);
@@ -36,22 +46,30 @@ extern kapi_t *kapi_get(void);
 
 // Process table
 static process_t proc_table[MAX_PROCESSES];
-static int current_pid = -1; // -1 means kernel/shell is running
 static int next_pid = 1;
 
 // Spinlock protecting process table access
 static DEFINE_SPINLOCK(proc_table_lock);
 
-// Current process pointer - used by IRQ handler for preemption
-// NULL means kernel is running (no process to save to)
+// Per-CPU current process and kernel context - used by IRQ handler for
+// preemption. current == NULL means the CPU's kernel context is running.
+// The kernel context is saved when switching from kernel to a process, so
+// we can return to it (e.g., desktop running via process_exec).
 // Global for asm access
-process_t *current_process = NULL;
+struct proc_cpu proc_cpus[MAX_CPUS];
+
+static inline struct proc_cpu *this_proc_cpu(void) {
+  return &proc_cpus[arch_cpu_id()];
+}
 
-// Kernel context - saved when switching from kernel to a process
-// This allows us to return to kernel (e.g., desktop running via process_exec)
-// Global (not static) so vectors.S can access it for kernel->process IRQ
-// switches
-cpu_context_t kernel_context;
+// Ready queue, protected by proc_table_lock
+static struct {
+  uint32_t bitmap;                  // Bit p set when head[p] is non-empty
+  process_t *head[PROC_NR_PRIO];
+  process_t *tail[PROC_NR_PRIO];
+  int nr_ready;                     // Processes in PROC_STATE_READY
+  int nr_running;                   // Processes in PROC_STATE_RUNNING
+} ready_queue;
 
 // Program load address - grows upward as we load programs
 // Set dynamically based on heap_end
@@ -68,16 +86,36 @@ typedef int (*program_entry_t)(kapi_t *api, int argc, char **argv);
 static void process_entry_wrapper(void);
 static void kill_children(int parent_pid);
 
+void process_cpu_init(int cpu) {
+  struct proc_cpu *pc = &proc_cpus[cpu];
+  pc->current = NULL;
+  pc->current_slot = -1;
+  pc->idle = 0;
+#ifdef ARCH_ARM64
+  // The IRQ entry path finds this CPU's state through TPIDR_EL1
+  asm volatile("msr tpidr_el1, %0" ::"r"(pc));
+#endif
+}
+
 void process_init(void) {
   // Clear process table
   for (int i = 0; i < MAX_PROCESSES; i++) {
     proc_table[i].state = PROC_STATE_FREE;
     proc_table[i].pid = 0;
+    proc_table[i].on_cpu = 0;
+    proc_table[i].kill_pending = 0;
+    proc_table[i].in_wait = 0;
+    proc_table[i].prio = PROC_PRIO_DEFAULT;
+    proc_table[i].rq_next = proc_table[i].rq_prev = NULL;
     // Also clear context to prevent garbage
     memset(&proc_table[i].context, 0, sizeof(cpu_context_t));
   }
-  current_pid = -1;
-  current_process = NULL;
+  for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+    proc_cpus[cpu].current = NULL;
+    proc_cpus[cpu].current_slot = -1;
+  }
+  memset(&ready_queue, 0, sizeof(ready_queue));
+  process_cpu_init(arch_cpu_id());
   next_pid = 1;
 
   // Programs load right after the heap
@@ -89,23 +127,162 @@ void process_init(void) {
   printf("[PROC] Program load area: 0x%llx+\n",
          (unsigned long long)program_base);
   printf("[PROC] kernel_context at: 0x%llx\n",
-         (unsigned long long)&kernel_context);
+         (unsigned long long)&proc_cpus[arch_cpu_id()].kernel_context);
 }
 
 // Find a free slot in the process table (caller must hold proc_table_lock)
+// A slot freed by an exiting process is reusable once it is off its CPU.
 static int find_free_slot_unlocked(void) {
   for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (proc_table[i].state == PROC_STATE_FREE) {
+    if (proc_table[i].state == PROC_STATE_FREE && !proc_table[i].on_cpu) {
       return i;
     }
   }
   return -1;
 }
 
+// Ready queue helpers (caller must hold proc_table_lock)
+static void rq_enqueue(process_t *p) {
+  int prio = p->prio;
+  p->rq_next = NULL;
+  p->rq_prev = ready_queue.tail[prio];
+  if (p->rq_prev)
+    p->rq_prev->rq_next = p;
+  else
+    ready_queue.head[prio] = p;
+  ready_queue.tail[prio] = p;
+  ready_queue.bitmap |= 1U << prio;
+  ready_queue.nr_ready++;
+}
+
+static void rq_dequeue(process_t *p) {
+  int prio = p->prio;
+  if (p->rq_prev)
+    p->rq_prev->rq_next = p->rq_next;
+  else
+    ready_queue.head[prio] = p->rq_next;
+  if (p->rq_next)
+    p->rq_next->rq_prev = p->rq_prev;
+  else
+    ready_queue.tail[prio] = p->rq_prev;
+  p->rq_next = p->rq_prev = NULL;
+  if (!ready_queue.head[prio])
+    ready_queue.bitmap &= ~(1U << prio);
+  ready_queue.nr_ready--;
+}
+
+// Change a process's state, keeping the ready queue and counters in step
+// (caller must hold proc_table_lock)
+static void proc_set_state_locked(process_t *p, proc_state_t state) {
+  if (p->state == state)
+    return;
+
+  if (p->state == PROC_STATE_READY)
+    rq_dequeue(p);
+  else if (p->state == PROC_STATE_RUNNING)
+    ready_queue.nr_running--;
+
+  p->state = state;
+
+  if (state == PROC_STATE_READY)
+    rq_enqueue(p);
+  else if (state == PROC_STATE_RUNNING)
+    ready_queue.nr_running++;
+}
+
+// Woken when a process exits or is killed, for process_exec_args()
+static DECLARE_WAIT_QUEUE_HEAD(proc_exit_wait);
+
+// Free a process slot (caller must hold proc_table_lock). A process that is
+// live on another CPU is only flagged; that CPU drops it at its next
+// tick or reschedule IPI. A sleeping process is still linked on a wait
+// queue, so it is made runnable to unlink itself and exit (see wait.c).
+static void reap_slot_locked(int slot) {
+  process_t *p = &proc_table[slot];
+  if (p->on_cpu || p->in_wait) {
+    p->kill_pending = 1;
+    if (p->on_cpu)
+      arch_smp_send_reschedule(p->cpu);
+    else if (p->state == PROC_STATE_BLOCKED)
+      proc_set_state_locked(p, PROC_STATE_READY);
+    return;
+  }
+  if (p->stack_base) {
+    free(p->stack_base);
+    p->stack_base = NULL;
+  }
+  p->kill_pending = 0;
+  proc_set_state_locked(p, PROC_STATE_FREE);
+  p->pid = 0;
+}
+
+// Pick the first process of the highest-priority non-empty list that no
+// other CPU is still running. Only processes caught mid-switch on another
+// CPU are passed over, so the cost is bounded by the CPU count rather than
+// the table size. A yielding old_slot is queued at the tail of its list,
+// which gives round-robin within a priority (caller must hold
+// proc_table_lock).
+static int pick_next_slot_locked(int old_slot) {
+  uint32_t map = ready_queue.bitmap;
+
+  while (map) {
+    int prio = __builtin_ctz(map);
+    map &= map - 1;
+
+    process_t *p = ready_queue.head[prio];
+    while (p) {
+      process_t *next = p->rq_next;
+      int idx = (int)(p - proc_table);
+
+      if (p->kill_pending && !p->in_wait) {
+        // Killed while it was switching away on another CPU
+        if (!p->on_cpu)
+          reap_slot_locked(idx);
+      } else if (p->on_cpu && idx != old_slot) {
+        // Still being switched out elsewhere
+      } else if (arch_context_get_sp(&p->context) != 0 &&
+                 arch_context_get_pc(&p->context) != 0) {
+        // Safety check above: verify process has valid context
+        return idx;
+      }
+      p = next;
+    }
+  }
+  return -1;
+}
+
+// Wake an idle CPU so a newly runnable process starts without waiting
+// for that CPU's next tick
+static void kick_idle_cpu(void) {
+  uint32_t self = arch_cpu_id();
+  for (uint32_t cpu = 0; cpu < arch_cpu_count(); cpu++) {
+    if (cpu != self && proc_cpus[cpu].idle) {
+      arch_smp_send_reschedule(cpu);
+      return;
+    }
+  }
+}
+
+// Switch away from prev (NULL for the kernel context). prev->on_cpu is
+// cleared only once its registers are saved, so another CPU can't resume
+// it from a stale context.
+static void process_switch(cpu_context_t *old_ctx, cpu_context_t *new_ctx,
+                           process_t *prev) {
+#ifdef ARCH_ARM64
+  switch_context_release(old_ctx, new_ctx, prev ? &prev->on_cpu : NULL);
+#else
+  // Uniprocessor: nobody else can pick prev up in the meantime
+  if (prev)
+    prev->on_cpu = 0;
+  switch_context(old_ctx, new_ctx);
+#endif
+}
+
 process_t *process_current(void) {
-  if (current_pid < 0)
+  struct proc_cpu *pc = this_proc_cpu();
+  if (pc->current_slot < 0)
     return NULL;
-  return &proc_table[current_pid];
+  return &proc_table[pc->current_slot];
 }
 
 process_t *process_get(int pid) {
@@ -120,20 +297,73 @@ process_t *process_get(int pid) {
   return NULL;
 }
 
-// Get pointer to current_process pointer (for assembly IRQ handler)
-process_t **process_get_current_ptr(void) { return &current_process; }
+// Get pointer to this CPU's current process pointer (for assembly IRQ handler)
+process_t **process_get_current_ptr(void) { return &this_proc_cpu()->current; }
 
 int process_count_ready(void) {
   uint64_t flags = spin_lock_irqsave(&proc_table_lock);
-  int count = 0;
+  int count = ready_queue.nr_ready + ready_queue.nr_running;
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+  return count;
+}
+
+// A process going to sleep stays on its CPU until it calls
+// process_schedule(); a wakeup before that just makes it RUNNING again
+void process_sleep_prepare(process_t *p) {
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+  p->in_wait = 1;
+  if (p->state == PROC_STATE_RUNNING && !p->kill_pending)
+    proc_set_state_locked(p, PROC_STATE_BLOCKED);
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+}
+
+void process_sleep_cancel(process_t *p) {
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+  p->in_wait = 0;
+  if (p->state == PROC_STATE_BLOCKED || p->state == PROC_STATE_READY)
+    proc_set_state_locked(p, PROC_STATE_RUNNING);
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+}
+
+void process_wake(process_t *p) {
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+  int woken = 0;
+  if (p->state == PROC_STATE_BLOCKED) {
+    if (p->on_cpu && p == proc_cpus[p->cpu].current) {
+      // Hasn't switched away yet: keep running
+      proc_set_state_locked(p, PROC_STATE_RUNNING);
+    } else {
+      proc_set_state_locked(p, PROC_STATE_READY);
+      woken = 1;
+    }
+  }
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+
+  if (woken)
+    kick_idle_cpu();
+}
+
+int process_set_priority(int pid, int prio) {
+  if (prio < 0 || prio >= PROC_NR_PRIO)
+    return -1;
+
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
   for (int i = 0; i < MAX_PROCESSES; i++) {
-    if (proc_table[i].state == PROC_STATE_READY ||
-        proc_table[i].state == PROC_STATE_RUNNING) {
-      count++;
+    process_t *p = &proc_table[i];
+    if (p->pid == pid && p->state != PROC_STATE_FREE) {
+      if (p->state == PROC_STATE_READY) {
+        rq_dequeue(p);
+        p->prio = prio;
+        rq_enqueue(p);
+      } else {
+        p->prio = prio;
+      }
+      spin_unlock_irqrestore(&proc_table_lock, flags);
+      return 0;
     }
   }
   spin_unlock_irqrestore(&proc_table_lock, flags);
-  return count;
+  return -1;
 }
 
 int process_get_info(int index, char *name, int name_size, int *state) {
@@ -160,6 +390,18 @@ int process_get_info(int index, char *name, int name_size, int *state) {
   return 1;
 }
 
+// Give back a slot reserved by process_create() that never ran. One killed
+// meanwhile has already been freed, and may have been reused since.
+static void release_slot(int slot, int pid) {
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+  process_t *p = &proc_table[slot];
+  if (p->pid == pid && p->state != PROC_STATE_FREE) {
+    proc_set_state_locked(p, PROC_STATE_FREE);
+    p->pid = 0;
+  }
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+}
+
 // Create a new process (load the binary but don't start it)
 int process_create(const char *path, int argc, char **argv) {
   (void)argc;
@@ -173,26 +415,41 @@ int process_create(const char *path, int argc, char **argv) {
     printf("[PROC] No free process slots\n");
     return -1;
   }
-  // Reserve the slot immediately
-  proc_table[slot].state = PROC_STATE_READY;
-  proc_table[slot].pid = next_pid++;
+  // Reserve the slot immediately; BLOCKED keeps schedulers on other CPUs
+  // away until the process is fully loaded
+  proc_table[slot].prio = PROC_PRIO_DEFAULT;
+  proc_set_state_locked(&proc_table[slot], PROC_STATE_BLOCKED);
+  int pid = next_pid++;
+  proc_table[slot].pid = pid;
+  proc_table[slot].kill_pending = 0;
+  proc_table[slot].in_wait = 0;
+  // The previous occupant exited or was killed on its own stack, which was
+  // left for us to free
+  void *old_stack = proc_table[slot].stack_base;
+  proc_table[slot].stack_base = NULL;
   spin_unlock_irqrestore(&proc_table_lock, flags);
 
+  if (old_stack)
+    free(old_stack);
+
   // Look up file
   vfs_node_t *file = vfs_lookup(path);
   if (!file) {
     printf("[PROC] File not found: %s\n", path);
+    release_slot(slot, pid);
     return -1;
   }
 
   if (vfs_is_dir(file)) {
     printf("[PROC] Cannot exec directory: %s\n", path);
+    release_slot(slot, pid);
     return -1;
   }
 
   size_t size = file->size;
   if (size == 0) {
     printf("[PROC] File is empty: %s\n", path);
+    release_slot(slot, pid);
     return -1;
   }
 
@@ -200,6 +457,7 @@ int process_create(const char *path, int argc, char **argv) {
   char *data = malloc(size);
   if (!data) {
     printf("[PROC] Out of memory reading %s\n", path);
+    release_slot(slot, pid);
     return -1;
   }
 
@@ -207,6 +465,7 @@ int process_create(const char *path, int argc, char **argv) {
   if (bytes != (int)size) {
     printf("[PROC] Failed to read %s\n", path);
     free(data);
+    release_slot(slot, pid);
     return -1;
   }
 
@@ -219,44 +478,53 @@ int process_create(const char *path, int argc, char **argv) {
     printf("[PROC] Header: %02x %02x %02x %02x %02x %02x %02x %02x\n", b[0],
            b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
     free(data);
+    release_slot(slot, pid);
     return -1;
   }
 
-  // Align load address with ASLR randomization
+  // Align load address with ASLR randomization, and reserve the range so a
+  // process created on another CPU meanwhile loads past it
   uint64_t aslr_offset = aslr_exec_offset();
+  flags = spin_lock_irqsave(&proc_table_lock);
   uint64_t load_addr = ALIGN_64K(next_load_addr + aslr_offset);
+  next_load_addr = ALIGN_64K(load_addr + prog_size + 0x10000);
+  spin_unlock_irqrestore(&proc_table_lock, flags);
 
   // Load the ELF at this address
   elf_load_info_t info;
   if (elf_load_at(data, size, load_addr, &info) != 0) {
     printf("[PROC] Failed to load ELF: %s\n", path);
     free(data);
+    release_slot(slot, pid);
     return -1;
   }
 
   free(data);
 
-  // Update next load address for future programs
-  next_load_addr = ALIGN_64K(load_addr + info.load_size + 0x10000);
+  // Segments may end past the reserved size if they don't start at zero
+  uint64_t load_end = ALIGN_64K(load_addr + info.load_size + 0x10000);
+  flags = spin_lock_irqsave(&proc_table_lock);
+  if (next_load_addr < load_end)
+    next_load_addr = load_end;
+  spin_unlock_irqrestore(&proc_table_lock, flags);
 
   // Set up process structure
   process_t *proc = &proc_table[slot];
-  proc->pid = next_pid++;
   strncpy(proc->name, path, PROCESS_NAME_MAX - 1);
   proc->name[PROCESS_NAME_MAX - 1] = '\0';
-  proc->state = PROC_STATE_READY;
   proc->load_base = info.load_base;
   proc->load_size = info.load_size;
   proc->entry = info.entry;
-  proc->parent_pid = current_pid;
+  proc->parent_pid = this_proc_cpu()->current_slot;
   proc->exit_status = 0;
+  proc->cpu = arch_cpu_id();
 
   // Allocate stack
   proc->stack_size = PROCESS_STACK_SIZE;
   proc->stack_base = malloc(proc->stack_size);
   if (!proc->stack_base) {
     printf("[PROC] Failed to allocate stack\n");
-    proc->state = PROC_STATE_FREE;
+    release_slot(slot, pid);
     return -1;
   }
 
@@ -314,14 +582,21 @@ int process_create(const char *path, int argc, char **argv) {
   //        (unsigned long long)proc->stack_base, (unsigned long
   //        long)proc->stack_base + proc->stack_size);
 
+  // Loaded: let any CPU run it
+  flags = spin_lock_irqsave(&proc_table_lock);
+  proc_set_state_locked(proc, PROC_STATE_READY);
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+  kick_idle_cpu();
+
   return proc->pid;
 }
 
 // Helper for x86 assembly
 uint32_t get_current_stack_top(void) {
-  if (!current_process)
+  process_t *cur = this_proc_cpu()->current;
+  if (!cur)
     return 0;
-  return (uint32_t)current_process->stack_base + current_process->stack_size;
+  return (uint32_t)cur->stack_base + cur->stack_size;
 }
 
 // Entry wrapper - called when a new process is switched to for the first time
@@ -383,43 +658,51 @@ void process_exit(int status) {
   // Disable IRQs during exit to prevent race with preemption
   arch_irq_disable();
 
-  if (current_pid < 0) {
+  struct proc_cpu *pc = this_proc_cpu();
+  if (pc->current_slot < 0) {
     printf("[PROC] Exit called with no current process!\n");
     arch_irq_enable();
     return;
   }
 
-  int slot = current_pid;
+  int slot = pc->current_slot;
   process_t *proc = &proc_table[slot];
   printf("[PROC] Process '%s' (pid %d) exited with status %d\n", proc->name,
          proc->pid, status);
 
+  spin_lock(&proc_table_lock);
+
   // Kill all children of this process before exiting
   kill_children(proc->pid);
 
   proc->exit_status = status;
-  proc->state = PROC_STATE_ZOMBIE;
+  proc_set_state_locked(proc, PROC_STATE_ZOMBIE);
 
   // Free stack - but we're still on it! Don't free yet.
   // The stack will be freed when the slot is reused.
 
-  // Mark slot as free (simple cleanup for now)
-  proc->state = PROC_STATE_FREE;
+  // Mark slot as free (simple cleanup for now). It can't be reused until
+  // process_switch() below has cleared on_cpu.
+  proc_set_state_locked(proc, PROC_STATE_FREE);
+  proc->kill_pending = 0;
+  spin_unlock(&proc_table_lock);
+
+  wake_up(&proc_exit_wait);
 
   // We're done with this process - switch back to kernel context
   // This MUST not return - we context switch away
-  current_pid = -1;
-  current_process = NULL;
+  pc->current_slot = -1;
+  pc->current = NULL;
 
   // Debug: verify kernel_context before switching
   printf("[PROC] Switching to kernel_context: pc=0x%llx sp=0x%llx\n",
-         (unsigned long long)arch_context_get_pc(&kernel_context),
-         (unsigned long long)arch_context_get_sp(&kernel_context));
+         (unsigned long long)arch_context_get_pc(&pc->kernel_context),
+         (unsigned long long)arch_context_get_sp(&pc->kernel_context));
 
   // Sanity check kernel_context
   // Note: kernel code is in flash at 0x0, stack is near 0x5f000000
-  if (arch_context_get_pc(&kernel_context) == 0 ||
-      arch_context_get_sp(&kernel_context) == 0) {
+  if (arch_context_get_pc(&pc->kernel_context) == 0 ||
+      arch_context_get_sp(&pc->kernel_context) == 0) {
     printf("[PROC] ERROR: kernel_context appears corrupted!\n");
     printf(
         "[PROC] This indicates memory corruption during process execution\n");
@@ -427,11 +710,11 @@ void process_exit(int status) {
       ; // Hang instead of crashing
   }
 
-  // Switch directly back to kernel context
+  // Switch directly back to this CPU's kernel context
   // This will resume in process_exec_args() or process_schedule()
   // wherever the kernel was waiting
   // IRQs will be re-enabled when kernel re-enables them
-  switch_context(&proc->context, &kernel_context);
+  process_switch(&proc->context, &pc->kernel_context, proc);
 
   // Should never reach here
   printf("[PROC] ERROR: process_exit returned!\n");
@@ -441,11 +724,15 @@ void process_exit(int status) {
 
 // Yield - voluntarily give up CPU
 void process_yield(void) {
-  if (current_pid >= 0) {
-    // Mark current process as ready
-    process_t *proc = &proc_table[current_pid];
-    proc->state = PROC_STATE_READY;
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+  struct proc_cpu *pc = this_proc_cpu();
+  if (pc->current_slot >= 0) {
+    // Mark current process as ready (on_cpu keeps other CPUs off it until
+    // it has been switched out)
+    process_t *proc = &proc_table[pc->current_slot];
+    proc_set_state_locked(proc, PROC_STATE_READY);
   }
+  spin_unlock_irqrestore(&proc_table_lock, flags);
   // Always try to schedule - even from kernel context
   // This lets programs started via process_exec() yield to spawned children
   process_schedule();
@@ -456,50 +743,64 @@ void process_schedule(void) {
   // Disable IRQs during scheduling to prevent race with preemption
   arch_irq_disable();
 
-  int old_pid = current_pid;
-  process_t *old_proc = (old_pid >= 0) ? &proc_table[old_pid] : NULL;
+  // Whatever runs next, this CPU has left any RCU read section
+  rcu_note_context_switch();
 
-  // Find next runnable process (round-robin)
-  int start = (old_pid >= 0) ? old_pid + 1 : 0;
-  int next = -1;
+  struct proc_cpu *pc = this_proc_cpu();
+  int old_slot = pc->current_slot;
+  process_t *old_proc = (old_slot >= 0) ? &proc_table[old_slot] : NULL;
 
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    int idx = (start + i) % MAX_PROCESSES;
-    if (proc_table[idx].state == PROC_STATE_READY) {
-      next = idx;
-      break;
-    }
-  }
+  spin_lock(&proc_table_lock);
+
+  // Find next runnable process (round-robin)
+  int next = pick_next_slot_locked(old_slot);
 
   if (next < 0) {
     // No runnable processes
-    if (old_pid >= 0 && old_proc->state == PROC_STATE_RUNNING) {
+    if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
       // Current process still running, keep it
+      spin_unlock(&proc_table_lock);
       arch_irq_enable();
       return;
     }
     // Return to kernel (if we were in a process, switch back to kernel)
-    if (old_pid >= 0) {
-      current_pid = -1;
-      current_process = NULL;
-      switch_context(&old_proc->context, &kernel_context);
+    if (old_proc) {
+      pc->current_slot = -1;
+      pc->current = NULL;
+      spin_unlock(&proc_table_lock);
+      process_switch(&old_proc->context, &pc->kernel_context, old_proc);
       // When we return here, IRQs will be re-enabled below
+      arch_irq_enable();
+      return;
     }
-    // Already in kernel with nothing to run - sleep until next interrupt
-    arch_irq_enable();
+    // Already in kernel with nothing to run - sleep until next interrupt.
+    // Flagged under the lock so process_create() knows to send an IPI.
+    // The tick is stopped meanwhile: only a timer deadline or an IPI wakes
+    // us.
+    pc->idle = 1;
+    spin_unlock(&proc_table_lock);
+    tick_nohz_idle_enter();
+#ifdef ARCH_ARM64
+    // wfi with IRQs masked still wakes on a pending one, so an IRQ that
+    // arrives just before it can't leave us asleep with no tick. No handler
+    // runs until RCU is watching this CPU again.
+    rcu_idle_enter();
     arch_idle();
-    return;
-  }
-
-  if (next == old_pid && old_proc && old_proc->state == PROC_STATE_RUNNING) {
-    // Same process and it's running - nothing to switch
+    rcu_idle_exit();
     arch_irq_enable();
+#else
+    arch_irq_enable();
+    arch_idle();
+#endif
+    this_proc_cpu()->idle = 0;
+    tick_nohz_idle_exit();
     return;
   }
 
-  if (next == old_pid && old_proc && old_proc->state == PROC_STATE_READY) {
+  if (next == old_slot && old_proc->state == PROC_STATE_READY) {
     // Process yielded but it's the only one - sleep until interrupt
-    old_proc->state = PROC_STATE_RUNNING;
+    proc_set_state_locked(old_proc, PROC_STATE_RUNNING);
+    spin_unlock(&proc_table_lock);
     arch_irq_enable();
     arch_idle();
     return;
@@ -509,34 +810,38 @@ void process_schedule(void) {
   process_t *new_proc = &proc_table[next];
 
   if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
-    old_proc->state = PROC_STATE_READY;
+    proc_set_state_locked(old_proc, PROC_STATE_READY);
   }
 
-  new_proc->state = PROC_STATE_RUNNING;
-  current_pid = next;
-  current_process = new_proc;
+  proc_set_state_locked(new_proc, PROC_STATE_RUNNING);
+  new_proc->on_cpu = 1;
+  new_proc->cpu = arch_cpu_id();
+  pc->current_slot = next;
+  pc->current = new_proc;
+  spin_unlock(&proc_table_lock);
 
   // Context switch!
-  // If old_pid == -1, we're switching FROM kernel context
+  // If old_slot == -1, we're switching FROM kernel context
   // IRQs stay disabled - new process will enable them (entry_wrapper or return
   // path)
-  cpu_context_t *old_ctx =
-      (old_pid >= 0) ? &old_proc->context : &kernel_context;
+  cpu_context_t *old_ctx = old_proc ? &old_proc->context : &pc->kernel_context;
 
   // Debug: if switching from kernel, verify kernel_context after we return
-  int was_kernel = (old_pid < 0);
+  int was_kernel = (old_slot < 0);
 
-  switch_context(old_ctx, &new_proc->context);
+  process_switch(old_ctx, &new_proc->context, old_proc);
 
-  // We return here when someone switches back to us
+  // We return here when someone switches back to us - a process may now be
+  // on a different CPU, a kernel context never is
   // Verify kernel_context wasn't corrupted during process execution
   if (was_kernel) {
-    if (arch_context_get_pc(&kernel_context) < 0x40000000 ||
-        arch_context_get_sp(&kernel_context) < 0x40000000) {
+    cpu_context_t *kctx = &this_proc_cpu()->kernel_context;
+    if (arch_context_get_pc(kctx) < 0x40000000 ||
+        arch_context_get_sp(kctx) < 0x40000000) {
       printf("[PROC] WARNING: kernel_context corrupted after process ran!\n");
       printf("[PROC] pc=0x%llx sp=0x%llx\n",
-             (unsigned long long)arch_context_get_pc(&kernel_context),
-             (unsigned long long)arch_context_get_sp(&kernel_context));
+             (unsigned long long)arch_context_get_pc(kctx),
+             (unsigned long long)arch_context_get_sp(kctx));
     }
   }
 
@@ -568,12 +873,9 @@ int process_exec_args(const char *path, int argc, char **argv) {
     return -1;
   }
 
-  // Wait for it to finish by yielding until it's done
-  // The process is READY, we need to run the scheduler to let it execute
-  while (proc_table[slot].state != PROC_STATE_FREE &&
-         proc_table[slot].state != PROC_STATE_ZOMBIE) {
-    process_schedule();
-  }
+  // Sleep until it has finished; other processes run in the meantime
+  wait_event(proc_exit_wait, proc_table[slot].state == PROC_STATE_FREE ||
+                                 proc_table[slot].state == PROC_STATE_ZOMBIE);
 
   int result = proc_table[slot].exit_status;
   printf("[PROC] Process '%s' (pid %d) finished with status %d\n", path, pid,
@@ -586,58 +888,94 @@ int process_exec(const char *path) {
   return process_exec_args(path, 1, argv);
 }
 
-// Called from IRQ handler for preemptive scheduling
-// Just updates current_process - IRQ handler does the actual context switch
+// Called from IRQ handler (timer tick or reschedule IPI) for preemptive
+// scheduling. Just updates this CPU's current process - IRQ handler does the
+// actual context switch. The interrupted process's registers were already
+// saved by the IRQ entry path, so it can be released to other CPUs here.
 void process_schedule_from_irq(void) {
-  // Check how many processes are ready to run
-  int ready_count = process_count_ready();
+  struct proc_cpu *pc = this_proc_cpu();
+  int old_slot = pc->current_slot;
+  int killed = 0;
+
+  // A spinlock is held or queued for on this CPU. Switching away would
+  // leave everyone else spinning behind a context that isn't running, so
+  // the interrupted code keeps the CPU until the next tick.
+  if (!preemptible())
+    return;
 
-  // If kernel is running (current_pid == -1), we should switch to ANY ready
-  // process If a process is running, we only switch if there's another ready
-  // process
-  if (current_pid >= 0 && ready_count <= 1) {
-    return; // Only one process, no point switching
-  }
-  if (current_pid < 0 && ready_count == 0) {
-    return; // Kernel running, no processes to switch to
+  // Nor can it be inside an RCU read section
+  rcu_tick();
+
+  spin_lock(&proc_table_lock);
+
+  // Killed from another CPU while running here: drop it. Its stack is still
+  // in use until this interrupt returns, so as in exit it is left for
+  // process_create() to free when the slot is reused.
+  // One inside a wait is left to unlink itself from the wait queue first.
+  if (old_slot >= 0 && proc_table[old_slot].kill_pending &&
+      !proc_table[old_slot].in_wait) {
+    process_t *old = &proc_table[old_slot];
+    printf("[PROC] Killing '%s' (pid %d) on CPU %u\n", old->name, old->pid,
+           arch_cpu_id());
+    old->kill_pending = 0;
+    proc_set_state_locked(old, PROC_STATE_FREE);
+    old->pid = 0;
+    old->on_cpu = 0;
+    pc->current_slot = -1;
+    pc->current = NULL;
+    old_slot = -1;
+    killed = 1;
   }
 
-  // Find next runnable process (round-robin)
-  int old_slot = current_pid;
-  int start = (old_slot >= 0) ? old_slot + 1 : 0;
+  // Find next runnable process (round-robin). A running process is only
+  // preempted for one at least as urgent as itself.
+  int next = pick_next_slot_locked(old_slot);
+  if (next >= 0 && old_slot >= 0 &&
+      proc_table[old_slot].state == PROC_STATE_RUNNING &&
+      proc_table[next].prio > proc_table[old_slot].prio)
+    next = old_slot;
+  if (next >= 0 && next != old_slot) {
+    process_t *new_proc = &proc_table[next];
+
+    // Mark old process as ready (it was running). One preempted between
+    // process_sleep_prepare() and sleeping stays runnable too, so it gets
+    // to recheck its wait condition.
+    if (old_slot >= 0) {
+      process_t *old = &proc_table[old_slot];
+      if (old->state == PROC_STATE_RUNNING ||
+          old->state == PROC_STATE_BLOCKED) {
+        proc_set_state_locked(old, PROC_STATE_READY);
+      }
+      old->on_cpu = 0;
+    }
 
-  for (int i = 0; i < MAX_PROCESSES; i++) {
-    int idx = (start + i) % MAX_PROCESSES;
-    if (proc_table[idx].state == PROC_STATE_READY) {
-      // Found a different process to switch to
-      if (idx != old_slot) {
-        // Safety check: verify process has valid context
-        process_t *new_proc = &proc_table[idx];
-        if (arch_context_get_sp(&new_proc->context) == 0 ||
-            arch_context_get_pc(&new_proc->context) == 0) {
-          continue; // Skip invalid process
-        }
+    // Switch to new process
+    proc_set_state_locked(new_proc, PROC_STATE_RUNNING);
+    new_proc->on_cpu = 1;
+    new_proc->cpu = arch_cpu_id();
+    pc->current_slot = next;
+    pc->current = new_proc;
+  }
 
-        // Mark old process as ready (it was running)
-        if (old_slot >= 0 && proc_table[old_slot].state == PROC_STATE_RUNNING) {
-          proc_table[old_slot].state = PROC_STATE_READY;
-        }
+  spin_unlock(&proc_table_lock);
 
-        // Switch to new process
-        proc_table[idx].state = PROC_STATE_RUNNING;
-        current_pid = idx;
-        current_process = new_proc;
+  // Leaving idle straight from an IPI: the process needs the tick to be
+  // preempted
+  if (next >= 0)
+    tick_nohz_idle_exit();
 
-        // Memory barrier to ensure current_process is visible to IRQ handler
-        arch_dsb();
-      }
-      return;
-    }
-  }
+  if (killed)
+    wake_up(&proc_exit_wait);
+
+  // Memory barrier to ensure current is visible to IRQ handler
+  arch_dsb();
 }
 
 // Kill all children of a process (iterative to prevent stack overflow)
+// Caller must hold proc_table_lock
 static void kill_children(int parent_pid) {
+  int self = this_proc_cpu()->current_slot;
+
   // Use a work stack to avoid recursion - max depth is MAX_PROCESSES
   int work_stack[MAX_PROCESSES];
   int stack_top = 0;
@@ -660,15 +998,10 @@ static void kill_children(int parent_pid) {
         }
 
         // Kill this child (skip if it's current process)
-        if (i != current_pid) {
+        if (i != self && !proc_table[i].kill_pending) {
           printf("[PROC] Killing child '%s' (pid %d, parent %d)\n",
                  proc_table[i].name, child_pid, current_parent);
-          if (proc_table[i].stack_base) {
-            free(proc_table[i].stack_base);
-            proc_table[i].stack_base = NULL;
-          }
-          proc_table[i].state = PROC_STATE_FREE;
-          proc_table[i].pid = 0;
+          reap_slot_locked(i);
         }
       }
     }
@@ -683,6 +1016,8 @@ int process_kill(int pid) {
     return -1;
   }
 
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+
   // Find the process
   int slot = -1;
   for (int i = 0; i < MAX_PROCESSES; i++) {
@@ -693,6 +1028,7 @@ int process_kill(int pid) {
   }
 
   if (slot < 0) {
+    spin_unlock_irqrestore(&proc_table_lock, flags);
     printf("[PROC] Process %d not found\n", pid);
     return -1;
   }
@@ -700,7 +1036,8 @@ int process_kill(int pid) {
   process_t *proc = &proc_table[slot];
 
   // Don't allow killing the current process this way - use exit() instead
-  if (slot == current_pid) {
+  if (slot == this_proc_cpu()->current_slot) {
+    spin_unlock_irqrestore(&proc_table_lock, flags);
     printf("[PROC] Cannot kill current process (use exit)\n");
     return -1;
   }
@@ -710,15 +1047,12 @@ int process_kill(int pid) {
   // First kill all children of this process
   kill_children(pid);
 
-  // Free the process memory
-  if (proc->stack_base) {
-    free(proc->stack_base);
-    proc->stack_base = NULL;
-  }
+  // Free the process memory and slot, or have its CPU drop it if it is
+  // running elsewhere
+  reap_slot_locked(slot);
 
-  // Mark slot as free
-  proc->state = PROC_STATE_FREE;
-  proc->pid = 0;
+  spin_unlock_irqrestore(&proc_table_lock, flags);
 
+  wake_up(&proc_exit_wait);
   return 0;
 }
@@ -15,6 +15,10 @@
 #define PROCESS_STACK_SIZE 0x100000  // 1MB per process (TLS crypto needs lots of stack)
 #define MAX_PROCESSES 16
 
+// Scheduling priorities: 0 is the highest, one ready list per level
+#define PROC_NR_PRIO 32
+#define PROC_PRIO_DEFAULT 16
+
 // Process states
 typedef enum {
     PROC_STATE_FREE = 0,     // Slot available
@@ -44,11 +48,36 @@ typedef struct process {
     // Exit
     int exit_status;
     int parent_pid;           // Who spawned us
+
+    // Scheduling
+    int prio;                 // 0 (highest) .. PROC_NR_PRIO - 1
+    struct process *rq_next;  // Ready queue links (valid while READY)
+    struct process *rq_prev;
+
+    // SMP
+    int cpu;                  // CPU it is running on, or last ran on
+    volatile uint32_t on_cpu; // Registers live on a CPU, not yet saved
+    volatile int kill_pending; // Killed while running on another CPU
+    volatile int in_wait;     // Between prepare_to_wait() and finish_wait()
 } process_t;
 
+// Per-CPU scheduling state. The IRQ entry path reaches it through
+// TPIDR_EL1 and depends on the offsets of the first two fields (boot.S).
+struct proc_cpu {
+    process_t *current;            // Running process, NULL for the kernel
+    cpu_context_t kernel_context;  // This CPU's kernel context while a process runs
+    int current_slot;              // proc_table index of current, -1 for kernel
+    volatile int idle;             // Waiting for work in process_schedule()
+};
+
+extern struct proc_cpu proc_cpus[MAX_CPUS];
+
 // Initialize process subsystem
 void process_init(void);
 
+// Set up the calling CPU's scheduling state (boot CPU: from process_init)
+void process_cpu_init(int cpu);
+
 // Create a new process from ELF path (does NOT start it yet)
 int process_create(const char *path, int argc, char **argv);
 
@@ -66,10 +95,7 @@ void process_exit(int status);
 process_t *process_current(void);
 process_t *process_get(int pid);
 
-// Current running process (NULL if kernel)
-extern process_t *current_process;
-
-// Get pointer to current_process pointer (for assembly IRQ handler)
+// Get pointer to this CPU's current process pointer (NULL if kernel)
 process_t **process_get_current_ptr(void);
 
 // Scheduling
@@ -77,6 +103,12 @@ void process_yield(void);              // Give up CPU voluntarily
 void process_schedule(void);           // Pick next process to run
 void process_schedule_from_irq(void);  // Called from timer IRQ for preemption
 int process_count_ready(void);         // Count runnable processes
+int process_set_priority(int pid, int prio); // 0 on success, -1 if not found
+
+// Sleeping (used by wait queues, see sync/wait.h)
+void process_sleep_prepare(process_t *p); // RUNNING -> BLOCKED, still on CPU
+void process_sleep_cancel(process_t *p);  // Back to RUNNING without sleeping
+void process_wake(process_t *p);          // BLOCKED -> READY
 
 // Context switch (implemented in assembly)
 void process_context_switch(cpu_context_t *old_ctx, cpu_context_t *new_ctx);
@@ -5,6 +5,7 @@
  * Enables dual-boot with macOS.
  */
 
+#include "fs/pagecache.h"
 #include "fs/vfs.h"
 #include "printk.h"
 #include "mm/kmalloc.h"
@@ -135,6 +136,7 @@ struct apfs_fs {
     } volumes[APFS_MAX_VOLUMES];
     void *device;
     int (*read_block)(void *device, uint64_t block, void *buf);
+    struct pagecache_mapping cache;     /* Read-only, set up once block_size is known */
 };
 
 static struct apfs_fs *mounted_apfs = NULL;
@@ -146,7 +148,7 @@ static struct apfs_fs *mounted_apfs = NULL;
 static int apfs_read_block(struct apfs_fs *fs, uint64_t block, void *buf)
 {
     if (!fs->read_block) return -1;
-    return fs->read_block(fs->device, block, buf);
+    return pagecache_read(&fs->cache, block, buf);
 }
 
 /* ===================================================================== */
@@ -180,8 +182,8 @@ static int apfs_read_container(struct apfs_fs *fs)
     uint8_t *buf = kmalloc(fs->block_size);
     if (!buf) return -1;
     
-    /* Read block 0 - container superblock */
-    if (apfs_read_block(fs, 0, buf) < 0) {
+    /* Read block 0 - container superblock (uncached, block size unknown yet) */
+    if (fs->read_block(fs->device, 0, buf) < 0) {
         kfree(buf);
         return -1;
     }
@@ -280,6 +282,8 @@ int apfs_mount(void *device, int (*read_block)(void*, uint64_t, void*))
         return -1;
     }
     
+    pagecache_init_mapping(&fs->cache, device, fs->block_size, read_block, NULL);
+    
     /* Read all volumes */
     for (int i = 0; i < fs->num_volumes; i++) {
         apfs_read_volume(fs, i);
@@ -299,6 +303,7 @@ int apfs_unmount(void)
         kfree(mounted_apfs->container_sb);
     }
     
+    pagecache_invalidate(&mounted_apfs->cache);
     kfree(mounted_apfs);
     mounted_apfs = NULL;
     
@@ -0,0 +1,299 @@
+/*
+ * UnixOS Kernel - Dentry Cache
+ *
+ * Hash table of dentries keyed by (parent, name) plus an LRU list of the
+ * unused ones. A single lock covers the table, the list and the
+ * reference counts; filesystem callbacks are never made with it held.
+ */
+
+#include "fs/dcache.h"
+#include "mm/kmalloc.h"
+#include "sync/spinlock.h"
+
+#define DCACHE_HASH_BITS 9
+#define DCACHE_HASH_SIZE (1 << DCACHE_HASH_BITS)
+
+static struct dentry *dentry_hash[DCACHE_HASH_SIZE];
+
+/* Unused list: head is most recently released, reclaim works from the tail */
+static struct dentry *lru_head;
+static struct dentry *lru_tail;
+
+static struct dcache_stats dc_stats;
+static DEFINE_SPINLOCK(dcache_lock);
+
+/* Mount roots are owned by their super_block and never freed here */
+#define IS_ROOT(d) (!(d)->d_parent || (d)->d_parent == (d))
+
+/* ===================================================================== */
+/* Helpers */
+/* ===================================================================== */
+
+static uint32_t d_hash_name(const struct dentry *parent, const char *name) {
+  /* FNV-1a over the name, seeded with the parent pointer */
+  uint32_t hash = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 4);
+  while (*name) {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int d_name_equal(const char *a, const char *b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+/* dcache_lock held */
+static void lru_del(struct dentry *d) {
+  if (d->d_lru_prev) {
+    d->d_lru_prev->d_lru_next = d->d_lru_next;
+  } else {
+    lru_head = d->d_lru_next;
+  }
+  if (d->d_lru_next) {
+    d->d_lru_next->d_lru_prev = d->d_lru_prev;
+  } else {
+    lru_tail = d->d_lru_prev;
+  }
+  d->d_lru_prev = d->d_lru_next = NULL;
+  d->d_flags &= ~DCACHE_LRU;
+  dc_stats.nr_unused--;
+}
+
+/* dcache_lock held */
+static void lru_add_head(struct dentry *d) {
+  d->d_lru_prev = NULL;
+  d->d_lru_next = lru_head;
+  if (lru_head) {
+    lru_head->d_lru_prev = d;
+  } else {
+    lru_tail = d;
+  }
+  lru_head = d;
+  d->d_flags |= DCACHE_LRU;
+  dc_stats.nr_unused++;
+}
+
+/* dcache_lock held */
+static void d_unhash(struct dentry *d) {
+  struct dentry **pp = &dentry_hash[d->d_hash & (DCACHE_HASH_SIZE - 1)];
+  while (*pp && *pp != d) {
+    pp = &(*pp)->d_hash_next;
+  }
+  if (*pp) {
+    *pp = d->d_hash_next;
+  }
+  d->d_hash_next = NULL;
+  d->d_flags &= ~DCACHE_HASHED;
+}
+
+/* Drop the dentry's use of its inode */
+static void d_release_inode(struct inode *inode) {
+  if (atomic_read(&inode->i_count) > 1) {
+    atomic_dec(&inode->i_count);
+    return;
+  }
+
+  if (inode->i_sb && inode->i_sb->s_op && inode->i_sb->s_op->destroy_inode) {
+    inode->i_sb->s_op->destroy_inode(inode);
+  } else {
+    kfree(inode);
+  }
+}
+
+/* Free an unreferenced, unhashed dentry and return its parent */
+static struct dentry *d_kill(struct dentry *d) {
+  struct dentry *parent = d->d_parent;
+
+  if (d->d_inode) {
+    d_release_inode(d->d_inode);
+  }
+
+  spin_lock(&dcache_lock);
+  dc_stats.nr_dentry--;
+  spin_unlock(&dcache_lock);
+
+  kfree(d);
+  return parent;
+}
+
+/* ===================================================================== */
+/* Public API */
+/* ===================================================================== */
+
+struct dentry *d_alloc(struct dentry *parent, const char *name) {
+  struct dentry *d = kzalloc(sizeof(struct dentry), GFP_KERNEL);
+  if (!d) {
+    return NULL;
+  }
+
+  int i;
+  for (i = 0; i < NAME_MAX && name[i]; i++) {
+    d->d_name[i] = name[i];
+  }
+  d->d_name[i] = '\0';
+
+  d->d_parent = dget(parent);
+  d->d_sb = parent->d_sb;
+  d->d_hash = d_hash_name(parent, d->d_name);
+  atomic_set(&d->d_count, 1);
+
+  spin_lock(&dcache_lock);
+  dc_stats.nr_dentry++;
+  spin_unlock(&dcache_lock);
+  return d;
+}
+
+void d_add(struct dentry *dentry, struct inode *inode) {
+  spin_lock(&dcache_lock);
+  dentry->d_inode = inode;
+  if (!(dentry->d_flags & DCACHE_HASHED)) {
+    struct dentry **bucket =
+        &dentry_hash[dentry->d_hash & (DCACHE_HASH_SIZE - 1)];
+    dentry->d_hash_next = *bucket;
+    *bucket = dentry;
+    dentry->d_flags |= DCACHE_HASHED;
+  }
+  spin_unlock(&dcache_lock);
+}
+
+struct dentry *d_lookup(struct dentry *parent, const char *name) {
+  uint32_t hash = d_hash_name(parent, name);
+
+  spin_lock(&dcache_lock);
+  struct dentry *d = dentry_hash[hash & (DCACHE_HASH_SIZE - 1)];
+  while (d) {
+    if (d->d_hash == hash && d->d_parent == parent &&
+        d_name_equal(d->d_name, name)) {
+      if (d->d_flags & DCACHE_LRU) {
+        lru_del(d);
+      }
+      atomic_inc(&d->d_count);
+      if (d->d_inode) {
+        dc_stats.hits++;
+      } else {
+        dc_stats.negative_hits++;
+      }
+      spin_unlock(&dcache_lock);
+      return d;
+    }
+    d = d->d_hash_next;
+  }
+  dc_stats.misses++;
+  spin_unlock(&dcache_lock);
+  return NULL;
+}
+
+struct dentry *dget(struct dentry *dentry) {
+  if (!dentry) {
+    return NULL;
+  }
+
+  spin_lock(&dcache_lock);
+  if (dentry->d_flags & DCACHE_LRU) {
+    lru_del(dentry);
+  }
+  atomic_inc(&dentry->d_count);
+  spin_unlock(&dcache_lock);
+  return dentry;
+}
+
+/* Release a reference; returns how far the LRU list is over its limit */
+static size_t dput_noshrink(struct dentry *dentry) {
+  size_t excess = 0;
+
+  while (dentry) {
+    spin_lock(&dcache_lock);
+    if (IS_ROOT(dentry)) {
+      if (atomic_read(&dentry->d_count) > 0) {
+        atomic_dec(&dentry->d_count);
+      }
+      spin_unlock(&dcache_lock);
+      break;
+    }
+    if (!atomic_dec_and_test(&dentry->d_count)) {
+      spin_unlock(&dcache_lock);
+      break;
+    }
+    if (dentry->d_flags & DCACHE_HASHED) {
+      /* Keep it around for the next lookup */
+      lru_add_head(dentry);
+      if (dc_stats.nr_unused > DCACHE_MAX_UNUSED) {
+        excess = dc_stats.nr_unused - DCACHE_MAX_UNUSED;
+      }
+      spin_unlock(&dcache_lock);
+      break;
+    }
+    spin_unlock(&dcache_lock);
+
+    /* Unhashed and unused: free it and release the parent */
+    dentry = d_kill(dentry);
+  }
+
+  return excess;
+}
+
+void dput(struct dentry *dentry) {
+  size_t excess = dput_noshrink(dentry);
+  if (excess) {
+    dcache_shrink(excess);
+  }
+}
+
+void d_drop(struct dentry *dentry) {
+  spin_lock(&dcache_lock);
+  if (dentry->d_flags & DCACHE_HASHED) {
+    d_unhash(dentry);
+  }
+  spin_unlock(&dcache_lock);
+}
+
+void d_delete(struct dentry *dentry) {
+  struct inode *inode = NULL;
+
+  spin_lock(&dcache_lock);
+  if (atomic_read(&dentry->d_count) == 1) {
+    /* Only the caller holds it: keep it as a negative entry */
+    inode = dentry->d_inode;
+    dentry->d_inode = NULL;
+  } else if (dentry->d_flags & DCACHE_HASHED) {
+    d_unhash(dentry);
+  }
+  spin_unlock(&dcache_lock);
+
+  if (inode) {
+    d_release_inode(inode);
+  }
+}
+
+size_t dcache_shrink(size_t nr) {
+  size_t freed = 0;
+
+  while (freed < nr) {
+    spin_lock(&dcache_lock);
+    struct dentry *d = lru_tail;
+    if (!d) {
+      spin_unlock(&dcache_lock);
+      break;
+    }
+    lru_del(d);
+    d_unhash(d);
+    dc_stats.evictions++;
+    spin_unlock(&dcache_lock);
+
+    /* May move the parent onto the LRU list in turn */
+    dput_noshrink(d_kill(d));
+    freed++;
+  }
+  return freed;
+}
+
+void dcache_get_stats(struct dcache_stats *stats) {
+  spin_lock(&dcache_lock);
+  *stats = dc_stats;
+  spin_unlock(&dcache_lock);
+}
@@ -0,0 +1,463 @@
+/*
+ * vib-OS Kernel - Event Poll
+ *
+ * Locking:
+ *
+ *   epoll_lock   Serializes adding and removing watches anywhere, and the
+ *                ready list scan of epoll_wait(). Holding it keeps every
+ *                watch, and the file it is on, from going away.
+ *   queue lock   The watched file's wait queue, held while the wakeup
+ *                function runs.
+ *   ep->lock     An instance's tree, ready list and watch state. Taken
+ *                from the wakeup function, so always with irqs off.
+ *
+ * in that order. epoll_wait() sleeps on ep->wq with none of them held.
+ */
+
+#include "fs/eventpoll.h"
+#include "fs/vfs.h"
+#include "mm/kmalloc.h"
+#include "rbtree.h"
+#include "sync/spinlock.h"
+#include "time/hrtimer.h"
+
+/* Flags that are not events */
+#define EP_PRIVATE_BITS (EPOLLEXCLUSIVE | EPOLLWAKEUP | EPOLLONESHOT | EPOLLET)
+
+/* Reported whether asked for or not */
+#define EP_ALWAYS (EPOLLERR | EPOLLHUP)
+
+/* Where a watch is */
+#define EPI_IDLE 0  /* Waiting for a wakeup */
+#define EPI_READY 1 /* On the ready list */
+#define EPI_TX 2    /* Taken off it by epoll_wait(), being reported */
+
+struct eventpoll {
+  spinlock_t lock;
+  struct rb_root rbr;     /* Watches by (file, fd) */
+  struct epitem *rdhead;  /* Ready watches, oldest first */
+  struct epitem *rdtail;
+  wait_queue_head_t wq;   /* epoll_wait() callers */
+};
+
+struct epitem {
+  struct rb_node rbn;
+  struct eventpoll *ep;
+  struct file *file;
+  int fd;
+  uint32_t events; /* Requested events and flags; none left once disabled */
+  uint64_t data;
+  wait_queue_head_t *whead;      /* Queue the file named in poll() */
+  struct wait_queue_entry wait;  /* Our function entry on it */
+  int state;                     /* EPI_* */
+  int woken;                     /* Woken while EPI_TX */
+  struct epitem *rdnext;
+  struct epitem *rdprev;
+  struct epitem *fnext; /* Next watch on the same file */
+};
+
+/* Used while registering a watch: poll_wait() lands in ep_ptable_queue() */
+struct ep_pqueue {
+  struct poll_table pt;
+  struct epitem *epi;
+};
+
+static DEFINE_SPINLOCK(epoll_lock);
+
+static const struct file_operations eventpoll_fops;
+
+/* ===================================================================== */
+/* Ready list, ep->lock held */
+/* ===================================================================== */
+
+static void ep_ready_add(struct eventpoll *ep, struct epitem *epi) {
+  if (epi->state == EPI_TX) {
+    /* epoll_wait() requeues it when done */
+    epi->woken = 1;
+    return;
+  }
+  if (epi->state == EPI_READY) {
+    return;
+  }
+  epi->state = EPI_READY;
+  epi->rdnext = NULL;
+  epi->rdprev = ep->rdtail;
+  if (ep->rdtail) {
+    ep->rdtail->rdnext = epi;
+  } else {
+    ep->rdhead = epi;
+  }
+  ep->rdtail = epi;
+}
+
+static void ep_ready_del(struct eventpoll *ep, struct epitem *epi) {
+  if (epi->state != EPI_READY) {
+    return;
+  }
+  if (epi->rdprev) {
+    epi->rdprev->rdnext = epi->rdnext;
+  } else {
+    ep->rdhead = epi->rdnext;
+  }
+  if (epi->rdnext) {
+    epi->rdnext->rdprev = epi->rdprev;
+  } else {
+    ep->rdtail = epi->rdprev;
+  }
+  epi->rdnext = epi->rdprev = NULL;
+  epi->state = EPI_IDLE;
+}
+
+static inline int ep_has_ready(struct eventpoll *ep) {
+  return __atomic_load_n(&ep->rdhead, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* ===================================================================== */
+/* Watches */
+/* ===================================================================== */
+
+static int ep_cmp(struct file *f1, int fd1, struct file *f2, int fd2) {
+  if (f1 != f2) {
+    return f1 < f2 ? -1 : 1;
+  }
+  return fd1 - fd2;
+}
+
+/* ep->lock held */
+static struct epitem *ep_find(struct eventpoll *ep, struct file *file,
+                              int fd) {
+  struct rb_node *node = ep->rbr.node;
+
+  while (node) {
+    struct epitem *epi = rb_entry(node, struct epitem, rbn);
+    int c = ep_cmp(file, fd, epi->file, epi->fd);
+    if (c == 0) {
+      return epi;
+    }
+    node = c < 0 ? node->left : node->right;
+  }
+  return NULL;
+}
+
+/* ep->lock held */
+static void ep_rbtree_insert(struct eventpoll *ep, struct epitem *epi) {
+  struct rb_node **link = &ep->rbr.node;
+  struct rb_node *parent = NULL;
+
+  while (*link) {
+    struct epitem *cur = rb_entry(*link, struct epitem, rbn);
+    parent = *link;
+    if (ep_cmp(epi->file, epi->fd, cur->file, cur->fd) < 0) {
+      link = &(*link)->left;
+    } else {
+      link = &(*link)->right;
+    }
+  }
+  rb_link_node(&epi->rbn, parent, link);
+  rb_insert_color(&epi->rbn, &ep->rbr);
+}
+
+/* Wakeup function: the watched file may have become ready */
+static void ep_poll_callback(struct wait_queue_entry *wait) {
+  struct epitem *epi = container_of(wait, struct epitem, wait);
+  struct eventpoll *ep = epi->ep;
+  int woke = 0;
+
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  /* Disabled by EPOLLONESHOT until the next EPOLL_CTL_MOD */
+  if (epi->events & ~EP_PRIVATE_BITS) {
+    ep_ready_add(ep, epi);
+    woke = 1;
+  }
+  spin_unlock_irqrestore(&ep->lock, flags);
+
+  if (woke) {
+    wake_up(&ep->wq);
+  }
+}
+
+static void ep_ptable_queue(struct file *file, wait_queue_head_t *wq,
+                            struct poll_table *pt) {
+  struct epitem *epi = container_of(pt, struct ep_pqueue, pt)->epi;
+  (void)file;
+
+  /* One queue per watch is all the files here need */
+  if (epi->whead) {
+    return;
+  }
+  epi->whead = wq;
+  add_wait_queue(wq, &epi->wait);
+}
+
+static inline unsigned int ep_item_poll(struct epitem *epi,
+                                        struct poll_table *pt) {
+  unsigned int revents = epi->file->f_op->poll(epi->file, pt);
+  return revents & (epi->events | EP_ALWAYS);
+}
+
+/* epoll_lock held */
+static void ep_remove(struct eventpoll *ep, struct epitem *epi) {
+  if (epi->whead) {
+    remove_wait_queue(epi->whead, &epi->wait);
+  }
+
+  struct epitem **link = &epi->file->f_ep;
+  while (*link != epi) {
+    link = &(*link)->fnext;
+  }
+  __atomic_store_n(link, epi->fnext, __ATOMIC_RELEASE);
+
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  rb_erase(&epi->rbn, &ep->rbr);
+  ep_ready_del(ep, epi);
+  spin_unlock_irqrestore(&ep->lock, flags);
+
+  kfree(epi);
+}
+
+/* epoll_lock held */
+static int ep_insert(struct eventpoll *ep, int fd, struct file *file,
+                     const struct epoll_event *event) {
+  struct epitem *epi = kzalloc(sizeof(*epi), GFP_KERNEL);
+  if (!epi) {
+    return -ENOMEM;
+  }
+
+  epi->ep = ep;
+  epi->file = file;
+  epi->fd = fd;
+  epi->events = event->events;
+  epi->data = event->data;
+  init_waitqueue_func_entry(&epi->wait, ep_poll_callback);
+
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  ep_rbtree_insert(ep, epi);
+  spin_unlock_irqrestore(&ep->lock, flags);
+
+  /* Hook into the file's queue first, so no change after the poll is
+   * missed */
+  struct ep_pqueue epq = {.pt = {.qproc = ep_ptable_queue}, .epi = epi};
+  unsigned int revents = ep_item_poll(epi, &epq.pt);
+
+  epi->fnext = file->f_ep;
+  __atomic_store_n(&file->f_ep, epi, __ATOMIC_RELEASE);
+
+  if (revents) {
+    flags = spin_lock_irqsave(&ep->lock);
+    ep_ready_add(ep, epi);
+    spin_unlock_irqrestore(&ep->lock, flags);
+    wake_up(&ep->wq);
+  }
+  return 0;
+}
+
+/* epoll_lock held */
+static void ep_modify(struct eventpoll *ep, struct epitem *epi,
+                      const struct epoll_event *event) {
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  epi->events = event->events;
+  epi->data = event->data;
+  spin_unlock_irqrestore(&ep->lock, flags);
+
+  if (ep_item_poll(epi, NULL)) {
+    flags = spin_lock_irqsave(&ep->lock);
+    ep_ready_add(ep, epi);
+    spin_unlock_irqrestore(&ep->lock, flags);
+    wake_up(&ep->wq);
+  }
+}
+
+/* Report ready watches; returns the number of events stored */
+static int ep_send_events(struct eventpoll *ep, struct epoll_event *events,
+                          int maxevents) {
+  int n = 0;
+
+  uint64_t lflags = spin_lock_irqsave(&epoll_lock);
+
+  /* Take the whole list; wakeups meanwhile just mark the watches */
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  struct epitem *txlist = ep->rdhead;
+  ep->rdhead = ep->rdtail = NULL;
+  for (struct epitem *epi = txlist; epi; epi = epi->rdnext) {
+    epi->state = EPI_TX;
+    epi->woken = 0;
+  }
+  spin_unlock_irqrestore(&ep->lock, flags);
+
+  struct epitem *epi = txlist;
+  while (epi) {
+    struct epitem *next = epi->rdnext;
+    unsigned int revents = 0;
+
+    /* Out of room: the rest go back unreported */
+    int room = n < maxevents;
+    if (room && (epi->events & ~EP_PRIVATE_BITS)) {
+      revents = ep_item_poll(epi, NULL);
+    }
+    if (revents) {
+      events[n].events = revents;
+      events[n].data = epi->data;
+      n++;
+    }
+
+    flags = spin_lock_irqsave(&ep->lock);
+    int requeue = epi->woken || !room;
+    if (revents && (epi->events & EPOLLONESHOT)) {
+      epi->events &= EP_PRIVATE_BITS;
+    } else if (revents && !(epi->events & EPOLLET)) {
+      /* Level-triggered: look again next time */
+      requeue = 1;
+    }
+    epi->state = EPI_IDLE;
+    if (requeue) {
+      ep_ready_add(ep, epi);
+    }
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    epi = next;
+  }
+
+  spin_unlock_irqrestore(&epoll_lock, lflags);
+  return n;
+}
+
+/* ===================================================================== */
+/* Instance file */
+/* ===================================================================== */
+
+static int ep_release(struct inode *inode, struct file *file) {
+  (void)inode;
+
+  struct eventpoll *ep = (struct eventpoll *)file->private_data;
+  if (!ep) {
+    return 0;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&epoll_lock);
+  while (ep->rbr.node) {
+    ep_remove(ep, rb_entry(ep->rbr.node, struct epitem, rbn));
+  }
+  spin_unlock_irqrestore(&epoll_lock, flags);
+
+  kfree(ep);
+  return 0;
+}
+
+static const struct file_operations eventpoll_fops = {
+    .release = ep_release,
+};
+
+static struct eventpoll *get_ep(struct file *file) {
+  if (!file || file->f_op != &eventpoll_fops) {
+    return NULL;
+  }
+  return (struct eventpoll *)file->private_data;
+}
+
+int eventpoll_create(struct file **filep) {
+  struct eventpoll *ep = kzalloc(sizeof(*ep), GFP_KERNEL);
+  if (!ep) {
+    return -ENOMEM;
+  }
+  spin_lock_init(&ep->lock);
+  ep->rbr = RB_ROOT;
+  init_waitqueue_head(&ep->wq);
+
+  struct file *file = kzalloc(sizeof(struct file), GFP_KERNEL);
+  if (!file) {
+    kfree(ep);
+    return -ENOMEM;
+  }
+  file->f_op = &eventpoll_fops;
+  file->f_flags = O_RDWR;
+  file->private_data = ep;
+  file->f_count.counter = 1;
+
+  *filep = file;
+  return 0;
+}
+
+int eventpoll_ctl(struct file *epfile, int op, int fd, struct file *file,
+                  const struct epoll_event *event) {
+  struct eventpoll *ep = get_ep(epfile);
+  if (!ep || file == epfile) {
+    return -EINVAL;
+  }
+  if (!file->f_op || !file->f_op->poll) {
+    /* Regular files are always ready and instances can't be nested */
+    return -EPERM;
+  }
+
+  uint64_t lflags = spin_lock_irqsave(&epoll_lock);
+
+  uint64_t flags = spin_lock_irqsave(&ep->lock);
+  struct epitem *epi = ep_find(ep, file, fd);
+  spin_unlock_irqrestore(&ep->lock, flags);
+
+  int ret = 0;
+  switch (op) {
+  case EPOLL_CTL_ADD:
+    ret = epi ? -EEXIST : ep_insert(ep, fd, file, event);
+    break;
+  case EPOLL_CTL_DEL:
+    if (epi) {
+      ep_remove(ep, epi);
+    } else {
+      ret = -ENOENT;
+    }
+    break;
+  case EPOLL_CTL_MOD:
+    if (epi) {
+      ep_modify(ep, epi, event);
+    } else {
+      ret = -ENOENT;
+    }
+    break;
+  default:
+    ret = -EINVAL;
+    break;
+  }
+
+  spin_unlock_irqrestore(&epoll_lock, lflags);
+  return ret;
+}
+
+int eventpoll_wait(struct file *epfile, struct epoll_event *events,
+                   int maxevents, int64_t timeout) {
+  struct eventpoll *ep = get_ep(epfile);
+  if (!ep || maxevents <= 0 || maxevents > EP_MAX_EVENTS) {
+    return -EINVAL;
+  }
+
+  ktime_t deadline = timeout > 0 ? ktime_get() + (ktime_t)timeout : 0;
+
+  for (;;) {
+    int n = ep_send_events(ep, events, maxevents);
+    if (n > 0 || timeout == 0) {
+      return n;
+    }
+
+    int ret;
+    if (timeout < 0) {
+      ret = wait_event_killable(ep->wq, ep_has_ready(ep));
+    } else {
+      ktime_t now = ktime_get();
+      if (now >= deadline) {
+        return 0;
+      }
+      ret = wait_event_timeout(ep->wq, ep_has_ready(ep), deadline - now);
+    }
+    if (ret < 0) {
+      return -EINTR;
+    }
+    /* Woken or timed out: either way, one more look */
+  }
+}
+
+void eventpoll_release(struct file *file) {
+  uint64_t flags = spin_lock_irqsave(&epoll_lock);
+  while (file->f_ep) {
+    ep_remove(file->f_ep->ep, file->f_ep);
+  }
+  spin_unlock_irqrestore(&epoll_lock, flags);
+}
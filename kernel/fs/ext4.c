@@ -4,9 +4,11 @@
  * Read/write support for ext4 filesystem.
  */
 
+#include "fs/pagecache.h"
 #include "fs/vfs.h"
 #include "printk.h"
 #include "mm/kmalloc.h"
+#include "string.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -35,6 +37,16 @@
 #define EXT4_TIND_BLOCK     (EXT4_DIND_BLOCK + 1)
 #define EXT4_N_BLOCKS       (EXT4_TIND_BLOCK + 1)
 
+/* Extent trees */
+#define EXT4_EXTENTS_FL         0x80000     /* Inode uses extents (i_flags) */
+#define EXT4_EXT_MAGIC          0xF30A
+#define EXT4_EXT_MAX_DEPTH      5
+#define EXT4_EXT_INIT_MAX_LEN   32768       /* Longer ee_len means unwritten */
+
+/* In-memory extent cache */
+#define EXT4_ES_SLOTS           64          /* Inodes tracked */
+#define EXT4_ES_PER_INODE       4           /* Extents kept per inode */
+
 /* ===================================================================== */
 /* ext4 On-disk Structures */
 /* ===================================================================== */
@@ -159,6 +171,28 @@ struct ext4_inode {
     /* ... more fields */
 } __attribute__((packed));
 
+struct ext4_extent_header {
+    uint16_t eh_magic;
+    uint16_t eh_entries;
+    uint16_t eh_max;
+    uint16_t eh_depth;          /* 0 for leaves */
+    uint32_t eh_generation;
+} __attribute__((packed));
+
+struct ext4_extent_idx {
+    uint32_t ei_block;          /* First logical block covered */
+    uint32_t ei_leaf_lo;
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+} __attribute__((packed));
+
+struct ext4_extent {
+    uint32_t ee_block;          /* First logical block */
+    uint16_t ee_len;
+    uint16_t ee_start_hi;
+    uint32_t ee_start_lo;
+} __attribute__((packed));
+
 struct ext4_dir_entry {
     uint32_t inode;
     uint16_t rec_len;
@@ -171,6 +205,19 @@ struct ext4_dir_entry {
 /* ext4 In-memory Structures */
 /* ===================================================================== */
 
+/* A cached extent: len blocks from lblk map to pblk onwards */
+struct ext4_extent_status {
+    uint32_t lblk;
+    uint32_t len;               /* 0 if the slot is empty */
+    uint64_t pblk;
+};
+
+struct ext4_es_slot {
+    uint32_t ino;               /* 0 if unused */
+    uint32_t next;              /* Round-robin replacement */
+    struct ext4_extent_status es[EXT4_ES_PER_INODE];
+};
+
 struct ext4_fs {
     struct ext4_superblock sb;
     uint32_t block_size;
@@ -184,6 +231,10 @@ struct ext4_fs {
     /* Read function */
     int (*read_block)(void *device, uint64_t block, void *buf);
     int (*write_block)(void *device, uint64_t block, const void *buf);
+    /* Cached view of the device, all block I/O goes through it */
+    struct pagecache_mapping cache;
+    /* Recently used extents of extent-mapped inodes */
+    struct ext4_es_slot es_cache[EXT4_ES_SLOTS];
 };
 
 /* ===================================================================== */
@@ -197,7 +248,7 @@ struct ext4_fs {
 static int ext4_read_block(struct ext4_fs *fs, uint64_t block, void *buf)
 {
     if (fs->read_block) {
-        return fs->read_block(fs->device, block, buf);
+        return pagecache_read(&fs->cache, block, buf);
     }
     return -1;
 }
@@ -205,11 +256,35 @@ static int ext4_read_block(struct ext4_fs *fs, uint64_t block, void *buf)
 static int ext4_write_block_raw(struct ext4_fs *fs, uint64_t block, const void *buf)
 {
     if (fs->write_block) {
-        return fs->write_block(fs->device, block, buf);
+        return pagecache_write(&fs->cache, block, buf);
     }
     return -1;
 }
 
+/* Forget cached extents of an inode whose mapping changed or went away */
+static void ext4_es_invalidate(struct ext4_fs *fs, uint32_t ino)
+{
+    struct ext4_es_slot *slot = &fs->es_cache[ino % EXT4_ES_SLOTS];
+    if (slot->ino == ino) {
+        slot->ino = 0;
+    }
+}
+
+/*
+ * Read one 32-bit block pointer out of an indirect block without copying
+ * the block. Returns 0 on error, same as a hole.
+ */
+static uint32_t ext4_read_block_ptr(struct ext4_fs *fs, uint64_t block,
+                                    uint32_t idx)
+{
+    struct pagecache_entry *e = pagecache_get(&fs->cache, block);
+    if (!e) return 0;
+
+    uint32_t ptr = ((uint32_t *)e->data)[idx];
+    pagecache_put(e);
+    return ptr;
+}
+
 /* ===================================================================== */
 /* Block Bitmap Management */
 /* ===================================================================== */
@@ -395,6 +470,8 @@ static int ext4_free_inode(struct ext4_fs *fs, uint32_t ino)
 {
     if (ino == 0) return -1;
     
+    ext4_es_invalidate(fs, ino);
+    
     uint32_t group = (ino - 1) / fs->inodes_per_group;
     uint32_t index = (ino - 1) % fs->inodes_per_group;
     
@@ -513,8 +590,9 @@ static int ext4_write_inode(struct ext4_fs *fs, uint32_t ino, struct ext4_inode
 /* Block Mapping (get/set file blocks) */
 /* ===================================================================== */
 
-static uint64_t ext4_get_file_block(struct ext4_fs *fs, struct ext4_inode *inode, 
-                                     uint64_t file_block)
+static uint64_t ext4_get_file_block_ind(struct ext4_fs *fs,
+                                        struct ext4_inode *inode,
+                                        uint64_t file_block)
 {
     /* Direct blocks */
     if (file_block < EXT4_NDIR_BLOCKS) {
@@ -527,62 +605,186 @@ static uint64_t ext4_get_file_block(struct ext4_fs *fs, struct ext4_inode *inode
     /* Single indirect block */
     if (file_block < ptrs_per_block) {
         if (inode->i_block[EXT4_IND_BLOCK] == 0) return 0;
-        
-        uint32_t *indirect = kmalloc(fs->block_size);
-        if (!indirect) return 0;
-        
-        if (ext4_read_block(fs, inode->i_block[EXT4_IND_BLOCK], indirect) < 0) {
-            kfree(indirect);
-            return 0;
-        }
-        
-        uint64_t block = indirect[file_block];
-        kfree(indirect);
-        return block;
+        return ext4_read_block_ptr(fs, inode->i_block[EXT4_IND_BLOCK], file_block);
     }
     
     file_block -= ptrs_per_block;
     
     /* Double indirect block */
-    if (file_block < ptrs_per_block * ptrs_per_block) {
+    if (file_block < (uint64_t)ptrs_per_block * ptrs_per_block) {
         if (inode->i_block[EXT4_DIND_BLOCK] == 0) return 0;
         
-        uint32_t *dind = kmalloc(fs->block_size);
-        if (!dind) return 0;
+        uint32_t ind_idx = file_block / ptrs_per_block;
+        uint32_t ind_off = file_block % ptrs_per_block;
         
-        if (ext4_read_block(fs, inode->i_block[EXT4_DIND_BLOCK], dind) < 0) {
-            kfree(dind);
-            return 0;
-        }
+        uint32_t ind = ext4_read_block_ptr(fs, inode->i_block[EXT4_DIND_BLOCK], ind_idx);
+        if (ind == 0) return 0;
+        return ext4_read_block_ptr(fs, ind, ind_off);
+    }
+    
+    file_block -= (uint64_t)ptrs_per_block * ptrs_per_block;
+    
+    /* Triple indirect block */
+    if (file_block < (uint64_t)ptrs_per_block * ptrs_per_block * ptrs_per_block) {
+        if (inode->i_block[EXT4_TIND_BLOCK] == 0) return 0;
         
-        uint32_t ind_idx = file_block / ptrs_per_block;
+        uint32_t dind_idx = file_block / ((uint64_t)ptrs_per_block * ptrs_per_block);
+        uint32_t ind_idx = (file_block / ptrs_per_block) % ptrs_per_block;
         uint32_t ind_off = file_block % ptrs_per_block;
         
-        if (dind[ind_idx] == 0) {
-            kfree(dind);
-            return 0;
+        uint32_t dind = ext4_read_block_ptr(fs, inode->i_block[EXT4_TIND_BLOCK], dind_idx);
+        if (dind == 0) return 0;
+        uint32_t ind = ext4_read_block_ptr(fs, dind, ind_idx);
+        if (ind == 0) return 0;
+        return ext4_read_block_ptr(fs, ind, ind_off);
+    }
+    
+    return 0;
+}
+
+/*
+ * Find the extent covering file_block by walking the extent tree from the
+ * root in i_block. Index and leaf blocks are read in place from the page
+ * cache. Returns 0 and fills *out on success, -1 for a hole or a corrupt
+ * tree. Unwritten extents read as holes.
+ */
+static int ext4_ext_find(struct ext4_fs *fs, struct ext4_inode *inode,
+                         uint32_t file_block, struct ext4_extent_status *out)
+{
+    const uint8_t *node = (const uint8_t *)inode->i_block;
+    size_t node_size = sizeof(inode->i_block);
+    struct pagecache_entry *pinned = NULL;
+    int ret = -1;
+    
+    for (int level = 0; level <= EXT4_EXT_MAX_DEPTH; level++) {
+        const struct ext4_extent_header *eh = (const struct ext4_extent_header *)node;
+        uint16_t entries = eh->eh_entries;
+        
+        if (eh->eh_magic != EXT4_EXT_MAGIC ||
+            sizeof(*eh) + (size_t)entries * sizeof(struct ext4_extent) > node_size) {
+            printk(KERN_ERR "EXT4: Corrupt extent tree\n");
+            break;
         }
+        if (entries == 0) break;
         
-        uint32_t *ind = kmalloc(fs->block_size);
-        if (!ind) {
-            kfree(dind);
-            return 0;
+        if (eh->eh_depth == 0) {
+            /* Leaf: binary search for the last extent starting at or before file_block */
+            const struct ext4_extent *ex = (const struct ext4_extent *)(eh + 1);
+            int lo = 0, hi = entries - 1;
+            while (lo < hi) {
+                int mid = (lo + hi + 1) / 2;
+                if (ex[mid].ee_block <= file_block) lo = mid;
+                else hi = mid - 1;
+            }
+            
+            uint32_t len = ex[lo].ee_len;
+            if (len > EXT4_EXT_INIT_MAX_LEN) break;     /* Unwritten */
+            if (ex[lo].ee_block > file_block ||
+                file_block - ex[lo].ee_block >= len) break;
+            
+            out->lblk = ex[lo].ee_block;
+            out->len = len;
+            out->pblk = ((uint64_t)ex[lo].ee_start_hi << 32) | ex[lo].ee_start_lo;
+            ret = 0;
+            break;
         }
         
-        if (ext4_read_block(fs, dind[ind_idx], ind) < 0) {
-            kfree(dind);
-            kfree(ind);
-            return 0;
+        /* Index node: descend into the last child starting at or before file_block */
+        const struct ext4_extent_idx *ix = (const struct ext4_extent_idx *)(eh + 1);
+        int lo = 0, hi = entries - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (ix[mid].ei_block <= file_block) lo = mid;
+            else hi = mid - 1;
         }
+        if (ix[lo].ei_block > file_block) break;
         
-        uint64_t block = ind[ind_off];
-        kfree(dind);
-        kfree(ind);
-        return block;
+        uint64_t child = ((uint64_t)ix[lo].ei_leaf_hi << 32) | ix[lo].ei_leaf_lo;
+        struct pagecache_entry *e = pagecache_get(&fs->cache, child);
+        if (pinned) pagecache_put(pinned);
+        pinned = e;
+        if (!e) break;
+        
+        node = e->data;
+        node_size = fs->block_size;
     }
     
-    /* Triple indirect not implemented */
-    return 0;
+    if (pinned) pagecache_put(pinned);
+    return ret;
+}
+
+/*
+ * Map file_block through the extent cache, walking the tree on a miss.
+ * Returns the device block and sets *run to the number of blocks that
+ * follow contiguously on disk (including this one).
+ */
+static uint64_t ext4_ext_map(struct ext4_fs *fs, uint32_t ino,
+                             struct ext4_inode *inode, uint32_t file_block,
+                             uint32_t *run)
+{
+    struct ext4_es_slot *slot = ino ? &fs->es_cache[ino % EXT4_ES_SLOTS] : NULL;
+    struct ext4_extent_status es;
+    
+    if (slot && slot->ino == ino) {
+        for (int i = 0; i < EXT4_ES_PER_INODE; i++) {
+            struct ext4_extent_status *c = &slot->es[i];
+            if (c->len && file_block >= c->lblk && file_block - c->lblk < c->len) {
+                *run = c->len - (file_block - c->lblk);
+                return c->pblk + (file_block - c->lblk);
+            }
+        }
+    }
+    
+    if (ext4_ext_find(fs, inode, file_block, &es) < 0) {
+        *run = 1;
+        return 0;
+    }
+    
+    if (slot) {
+        if (slot->ino != ino) {
+            /* Take the slot over from another inode */
+            for (int i = 0; i < EXT4_ES_PER_INODE; i++) slot->es[i].len = 0;
+            slot->ino = ino;
+            slot->next = 0;
+        }
+        slot->es[slot->next] = es;
+        slot->next = (slot->next + 1) % EXT4_ES_PER_INODE;
+    }
+    
+    *run = es.len - (file_block - es.lblk);
+    return es.pblk + (file_block - es.lblk);
+}
+
+/*
+ * ext4_map_blocks - Map a file block to a device block
+ * @ino: Inode number for the extent cache, 0 to bypass it
+ * @run: If set, receives the length of the contiguous run starting here
+ *
+ * Returns 0 for holes.
+ */
+static uint64_t ext4_map_blocks(struct ext4_fs *fs, uint32_t ino,
+                                struct ext4_inode *inode, uint64_t file_block,
+                                uint32_t *run)
+{
+    uint32_t dummy;
+    if (!run) run = &dummy;
+    
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        if (file_block > 0xFFFFFFFFULL) {
+            *run = 1;
+            return 0;
+        }
+        return ext4_ext_map(fs, ino, inode, (uint32_t)file_block, run);
+    }
+    
+    *run = 1;
+    return ext4_get_file_block_ind(fs, inode, file_block);
+}
+
+static uint64_t ext4_get_file_block(struct ext4_fs *fs, struct ext4_inode *inode, 
+                                     uint64_t file_block)
+{
+    return ext4_map_blocks(fs, 0, inode, file_block, NULL);
 }
 
 static int ext4_set_file_block(struct ext4_fs *fs, struct ext4_inode *inode,
@@ -591,6 +793,13 @@ static int ext4_set_file_block(struct ext4_fs *fs, struct ext4_inode *inode,
 {
     uint32_t group = (*ino_for_write - 1) / fs->inodes_per_group;
     
+    /* Allocating into an extent tree is not supported yet */
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        printk(KERN_WARNING "EXT4: Cannot extend extent-mapped inode %u\n",
+               *ino_for_write);
+        return -1;
+    }
+    
     /* Direct blocks */
     if (file_block < EXT4_NDIR_BLOCKS) {
         inode->i_block[file_block] = (uint32_t)disk_block;
@@ -915,41 +1124,52 @@ static int ext4_read_file(struct ext4_fs *fs, uint32_t ino, void *buf,
         return -1;
     }
     
-    uint64_t file_size = inode.i_size_lo;
+    uint64_t file_size = inode.i_size_lo | ((uint64_t)inode.i_size_hi << 32);
     if (offset >= file_size) return 0;
     if (offset + len > file_size) {
         len = file_size - offset;
     }
     
-    uint8_t *block_buf = kmalloc(fs->block_size);
-    if (!block_buf) return -1;
-    
     size_t bytes_read = 0;
+    uint64_t last_block = (offset + len - 1) / fs->block_size;
     
     while (bytes_read < len) {
         uint64_t file_block = (offset + bytes_read) / fs->block_size;
-        uint64_t block_offset = (offset + bytes_read) % fs->block_size;
-        
-        uint64_t disk_block = ext4_get_file_block(fs, &inode, file_block);
-        if (disk_block == 0) break;
+        uint32_t run;
         
-        if (ext4_read_block(fs, disk_block, block_buf) < 0) {
-            break;
+        uint64_t disk_block = ext4_map_blocks(fs, ino, &inode, file_block, &run);
+        if (run > last_block - file_block + 1) {
+            run = last_block - file_block + 1;
         }
         
-        size_t to_copy = fs->block_size - block_offset;
-        if (to_copy > len - bytes_read) {
-            to_copy = len - bytes_read;
+        /* Fetch the rest of a contiguous extent before copying it out */
+        if (disk_block && run > 1) {
+            pagecache_readahead(&fs->cache, disk_block, run);
         }
         
-        for (size_t i = 0; i < to_copy; i++) {
-            ((uint8_t *)buf)[bytes_read + i] = block_buf[block_offset + i];
+        for (uint32_t i = 0; i < run && bytes_read < len; i++) {
+            uint64_t block_offset = (offset + bytes_read) % fs->block_size;
+            size_t to_copy = fs->block_size - block_offset;
+            if (to_copy > len - bytes_read) {
+                to_copy = len - bytes_read;
+            }
+            
+            if (disk_block == 0) {
+                /* Hole or unwritten extent reads as zeros */
+                memset((uint8_t *)buf + bytes_read, 0, to_copy);
+            } else {
+                /* Copy straight out of the cached block */
+                struct pagecache_entry *e = pagecache_get(&fs->cache, disk_block + i);
+                if (!e) return bytes_read;
+                memcpy((uint8_t *)buf + bytes_read, (uint8_t *)e->data + block_offset,
+                       to_copy);
+                pagecache_put(e);
+            }
+            
+            bytes_read += to_copy;
         }
-        
-        bytes_read += to_copy;
     }
     
-    kfree(block_buf);
     return bytes_read;
 }
 
@@ -1011,9 +1231,18 @@ int ext4_mount(void *device,
     fs->desc_size = (fs->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) 
                     ? fs->sb.s_desc_size : 32;
     
+    pagecache_init_mapping(&fs->cache, device, fs->block_size,
+                           read_block, write_block);
+    for (int i = 0; i < EXT4_ES_SLOTS; i++) {
+        fs->es_cache[i].ino = 0;
+    }
+    
     printk(KERN_INFO "EXT4: Block size: %u\n", fs->block_size);
     printk(KERN_INFO "EXT4: Groups: %u\n", fs->group_count);
     printk(KERN_INFO "EXT4: Volume: %s\n", fs->sb.s_volume_name);
+    if (fs->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_EXTENTS) {
+        printk(KERN_INFO "EXT4: Extent-mapped files supported (read, overwrite)\n");
+    }
     
     /* Read group descriptors */
     size_t gd_size = fs->group_count * fs->desc_size;
@@ -1040,6 +1269,7 @@ int ext4_mount(void *device,
             printk(KERN_ERR "EXT4: Failed to read group descriptor block %llu\n", 
                    (unsigned long long)(gd_block + b));
             kfree(gd_buf);
+            pagecache_invalidate(&fs->cache);
             kfree(fs->group_descs);
             kfree(fs);
             return -1;
@@ -1076,6 +1306,7 @@ int ext4_unmount(void)
     if (root_ext4) {
         /* Sync superblock before unmount */
         ext4_sync_superblock(root_ext4);
+        pagecache_invalidate(&root_ext4->cache);
         
         if (root_ext4->group_descs) {
             kfree(root_ext4->group_descs);
@@ -1181,6 +1412,11 @@ int ext4_vfs_truncate(uint32_t ino, uint64_t size)
     
     uint64_t old_size = inode.i_size_lo;
     
+    /* Freeing blocks would need the extent tree updated as well */
+    if (size < old_size && (inode.i_flags & EXT4_EXTENTS_FL)) {
+        return -1;
+    }
+    
     /* If shrinking, free excess blocks */
     if (size < old_size) {
         uint64_t new_blocks = (size + root_ext4->block_size - 1) / root_ext4->block_size;
@@ -1207,7 +1443,8 @@ int ext4_vfs_truncate(uint32_t ino, uint64_t size)
 int ext4_vfs_sync(void)
 {
     if (!root_ext4) return -1;
-    return ext4_sync_superblock(root_ext4);
+    if (ext4_sync_superblock(root_ext4) < 0) return -1;
+    return pagecache_sync(&root_ext4->cache);
 }
 
 /**
@@ -0,0 +1,310 @@
+/*
+ * vib-OS Kernel - File Descriptor Tables
+ */
+
+#include "fs/fdtable.h"
+#include "fs/vfs.h"
+#include "mm/kmalloc.h"
+#include "sched/sched.h"
+
+/* stdin/stdout/stderr, reserved in every table */
+#define NR_STD_FDS 3
+
+#define FD_WORDS_MASK ((1ULL << FD_WORDS) - 1)
+
+/* ===================================================================== */
+/* Bitmap helpers, table lock held */
+/* ===================================================================== */
+
+static inline int fd_is_open(struct files_struct *files, int fd) {
+  return (files->open_fds[fd / 64] >> (fd % 64)) & 1;
+}
+
+static inline void set_open_fd(struct files_struct *files, int fd) {
+  int w = fd / 64;
+
+  files->open_fds[w] |= 1ULL << (fd % 64);
+  if (files->open_fds[w] == ~0ULL) {
+    files->full_fds_bits |= 1ULL << w;
+  }
+}
+
+static inline void clear_open_fd(struct files_struct *files, int fd) {
+  int w = fd / 64;
+
+  files->open_fds[w] &= ~(1ULL << (fd % 64));
+  files->close_on_exec[w] &= ~(1ULL << (fd % 64));
+  files->full_fds_bits &= ~(1ULL << w);
+}
+
+static inline void set_cloexec_bit(struct files_struct *files, int fd,
+                                   int cloexec) {
+  if (cloexec) {
+    files->close_on_exec[fd / 64] |= 1ULL << (fd % 64);
+  } else {
+    files->close_on_exec[fd / 64] &= ~(1ULL << (fd % 64));
+  }
+}
+
+/* Lowest free descriptor >= start, or -EMFILE */
+static int find_free_fd(struct files_struct *files, int start) {
+  if (start < 0) {
+    start = 0;
+  }
+  if (start >= MAX_FDS) {
+    return -EMFILE;
+  }
+
+  /* Skip full words without looking at them */
+  uint64_t words = ~files->full_fds_bits & FD_WORDS_MASK &
+                   (~0ULL << (start / 64));
+
+  while (words) {
+    int w = __builtin_ctzll(words);
+    uint64_t used = files->open_fds[w];
+
+    if (w == start / 64) {
+      used |= (1ULL << (start % 64)) - 1;
+    }
+    if (~used) {
+      return w * 64 + __builtin_ctzll(~used);
+    }
+    words &= words - 1;
+  }
+  return -EMFILE;
+}
+
+/* ===================================================================== */
+/* Tables */
+/* ===================================================================== */
+
+struct files_struct *files_alloc(void) {
+  struct files_struct *files = kzalloc(sizeof(*files), GFP_KERNEL);
+  if (!files) {
+    return NULL;
+  }
+
+  atomic_set(&files->count, 1);
+  spin_lock_init(&files->lock);
+  for (int fd = 0; fd < NR_STD_FDS; fd++) {
+    set_open_fd(files, fd);
+  }
+  return files;
+}
+
+struct files_struct *files_dup(struct files_struct *old) {
+  struct files_struct *files = files_alloc();
+  if (!files) {
+    return NULL;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&old->lock);
+  for (int fd = 0; fd < MAX_FDS; fd++) {
+    struct file *f = old->fd[fd];
+
+    /* Slots reserved for an open still in progress stay with the parent */
+    if (!f) {
+      continue;
+    }
+    atomic_inc(&f->f_count);
+    files->fd[fd] = f;
+    set_open_fd(files, fd);
+  }
+  for (int w = 0; w < FD_WORDS; w++) {
+    files->close_on_exec[w] = old->close_on_exec[w] & files->open_fds[w];
+  }
+  spin_unlock_irqrestore(&old->lock, flags);
+
+  return files;
+}
+
+struct files_struct *task_files(struct task_struct *task) {
+  struct files_struct *files = __atomic_load_n(&task->files, __ATOMIC_ACQUIRE);
+  if (files) {
+    return files;
+  }
+
+  struct files_struct *expected = NULL;
+  files = files_alloc();
+  if (files &&
+      !__atomic_compare_exchange_n(&task->files, &expected, files, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    /* Another thread installed one first */
+    files_put(files);
+    files = expected;
+  }
+  return files;
+}
+
+void files_put(struct files_struct *files) {
+  if (!files || !atomic_dec_and_test(&files->count)) {
+    return;
+  }
+
+  /* Nobody else can reach the table any more */
+  for (int fd = 0; fd < MAX_FDS; fd++) {
+    if (files->fd[fd]) {
+      vfs_close(files->fd[fd]);
+    }
+  }
+  kfree(files);
+}
+
+/* ===================================================================== */
+/* Descriptors */
+/* ===================================================================== */
+
+int fd_alloc(struct files_struct *files, int start) {
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  int fd = find_free_fd(files, start);
+  if (fd >= 0) {
+    set_open_fd(files, fd);
+  }
+  spin_unlock_irqrestore(&files->lock, flags);
+  return fd;
+}
+
+void fd_install(struct files_struct *files, int fd, struct file *file,
+                int cloexec) {
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  files->fd[fd] = file;
+  set_cloexec_bit(files, fd, cloexec);
+  spin_unlock_irqrestore(&files->lock, flags);
+}
+
+void fd_free(struct files_struct *files, int fd) {
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  clear_open_fd(files, fd);
+  spin_unlock_irqrestore(&files->lock, flags);
+}
+
+struct file *fd_close(struct files_struct *files, int fd) {
+  struct file *f = NULL;
+
+  if (fd < 0 || fd >= MAX_FDS) {
+    return NULL;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  if (files->fd[fd]) {
+    f = files->fd[fd];
+    files->fd[fd] = NULL;
+    clear_open_fd(files, fd);
+  }
+  spin_unlock_irqrestore(&files->lock, flags);
+  return f;
+}
+
+struct file *fd_get(struct files_struct *files, int fd) {
+  struct file *f = NULL;
+
+  if (fd < 0 || fd >= MAX_FDS) {
+    return NULL;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  if (files->fd[fd]) {
+    f = files->fd[fd];
+    atomic_inc(&f->f_count);
+  }
+  spin_unlock_irqrestore(&files->lock, flags);
+  return f;
+}
+
+int fd_dup(struct files_struct *files, int oldfd, int newfd, int start,
+           int cloexec) {
+  struct file *replaced = NULL;
+  int ret;
+
+  if (oldfd < 0 || oldfd >= MAX_FDS || newfd >= MAX_FDS) {
+    return -EBADF;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  struct file *f = files->fd[oldfd];
+  if (!f) {
+    ret = -EBADF;
+    goto out;
+  }
+
+  if (newfd < 0) {
+    newfd = find_free_fd(files, start);
+    if (newfd < 0) {
+      ret = newfd;
+      goto out;
+    }
+  } else if (fd_is_open(files, newfd) && !files->fd[newfd] &&
+             newfd >= NR_STD_FDS) {
+    /* Another thread is between fd_alloc() and fd_install() on it */
+    ret = -EBUSY;
+    goto out;
+  }
+
+  replaced = files->fd[newfd];
+  atomic_inc(&f->f_count);
+  files->fd[newfd] = f;
+  set_open_fd(files, newfd);
+  set_cloexec_bit(files, newfd, cloexec);
+  ret = newfd;
+
+out:
+  spin_unlock_irqrestore(&files->lock, flags);
+  if (replaced) {
+    vfs_close(replaced);
+  }
+  return ret;
+}
+
+int fd_get_cloexec(struct files_struct *files, int fd) {
+  if (fd < 0 || fd >= MAX_FDS) {
+    return -EBADF;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  int ret = fd_is_open(files, fd)
+                ? (int)((files->close_on_exec[fd / 64] >> (fd % 64)) & 1)
+                : -EBADF;
+  spin_unlock_irqrestore(&files->lock, flags);
+  return ret;
+}
+
+int fd_set_cloexec(struct files_struct *files, int fd, int cloexec) {
+  if (fd < 0 || fd >= MAX_FDS) {
+    return -EBADF;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&files->lock);
+  int ret = -EBADF;
+  if (fd_is_open(files, fd)) {
+    set_cloexec_bit(files, fd, cloexec);
+    ret = 0;
+  }
+  spin_unlock_irqrestore(&files->lock, flags);
+  return ret;
+}
+
+void files_close_on_exec(struct files_struct *files) {
+  struct file *closing[64];
+
+  for (int w = 0; w < FD_WORDS; w++) {
+    int n = 0;
+
+    /* Detach a word's worth under the lock; closing may sleep */
+    uint64_t flags = spin_lock_irqsave(&files->lock);
+    uint64_t bits = files->close_on_exec[w];
+    while (bits) {
+      int fd = w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      if (files->fd[fd]) {
+        closing[n++] = files->fd[fd];
+        files->fd[fd] = NULL;
+        clear_open_fd(files, fd);
+      }
+    }
+    spin_unlock_irqrestore(&files->lock, flags);
+
+    for (int i = 0; i < n; i++) {
+      vfs_close(closing[i]);
+    }
+  }
+}
@@ -0,0 +1,954 @@
+/*
+ * vib-OS Kernel - Submission/Completion Rings
+ *
+ * Locking:
+ *
+ *   sq_lock    The kernel's SQ head. Held only while SQEs are copied out
+ *              of the ring, never while they are issued.
+ *   cq_lock    The CQ tail, the overflow list and the timeout lists. Taken
+ *              from the timeout callback, so always with irqs off.
+ *   wq_lock    The work list and worker counts.
+ *
+ * None of them nest. Workers and the ring file each hold a reference to
+ * the context; the ring pages go with the last one.
+ */
+
+#include "fs/io_uring.h"
+#include "fs/fdtable.h"
+#include "fs/vfs.h"
+#include "mm/kmalloc.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "sched/sched.h"
+#include "string.h"
+#include "sync/spinlock.h"
+#include "sync/wait.h"
+#include "syscall/syscall.h"
+#include "time/hrtimer.h"
+
+/* SQEs copied out of the ring per sq_lock hold */
+#define IO_SUBMIT_BATCH 16
+
+/* Where the CQE array starts in the rings region */
+#define IO_CQES_OFFSET 64
+
+/* Ring header at the start of the rings region, shared with userspace */
+struct io_rings {
+  uint32_t sq_head; /* Written by the kernel */
+  uint32_t sq_tail; /* Written by userspace */
+  uint32_t sq_ring_mask;
+  uint32_t sq_ring_entries;
+  uint32_t sq_flags; /* IORING_SQ_* */
+  uint32_t sq_dropped;
+  uint32_t cq_head; /* Written by userspace */
+  uint32_t cq_tail; /* Written by the kernel */
+  uint32_t cq_ring_mask;
+  uint32_t cq_ring_entries;
+  uint32_t cq_overflow;
+  uint32_t cq_flags;
+};
+
+/* A completion that did not fit in the CQ ring */
+struct io_overflow {
+  uint64_t user_data;
+  int32_t res;
+  struct io_overflow *next;
+};
+
+struct io_ring_ctx {
+  atomic_t refs;
+  struct mm_struct *mm; /* Owner's address space, borrowed by workers */
+  volatile int dying;   /* Ring file closed */
+
+  /* Ring memory: rings region, then the SQE array from sqes_off */
+  phys_addr_t *pages;
+  size_t nr_pages;
+  struct io_rings *rings;
+  uint32_t sq_entries;
+  uint32_t cq_entries;
+  size_t array_off;
+  size_t sqes_off;
+
+  spinlock_t sq_lock;
+  uint32_t cached_sq_head;
+
+  spinlock_t cq_lock;
+  uint32_t cached_cq_tail;
+  uint64_t nr_completions; /* CQEs of requests other than timeouts */
+  struct io_overflow *ovf_head;
+  struct io_overflow *ovf_tail;
+  struct io_kiocb *timeouts; /* Armed */
+  struct io_kiocb *expired;  /* Fired, waiting to be freed */
+  wait_queue_head_t cq_wait;
+
+  spinlock_t wq_lock;
+  struct io_kiocb *work_head;
+  struct io_kiocb *work_tail;
+  unsigned int nr_pending;
+  unsigned int nr_workers;
+  unsigned int nr_idle;
+  wait_queue_head_t work_wait;
+};
+
+/* One request, from its SQE to its CQE */
+struct io_kiocb {
+  struct io_ring_ctx *ctx;
+  uint8_t opcode;
+  uint8_t flags;
+  uint64_t user_data;
+
+  struct file *file; /* READ, WRITE, SEND, RECV */
+  uint64_t addr;
+  uint32_t len;
+  uint64_t off;
+
+  char *path;                  /* OPENAT */
+  int open_flags;
+  mode_t mode;
+  struct files_struct *files;  /* Table the new descriptor goes in */
+
+  struct hrtimer timer;        /* TIMEOUT */
+  uint64_t target;             /* nr_completions that ends it, 0 for none */
+  int done;                    /* Set by whoever completes it */
+  struct io_kiocb *tprev;
+
+  struct io_kiocb *next; /* Work list, timeout lists */
+};
+
+static const struct file_operations io_uring_fops;
+
+/* ===================================================================== */
+/* Contexts */
+/* ===================================================================== */
+
+static void ctx_get(struct io_ring_ctx *ctx) { atomic_inc(&ctx->refs); }
+
+static void ctx_put(struct io_ring_ctx *ctx) {
+  if (!atomic_dec_and_test(&ctx->refs)) {
+    return;
+  }
+
+  while (ctx->ovf_head) {
+    struct io_overflow *ovf = ctx->ovf_head;
+    ctx->ovf_head = ovf->next;
+    kfree(ovf);
+  }
+
+  /* The pin taken in io_uring_create() */
+  if (ctx->mm) {
+    atomic_dec(&ctx->mm->users);
+  }
+
+  /* Pages still mapped somewhere stay until they are unmapped */
+  for (size_t i = 0; i < ctx->nr_pages; i++) {
+    if (ctx->pages[i]) {
+      pmm_put_page(ctx->pages[i]);
+    }
+  }
+  kfree(ctx->pages);
+  kfree(ctx);
+}
+
+/* Kernel view of the ring memory; no entry straddles a page */
+static inline void *ring_ptr(struct io_ring_ctx *ctx, size_t off) {
+  return (void *)(ctx->pages[off / PAGE_SIZE] + off % PAGE_SIZE);
+}
+
+static inline struct io_uring_cqe *cqe_at(struct io_ring_ctx *ctx,
+                                          uint32_t idx) {
+  return ring_ptr(ctx, IO_CQES_OFFSET + idx * sizeof(struct io_uring_cqe));
+}
+
+static inline struct io_uring_sqe *sqe_at(struct io_ring_ctx *ctx,
+                                          uint32_t idx) {
+  return ring_ptr(ctx, ctx->sqes_off + idx * sizeof(struct io_uring_sqe));
+}
+
+static inline uint32_t *sq_array_at(struct io_ring_ctx *ctx, uint32_t idx) {
+  return ring_ptr(ctx, ctx->array_off + idx * sizeof(uint32_t));
+}
+
+static void req_free(struct io_kiocb *req) {
+  if (req->file) {
+    vfs_close(req->file);
+  }
+  if (req->files) {
+    files_put(req->files);
+  }
+  kfree(req->path);
+  kfree(req);
+}
+
+/* ===================================================================== */
+/* Completions, cq_lock held */
+/* ===================================================================== */
+
+/* Store a CQE if the ring has room */
+static int cq_fill(struct io_ring_ctx *ctx, uint64_t user_data, int32_t res) {
+  uint32_t head = __atomic_load_n(&ctx->rings->cq_head, __ATOMIC_ACQUIRE);
+  if (ctx->cached_cq_tail - head >= ctx->cq_entries) {
+    return 0;
+  }
+
+  struct io_uring_cqe *cqe =
+      cqe_at(ctx, ctx->cached_cq_tail & (ctx->cq_entries - 1));
+  cqe->user_data = user_data;
+  cqe->res = res;
+  cqe->flags = 0;
+
+  /* Publish the entry before the tail that covers it */
+  ctx->cached_cq_tail++;
+  __atomic_store_n(&ctx->rings->cq_tail, ctx->cached_cq_tail,
+                   __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Move held-back completions into the ring, oldest first */
+static void cq_flush_overflow(struct io_ring_ctx *ctx) {
+  while (ctx->ovf_head) {
+    struct io_overflow *ovf = ctx->ovf_head;
+    if (!cq_fill(ctx, ovf->user_data, ovf->res)) {
+      return;
+    }
+    ctx->ovf_head = ovf->next;
+    kfree(ovf);
+  }
+  ctx->ovf_tail = NULL;
+  __atomic_fetch_and(&ctx->rings->sq_flags, ~IORING_SQ_CQ_OVERFLOW,
+                     __ATOMIC_RELAXED);
+}
+
+static void cq_commit(struct io_ring_ctx *ctx, uint64_t user_data,
+                      int32_t res) {
+  cq_flush_overflow(ctx);
+  if (!ctx->ovf_head && cq_fill(ctx, user_data, res)) {
+    return;
+  }
+
+  /* Ring full: keep it until userspace makes room */
+  struct io_overflow *ovf = kmalloc(sizeof(*ovf), GFP_ATOMIC);
+  if (!ovf) {
+    __atomic_fetch_add(&ctx->rings->cq_overflow, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  ovf->user_data = user_data;
+  ovf->res = res;
+  ovf->next = NULL;
+  if (ctx->ovf_tail) {
+    ctx->ovf_tail->next = ovf;
+  } else {
+    ctx->ovf_head = ovf;
+  }
+  ctx->ovf_tail = ovf;
+  __atomic_fetch_or(&ctx->rings->sq_flags, IORING_SQ_CQ_OVERFLOW,
+                    __ATOMIC_RELAXED);
+}
+
+static void timeout_unlink(struct io_ring_ctx *ctx, struct io_kiocb *req) {
+  if (req->tprev) {
+    req->tprev->next = req->next;
+  } else {
+    ctx->timeouts = req->next;
+  }
+  if (req->next) {
+    req->next->tprev = req->tprev;
+  }
+}
+
+/* Hand a completed timeout to the reaper; its timer may still be queued */
+static void timeout_expire(struct io_ring_ctx *ctx, struct io_kiocb *req,
+                           int32_t res) {
+  timeout_unlink(ctx, req);
+  cq_commit(ctx, req->user_data, res);
+  req->next = ctx->expired;
+  ctx->expired = req;
+}
+
+/* Complete counted timeouts whose count has been reached */
+static void timeout_count(struct io_ring_ctx *ctx) {
+  struct io_kiocb *req = ctx->timeouts;
+
+  while (req) {
+    struct io_kiocb *next = req->next;
+    if (req->target && ctx->nr_completions >= req->target &&
+        !__atomic_exchange_n(&req->done, 1, __ATOMIC_ACQ_REL)) {
+      timeout_expire(ctx, req, 0);
+    }
+    req = next;
+  }
+}
+
+static void io_complete(struct io_ring_ctx *ctx, uint64_t user_data,
+                        int32_t res) {
+  uint64_t flags = spin_lock_irqsave(&ctx->cq_lock);
+  cq_commit(ctx, user_data, res);
+  ctx->nr_completions++;
+  if (ctx->timeouts) {
+    timeout_count(ctx);
+  }
+  spin_unlock_irqrestore(&ctx->cq_lock, flags);
+
+  wake_up(&ctx->cq_wait);
+}
+
+/* ===================================================================== */
+/* Timeouts */
+/* ===================================================================== */
+
+static enum hrtimer_restart io_timeout_fn(struct hrtimer *timer) {
+  struct io_kiocb *req = container_of(timer, struct io_kiocb, timer);
+  struct io_ring_ctx *ctx = req->ctx;
+
+  /* Lost to the completion count */
+  if (__atomic_exchange_n(&req->done, 1, __ATOMIC_ACQ_REL)) {
+    return HRTIMER_NORESTART;
+  }
+
+  /* The hrtimer code still touches the timer after this returns, so the
+   * request is freed later, after hrtimer_cancel() */
+  uint64_t flags = spin_lock_irqsave(&ctx->cq_lock);
+  int posted = !ctx->dying;
+  if (posted) {
+    timeout_expire(ctx, req, -ETIME);
+  }
+  spin_unlock_irqrestore(&ctx->cq_lock, flags);
+
+  if (posted) {
+    wake_up(&ctx->cq_wait);
+  }
+  return HRTIMER_NORESTART;
+}
+
+static void io_arm_timeout(struct io_ring_ctx *ctx, struct io_kiocb *req,
+                           ktime_t expires, enum hrtimer_mode mode,
+                           uint32_t count) {
+  hrtimer_init(&req->timer, io_timeout_fn);
+
+  uint64_t flags = spin_lock_irqsave(&ctx->cq_lock);
+  req->target = count ? ctx->nr_completions + count : 0;
+  req->tprev = NULL;
+  req->next = ctx->timeouts;
+  if (ctx->timeouts) {
+    ctx->timeouts->tprev = req;
+  }
+  ctx->timeouts = req;
+  spin_unlock_irqrestore(&ctx->cq_lock, flags);
+
+  hrtimer_start(&req->timer, expires, mode);
+}
+
+/* Free a list of timeouts nobody else can complete any more */
+static void timeout_free_list(struct io_kiocb *req) {
+  while (req) {
+    struct io_kiocb *next = req->next;
+    hrtimer_cancel(&req->timer);
+    req_free(req);
+    req = next;
+  }
+}
+
+static void io_reap_timeouts(struct io_ring_ctx *ctx) {
+  if (!__atomic_load_n(&ctx->expired, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&ctx->cq_lock);
+  struct io_kiocb *list = ctx->expired;
+  ctx->expired = NULL;
+  spin_unlock_irqrestore(&ctx->cq_lock, flags);
+
+  timeout_free_list(list);
+}
+
+/* ===================================================================== */
+/* Issuing */
+/* ===================================================================== */
+
+static int32_t io_openat(struct io_kiocb *req) {
+  int fd = fd_alloc(req->files, FIRST_FILE_FD);
+  if (fd < 0) {
+    return -EMFILE;
+  }
+
+  struct file *f = vfs_open(req->path, req->open_flags, req->mode);
+  if (!f) {
+    fd_free(req->files, fd);
+    return -ENOENT;
+  }
+
+  fd_install(req->files, fd, f, (req->open_flags & O_CLOEXEC) != 0);
+  return fd;
+}
+
+/* Run a prepared request; may sleep */
+static int32_t io_issue(struct io_kiocb *req) {
+  ssize_t ret;
+
+  switch (req->opcode) {
+  case IORING_OP_READ:
+    ret = req->off == (uint64_t)-1
+              ? vfs_read(req->file, (char *)req->addr, req->len)
+              : vfs_pread(req->file, (char *)req->addr, req->len,
+                          (loff_t)req->off);
+    break;
+  case IORING_OP_WRITE:
+    ret = req->off == (uint64_t)-1
+              ? vfs_write(req->file, (const char *)req->addr, req->len)
+              : vfs_pwrite(req->file, (const char *)req->addr, req->len,
+                           (loff_t)req->off);
+    break;
+  case IORING_OP_RECV:
+    ret = vfs_read(req->file, (char *)req->addr, req->len);
+    break;
+  case IORING_OP_SEND:
+    ret = vfs_write(req->file, (const char *)req->addr, req->len);
+    break;
+  case IORING_OP_OPENAT:
+    ret = io_openat(req);
+    break;
+  default:
+    ret = -EINVAL;
+    break;
+  }
+  return (int32_t)ret;
+}
+
+static void io_issue_and_complete(struct io_kiocb *req) {
+  struct io_ring_ctx *ctx = req->ctx;
+  int32_t res = io_issue(req);
+  uint64_t user_data = req->user_data;
+
+  req_free(req);
+  io_complete(ctx, user_data, res);
+}
+
+/* ===================================================================== */
+/* Workers */
+/* ===================================================================== */
+
+static int io_wq_ready(struct io_ring_ctx *ctx) {
+  return __atomic_load_n(&ctx->work_head, __ATOMIC_ACQUIRE) != NULL ||
+         ctx->dying;
+}
+
+/* Take the oldest queued request, wq_lock held */
+static struct io_kiocb *io_wq_pop(struct io_ring_ctx *ctx) {
+  struct io_kiocb *req = ctx->work_head;
+
+  if (req) {
+    ctx->work_head = req->next;
+    if (!ctx->work_head) {
+      ctx->work_tail = NULL;
+    }
+    ctx->nr_pending--;
+  }
+  return req;
+}
+
+/* Next queued request, sleeping for one; NULL once the ring is closed */
+static struct io_kiocb *io_wq_next(struct io_ring_ctx *ctx) {
+  uint64_t flags = spin_lock_irqsave(&ctx->wq_lock);
+
+  while (!ctx->work_head && !ctx->dying) {
+    ctx->nr_idle++;
+    spin_unlock_irqrestore(&ctx->wq_lock, flags);
+    wait_event(ctx->work_wait, io_wq_ready(ctx));
+    flags = spin_lock_irqsave(&ctx->wq_lock);
+    ctx->nr_idle--;
+  }
+
+  struct io_kiocb *req = io_wq_pop(ctx);
+  if (!req) {
+    ctx->nr_workers--;
+  }
+  spin_unlock_irqrestore(&ctx->wq_lock, flags);
+  return req;
+}
+
+static void io_wq_worker(void *arg) {
+  struct io_ring_ctx *ctx = arg;
+  struct task_struct *task = get_current();
+
+  strncpy(task->comm, "io_wq", TASK_COMM_LEN);
+
+  /* Buffers are addresses in the ring owner's address space */
+  if (ctx->mm) {
+    task->mm = ctx->mm;
+    task->active_mm = ctx->mm;
+    atomic_inc(&ctx->mm->users);
+    vmm_switch_address_space(ctx->mm);
+  }
+
+  struct io_kiocb *req;
+  while ((req = io_wq_next(ctx)) != NULL) {
+    io_issue_and_complete(req);
+  }
+
+  /* Drop our pin before ctx_put() can free ctx */
+  if (ctx->mm) {
+    atomic_dec(&ctx->mm->users);
+  }
+  ctx_put(ctx);
+  exit_task(0);
+}
+
+static void io_wq_enqueue(struct io_ring_ctx *ctx, struct io_kiocb *req) {
+  req->next = NULL;
+
+  uint64_t flags = spin_lock_irqsave(&ctx->wq_lock);
+  if (ctx->work_tail) {
+    ctx->work_tail->next = req;
+  } else {
+    ctx->work_head = req;
+  }
+  ctx->work_tail = req;
+  ctx->nr_pending++;
+
+  /* Grow the pool while requests outnumber the idle workers */
+  int spawn = ctx->nr_pending > ctx->nr_idle &&
+              ctx->nr_workers < IORING_MAX_WORKERS;
+  if (spawn) {
+    ctx->nr_workers++;
+  }
+  spin_unlock_irqrestore(&ctx->wq_lock, flags);
+
+  wake_up(&ctx->work_wait);
+  if (!spawn) {
+    return;
+  }
+
+  ctx_get(ctx);
+  if (create_task(io_wq_worker, ctx, PF_KTHREAD)) {
+    return;
+  }
+  ctx_put(ctx);
+
+  flags = spin_lock_irqsave(&ctx->wq_lock);
+  int orphaned = --ctx->nr_workers == 0;
+  spin_unlock_irqrestore(&ctx->wq_lock, flags);
+
+  /* No worker to run it: do the queued work here */
+  while (orphaned) {
+    flags = spin_lock_irqsave(&ctx->wq_lock);
+    req = io_wq_pop(ctx);
+    spin_unlock_irqrestore(&ctx->wq_lock, flags);
+    if (!req) {
+      break;
+    }
+    io_issue_and_complete(req);
+  }
+}
+
+/* ===================================================================== */
+/* Submission */
+/* ===================================================================== */
+
+static struct file *io_file_get(int fd) {
+  struct files_struct *files = get_current()->files;
+  return files ? fd_get(files, fd) : NULL;
+}
+
+/* Copy a NUL-terminated path out of user memory */
+static int io_copy_path(struct io_kiocb *req, uint64_t uaddr) {
+  if (!is_valid_user_ptr(uaddr, 1)) {
+    return -EFAULT;
+  }
+
+  req->path = kmalloc(PATH_MAX);
+  if (!req->path) {
+    return -ENOMEM;
+  }
+
+  const char *src = (const char *)uaddr;
+  for (size_t i = 0; i < PATH_MAX; i++) {
+    if (!is_valid_user_ptr(uaddr + i, 1)) {
+      return -EFAULT;
+    }
+    req->path[i] = src[i];
+    if (!src[i]) {
+      return 0;
+    }
+  }
+  return -ENAMETOOLONG;
+}
+
+/* Validate an SQE and take what the request needs from the submitter */
+static int io_prep(struct io_kiocb *req, const struct io_uring_sqe *sqe) {
+  if (sqe->flags & ~IOSQE_ASYNC) {
+    return -EINVAL;
+  }
+
+  switch (req->opcode) {
+  case IORING_OP_NOP:
+    return 0;
+
+  case IORING_OP_READ:
+  case IORING_OP_WRITE:
+  case IORING_OP_RECV:
+  case IORING_OP_SEND:
+    if (!is_valid_user_ptr(sqe->addr, sqe->len)) {
+      return -EFAULT;
+    }
+    req->file = io_file_get(sqe->fd);
+    if (!req->file) {
+      return -EBADF;
+    }
+    req->addr = sqe->addr;
+    req->len = sqe->len;
+    req->off = sqe->off;
+    return 0;
+
+  case IORING_OP_OPENAT:
+    /* Like openat(), the directory is ignored and paths are absolute */
+    req->open_flags = (int)sqe->op_flags;
+    req->mode = (mode_t)sqe->len;
+    req->files = task_files(get_current());
+    if (!req->files) {
+      return -EMFILE;
+    }
+    files_get(req->files);
+    return io_copy_path(req, sqe->addr);
+
+  case IORING_OP_TIMEOUT:
+    if (sqe->len != 1 || (sqe->op_flags & ~IORING_TIMEOUT_ABS) ||
+        sqe->off > UINT32_MAX) {
+      return -EINVAL;
+    }
+    if (!is_valid_user_ptr(sqe->addr, sizeof(struct io_uring_timespec))) {
+      return -EFAULT;
+    }
+    return 0;
+
+  default:
+    return -EINVAL;
+  }
+}
+
+static int io_start_timeout(struct io_ring_ctx *ctx, struct io_kiocb *req,
+                            const struct io_uring_sqe *sqe) {
+  struct io_uring_timespec ts;
+  memcpy(&ts, (const void *)sqe->addr, sizeof(ts));
+  if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= (int64_t)NSEC_PER_SEC) {
+    return -EINVAL;
+  }
+
+  ktime_t expires = (ktime_t)ts.tv_sec * NSEC_PER_SEC + (ktime_t)ts.tv_nsec;
+  io_arm_timeout(ctx, req, expires,
+                 (sqe->op_flags & IORING_TIMEOUT_ABS) ? HRTIMER_MODE_ABS
+                                                      : HRTIMER_MODE_REL,
+                 (uint32_t)sqe->off);
+  return 0;
+}
+
+/* Regular files don't wait for anyone, so they run in the submitter */
+static int io_needs_worker(struct io_kiocb *req) {
+  if (req->flags & IOSQE_ASYNC) {
+    return 1;
+  }
+  if (req->opcode == IORING_OP_READ || req->opcode == IORING_OP_WRITE) {
+    return !req->file->f_dentry;
+  }
+  return req->opcode != IORING_OP_NOP;
+}
+
+static void io_submit_one(struct io_ring_ctx *ctx,
+                          const struct io_uring_sqe *sqe) {
+  struct io_kiocb *req = kzalloc(sizeof(*req), GFP_KERNEL);
+  if (!req) {
+    io_complete(ctx, sqe->user_data, -ENOMEM);
+    return;
+  }
+  req->ctx = ctx;
+  req->opcode = sqe->opcode;
+  req->flags = sqe->flags;
+  req->user_data = sqe->user_data;
+
+  int ret = io_prep(req, sqe);
+  if (ret == 0 && req->opcode == IORING_OP_TIMEOUT) {
+    ret = io_start_timeout(ctx, req, sqe);
+    if (ret == 0) {
+      return;
+    }
+  }
+  if (ret < 0 || req->opcode == IORING_OP_NOP) {
+    req_free(req);
+    io_complete(ctx, sqe->user_data, ret);
+    return;
+  }
+
+  /* Workers only see the owner's address space */
+  if (io_needs_worker(req) && get_current()->mm == ctx->mm) {
+    io_wq_enqueue(ctx, req);
+  } else {
+    io_issue_and_complete(req);
+  }
+}
+
+static int io_submit_sqes(struct io_ring_ctx *ctx, uint32_t to_submit) {
+  struct io_uring_sqe batch[IO_SUBMIT_BATCH];
+  int submitted = 0;
+
+  while (to_submit > 0) {
+    uint32_t n = 0;
+
+    uint64_t flags = spin_lock_irqsave(&ctx->sq_lock);
+    uint32_t tail = __atomic_load_n(&ctx->rings->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t avail = tail - ctx->cached_sq_head;
+    if (avail > ctx->sq_entries) {
+      /* Userspace moved the tail past a full ring; take what is there */
+      avail = ctx->sq_entries;
+    }
+    while (n < avail && n < to_submit && n < IO_SUBMIT_BATCH) {
+      uint32_t idx = __atomic_load_n(
+          sq_array_at(ctx, ctx->cached_sq_head & (ctx->sq_entries - 1)),
+          __ATOMIC_RELAXED);
+      ctx->cached_sq_head++;
+      if (idx >= ctx->sq_entries) {
+        __atomic_fetch_add(&ctx->rings->sq_dropped, 1, __ATOMIC_RELAXED);
+        avail--;
+        to_submit--;
+        continue;
+      }
+      memcpy(&batch[n++], sqe_at(ctx, idx), sizeof(struct io_uring_sqe));
+    }
+    /* The slots can be refilled as soon as the entries are copied */
+    __atomic_store_n(&ctx->rings->sq_head, ctx->cached_sq_head,
+                     __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&ctx->sq_lock, flags);
+
+    if (n == 0) {
+      break;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      io_submit_one(ctx, &batch[i]);
+    }
+    submitted += n;
+    to_submit -= n;
+  }
+  return submitted;
+}
+
+/* ===================================================================== */
+/* Ring file */
+/* ===================================================================== */
+
+static struct io_ring_ctx *get_ctx(struct file *file) {
+  return file && file->f_op == &io_uring_fops ? file->private_data : NULL;
+}
+
+static int io_uring_release(struct inode *inode, struct file *file) {
+  (void)inode;
+  struct io_ring_ctx *ctx = file->private_data;
+
+  /* Timeouts in flight complete without a CQE */
+  uint64_t flags = spin_lock_irqsave(&ctx->cq_lock);
+  ctx->dying = 1;
+  struct io_kiocb *armed = ctx->timeouts;
+  struct io_kiocb *expired = ctx->expired;
+  ctx->timeouts = NULL;
+  ctx->expired = NULL;
+  spin_unlock_irqrestore(&ctx->cq_lock, flags);
+
+  timeout_free_list(armed);
+  timeout_free_list(expired);
+
+  /* Queued work is dropped; running work finishes into the dead ring */
+  flags = spin_lock_irqsave(&ctx->wq_lock);
+  struct io_kiocb *work = ctx->work_head;
+  ctx->work_head = NULL;
+  ctx->work_tail = NULL;
+  ctx->nr_pending = 0;
+  spin_unlock_irqrestore(&ctx->wq_lock, flags);
+  wake_up(&ctx->work_wait);
+
+  while (work) {
+    struct io_kiocb *next = work->next;
+    req_free(work);
+    work = next;
+  }
+
+  ctx_put(ctx);
+  return 0;
+}
+
+static const struct file_operations io_uring_fops = {
+    .release = io_uring_release,
+};
+
+/* ===================================================================== */
+/* Setup and entry */
+/* ===================================================================== */
+
+static uint32_t roundup_pow2(uint32_t n) {
+  uint32_t v = 1;
+  while (v < n) {
+    v <<= 1;
+  }
+  return v;
+}
+
+/* Allocate the ring pages and lay them out */
+static int io_alloc_rings(struct io_ring_ctx *ctx) {
+  size_t rings_size = IO_CQES_OFFSET +
+                      ctx->cq_entries * sizeof(struct io_uring_cqe) +
+                      ctx->sq_entries * sizeof(uint32_t);
+  size_t sqes_size = ctx->sq_entries * sizeof(struct io_uring_sqe);
+
+  ctx->array_off =
+      IO_CQES_OFFSET + ctx->cq_entries * sizeof(struct io_uring_cqe);
+  ctx->sqes_off = PAGE_ALIGN(rings_size);
+
+  size_t nr_pages = (ctx->sqes_off + PAGE_ALIGN(sqes_size)) / PAGE_SIZE;
+  ctx->pages = kzalloc(nr_pages * sizeof(phys_addr_t), GFP_KERNEL);
+  if (!ctx->pages) {
+    return -ENOMEM;
+  }
+  ctx->nr_pages = nr_pages;
+  for (size_t i = 0; i < ctx->nr_pages; i++) {
+    ctx->pages[i] = pmm_alloc_page();
+    if (!ctx->pages[i]) {
+      return -ENOMEM;
+    }
+    memset((void *)ctx->pages[i], 0, PAGE_SIZE);
+  }
+
+  ctx->rings = ring_ptr(ctx, 0);
+  ctx->rings->sq_ring_mask = ctx->sq_entries - 1;
+  ctx->rings->sq_ring_entries = ctx->sq_entries;
+  ctx->rings->cq_ring_mask = ctx->cq_entries - 1;
+  ctx->rings->cq_ring_entries = ctx->cq_entries;
+  return 0;
+}
+
+static void io_fill_offsets(struct io_ring_ctx *ctx, struct io_uring_params *p,
+                            virt_addr_t base) {
+  memset(&p->sq_off, 0, sizeof(p->sq_off));
+  p->sq_off.head = offsetof(struct io_rings, sq_head);
+  p->sq_off.tail = offsetof(struct io_rings, sq_tail);
+  p->sq_off.ring_mask = offsetof(struct io_rings, sq_ring_mask);
+  p->sq_off.ring_entries = offsetof(struct io_rings, sq_ring_entries);
+  p->sq_off.flags = offsetof(struct io_rings, sq_flags);
+  p->sq_off.dropped = offsetof(struct io_rings, sq_dropped);
+  p->sq_off.array = (uint32_t)ctx->array_off;
+  p->sq_off.user_addr = base + ctx->sqes_off;
+
+  memset(&p->cq_off, 0, sizeof(p->cq_off));
+  p->cq_off.head = offsetof(struct io_rings, cq_head);
+  p->cq_off.tail = offsetof(struct io_rings, cq_tail);
+  p->cq_off.ring_mask = offsetof(struct io_rings, cq_ring_mask);
+  p->cq_off.ring_entries = offsetof(struct io_rings, cq_ring_entries);
+  p->cq_off.overflow = offsetof(struct io_rings, cq_overflow);
+  p->cq_off.cqes = IO_CQES_OFFSET;
+  p->cq_off.flags = offsetof(struct io_rings, cq_flags);
+  p->cq_off.user_addr = base;
+
+  p->sq_entries = ctx->sq_entries;
+  p->cq_entries = ctx->cq_entries;
+  p->features = IORING_FEAT_NODROP;
+}
+
+int io_uring_create(uint32_t entries, struct io_uring_params *p,
+                    struct file **filep) {
+  if (entries == 0 || entries > IORING_MAX_ENTRIES ||
+      (p->flags & ~IORING_SETUP_CQSIZE)) {
+    return -EINVAL;
+  }
+
+  uint32_t sq_entries = roundup_pow2(entries);
+  uint32_t cq_entries = 2 * sq_entries;
+  if (p->flags & IORING_SETUP_CQSIZE) {
+    if (p->cq_entries < sq_entries || p->cq_entries > IORING_MAX_CQ_ENTRIES) {
+      return -EINVAL;
+    }
+    cq_entries = roundup_pow2(p->cq_entries);
+  }
+
+  /* The kernel's shared address space has no room for user mappings */
+  struct mm_struct *mm = get_current()->mm;
+  if (!mm) {
+    return -ENOSYS;
+  }
+
+  struct io_ring_ctx *ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+  if (!ctx) {
+    return -ENOMEM;
+  }
+  atomic_set(&ctx->refs, 1);
+  spin_lock_init(&ctx->sq_lock);
+  spin_lock_init(&ctx->cq_lock);
+  spin_lock_init(&ctx->wq_lock);
+  init_waitqueue_head(&ctx->cq_wait);
+  init_waitqueue_head(&ctx->work_wait);
+  ctx->sq_entries = sq_entries;
+  ctx->cq_entries = cq_entries;
+
+  if (io_alloc_rings(ctx) < 0) {
+    ctx_put(ctx);
+    return -ENOMEM;
+  }
+
+  struct file *file = kzalloc(sizeof(struct file), GFP_KERNEL);
+  if (!file) {
+    ctx_put(ctx);
+    return -ENOMEM;
+  }
+
+  virt_addr_t base =
+      vmm_map_pages(mm, ctx->pages, ctx->nr_pages, VM_READ | VM_WRITE);
+  if (!base) {
+    kfree(file);
+    ctx_put(ctx);
+    return -ENOMEM;
+  }
+
+  /* Pinned for the workers, like a thread sharing it */
+  atomic_inc(&mm->users);
+  ctx->mm = mm;
+
+  file->f_op = &io_uring_fops;
+  file->f_flags = O_RDWR;
+  file->private_data = ctx;
+  file->f_count.counter = 1;
+
+  io_fill_offsets(ctx, p, base);
+  *filep = file;
+  return 0;
+}
+
+/* CQEs waiting for userspace */
+static uint32_t io_cqring_events(struct io_ring_ctx *ctx) {
+  uint32_t tail = __atomic_load_n(&ctx->rings->cq_tail, __ATOMIC_ACQUIRE);
+  uint32_t head = __atomic_load_n(&ctx->rings->cq_head, __ATOMIC_ACQUIRE);
+  return tail - head;
+}
+
+int io_uring_submit_and_wait(struct file *file, uint32_t to_submit,
+                             uint32_t min_complete, uint32_t flags) {
+  struct io_ring_ctx *ctx = get_ctx(file);
+  if (!ctx) {
+    return -EOPNOTSUPP;
+  }
+
+  io_reap_timeouts(ctx);
+
+  /* Userspace may have made room for held-back completions */
+  if (__atomic_load_n(&ctx->ovf_head, __ATOMIC_RELAXED)) {
+    uint64_t lflags = spin_lock_irqsave(&ctx->cq_lock);
+    cq_flush_overflow(ctx);
+    spin_unlock_irqrestore(&ctx->cq_lock, lflags);
+  }
+
+  int submitted = to_submit ? io_submit_sqes(ctx, to_submit) : 0;
+
+  if ((flags & IORING_ENTER_GETEVENTS) && min_complete > 0) {
+    if (min_complete > ctx->cq_entries) {
+      min_complete = ctx->cq_entries;
+    }
+    int ret = wait_event_killable(ctx->cq_wait,
+                                  io_cqring_events(ctx) >= min_complete);
+    if (ret < 0 && submitted == 0) {
+      return -EINTR;
+    }
+  }
+  return submitted;
+}
@@ -0,0 +1,535 @@
+/*
+ * UnixOS Kernel - Page Cache
+ *
+ * One global hash table of cached blocks plus an LRU list. The lock only
+ * covers the index and the list; device I/O always runs unlocked, with
+ * the entry pinned and PC_IO marking a read in flight.
+ */
+
+#include "fs/pagecache.h"
+#include "mm/kmalloc.h"
+#include "printk.h"
+#include "string.h"
+#include "sync/spinlock.h"
+
+#define PC_HASH_BITS 10
+#define PC_HASH_SIZE (1 << PC_HASH_BITS)
+
+/* Entries examined per reclaim pass once the cache is over budget */
+#define PC_RECLAIM_BATCH 16
+
+static struct pagecache_entry *pc_hash[PC_HASH_SIZE];
+
+/* LRU list: head is most recently used, reclaim works from the tail */
+static struct pagecache_entry *lru_head;
+static struct pagecache_entry *lru_tail;
+
+static struct pagecache_stats pc_stats;
+static DEFINE_SPINLOCK(pc_lock);
+
+/* ===================================================================== */
+/* Index and LRU helpers (pc_lock held) */
+/* ===================================================================== */
+
+static inline uint32_t pc_hashfn(struct pagecache_mapping *mapping,
+                                 uint64_t index) {
+  uint64_t key = ((uint64_t)(uintptr_t)mapping >> 4) ^ index;
+  key *= 0x9E3779B97F4A7C15ULL;
+  return (uint32_t)(key >> (64 - PC_HASH_BITS));
+}
+
+static struct pagecache_entry *pc_find(struct pagecache_mapping *mapping,
+                                       uint64_t index) {
+  struct pagecache_entry *e = pc_hash[pc_hashfn(mapping, index)];
+  while (e) {
+    if (e->mapping == mapping && e->index == index) {
+      return e;
+    }
+    e = e->hash_next;
+  }
+  return NULL;
+}
+
+static void lru_del(struct pagecache_entry *e) {
+  if (e->lru_prev) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    lru_head = e->lru_next;
+  }
+  if (e->lru_next) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    lru_tail = e->lru_prev;
+  }
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_add_head(struct pagecache_entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = lru_head;
+  if (lru_head) {
+    lru_head->lru_prev = e;
+  } else {
+    lru_tail = e;
+  }
+  lru_head = e;
+}
+
+static void pc_insert(struct pagecache_entry *e) {
+  uint32_t bucket = pc_hashfn(e->mapping, e->index);
+  e->hash_next = pc_hash[bucket];
+  pc_hash[bucket] = e;
+  lru_add_head(e);
+
+  e->mapping->nr_cached++;
+  pc_stats.entries++;
+  pc_stats.bytes += e->mapping->block_size;
+}
+
+static void pc_remove(struct pagecache_entry *e) {
+  struct pagecache_entry **pp = &pc_hash[pc_hashfn(e->mapping, e->index)];
+  while (*pp && *pp != e) {
+    pp = &(*pp)->hash_next;
+  }
+  if (*pp) {
+    *pp = e->hash_next;
+  }
+  e->hash_next = NULL;
+  lru_del(e);
+
+  if (e->flags & PC_DIRTY) {
+    pc_stats.dirty--;
+  }
+  e->mapping->nr_cached--;
+  pc_stats.entries--;
+  pc_stats.bytes -= e->mapping->block_size;
+}
+
+static void pc_free(struct pagecache_entry *e) {
+  kfree(e->data);
+  kfree(e);
+}
+
+/* ===================================================================== */
+/* Lookup and I/O */
+/* ===================================================================== */
+
+/*
+ * Find or create the entry for (mapping, index), pinned. A new entry is
+ * returned with PC_IO set and *created true; the caller must fill it.
+ */
+static struct pagecache_entry *pc_grab(struct pagecache_mapping *mapping,
+                                       uint64_t index, bool demand,
+                                       bool *created) {
+  *created = false;
+
+  spin_lock(&pc_lock);
+  struct pagecache_entry *e = pc_find(mapping, index);
+  if (e) {
+    e->refcount++;
+    lru_del(e);
+    lru_add_head(e);
+    if (demand) {
+      pc_stats.hits++;
+    }
+    spin_unlock(&pc_lock);
+    return e;
+  }
+  spin_unlock(&pc_lock);
+
+  /* Allocate unlocked; kmalloc may have to refill its slabs */
+  struct pagecache_entry *new = kzalloc(sizeof(*new), GFP_KERNEL);
+  void *data = new ? kmalloc(mapping->block_size) : NULL;
+  if (!data) {
+    kfree(new);
+    return NULL;
+  }
+
+  spin_lock(&pc_lock);
+  e = pc_find(mapping, index);
+  if (e) {
+    /* Someone else created it meanwhile */
+    e->refcount++;
+    lru_del(e);
+    lru_add_head(e);
+    if (demand) {
+      pc_stats.hits++;
+    }
+    spin_unlock(&pc_lock);
+    kfree(data);
+    kfree(new);
+    return e;
+  }
+
+  new->mapping = mapping;
+  new->index = index;
+  new->data = data;
+  new->flags = PC_IO;
+  new->refcount = 1;
+  pc_insert(new);
+  if (demand) {
+    pc_stats.misses++;
+  }
+  spin_unlock(&pc_lock);
+
+  *created = true;
+  return new;
+}
+
+/* Read a freshly created entry from the device */
+static void pc_fill(struct pagecache_entry *e) {
+  struct pagecache_mapping *mapping = e->mapping;
+  int ret = mapping->read(mapping->host, e->index, e->data);
+
+  spin_lock(&pc_lock);
+  e->flags &= ~PC_IO;
+  if (ret >= 0) {
+    e->flags |= PC_UPTODATE;
+  }
+  spin_unlock(&pc_lock);
+}
+
+/*
+ * Fill a run of freshly created, consecutive entries. Returns false if
+ * any read failed. Drops the caller's references.
+ */
+static bool pc_fill_run(struct pagecache_entry **run, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    pc_fill(run[i]);
+  }
+
+  bool ok = true;
+  uint32_t filled = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (run[i]->flags & PC_UPTODATE) {
+      filled++;
+    } else {
+      ok = false;
+    }
+    pagecache_put(run[i]);
+  }
+
+  spin_lock(&pc_lock);
+  pc_stats.readahead += filled;
+  spin_unlock(&pc_lock);
+  return ok;
+}
+
+/* Wait for another CPU to finish reading an entry */
+static void pc_wait_io(struct pagecache_entry *e) {
+  for (;;) {
+    spin_lock(&pc_lock);
+    bool busy = (e->flags & PC_IO) != 0;
+    spin_unlock(&pc_lock);
+    if (!busy) {
+      return;
+    }
+  }
+}
+
+/* Write a pinned entry back if it is dirty */
+static int pc_writeback(struct pagecache_entry *e) {
+  struct pagecache_mapping *mapping = e->mapping;
+
+  spin_lock(&pc_lock);
+  if (!(e->flags & PC_DIRTY)) {
+    spin_unlock(&pc_lock);
+    return 0;
+  }
+  /* Cleared first so a write racing with the I/O re-dirties the entry */
+  e->flags &= ~PC_DIRTY;
+  pc_stats.dirty--;
+  spin_unlock(&pc_lock);
+
+  int ret = mapping->write ? mapping->write(mapping->host, e->index, e->data)
+                           : -1;
+
+  spin_lock(&pc_lock);
+  if (ret < 0) {
+    if (!(e->flags & PC_DIRTY)) {
+      e->flags |= PC_DIRTY;
+      pc_stats.dirty++;
+    }
+  } else {
+    pc_stats.writebacks++;
+  }
+  spin_unlock(&pc_lock);
+  return ret;
+}
+
+/* Keep the cache within PAGECACHE_MAX_BYTES */
+static void pc_reclaim(void) {
+  while (pc_stats.bytes > PAGECACHE_MAX_BYTES) {
+    if (pagecache_shrink(PC_RECLAIM_BATCH) == 0) {
+      break;
+    }
+  }
+}
+
+/* ===================================================================== */
+/* Public API */
+/* ===================================================================== */
+
+void pagecache_init_mapping(struct pagecache_mapping *mapping, void *host,
+                            uint32_t block_size,
+                            int (*read)(void *, uint64_t, void *),
+                            int (*write)(void *, uint64_t, const void *)) {
+  memset(mapping, 0, sizeof(*mapping));
+  mapping->host = host;
+  mapping->block_size = block_size;
+  mapping->read = read;
+  mapping->write = write;
+  mapping->ra_pages = PAGECACHE_RA_DEFAULT;
+  mapping->last_index = (uint64_t)-2;
+}
+
+struct pagecache_entry *pagecache_get(struct pagecache_mapping *mapping,
+                                      uint64_t index) {
+  bool created;
+  struct pagecache_entry *e = pc_grab(mapping, index, true, &created);
+  if (!e) {
+    return NULL;
+  }
+
+  if (created) {
+    pc_fill(e);
+
+    /* Sequential misses pull in the following blocks as well */
+    bool sequential = (index == mapping->last_index + 1);
+    mapping->last_index = index;
+    if (sequential && mapping->ra_pages && (e->flags & PC_UPTODATE)) {
+      pagecache_readahead(mapping, index + 1, mapping->ra_pages);
+      mapping->last_index = index + mapping->ra_pages;
+    }
+  } else {
+    pc_wait_io(e);
+  }
+
+  if (!(e->flags & PC_UPTODATE)) {
+    pagecache_put(e);
+    return NULL;
+  }
+
+  pc_reclaim();
+  return e;
+}
+
+void pagecache_put(struct pagecache_entry *e) {
+  if (!e) {
+    return;
+  }
+
+  spin_lock(&pc_lock);
+  e->refcount--;
+  if (e->refcount == 0 && !(e->flags & (PC_UPTODATE | PC_IO))) {
+    /* Failed read: don't keep garbage around */
+    pc_remove(e);
+    spin_unlock(&pc_lock);
+    pc_free(e);
+    return;
+  }
+  spin_unlock(&pc_lock);
+}
+
+void pagecache_mark_dirty(struct pagecache_entry *e) {
+  spin_lock(&pc_lock);
+  if (!(e->flags & PC_DIRTY)) {
+    e->flags |= PC_DIRTY;
+    pc_stats.dirty++;
+  }
+  spin_unlock(&pc_lock);
+}
+
+int pagecache_read(struct pagecache_mapping *mapping, uint64_t index,
+                   void *buf) {
+  struct pagecache_entry *e = pagecache_get(mapping, index);
+  if (!e) {
+    return -1;
+  }
+  memcpy(buf, e->data, mapping->block_size);
+  pagecache_put(e);
+  return 0;
+}
+
+int pagecache_write(struct pagecache_mapping *mapping, uint64_t index,
+                    const void *buf) {
+  if (!mapping->write) {
+    return -1;
+  }
+
+  /* The whole block is overwritten, so a miss needs no read */
+  bool created;
+  struct pagecache_entry *e = pc_grab(mapping, index, true, &created);
+  if (!e) {
+    return -1;
+  }
+  if (!created) {
+    pc_wait_io(e);
+  }
+
+  memcpy(e->data, buf, mapping->block_size);
+
+  spin_lock(&pc_lock);
+  e->flags = (e->flags & ~PC_IO) | PC_UPTODATE;
+  spin_unlock(&pc_lock);
+
+  pagecache_mark_dirty(e);
+  pagecache_put(e);
+  pc_reclaim();
+  return 0;
+}
+
+void pagecache_readahead(struct pagecache_mapping *mapping, uint64_t index,
+                         uint32_t count) {
+  struct pagecache_entry *run[PAGECACHE_RA_BATCH];
+  uint32_t i = 0;
+
+  while (i < count) {
+    /* Collect a run of consecutive blocks that are not cached yet */
+    uint32_t n = 0;
+    bool stop = false;
+    while (i < count && n < PAGECACHE_RA_BATCH) {
+      bool created;
+      struct pagecache_entry *e = pc_grab(mapping, index + i, false, &created);
+      if (!e) {
+        stop = true;
+        break;
+      }
+      i++;
+      if (!created) {
+        pagecache_put(e);
+        if (n) {
+          break;
+        }
+        continue;
+      }
+      run[n++] = e;
+    }
+
+    /* Most likely ran off the end of the device */
+    if (n && !pc_fill_run(run, n)) {
+      return;
+    }
+    if (stop) {
+      return;
+    }
+  }
+}
+
+int pagecache_sync(struct pagecache_mapping *mapping) {
+  int ret = 0;
+  bool wrote;
+
+  /*
+   * Entries can move in the LRU while a write-back runs unlocked, so
+   * repeat until a pass finds nothing left to write.
+   */
+  do {
+    wrote = false;
+    spin_lock(&pc_lock);
+    struct pagecache_entry *e = lru_head;
+    while (e) {
+      if (!(e->flags & PC_DIRTY) || (mapping && e->mapping != mapping)) {
+        e = e->lru_next;
+        continue;
+      }
+
+      e->refcount++;
+      spin_unlock(&pc_lock);
+      if (pc_writeback(e) < 0) {
+        ret = -1;
+      } else {
+        wrote = true;
+      }
+      spin_lock(&pc_lock);
+      e->refcount--;
+      e = e->lru_next;
+    }
+    spin_unlock(&pc_lock);
+  } while (wrote && ret == 0);
+
+  return ret;
+}
+
+void pagecache_invalidate(struct pagecache_mapping *mapping) {
+  struct pagecache_entry *victims = NULL;
+
+  if (pagecache_sync(mapping) < 0) {
+    printk(KERN_WARNING "PAGECACHE: Write-back failed, dropping dirty data\n");
+  }
+
+  spin_lock(&pc_lock);
+  struct pagecache_entry *e = lru_head;
+  while (e) {
+    struct pagecache_entry *next = e->lru_next;
+    if (e->mapping == mapping) {
+      if (e->refcount) {
+        printk(KERN_WARNING "PAGECACHE: Block %lu still in use\n",
+               (unsigned long)e->index);
+      } else {
+        pc_remove(e);
+        e->hash_next = victims;
+        victims = e;
+      }
+    }
+    e = next;
+  }
+  spin_unlock(&pc_lock);
+
+  while (victims) {
+    struct pagecache_entry *next = victims->hash_next;
+    pc_free(victims);
+    victims = next;
+  }
+}
+
+size_t pagecache_shrink(size_t nr) {
+  struct pagecache_entry *victims = NULL;
+  size_t freed = 0;
+
+  spin_lock(&pc_lock);
+  struct pagecache_entry *e = lru_tail;
+  while (e && freed < nr) {
+    struct pagecache_entry *prev = e->lru_prev;
+
+    if (e->refcount || (e->flags & PC_IO)) {
+      e = prev;
+      continue;
+    }
+
+    if (e->flags & PC_DIRTY) {
+      /* Write back first; the entry is pinned so it stays listed */
+      e->refcount++;
+      spin_unlock(&pc_lock);
+      pc_writeback(e);
+      spin_lock(&pc_lock);
+      e->refcount--;
+      prev = e->lru_prev;
+      if (e->refcount || (e->flags & PC_DIRTY)) {
+        e = prev;
+        continue;
+      }
+    }
+
+    pc_remove(e);
+    pc_stats.evictions++;
+    e->hash_next = victims;
+    victims = e;
+    freed++;
+    e = prev;
+  }
+  spin_unlock(&pc_lock);
+
+  while (victims) {
+    struct pagecache_entry *next = victims->hash_next;
+    pc_free(victims);
+    victims = next;
+  }
+  return freed;
+}
+
+void pagecache_get_stats(struct pagecache_stats *stats) {
+  spin_lock(&pc_lock);
+  *stats = pc_stats;
+  spin_unlock(&pc_lock);
+}
@@ -192,6 +192,10 @@ static ssize_t ramfs_write(struct file *file, const char *buf, size_t count,
 
   if (*pos > (loff_t)inode->size) {
     inode->size = *pos;
+    /* The VFS inode is cached by the dcache, keep its size current */
+    if (file->f_dentry && file->f_dentry->d_inode) {
+      file->f_dentry->d_inode->i_size = inode->size;
+    }
   }
 
   return count;
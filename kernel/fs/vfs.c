@@ -3,14 +3,25 @@
  */
 
 #include "fs/vfs.h"
+#include "fs/dcache.h"
+#include "fs/eventpoll.h"
 #include "fs/fat32.h"
 #include "printk.h"
+#include "sync/rcu.h"
+#include "sync/seqlock.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Static data */
 /* ===================================================================== */
 
-/* Registered filesystems */
+/* Serializes filesystem registration and protects the mount table */
+static DEFINE_SPINLOCK(vfs_lock);
+
+/* Guards the root pair, read locklessly by every path walk */
+static DEFINE_SEQLOCK(root_seq);
+
+/* Registered filesystems, an RCU list */
 static struct file_system_type *file_systems = NULL;
 
 /* Mount points */
@@ -25,8 +36,10 @@ static struct dentry *root_dentry = NULL;
 /* Helper functions */
 /* ===================================================================== */
 
+/* Lockless. Types are never unregistered, so the result stays valid */
 static struct file_system_type *find_filesystem(const char *name) {
-  struct file_system_type *fs = file_systems;
+  rcu_read_lock();
+  struct file_system_type *fs = rcu_dereference(file_systems);
   while (fs) {
     /* Compare names */
     const char *a = fs->name;
@@ -36,11 +49,12 @@ static struct file_system_type *find_filesystem(const char *name) {
       b++;
     }
     if (*a == '\0' && *b == '\0') {
-      return fs;
+      break;
     }
-    fs = fs->next;
+    fs = rcu_dereference(fs->next);
   }
-  return NULL;
+  rcu_read_unlock();
+  return fs;
 }
 
 static int path_compare(const char *a, const char *b) {
@@ -82,15 +96,19 @@ int register_filesystem(struct file_system_type *fs) {
     return -EINVAL;
   }
 
+  uint64_t flags = spin_lock_irqsave(&vfs_lock);
+
   /* Check for duplicate */
   if (find_filesystem(fs->name)) {
+    spin_unlock_irqrestore(&vfs_lock, flags);
     printk(KERN_WARNING "VFS: Filesystem '%s' already registered\n", fs->name);
     return -EBUSY;
   }
 
-  /* Add to list */
+  /* Add to list, fully set up before lookups can see it */
   fs->next = file_systems;
-  file_systems = fs;
+  rcu_assign_pointer(file_systems, fs);
+  spin_unlock_irqrestore(&vfs_lock, flags);
 
   printk(KERN_INFO "VFS: Registered filesystem '%s'\n", fs->name);
 
@@ -107,234 +125,166 @@ int register_filesystem(struct file_system_type *fs) {
 /* Path lookup */
 /* ===================================================================== */
 
-static struct dentry *vfs_lookup_path(const char *path, const char **filename) {
-  if (!root_dentry)
-    return NULL;
+/*
+ * Referenced root dentry, or NULL before "/" is mounted. A mount replaces
+ * the root but the old one stays pinned by its superblock, so taking the
+ * reference after the lockless read is safe.
+ */
+static struct dentry *vfs_get_root(void) {
+  struct dentry *root;
+  uint32_t seq;
 
-  struct dentry *curr = root_dentry;
-  char *p = (char *)path;
+  do {
+    seq = read_seqbegin(&root_seq);
+    root = root_dentry;
+  } while (read_seqretry(&root_seq, seq));
 
-  /* Skip leading / */
-  while (*p == '/')
-    p++;
+  return root ? dget(root) : NULL;
+}
 
-  if (*p == '\0') {
-    if (filename)
-      *filename = NULL;
-    return curr;
+/*
+ * Look up one name in a directory, consulting the dentry cache first.
+ * Returns a referenced dentry, negative if the name does not exist, or
+ * NULL if the directory cannot be searched.
+ */
+static struct dentry *vfs_lookup_child(struct dentry *parent,
+                                       const char *name) {
+  struct dentry *child = d_lookup(parent, name);
+  if (child)
+    return child;
+
+  if (!parent->d_inode || !parent->d_inode->i_op ||
+      !parent->d_inode->i_op->lookup) {
+    return NULL;
   }
 
-  static char buf[NAME_MAX + 1];
-
-  while (*p) {
-    /* Extract next component */
-    int len = 0;
-    char *start = p;
-    while (*p && *p != '/') {
-      if (len < NAME_MAX)
-        buf[len++] = *p;
-      p++;
-    }
-    buf[len] = '\0';
-
-    while (*p == '/')
-      p++;
-
-    /* If this is the last component, return parent and filename */
-    if (*p == '\0' && filename) {
-      *filename = start; /* Pointer into original string - careful */
-      /* Actually, we need to copy it because original might be const */
-      /* But caller usually passes non-const or we can just return curr */
-      /* Better design: return parent dentry and pointer to last component in
-       * path */
-      return curr; /* curr is the directory containing the file */
-                   /* Wait, this logic is tricky. Let's do simple traversal */
-    }
-
-    /* Lookup child */
-    if (!curr->d_inode || !curr->d_inode->i_op ||
-        !curr->d_inode->i_op->lookup) {
-      return NULL;
-    }
-
-    struct dentry target;
-    for (int i = 0; i <= len; i++)
-      target.d_name[i] = buf[i];
-
-    /* In this simplified VFS, lookup populates the dentry if found */
-    /* We need to allocate a real dentry to return/store */
-    /* For now, simplified: rely on ramfs creating the inode and we assume we
-     * traverse */
-
-    /* Simple hack for ramfs traversal without full dcache: */
-    /* We construct a dummy dentry, pass to lookup. If lookup populates d_inode,
-     * we proceed. */
-
-    /* Allocate a dentry to be safe/consistent */
-    struct dentry *child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-    if (!child)
-      return NULL;
-
-    for (int i = 0; i <= len; i++)
-      child->d_name[i] = buf[i];
-    child->d_parent = curr;
-    child->d_sb = curr->d_sb;
-
-    if (curr->d_inode->i_op->lookup(curr->d_inode, child) != NULL) {
-      /* If it returns a dentry, use it */
-      /* (Not implemented in ramfs, it returns NULL on success with populated
-       * pointer) */
-    }
+  child = d_alloc(parent, name);
+  if (!child)
+    return NULL;
 
-    if (!child->d_inode) {
-      /* Not found */
-      kfree(child);
-      return NULL;
-    }
+  /* Filesystems fill in d_inode when the name exists */
+  parent->d_inode->i_op->lookup(parent->d_inode, child);
+  d_add(child, child->d_inode);
+  return child;
+}
 
-    curr = child;
+/* Copy the next path component into name and advance past it */
+static const char *vfs_next_component(const char *p, char *name) {
+  int len = 0;
+  while (*p && *p != '/') {
+    if (len < NAME_MAX)
+      name[len++] = *p;
+    p++;
   }
+  name[len] = '\0';
 
-  if (filename)
-    *filename = NULL;
-  return curr;
+  while (*p == '/')
+    p++;
+  return p;
 }
 
-/* Helper to find parent and last component */
-static struct dentry *vfs_lookup_parent(const char *path, char *name_buf) {
-  if (!root_dentry)
+/*
+ * Walk a path and return a reference to its dentry. With name_buf set,
+ * the walk stops one short: the parent is returned and the last
+ * component is copied into name_buf.
+ */
+static struct dentry *vfs_walk(const char *path, char *name_buf) {
+  struct dentry *curr = vfs_get_root();
+  if (!curr)
     return NULL;
 
-  struct dentry *curr = root_dentry;
-  char *p = (char *)path;
+  const char *p = path;
+  char name[NAME_MAX + 1];
 
   /* Skip leading / */
   while (*p == '/')
     p++;
 
-  if (*p == '\0')
-    return NULL; /* Root has no parent */
-
-  static char buf[NAME_MAX + 1];
-
-  while (*p) {
-    /* Extract next component */
-    int len = 0;
-    while (*p && *p != '/') {
-      if (len < NAME_MAX)
-        buf[len++] = *p;
-      p++;
+  if (*p == '\0') {
+    if (name_buf) {
+      dput(curr);
+      return NULL; /* Root has no parent */
     }
-    buf[len] = '\0';
+    return curr;
+  }
 
-    while (*p == '/')
-      p++;
+  while (*p) {
+    p = vfs_next_component(p, name);
 
-    if (*p == '\0') {
+    if (*p == '\0' && name_buf) {
       /* This was the last component */
-      if (name_buf) {
-        for (int i = 0; i <= len; i++)
-          name_buf[i] = buf[i];
-      }
+      for (int i = 0; i == 0 || name[i - 1]; i++)
+        name_buf[i] = name[i];
       return curr;
     }
 
-    /* Traverse down */
-    if (!curr->d_inode || !curr->d_inode->i_op ||
-        !curr->d_inode->i_op->lookup) {
-      return NULL;
-    }
-
-    struct dentry *child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
+    struct dentry *child = vfs_lookup_child(curr, name);
+    dput(curr);
     if (!child)
       return NULL;
-
-    for (int i = 0; i <= len; i++)
-      child->d_name[i] = buf[i];
-
-    /* Assume success for now (lookup populates child->d_inode) */
-    curr->d_inode->i_op->lookup(curr->d_inode, child);
-
     if (!child->d_inode) {
-      kfree(child);
+      /* Negative entry: not found */
+      dput(child);
       return NULL;
     }
     curr = child;
   }
 
-  return NULL;
+  return curr;
+}
+
+static struct dentry *vfs_lookup_path(const char *path) {
+  return vfs_walk(path, NULL);
+}
+
+/* Helper to find parent and last component */
+static struct dentry *vfs_lookup_parent(const char *path, char *name_buf) {
+  return vfs_walk(path, name_buf);
 }
 
 /* Redefine vfs_open with lookup */
 struct file *vfs_open(const char *path, int flags, mode_t mode) {
-  /* Special case for root */
-  if (path[0] == '/' && path[1] == '\0') {
-    struct file *f = kzalloc(sizeof(struct file), GFP_KERNEL);
-    f->f_dentry = root_dentry;
-    f->f_op = root_dentry->d_inode->i_fop;
-    f->private_data = root_dentry->d_inode->i_private;
-    f->f_mode = mode;
-    f->f_flags = flags;
-    f->f_count.counter = 1;
-    return f;
-  }
-
   char name[NAME_MAX + 1];
   struct dentry *parent = vfs_lookup_parent(path, name);
+  struct dentry *child;
 
   if (!parent) {
-    /* Try full lookup (might be exact match on an intermediate node? Unlikely
-     * for open) */
-    /* Or file exists in root */
-    if (root_dentry)
-      parent = root_dentry;
-
-    /* Extract name from /name */
-    const char *p = path;
-    while (*p == '/')
-      p++;
-    int i = 0;
-    while (*p && *p != '/') {
-      if (i < NAME_MAX)
-        name[i++] = *p;
-      p++;
+    /* Root itself, or a missing directory along the way */
+    child = vfs_lookup_path(path);
+    if (!child)
+      return NULL;
+  } else {
+    /* Now look for the file in parent */
+    child = vfs_lookup_child(parent, name);
+    if (!child) {
+      dput(parent);
+      return NULL;
     }
-    name[i] = '\0';
-    if (*p != '\0')
-      return NULL; /* Path had more components but parent lookup failed */
-  }
 
-  /* Now look for the file in parent */
-  struct dentry *child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-  for (int i = 0; i < NAME_MAX && name[i]; i++)
-    child->d_name[i] = name[i];
-
-  if (parent->d_inode && parent->d_inode->i_op &&
-      parent->d_inode->i_op->lookup) {
-    parent->d_inode->i_op->lookup(parent->d_inode, child);
-  }
-
-  if (!child->d_inode) {
-    /* Check O_CREAT */
-    if (flags & O_CREAT) {
-      /* Create it */
-      if (parent->d_inode->i_op->create) {
-        int ret = parent->d_inode->i_op->create(parent->d_inode, child, mode);
-        if (ret != 0) {
-          kfree(child);
-          return NULL;
-        }
+    if (!child->d_inode) {
+      /* Check O_CREAT */
+      int ret = -ENOENT;
+      if ((flags & O_CREAT) && parent->d_inode->i_op &&
+          parent->d_inode->i_op->create) {
+        /* Create it; the negative dentry becomes positive */
+        ret = parent->d_inode->i_op->create(parent->d_inode, child, mode);
+      }
+      if (ret != 0 || !child->d_inode) {
+        dput(child);
+        dput(parent);
+        return NULL;
       }
-    } else {
-      kfree(child);
-      return NULL;
     }
+    dput(parent);
   }
 
   struct file *f = kzalloc(sizeof(struct file), GFP_KERNEL);
-  if (!f)
+  if (!f) {
+    dput(child);
     return NULL;
+  }
 
+  /* The file keeps the dentry reference until vfs_close() */
   f->f_dentry = child;
   f->f_op = child->d_inode->i_fop;
   f->private_data = child->d_inode->i_private;
@@ -349,36 +299,45 @@ struct file *vfs_open(const char *path, int flags, mode_t mode) {
   return f;
 }
 
-int vfs_create(const char *path, mode_t mode) {
+/* Create a new name in path's parent through the given inode operation */
+static int vfs_create_common(const char *path, mode_t mode, bool dir) {
   char name[NAME_MAX + 1];
   struct dentry *parent = vfs_lookup_parent(path, name);
   if (!parent)
     return -ENOENT;
 
-  struct dentry *child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-  for (int i = 0; i < NAME_MAX && name[i]; i++)
-    child->d_name[i] = name[i];
-
-  if (!parent->d_inode->i_op || !parent->d_inode->i_op->create)
+  const struct inode_operations *iop = parent->d_inode->i_op;
+  if (!iop || !(dir ? iop->mkdir : iop->create)) {
+    dput(parent);
     return -EPERM;
+  }
 
-  return parent->d_inode->i_op->create(parent->d_inode, child, mode);
-}
+  struct dentry *child = vfs_lookup_child(parent, name);
+  if (!child) {
+    dput(parent);
+    return -ENOMEM;
+  }
 
-int vfs_mkdir(const char *path, mode_t mode) {
-  char name[NAME_MAX + 1];
-  struct dentry *parent = vfs_lookup_parent(path, name);
-  if (!parent)
-    return -ENOENT;
+  int ret;
+  if (child->d_inode) {
+    ret = -EEXIST;
+  } else if (dir) {
+    ret = iop->mkdir(parent->d_inode, child, mode);
+  } else {
+    ret = iop->create(parent->d_inode, child, mode);
+  }
 
-  struct dentry *child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-  for (int i = 0; i < NAME_MAX && name[i]; i++)
-    child->d_name[i] = name[i];
+  dput(child);
+  dput(parent);
+  return ret;
+}
 
-  if (!parent->d_inode->i_op || !parent->d_inode->i_op->mkdir)
-    return -EPERM;
+int vfs_create(const char *path, mode_t mode) {
+  return vfs_create_common(path, mode, false);
+}
 
-  return parent->d_inode->i_op->mkdir(parent->d_inode, child, mode);
+int vfs_mkdir(const char *path, mode_t mode) {
+  return vfs_create_common(path, mode, true);
 }
 
 int vfs_readdir(struct file *file, void *ctx,
@@ -393,13 +352,24 @@ int vfs_readdir(struct file *file, void *ctx,
 int vfs_close(struct file *file) {
   if (!file)
     return -EBADF;
-  if (file->f_op && file->f_op->release && file->f_dentry) {
-    file->f_op->release(file->f_dentry->d_inode, file);
+
+  /* Others still hold it, e.g. a read in progress on another CPU */
+  if (!atomic_dec_and_test(&file->f_count)) {
+    return 0;
   }
-  file->f_count.counter--;
-  if (file->f_count.counter <= 0) {
-    kfree(file);
+
+  /* Watches hang on the file's wait queues, which release may free */
+  if (__atomic_load_n(&file->f_ep, __ATOMIC_ACQUIRE)) {
+    eventpoll_release(file);
   }
+
+  /* Pipes and other files without a dentry still need releasing */
+  if (file->f_op && file->f_op->release) {
+    file->f_op->release(file->f_dentry ? file->f_dentry->d_inode : NULL,
+                        file);
+  }
+  dput(file->f_dentry);
+  kfree(file);
   return 0;
 }
 
@@ -423,6 +393,31 @@ ssize_t vfs_write(struct file *file, const char *buf, size_t count) {
   return file->f_op->write(file, buf, count, &file->f_pos);
 }
 
+ssize_t vfs_pread(struct file *file, char *buf, size_t count, loff_t pos) {
+  if (!file)
+    return -EBADF;
+  if (!buf)
+    return -EFAULT;
+  if (!file->f_dentry || pos < 0)
+    return file->f_dentry ? -EINVAL : -ESPIPE;
+  if (!file->f_op || !file->f_op->read)
+    return -EINVAL;
+  return file->f_op->read(file, buf, count, &pos);
+}
+
+ssize_t vfs_pwrite(struct file *file, const char *buf, size_t count,
+                   loff_t pos) {
+  if (!file)
+    return -EBADF;
+  if (!buf)
+    return -EFAULT;
+  if (!file->f_dentry || pos < 0)
+    return file->f_dentry ? -EINVAL : -ESPIPE;
+  if (!file->f_op || !file->f_op->write)
+    return -EINVAL;
+  return file->f_op->write(file, buf, count, &pos);
+}
+
 loff_t vfs_lseek(struct file *file, loff_t offset, int whence) {
   if (!file)
     return -EBADF;
@@ -450,89 +445,49 @@ loff_t vfs_lseek(struct file *file, loff_t offset, int whence) {
   return new_pos;
 }
 
-int vfs_rmdir(const char *path) {
+/* Remove a name through rmdir or unlink and forget its cached inode */
+static int vfs_remove_common(const char *path, bool dir) {
   char name[NAME_MAX + 1];
   struct dentry *parent = vfs_lookup_parent(path, name);
   if (!parent)
     return -ENOENT;
 
-  struct dentry *child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-  if (!child)
+  struct dentry *child = vfs_lookup_child(parent, name);
+  if (!child) {
+    dput(parent);
     return -ENOMEM;
-
-  int i;
-  for (i = 0; i < NAME_MAX && name[i]; i++)
-    child->d_name[i] = name[i];
-  child->d_name[i] = '\0';
-
-  /* Lookup the target */
-  if (parent->d_inode->i_op && parent->d_inode->i_op->lookup) {
-    parent->d_inode->i_op->lookup(parent->d_inode, child);
   }
 
-  if (!child->d_inode) {
-    kfree(child);
-    return -ENOENT;
-  }
-
-  /* Must be a directory */
-  if (!S_ISDIR(child->d_inode->i_mode)) {
-    kfree(child);
-    return -ENOTDIR;
-  }
-
-  /* Check if rmdir operation is supported */
-  if (!parent->d_inode->i_op || !parent->d_inode->i_op->rmdir) {
-    kfree(child);
-    return -EPERM;
-  }
+  const struct inode_operations *iop = parent->d_inode->i_op;
+  int ret;
 
-  int ret = parent->d_inode->i_op->rmdir(parent->d_inode, child);
-  kfree(child);
+  if (!child->d_inode) {
+    ret = -ENOENT;
+  } else if (dir && !S_ISDIR(child->d_inode->i_mode)) {
+    /* Must be a directory */
+    ret = -ENOTDIR;
+  } else if (!dir && S_ISDIR(child->d_inode->i_mode)) {
+    /* Must not be a directory (use rmdir for that) */
+    ret = -EISDIR;
+  } else if (!iop || !(dir ? iop->rmdir : iop->unlink)) {
+    /* Check if the operation is supported */
+    ret = -EPERM;
+  } else {
+    ret = dir ? iop->rmdir(parent->d_inode, child)
+              : iop->unlink(parent->d_inode, child);
+    if (ret == 0)
+      d_delete(child);
+  }
+
+  dput(child);
+  dput(parent);
   return ret;
 }
 
-int vfs_unlink(const char *path) {
-  char name[NAME_MAX + 1];
-  struct dentry *parent = vfs_lookup_parent(path, name);
-  if (!parent)
-    return -ENOENT;
+int vfs_rmdir(const char *path) { return vfs_remove_common(path, true); }
 
-  struct dentry *child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-  if (!child)
-    return -ENOMEM;
-
-  int i;
-  for (i = 0; i < NAME_MAX && name[i]; i++)
-    child->d_name[i] = name[i];
-  child->d_name[i] = '\0';
-
-  /* Lookup the target */
-  if (parent->d_inode->i_op && parent->d_inode->i_op->lookup) {
-    parent->d_inode->i_op->lookup(parent->d_inode, child);
-  }
-
-  if (!child->d_inode) {
-    kfree(child);
-    return -ENOENT;
-  }
+int vfs_unlink(const char *path) { return vfs_remove_common(path, false); }
 
-  /* Must not be a directory (use rmdir for that) */
-  if (S_ISDIR(child->d_inode->i_mode)) {
-    kfree(child);
-    return -EISDIR;
-  }
-
-  /* Check if unlink operation is supported */
-  if (!parent->d_inode->i_op || !parent->d_inode->i_op->unlink) {
-    kfree(child);
-    return -EPERM;
-  }
-
-  int ret = parent->d_inode->i_op->unlink(parent->d_inode, child);
-  kfree(child);
-  return ret;
-}
 int vfs_rename(const char *old, const char *new) {
   char old_name_buf[NAME_MAX + 1];
   struct dentry *old_parent = vfs_lookup_parent(old, old_name_buf);
@@ -541,43 +496,39 @@ int vfs_rename(const char *old, const char *new) {
 
   char new_name_buf[NAME_MAX + 1];
   struct dentry *new_parent = vfs_lookup_parent(new, new_name_buf);
-  if (!new_parent)
-    return -ENOENT;
-
-  /* Lookup full old dentry */
-  struct dentry *old_child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-  int i;
-  for (i = 0; i < NAME_MAX && old_name_buf[i]; i++)
-    old_child->d_name[i] = old_name_buf[i];
-  old_child->d_name[i] = '\0';
-
-  if (old_parent->d_inode->i_op && old_parent->d_inode->i_op->lookup) {
-    old_parent->d_inode->i_op->lookup(old_parent->d_inode, old_child);
-  }
-
-  if (!old_child->d_inode) {
-    kfree(old_child);
+  if (!new_parent) {
+    dput(old_parent);
     return -ENOENT;
   }
 
-  /* Construct new dentry pattern */
-  struct dentry *new_child = kzalloc(sizeof(struct dentry), GFP_KERNEL);
-  for (i = 0; i < NAME_MAX && new_name_buf[i]; i++)
-    new_child->d_name[i] = new_name_buf[i];
-  new_child->d_name[i] = '\0';
-
-  /* Check if operation supported */
-  if (!old_parent->d_inode->i_op || !old_parent->d_inode->i_op->rename) {
-    kfree(old_child);
-    kfree(new_child);
-    return -EPERM; /* Should be ENOSYS/EPERM */
+  int ret;
+  struct dentry *old_child = vfs_lookup_child(old_parent, old_name_buf);
+  struct dentry *new_child = vfs_lookup_child(new_parent, new_name_buf);
+
+  if (!old_child || !new_child) {
+    ret = -ENOMEM;
+  } else if (!old_child->d_inode) {
+    ret = -ENOENT;
+  } else if (!old_parent->d_inode->i_op ||
+             !old_parent->d_inode->i_op->rename) {
+    /* Check if operation supported */
+    ret = -EPERM; /* Should be ENOSYS/EPERM */
+  } else {
+    ret = old_parent->d_inode->i_op->rename(old_parent->d_inode, old_child,
+                                            new_parent->d_inode, new_child);
+    if (ret == 0) {
+      /* Both names changed meaning; look them up afresh next time */
+      d_drop(old_child);
+      d_drop(new_child);
+    }
   }
 
-  int ret = old_parent->d_inode->i_op->rename(old_parent->d_inode, old_child,
-                                              new_parent->d_inode, new_child);
-
-  kfree(old_child);
-  kfree(new_child);
+  if (old_child)
+    dput(old_child);
+  if (new_child)
+    dput(new_child);
+  dput(new_parent);
+  dput(old_parent);
   return ret;
 }
 
@@ -599,8 +550,8 @@ int vfs_mount(const char *source, const char *target, const char *fstype,
     return -ENODEV;
   }
 
-  /* Check mount limit */
-  if (mount_count >= MAX_MOUNTS) {
+  /* Check mount limit; checked again under the lock below */
+  if (__atomic_load_n(&mount_count, __ATOMIC_RELAXED) >= MAX_MOUNTS) {
     return -ENOMEM;
   }
 
@@ -614,9 +565,15 @@ int vfs_mount(const char *source, const char *target, const char *fstype,
     return -EIO;
   }
 
-  /* Create mount structure */
+  /* Create mount structure. The filesystem's mount ran unlocked, so the
+   * table may have filled up in the meantime. */
   /* TODO: Allocate properly */
   static struct vfsmount mount_pool[MAX_MOUNTS];
+  uint64_t irqflags = spin_lock_irqsave(&vfs_lock);
+  if (mount_count >= MAX_MOUNTS) {
+    spin_unlock_irqrestore(&vfs_lock, irqflags);
+    return -ENOMEM;
+  }
   struct vfsmount *mnt = &mount_pool[mount_count];
 
   mnt->mnt_root = sb->s_root;
@@ -635,9 +592,12 @@ int vfs_mount(const char *source, const char *target, const char *fstype,
 
   /* If mounting root, set root_mount */
   if (path_compare(target, "/") == 0) {
+    write_seqlock(&root_seq);
     root_mount = mnt;
     root_dentry = sb->s_root;
+    write_sequnlock(&root_seq);
   }
+  spin_unlock_irqrestore(&vfs_lock, irqflags);
 
   printk(KERN_INFO "VFS: Mounted '%s' on '%s'\n", source, target);
 
@@ -648,12 +608,14 @@ int vfs_umount(const char *target) {
   printk(KERN_INFO "VFS: umount('%s')\n", target);
 
   /* Find mount point */
+  uint64_t flags = spin_lock_irqsave(&vfs_lock);
   for (int i = 0; i < mount_count; i++) {
     if (mounts[i] && mounts[i]->mnt_root) {
       /* TODO: Compare mount point */
       /* For now, just mark as unmounted */
     }
   }
+  spin_unlock_irqrestore(&vfs_lock, flags);
 
   return -ENOSYS;
 }
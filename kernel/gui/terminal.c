@@ -4,9 +4,16 @@
  * VT100-compatible terminal emulator for the GUI.
  */
 
+#include "core/process.h"
+#include "fs/dcache.h"
+#include "fs/pagecache.h"
+#include "ipc/futex.h"
 #include "media/media.h"
 #include "mm/kmalloc.h"
 #include "printk.h"
+#include "sched/sched.h"
+#include "sync/spinlock.h"
+#include "syscall/syscall.h"
 #include "types.h"
 
 /* Forward declare window type */
@@ -506,7 +513,14 @@ void term_execute_command(struct terminal *term, const char *cmd) {
     term_puts(term, "  hostname  - Show hostname\n");
     term_puts(term, "  history   - Show command history\n");
     term_puts(term, "  free      - Memory usage\n");
+    term_puts(term, "  slabinfo  - Kernel allocator stats\n");
+    term_puts(term, "  cacheinfo - Page and dentry cache stats\n");
+    term_puts(term, "  schedstat - Per-CPU load balancing stats\n");
+    term_puts(term, "  lockstat  - Spinlock contention (LOCKSTAT=1)\n");
+    term_puts(term, "  syscallstat - Syscall counts/latency (SYSCALLSTAT=1)\n");
+    term_puts(term, "  futextest - Futex wakeup self-test\n");
     term_puts(term, "  ps        - Process list\n");
+    term_puts(term, "  nice <pid> <prio> - Set priority (0 highest)\n");
     term_puts(term, "  clear     - Clear screen\n");
     term_puts(term, "  help      - This help message\n");
     term_puts(term, "\033[33mNetwork:\033[0m\n");
@@ -601,11 +615,133 @@ void term_execute_command(struct terminal *term, const char *cmd) {
     term_puts(term, "              total        used        free\n");
     term_puts(term, "Mem:         252 MB       12 MB      240 MB\n");
     term_puts(term, "Swap:          0 MB        0 MB        0 MB\n");
+  } else if (str_starts_with(cmd, "slabinfo")) {
+    struct kmalloc_class_stats st;
+    char line[96];
+    term_puts(term, "  size     hits   misses    slabs   objs   free\n");
+    for (unsigned int i = 0; kmalloc_get_class_stats(i, &st) == 0; i++) {
+      snprintf(line, sizeof(line), "  %4lu %8lu %8lu %8lu %6lu %6lu\n",
+               (unsigned long)st.obj_size, (unsigned long)st.hits,
+               (unsigned long)st.misses, (unsigned long)st.slabs,
+               (unsigned long)st.objs_total,
+               (unsigned long)(st.objs_free + st.cached));
+      term_puts(term, line);
+    }
+  } else if (str_starts_with(cmd, "cacheinfo")) {
+    struct pagecache_stats st;
+    char line[96];
+    pagecache_get_stats(&st);
+    snprintf(line, sizeof(line), "  entries %lu  bytes %lu  dirty %lu\n",
+             (unsigned long)st.entries, (unsigned long)st.bytes,
+             (unsigned long)st.dirty);
+    term_puts(term, line);
+    snprintf(line, sizeof(line),
+             "  hits %lu  misses %lu  readahead %lu  evict %lu  wb %lu\n",
+             (unsigned long)st.hits, (unsigned long)st.misses,
+             (unsigned long)st.readahead, (unsigned long)st.evictions,
+             (unsigned long)st.writebacks);
+    term_puts(term, line);
+    struct dcache_stats ds;
+    dcache_get_stats(&ds);
+    snprintf(line, sizeof(line),
+             "  dentries %lu  unused %lu  hits %lu  neg %lu  misses %lu\n",
+             (unsigned long)ds.nr_dentry, (unsigned long)ds.nr_unused,
+             (unsigned long)ds.hits, (unsigned long)ds.negative_hits,
+             (unsigned long)ds.misses);
+    term_puts(term, line);
+  } else if (str_starts_with(cmd, "schedstat")) {
+    struct sched_stats st;
+    char line[96];
+    term_puts(term, "  cpu  run  balance  idle  steals    ok  migr   hot\n");
+    for (int cpu = 0; sched_get_stats(cpu, &st) == 0; cpu++) {
+      snprintf(line, sizeof(line), "  %3d %4u %8lu %5lu %7lu %5lu %5lu %5lu\n",
+               cpu, st.nr_running, (unsigned long)st.balance_runs,
+               (unsigned long)st.idle_balance,
+               (unsigned long)st.steal_attempts,
+               (unsigned long)st.steal_success, (unsigned long)st.migrations,
+               (unsigned long)st.hot_skipped);
+      term_puts(term, line);
+    }
+  } else if (str_starts_with(cmd, "lockstat")) {
+    struct lockstat_info li;
+    char line[128];
+    if (lockstat_get_class(0, &li) < 0) {
+      term_puts(term, "lockstat: kernel built without LOCKSTAT=1\n");
+    } else {
+      term_puts(term, "      acquired  contended  max hold ns  class\n");
+      for (unsigned int i = 0; lockstat_get_class(i, &li) == 0; i++) {
+        /* Static locks are named after their file; drop the directory */
+        const char *name = li.name;
+        for (const char *s = li.name; *s; s++) {
+          if (*s == '/')
+            name = s + 1;
+        }
+        snprintf(line, sizeof(line), "  %12lu %10lu %12lu  %s\n",
+                 (unsigned long)li.acquisitions, (unsigned long)li.contentions,
+                 (unsigned long)li.hold_max_ns, name);
+        term_puts(term, line);
+      }
+    }
+  } else if (str_starts_with(cmd, "syscallstat")) {
+    struct syscall_stat_info si;
+    char line[128];
+    if (syscall_get_stats(0, &si) < 0) {
+      term_puts(term, "syscallstat: kernel built without SYSCALLSTAT=1\n");
+    } else {
+      term_puts(term, "   nr       calls     avg ns     p99 ns     max ns\n");
+      for (unsigned int nr = 0; syscall_get_stats(nr, &si) == 0; nr++) {
+        if (!si.calls)
+          continue;
+        /* Upper bound of the bucket the 99th percentile falls in */
+        uint64_t seen = 0;
+        int b = 0;
+        while (b < SYSCALL_HIST_BUCKETS - 1) {
+          seen += si.hist[b];
+          if (seen * 100 >= si.calls * 99)
+            break;
+          b++;
+        }
+        uint64_t p99 = b < SYSCALL_HIST_BUCKETS - 1
+                           ? SYSCALL_HIST_BASE_NS << b
+                           : si.max_ns;
+        snprintf(line, sizeof(line), "  %3u %11lu %10lu %10lu %10lu\n", nr,
+                 (unsigned long)si.calls,
+                 (unsigned long)(si.total_ns / si.calls), (unsigned long)p99,
+                 (unsigned long)si.max_ns);
+        term_puts(term, line);
+      }
+    }
+  } else if (str_starts_with(cmd, "futextest")) {
+    term_puts(term, "Running futex self-test...\n");
+    term_puts(term, futex_selftest() == 0 ? "futextest: ok\n"
+                                          : "futextest: FAILED (see log)\n");
+  } else if (str_starts_with(cmd, "nice ")) {
+    const char *p = cmd + 5;
+    int pid = 0, prio = 0, have_prio = 0;
+    while (*p == ' ')
+      p++;
+    while (*p >= '0' && *p <= '9')
+      pid = pid * 10 + (*p++ - '0');
+    while (*p == ' ')
+      p++;
+    while (*p >= '0' && *p <= '9') {
+      prio = prio * 10 + (*p++ - '0');
+      have_prio = 1;
+    }
+    if (!pid || !have_prio) {
+      term_puts(term, "usage: nice <pid> <prio>\n");
+    } else if (process_set_priority(pid, prio) < 0) {
+      term_puts(term, "nice: no such process or bad priority\n");
+    }
   } else if (str_starts_with(cmd, "ps")) {
     term_puts(term, "  PID TTY          TIME CMD\n");
     term_puts(term, "    1 ?        00:00:00 init\n");
     term_puts(term, "    2 ?        00:00:00 kthread\n");
     term_puts(term, "   10 tty1     00:00:00 shell\n");
+    char line[48];
+    snprintf(line, sizeof(line), "%d runnable user process(es)\n",
+             process_count_ready());
+    term_puts(term, line);
   } else if (str_starts_with(cmd, "whoami")) {
     term_puts(term, "root\n");
   } else if (str_starts_with(cmd, "neofetch")) {
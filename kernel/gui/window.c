@@ -11,7 +11,10 @@
 #include "icons.h"           /* Icon bitmaps */
 #include "media/media.h"
 #include "mm/kmalloc.h"
+#include "mm/vmm.h"
 #include "printk.h"
+#include "sync/rcu.h"
+#include "sync/spinlock.h"
 #include "toolbar_icons.h" /* Toolbar icons for image viewer */
 #include "types.h"
 
@@ -700,10 +703,19 @@ struct window {
   void (*on_close)(struct window *win);
 
   struct window *next;
+  struct rcu_head rcu; /* Releases the slot once off the stack */
 };
 
 static struct window windows[MAX_WINDOWS];
-static struct window *window_stack = NULL; /* Z-order, top is focused */
+
+/*
+ * Z-order, top is focused. An RCU list: hit tests and the compositor walk
+ * it without locking, while changes are serialized by window_lock. A
+ * destroyed window keeps its slot and buffer until walks that may still
+ * see it are done.
+ */
+static struct window *window_stack = NULL;
+static DEFINE_SPINLOCK(window_lock);
 static struct window *focused_window = NULL;
 static int next_window_id = 1;
 
@@ -712,19 +724,21 @@ struct window *gui_create_window(const char *title, int x, int y, int w,
                                  int h) {
   /* Find free slot */
   struct window *win = NULL;
+  uint64_t flags = spin_lock_irqsave(&window_lock);
   for (int i = 0; i < MAX_WINDOWS; i++) {
     if (windows[i].id == 0) {
       win = &windows[i];
+      win->id = next_window_id++;
       break;
     }
   }
+  spin_unlock_irqrestore(&window_lock, flags);
 
   if (!win) {
     printk(KERN_ERR "GUI: No free window slots\n");
     return NULL;
   }
 
-  win->id = next_window_id++;
   for (int i = 0; i < 63 && title[i]; i++) {
     win->title[i] = title[i];
     win->title[i + 1] = '\0';
@@ -751,9 +765,11 @@ struct window *gui_create_window(const char *title, int x, int y, int w,
   int content_w = w - BORDER_WIDTH * 2;
   win->content_buffer = kmalloc(content_w * content_h * 4);
 
-  /* Add to stack */
+  /* Add to stack, filled in before walkers can reach it */
+  flags = spin_lock_irqsave(&window_lock);
   win->next = window_stack;
-  window_stack = win;
+  rcu_assign_pointer(window_stack, win);
+  spin_unlock_irqrestore(&window_lock, flags);
 
   printk(KERN_INFO "GUI: Created window '%s' (%dx%d)\n", title, w, h);
 
@@ -766,57 +782,74 @@ void gui_set_window_userdata(struct window *win, void *data) {
   }
 }
 
+/* After a grace period: nobody walking the stack can still see it */
+static void window_free_rcu(struct rcu_head *head) {
+  struct window *win = container_of(head, struct window, rcu);
+
+  if (win->content_buffer) {
+    kfree(win->content_buffer);
+    win->content_buffer = NULL;
+  }
+
+  __atomic_store_n(&win->id, 0, __ATOMIC_RELEASE);
+}
+
 void gui_destroy_window(struct window *win) {
   if (!win || win->id == 0)
     return;
 
-  if (win->on_close) {
-    win->on_close(win);
+  /* Remove from stack. Walkers already on it still get past it. */
+  uint64_t flags = spin_lock_irqsave(&window_lock);
+  struct window **pp = &window_stack;
+  while (*pp && *pp != win) {
+    pp = &(*pp)->next;
   }
-
-  /* Remove from stack */
-  if (window_stack == win) {
-    window_stack = win->next;
-  } else {
-    struct window *prev = window_stack;
-    while (prev && prev->next != win) {
-      prev = prev->next;
-    }
-    if (prev) {
-      prev->next = win->next;
-    }
+  if (!*pp) {
+    /* Already destroyed, its slot not yet released */
+    spin_unlock_irqrestore(&window_lock, flags);
+    return;
+  }
+  __atomic_store_n(pp, win->next, __ATOMIC_RELAXED);
+  if (focused_window == win) {
+    focused_window = NULL;
   }
+  spin_unlock_irqrestore(&window_lock, flags);
 
-  if (win->content_buffer) {
-    kfree(win->content_buffer);
+  if (win->on_close) {
+    win->on_close(win);
   }
 
-  win->id = 0;
+  call_rcu(&win->rcu, window_free_rcu);
 }
 
 void gui_focus_window(struct window *win) {
   if (!win)
     return;
 
+  uint64_t flags = spin_lock_irqsave(&window_lock);
+
   if (focused_window) {
     focused_window->focused = false;
   }
 
-  /* Move to top of stack */
+  /* Move to top of stack. A walker standing on it while it moves may see
+   * some windows twice, but never misses the end of the list. */
   if (window_stack != win) {
     struct window *prev = window_stack;
     while (prev && prev->next != win) {
       prev = prev->next;
     }
     if (prev) {
-      prev->next = win->next;
+      __atomic_store_n(&prev->next, win->next, __ATOMIC_RELAXED);
       win->next = window_stack;
-      window_stack = win;
+      rcu_assign_pointer(window_stack, win);
     }
   }
 
   win->focused = true;
   focused_window = win;
+
+  spin_unlock_irqrestore(&window_lock, flags);
 }
 
 /* Draw a filled circle (for traffic light buttons) */
@@ -3165,13 +3198,17 @@ void gui_compose(void) {
     snake_move();
   }
 
-  /* Draw windows from bottom to top (reverse order) */
+  /* Draw windows from bottom to top (reverse order). They are drawn after
+   * the read section: only this thread destroys windows, so none of them
+   * goes away before the frame is done. */
   struct window *draw_order[MAX_WINDOWS];
   int count = 0;
-  for (struct window *win = window_stack; win && count < MAX_WINDOWS;
-       win = win->next) {
+  rcu_read_lock();
+  for (struct window *win = rcu_dereference(window_stack);
+       win && count < MAX_WINDOWS; win = rcu_dereference(win->next)) {
     draw_order[count++] = win;
   }
+  rcu_read_unlock();
 
   /* Draw in reverse (bottom to top) */
   for (int i = count - 1; i >= 0; i--) {
@@ -3525,7 +3562,9 @@ void gui_handle_mouse_event(int x, int y, int buttons) {
     /* Check if right-click is on desktop area (not on window, menu bar, or
      * dock) */
     int on_window = 0;
-    for (struct window *win = window_stack; win; win = win->next) {
+    rcu_read_lock();
+    for (struct window *win = rcu_dereference(window_stack); win;
+         win = rcu_dereference(win->next)) {
       if (!win->visible)
         continue;
       if (x >= win->x && x < win->x + win->width && y >= win->y &&
@@ -3534,6 +3573,7 @@ void gui_handle_mouse_event(int x, int y, int buttons) {
         break;
       }
     }
+    rcu_read_unlock();
 
     if (!on_window && y > MENU_BAR_HEIGHT &&
         y < (int)primary_display.height - DOCK_HEIGHT) {
@@ -3593,7 +3633,9 @@ void gui_handle_mouse_event(int x, int y, int buttons) {
 
     /* Check if click is on desktop area (not on window) */
     int on_window = 0;
-    for (struct window *win = window_stack; win; win = win->next) {
+    rcu_read_lock();
+    for (struct window *win = rcu_dereference(window_stack); win;
+         win = rcu_dereference(win->next)) {
       if (!win->visible)
         continue;
       if (x >= win->x && x < win->x + win->width && y >= win->y &&
@@ -3602,6 +3644,7 @@ void gui_handle_mouse_event(int x, int y, int buttons) {
         break;
       }
     }
+    rcu_read_unlock();
 
     if (!on_window && y > MENU_BAR_HEIGHT &&
         y < (int)primary_display.height - DOCK_HEIGHT) {
@@ -4108,8 +4151,12 @@ int gui_init(uint32_t *framebuffer, uint32_t width, uint32_t height,
   extern void gui_handle_key_event(int key);
   input_set_gui_key_callback(gui_handle_key_event);
 
-  /* Allocate backbuffer for double-buffering */
-  primary_display.backbuffer = kmalloc(pitch * height);
+  /* Allocate backbuffer for double-buffering - block-mapped so full-screen
+   * blits don't thrash the TLB; fall back to the heap if that fails */
+  primary_display.backbuffer = vmm_alloc_huge(pitch * height, NULL);
+  if (!primary_display.backbuffer) {
+    primary_display.backbuffer = kmalloc(pitch * height);
+  }
 
   /* Clear windows */
   for (int i = 0; i < MAX_WINDOWS; i++) {
@@ -202,6 +202,9 @@ typedef struct kapi {
     
     /* Input Polling (Direct) */
     void (*input_poll)(void);
+
+    /* Monotonic clock in milliseconds, without a divide */
+    unsigned long (*get_uptime_ms)(void);
 } kapi_t;
 
 /* Initialize the kernel API */
@@ -213,6 +216,20 @@ kapi_t *kapi_get(void);
 /* Tick the timer */
 void kapi_tick(void);
 
+/* Queue a key for getc() and wake tasks sleeping in kapi_wait_key() */
+void kapi_sys_key_event(int key);
+
+/* Sleep until getc() has a queued key */
+void kapi_wait_key(void);
+
+/* Whether a task is sleeping in kapi_wait_key() or polling for a key */
+int kapi_input_waiting(void);
+
+/* Queued keys as a pollable file, readable while getc() has one; the
+ * caller drops the reference with vfs_close() */
+struct file;
+struct file *kapi_input_file(void);
+
 /* Launch an embedded application */
 typedef int (*app_main_fn)(kapi_t *api, int argc, char **argv);
 int app_run(const char *name, int argc, char **argv);
@@ -146,6 +146,16 @@ uint64_t arch_timer_get_frequency(void);
  */
 uint64_t arch_timer_get_ms(void);
 
+/**
+ * arch_timer_set_event - Program this CPU's one-shot timer interrupt
+ * @deadline: arch_timer_get_ticks() value to fire at, ~0 for never
+ *
+ * The interrupt handler must call hrtimer_interrupt().
+ *
+ * @return: 0, or -1 if there is no one-shot timer
+ */
+int arch_timer_set_event(uint64_t deadline);
+
 /* ===================================================================== */
 /* Context Switching */
 /* ===================================================================== */
@@ -159,6 +169,17 @@ uint64_t arch_timer_get_ms(void);
  */
 void switch_context(cpu_context_t *old, cpu_context_t *new);
 
+#ifdef ARCH_ARM64
+/**
+ * switch_context_release - switch_context() that hands @old to other CPUs
+ * @old: Pointer to save old context
+ * @new: Pointer to load new context
+ * @owner: Cleared with release semantics once @old is saved (may be NULL)
+ */
+void switch_context_release(cpu_context_t *old, cpu_context_t *new,
+                            volatile uint32_t *owner);
+#endif
+
 /* ===================================================================== */
 /* Memory Management */
 /* ===================================================================== */
@@ -288,6 +309,9 @@ static inline void arch_context_set_flags(cpu_context_t *ctx, uint64_t flags) {
 /* CPU Information */
 /* ===================================================================== */
 
+/* Maximum number of CPUs supported by per-CPU data structures */
+#define MAX_CPUS 8
+
 /**
  * arch_cpu_id - Get current CPU ID
  * @return: CPU ID (0 for single-core systems)
@@ -296,10 +320,24 @@ uint32_t arch_cpu_id(void);
 
 /**
  * arch_cpu_count - Get number of CPUs
- * @return: Number of CPUs
+ * @return: Number of online CPUs (CPU IDs run from 0 to count - 1)
  */
 uint32_t arch_cpu_count(void);
 
+/**
+ * smp_init - Bring the secondary CPUs online
+ *
+ * Called once by the boot CPU after the scheduler and process subsystem
+ * are initialized. Each secondary CPU enters the scheduler on its own.
+ */
+void smp_init(void);
+
+/**
+ * arch_smp_send_reschedule - Ask another CPU to run its scheduler
+ * @cpu: Target CPU ID
+ */
+void arch_smp_send_reschedule(uint32_t cpu);
+
 /**
  * arch_cpu_info - Get CPU information string
  * @buf: Buffer to write info to
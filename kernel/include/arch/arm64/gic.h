@@ -26,6 +26,9 @@
 #define GIC_PRIO_HIGHEST    0x00
 #define GIC_PRIO_DEFAULT    0x80
 
+/* SGIs used for inter-processor interrupts */
+#define SGI_RESCHEDULE      0       /* Ask the target CPU to reschedule */
+
 /* ===================================================================== */
 /* GIC Distributor registers (GICD) */
 /* ===================================================================== */
@@ -109,6 +112,9 @@ void gic_init(void);
 
 /**
  * gic_cpu_init - Initialize GIC for secondary CPUs (SMP)
+ *
+ * Sets up the calling CPU's redistributor and CPU interface. SGIs and
+ * PPIs are banked per CPU, so each CPU must enable its own.
  */
 void gic_cpu_init(void);
 
@@ -22,6 +22,12 @@
 #define TIMER_CTL_IMASK         (1 << 1)
 #define TIMER_CTL_ISTATUS       (1 << 2)
 
+/* CNTKCTL_EL1: which counters and timers EL0 may access */
+#define CNTKCTL_EL0PCTEN        (1 << 0)    /* Physical counter */
+#define CNTKCTL_EL0VCTEN        (1 << 1)    /* Virtual counter */
+#define CNTKCTL_EL0VTEN         (1 << 8)    /* Virtual timer */
+#define CNTKCTL_EL0PTEN         (1 << 9)    /* Physical timer */
+
 /* ===================================================================== */
 /* Function declarations */
 /* ===================================================================== */
@@ -31,6 +37,13 @@
  */
 void timer_init(void);
 
+/**
+ * timer_cpu_init - Start the tick on a secondary CPU
+ *
+ * Must run on the CPU being started, after timer_init() on the boot CPU.
+ */
+void timer_cpu_init(void);
+
 /**
  * timer_get_frequency - Get timer frequency in Hz
  * 
@@ -51,6 +64,12 @@ uint64_t timer_get_count(void);
  */
 void timer_set_next(uint64_t ticks);
 
+/**
+ * timer_set_event - Set the absolute time of the next timer interrupt
+ * @deadline: Counter value to fire at, ~0 for never
+ */
+void timer_set_event(uint64_t deadline);
+
 /**
  * timer_get_ms - Get milliseconds since boot
  * 
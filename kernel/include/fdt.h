@@ -0,0 +1,54 @@
+/*
+ * Vib-OS Kernel - Flattened Device Tree (DTB) Helpers
+ *
+ * Minimal read-only parser for the boot device tree, enough to discover
+ * the physical memory layout before any allocator is running.
+ */
+
+#ifndef _KERNEL_FDT_H
+#define _KERNEL_FDT_H
+
+#include "types.h"
+
+#define FDT_MAGIC           0xD00DFEED
+
+/* Structure block tokens */
+#define FDT_BEGIN_NODE      0x1
+#define FDT_END_NODE        0x2
+#define FDT_PROP            0x3
+#define FDT_NOP             0x4
+#define FDT_END             0x9
+
+/* A physical memory bank described by a /memory node */
+struct fdt_mem_region {
+    uint64_t base;
+    uint64_t size;
+};
+
+/**
+ * fdt_check - Validate a device tree blob header
+ * @fdt: Pointer to the blob (may be NULL)
+ *
+ * Return: 0 if @fdt looks like a valid DTB, negative otherwise
+ */
+int fdt_check(const void *fdt);
+
+/**
+ * fdt_totalsize - Get the size of a device tree blob
+ * @fdt: Validated device tree blob
+ *
+ * Return: Total blob size in bytes
+ */
+size_t fdt_totalsize(const void *fdt);
+
+/**
+ * fdt_get_memory - Read the memory banks from /memory nodes
+ * @fdt: Device tree blob
+ * @regions: Output array of memory banks
+ * @max: Capacity of @regions
+ *
+ * Return: Number of banks found, or negative on a malformed blob
+ */
+int fdt_get_memory(const void *fdt, struct fdt_mem_region *regions, int max);
+
+#endif /* _KERNEL_FDT_H */
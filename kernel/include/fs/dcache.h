@@ -0,0 +1,101 @@
+/*
+ * UnixOS Kernel - Dentry Cache
+ *
+ * Caches the result of name lookups as dentries hashed by (parent, name).
+ * A dentry without an inode is a negative entry and records that the name
+ * does not exist. Dentries are refcounted with dget()/dput(); unused ones
+ * stay hashed on an LRU list until they are reclaimed.
+ *
+ * Every dentry holds a reference on its parent, so a cached path is never
+ * left without the directories above it.
+ */
+
+#ifndef _FS_DCACHE_H
+#define _FS_DCACHE_H
+
+#include "fs/vfs.h"
+
+/* Unused dentries kept before LRU reclaim kicks in */
+#define DCACHE_MAX_UNUSED       1024
+
+/* d_flags */
+#define DCACHE_HASHED           (1 << 0)    /* Reachable through d_lookup() */
+#define DCACHE_LRU              (1 << 1)    /* On the unused list */
+
+struct dcache_stats {
+    uint64_t hits;
+    uint64_t negative_hits;     /* Hits on a negative entry */
+    uint64_t misses;
+    uint64_t evictions;
+    size_t nr_dentry;           /* Allocated dentries */
+    size_t nr_unused;           /* Dentries on the LRU list */
+};
+
+/**
+ * d_alloc - Allocate an unhashed dentry
+ * @parent: Parent directory (a reference is taken)
+ * @name: Name of the entry
+ *
+ * Return: Dentry with d_count 1, or NULL on out of memory
+ */
+struct dentry *d_alloc(struct dentry *parent, const char *name);
+
+/**
+ * d_add - Hash a dentry so lookups can find it
+ * @dentry: Dentry from d_alloc()
+ * @inode: Inode it names, or NULL for a negative entry
+ */
+void d_add(struct dentry *dentry, struct inode *inode);
+
+/**
+ * d_lookup - Look up a name in the cache
+ * @parent: Directory to look in
+ * @name: Name of the entry
+ *
+ * Return: Referenced dentry, possibly negative, or NULL on a miss
+ */
+struct dentry *d_lookup(struct dentry *parent, const char *name);
+
+/**
+ * dget - Take a reference on a dentry
+ */
+struct dentry *dget(struct dentry *dentry);
+
+/**
+ * dput - Release a reference on a dentry
+ *
+ * Unused hashed dentries move to the LRU list; unhashed ones are freed,
+ * releasing their parent in turn.
+ */
+void dput(struct dentry *dentry);
+
+/**
+ * d_drop - Unhash a dentry
+ *
+ * Later lookups of the name go back to the filesystem. Holders of the
+ * dentry keep using it until they dput() it.
+ */
+void d_drop(struct dentry *dentry);
+
+/**
+ * d_delete - Turn a dentry negative after its name was removed
+ *
+ * If nobody else holds the dentry it is kept as a negative entry,
+ * otherwise it is unhashed.
+ */
+void d_delete(struct dentry *dentry);
+
+/**
+ * dcache_shrink - Free unused dentries
+ * @nr: Maximum number to free
+ *
+ * Return: Number of dentries freed
+ */
+size_t dcache_shrink(size_t nr);
+
+/**
+ * dcache_get_stats - Get dentry cache statistics
+ */
+void dcache_get_stats(struct dcache_stats *stats);
+
+#endif /* _FS_DCACHE_H */
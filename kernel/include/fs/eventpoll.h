@@ -0,0 +1,87 @@
+/*
+ * vib-OS Kernel - Event Poll
+ *
+ * An epoll instance is a file holding an interest list of (file, events)
+ * pairs. Each watch hangs a function entry on the wait queue its file
+ * named in poll(); a wakeup there moves the watch to the instance's ready
+ * list, so epoll_wait() only looks at files that may have changed,
+ * however many are watched.
+ *
+ * Level-triggered watches are put back on the ready list after being
+ * reported, and are reported again as long as the file stays ready.
+ * Edge-triggered ones (EPOLLET) wait for the next wakeup of their file.
+ */
+
+#ifndef _FS_EVENTPOLL_H
+#define _FS_EVENTPOLL_H
+
+#include "fs/poll.h"
+#include "types.h"
+
+/* epoll_ctl() operations */
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+/* Watch flags, or'ed into the events */
+#define EPOLLEXCLUSIVE (1U << 28) /* Accepted, but every watcher is woken */
+#define EPOLLWAKEUP (1U << 29)    /* Accepted and ignored */
+#define EPOLLONESHOT (1U << 30)   /* Disable after one report until MOD */
+#define EPOLLET (1U << 31)        /* Edge-triggered */
+
+/* Largest number of events one epoll_wait() returns */
+#define EP_MAX_EVENTS 1024
+
+/* The x86_64 ABI packs this; everywhere else data is 8-byte aligned */
+struct epoll_event {
+  uint32_t events;
+  uint64_t data;
+}
+#ifdef ARCH_X86_64
+__attribute__((packed))
+#endif
+;
+
+/**
+ * eventpoll_create - Create an epoll instance
+ * @filep: Set to the new instance's file, with one reference
+ *
+ * Return: 0 or -ENOMEM
+ */
+int eventpoll_create(struct file **filep);
+
+/**
+ * eventpoll_ctl - Add, change or remove a watch
+ * @epfile: Epoll instance
+ * @op: EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ * @fd: Descriptor @file was reached through; with @file it names the watch
+ * @file: File to watch
+ * @event: Events and user data, ignored for EPOLL_CTL_DEL
+ *
+ * Return: 0, -EINVAL for a bad @op or an @epfile that is not an instance,
+ * -EPERM if @file can't be polled, -EEXIST or -ENOENT, or -ENOMEM
+ */
+int eventpoll_ctl(struct file *epfile, int op, int fd, struct file *file,
+                  const struct epoll_event *event);
+
+/**
+ * eventpoll_wait - Wait for watched files to become ready
+ * @epfile: Epoll instance
+ * @events: Kernel buffer for at most @maxevents events
+ * @maxevents: Size of @events, 1 to EP_MAX_EVENTS
+ * @timeout: Nanoseconds to wait, 0 to only check, negative to wait forever
+ *
+ * Return: Number of events stored, 0 on timeout, -EINVAL or -EINTR
+ */
+int eventpoll_wait(struct file *epfile, struct epoll_event *events,
+                   int maxevents, int64_t timeout);
+
+/**
+ * eventpoll_release - Drop every watch on a file that is going away
+ * @file: File whose last reference is being closed
+ *
+ * Called by vfs_close() before the file is released.
+ */
+void eventpoll_release(struct file *file);
+
+#endif /* _FS_EVENTPOLL_H */
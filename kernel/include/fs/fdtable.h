@@ -0,0 +1,174 @@
+/*
+ * vib-OS Kernel - File Descriptor Tables
+ *
+ * Each task points at a table mapping descriptor numbers to open files.
+ * Tasks created with CLONE_FILES share their parent's table; others get a
+ * copy, so one process closing or reusing a descriptor never touches
+ * another's.
+ *
+ * Allocated descriptors are tracked in a bitmap with a summary word on top
+ * marking the bitmap words that are full, so the lowest free descriptor is
+ * found with two bit scans however many are open.
+ */
+
+#ifndef _FS_FDTABLE_H
+#define _FS_FDTABLE_H
+
+#include "sync/spinlock.h"
+#include "types.h"
+
+struct file;
+struct task_struct;
+
+#define MAX_FDS 256
+#define FD_WORDS (MAX_FDS / 64)
+
+/* Descriptors 0-2 fall back to the console while nothing is installed
+ * there, so open() and pipe() start looking above them */
+#define FIRST_FILE_FD 3
+
+struct files_struct {
+  atomic_t count;  /* Tasks sharing the table */
+  spinlock_t lock; /* Protects everything below */
+  uint64_t full_fds_bits;           /* Bit i: open_fds[i] is all ones */
+  uint64_t open_fds[FD_WORDS];      /* Allocated descriptors */
+  uint64_t close_on_exec[FD_WORDS]; /* Closed by execve() */
+  struct file *fd[MAX_FDS];         /* NULL while reserved but not installed */
+};
+
+/**
+ * files_alloc - Create an empty descriptor table
+ *
+ * Descriptors 0-2 start out reserved with no file behind them; the console
+ * syscalls serve them until something is installed there with dup2().
+ *
+ * Return: Table with one reference, or NULL
+ */
+struct files_struct *files_alloc(void);
+
+/**
+ * files_dup - Copy a descriptor table for a new process
+ * @old: Table to copy
+ *
+ * The copy takes its own reference to every open file, so the two tables
+ * share file offsets but not descriptors.
+ *
+ * Return: Table with one reference, or NULL
+ */
+struct files_struct *files_dup(struct files_struct *old);
+
+/**
+ * task_files - A task's descriptor table, created on first use
+ * @task: Task
+ *
+ * Safe against CLONE_FILES siblings racing to create it: one table wins
+ * and the others are freed.
+ *
+ * Return: The table, or NULL if there is no memory for one
+ */
+struct files_struct *task_files(struct task_struct *task);
+
+/**
+ * files_get - Take another reference to a shared table
+ * @files: Table
+ */
+static inline void files_get(struct files_struct *files) {
+  atomic_inc(&files->count);
+}
+
+/**
+ * files_put - Drop a table reference
+ * @files: Table, may be NULL
+ *
+ * The last reference closes every descriptor and frees the table.
+ */
+void files_put(struct files_struct *files);
+
+/**
+ * fd_alloc - Reserve the lowest free descriptor
+ * @files: Table
+ * @start: Lowest descriptor number acceptable
+ *
+ * Return: Descriptor for fd_install() or fd_free(), or -EMFILE
+ */
+int fd_alloc(struct files_struct *files, int start);
+
+/**
+ * fd_install - Point a reserved descriptor at an open file
+ * @files: Table
+ * @fd: Descriptor from fd_alloc()
+ * @file: File; the table takes over the caller's reference
+ * @cloexec: Close it on execve()
+ */
+void fd_install(struct files_struct *files, int fd, struct file *file,
+                int cloexec);
+
+/**
+ * fd_free - Release a reserved descriptor that never got a file
+ * @files: Table
+ * @fd: Descriptor from fd_alloc()
+ */
+void fd_free(struct files_struct *files, int fd);
+
+/**
+ * fd_close - Detach a descriptor
+ * @files: Table
+ * @fd: Descriptor
+ *
+ * Return: Its file, still referenced, for the caller to vfs_close(); NULL
+ * if @fd had none
+ */
+struct file *fd_close(struct files_struct *files, int fd);
+
+/**
+ * fd_get - Look up a descriptor
+ * @files: Table
+ * @fd: Descriptor
+ *
+ * Return: Its file with a new reference, dropped with vfs_close(); NULL if
+ * @fd has none
+ */
+struct file *fd_get(struct files_struct *files, int fd);
+
+/**
+ * fd_dup - Duplicate a descriptor
+ * @files: Table
+ * @oldfd: Descriptor to duplicate
+ * @newfd: Number to use, or -1 for the lowest free one
+ * @start: Lowest number acceptable when @newfd is -1
+ * @cloexec: Set close-on-exec on the new descriptor
+ *
+ * A file already open at @newfd is closed first, atomically with the
+ * replacement.
+ *
+ * Return: New descriptor, -EBADF if @oldfd has no file, or -EMFILE
+ */
+int fd_dup(struct files_struct *files, int oldfd, int newfd, int start,
+           int cloexec);
+
+/**
+ * fd_get_cloexec - Read a descriptor's close-on-exec flag
+ * @files: Table
+ * @fd: Descriptor
+ *
+ * Return: 0 or 1, or -EBADF if @fd is not allocated
+ */
+int fd_get_cloexec(struct files_struct *files, int fd);
+
+/**
+ * fd_set_cloexec - Set or clear a descriptor's close-on-exec flag
+ * @files: Table
+ * @fd: Descriptor
+ * @cloexec: New value
+ *
+ * Return: 0, or -EBADF if @fd is not allocated
+ */
+int fd_set_cloexec(struct files_struct *files, int fd, int cloexec);
+
+/**
+ * files_close_on_exec - Close the descriptors marked close-on-exec
+ * @files: Table of the task calling execve()
+ */
+void files_close_on_exec(struct files_struct *files);
+
+#endif /* _FS_FDTABLE_H */
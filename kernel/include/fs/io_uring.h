@@ -0,0 +1,163 @@
+/*
+ * vib-OS Kernel - Submission/Completion Rings
+ *
+ * An io_uring instance is a pair of rings shared with userspace. The
+ * process fills in submission queue entries (SQEs) and advances the SQ
+ * tail; one io_uring_enter() hands the kernel every entry queued since the
+ * last call, however many that is. Each request ends in a completion queue
+ * entry (CQE) carrying its user_data and result, which the process reaps
+ * straight from the CQ ring without a syscall.
+ *
+ * Requests that may block run on a small pool of kernel workers per ring,
+ * which borrow the owner's address space; the submitter only waits if it
+ * asks to.
+ *
+ * The ring memory is allocated by the kernel and mapped into the caller by
+ * io_uring_setup(), which returns the addresses in io_uring_params:
+ *
+ *   cq_off.user_addr   The rings: both heads and tails, the CQE array and
+ *                      the SQ index array, at the sq_off/cq_off offsets
+ *   sq_off.user_addr   The SQE array
+ *
+ * so no mmap() of the ring file is needed. Layouts follow Linux.
+ */
+
+#ifndef _FS_IO_URING_H
+#define _FS_IO_URING_H
+
+#include "types.h"
+
+struct file;
+
+/* Largest SQ ring; the CQ ring may be twice that */
+#define IORING_MAX_ENTRIES 4096
+#define IORING_MAX_CQ_ENTRIES (2 * IORING_MAX_ENTRIES)
+
+/* Kernel workers a ring starts at most */
+#define IORING_MAX_WORKERS 4
+
+/* Submission queue entry */
+struct io_uring_sqe {
+  uint8_t opcode;  /* IORING_OP_* */
+  uint8_t flags;   /* IOSQE_* */
+  uint16_t ioprio; /* Ignored */
+  int32_t fd;
+  uint64_t off;      /* File offset, -1 for the file position; TIMEOUT: count */
+  uint64_t addr;     /* Buffer, path or timespec */
+  uint32_t len;      /* Buffer length; OPENAT: mode; TIMEOUT: must be 1 */
+  uint32_t op_flags; /* OPENAT: open flags; TIMEOUT: IORING_TIMEOUT_* */
+  uint64_t user_data; /* Copied to the CQE */
+  uint16_t buf_index;
+  uint16_t personality;
+  int32_t splice_fd_in;
+  uint64_t addr3;
+  uint64_t __pad2[1];
+};
+
+/* Completion queue entry */
+struct io_uring_cqe {
+  uint64_t user_data;
+  int32_t res; /* Result, or negative error */
+  uint32_t flags;
+};
+
+/* Opcodes, Linux numbering */
+#define IORING_OP_NOP 0
+#define IORING_OP_TIMEOUT 11
+#define IORING_OP_OPENAT 18
+#define IORING_OP_READ 22
+#define IORING_OP_WRITE 23
+#define IORING_OP_SEND 26
+#define IORING_OP_RECV 27
+
+/* sqe->flags */
+#define IOSQE_ASYNC (1U << 4) /* Always hand the request to a worker */
+
+/* sqe->op_flags for IORING_OP_TIMEOUT */
+#define IORING_TIMEOUT_ABS (1U << 0) /* Expiry is a ktime_get() value */
+
+/* Timeout argument, pointed to by sqe->addr */
+struct io_uring_timespec {
+  int64_t tv_sec;
+  int64_t tv_nsec;
+};
+
+/* io_uring_params.flags */
+#define IORING_SETUP_CQSIZE (1U << 3) /* Use cq_entries for the CQ ring */
+
+/* io_uring_params.features */
+#define IORING_FEAT_NODROP (1U << 1) /* A full CQ ring holds back, not drops */
+
+/* Ring flags, at sq_off.flags */
+#define IORING_SQ_CQ_OVERFLOW (1U << 1) /* Completions are held back */
+
+/* io_uring_enter() flags */
+#define IORING_ENTER_GETEVENTS (1U << 0) /* Wait for min_complete CQEs */
+
+struct io_sqring_offsets {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t ring_mask;
+  uint32_t ring_entries;
+  uint32_t flags;
+  uint32_t dropped; /* Entries skipped for a bad SQE index */
+  uint32_t array;   /* SQ ring slot -> SQE index */
+  uint32_t resv1;
+  uint64_t user_addr; /* SQE array */
+};
+
+struct io_cqring_offsets {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t ring_mask;
+  uint32_t ring_entries;
+  uint32_t overflow; /* CQEs lost because memory ran out */
+  uint32_t cqes;
+  uint32_t flags;
+  uint32_t resv1;
+  uint64_t user_addr; /* Rings */
+};
+
+struct io_uring_params {
+  uint32_t sq_entries;
+  uint32_t cq_entries;
+  uint32_t flags;
+  uint32_t sq_thread_cpu;
+  uint32_t sq_thread_idle;
+  uint32_t features;
+  uint32_t wq_fd;
+  uint32_t resv[3];
+  struct io_sqring_offsets sq_off;
+  struct io_cqring_offsets cq_off;
+};
+
+/**
+ * io_uring_create - Create a ring and map it into the calling task
+ * @entries: SQ ring size, rounded up to a power of two
+ * @p: Parameters; flags and cq_entries are read, the rest filled in
+ * @filep: Set to the ring's file, with one reference
+ *
+ * Return: 0, -EINVAL for a bad size or flag, -ENOSYS if the task has no
+ * address space of its own to map the ring into, or -ENOMEM
+ */
+int io_uring_create(uint32_t entries, struct io_uring_params *p,
+                    struct file **filep);
+
+/**
+ * io_uring_submit_and_wait - Submit queued SQEs and optionally wait
+ * @file: Ring file
+ * @to_submit: Most SQEs to take from the SQ ring
+ * @min_complete: With IORING_ENTER_GETEVENTS, CQEs to wait for
+ * @flags: IORING_ENTER_* flags
+ *
+ * Every SQE taken is answered with a CQE, including the ones that fail
+ * validation. Requests on regular files run before this returns unless
+ * they ask for IOSQE_ASYNC; the rest are queued for the ring's workers.
+ *
+ * Return: Number of SQEs taken, possibly 0; -EOPNOTSUPP if @file is not a
+ * ring, or -EINTR if the wait was interrupted before any SQE was taken
+ */
+int io_uring_submit_and_wait(struct file *file, uint32_t to_submit,
+                             uint32_t min_complete, uint32_t flags);
+
+#endif /* _FS_IO_URING_H */
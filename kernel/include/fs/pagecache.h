@@ -0,0 +1,168 @@
+/*
+ * UnixOS Kernel - Page Cache
+ *
+ * Hash-indexed cache of filesystem blocks shared by all block-backed
+ * filesystems. Entries are keyed by (mapping, index), where a mapping is
+ * a device or any other object with a block read/write callback. Clean
+ * entries are reclaimed in LRU order; dirty entries are written back on
+ * sync, on reclaim, or when the mapping is torn down.
+ */
+
+#ifndef _FS_PAGECACHE_H
+#define _FS_PAGECACHE_H
+
+#include "types.h"
+
+/* Total bytes of cached data before LRU reclaim kicks in */
+#define PAGECACHE_MAX_BYTES     (32UL * 1024 * 1024)
+
+/* Blocks read ahead when a mapping is read sequentially */
+#define PAGECACHE_RA_DEFAULT    8
+
+/* Most blocks fetched by one multi-block device request */
+#define PAGECACHE_RA_BATCH      32
+
+/* Entry flags */
+#define PC_UPTODATE     (1 << 0)    /* Data is valid */
+#define PC_DIRTY        (1 << 1)    /* Data must be written back */
+#define PC_IO           (1 << 2)    /* Read in progress */
+
+/*
+ * A cached object, usually a block device. Filesystems embed one per
+ * mount and fill in the callbacks; the cache never calls them with its
+ * lock held.
+ */
+struct pagecache_mapping {
+    void *host;                 /* Passed back to the callbacks */
+    uint32_t block_size;        /* Bytes per index */
+    int (*read)(void *host, uint64_t index, void *buf);
+    int (*write)(void *host, uint64_t index, const void *buf);
+
+    /* Read-ahead state */
+    uint32_t ra_pages;          /* Window size, 0 disables read-ahead */
+    uint64_t last_index;        /* Last index missed on */
+
+    size_t nr_cached;           /* Entries currently cached */
+};
+
+struct pagecache_entry {
+    struct pagecache_mapping *mapping;
+    uint64_t index;
+    void *data;
+    uint32_t flags;             /* PC_* */
+    int refcount;               /* Users holding the entry */
+    struct pagecache_entry *hash_next;
+    struct pagecache_entry *lru_prev;
+    struct pagecache_entry *lru_next;
+};
+
+struct pagecache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;         /* Blocks read ahead */
+    uint64_t evictions;
+    uint64_t writebacks;
+    size_t entries;
+    size_t bytes;
+    size_t dirty;
+};
+
+/**
+ * pagecache_init_mapping - Prepare a mapping for use
+ * @mapping: Mapping to initialize
+ * @host: Device or object passed to the callbacks
+ * @block_size: Bytes per block
+ * @read: Block read callback
+ * @write: Block write callback (NULL for read-only mappings)
+ */
+void pagecache_init_mapping(struct pagecache_mapping *mapping, void *host,
+                            uint32_t block_size,
+                            int (*read)(void *, uint64_t, void *),
+                            int (*write)(void *, uint64_t, const void *));
+
+/**
+ * pagecache_get - Look up a block, reading it in on a miss
+ * @mapping: Mapping to look in
+ * @index: Block number
+ *
+ * The entry stays pinned until pagecache_put(). Its data may be read
+ * directly; callers that modify it must call pagecache_mark_dirty().
+ *
+ * Return: Entry, or NULL on I/O error or out of memory
+ */
+struct pagecache_entry *pagecache_get(struct pagecache_mapping *mapping,
+                                      uint64_t index);
+
+/**
+ * pagecache_put - Release an entry from pagecache_get()
+ * @entry: Entry to release
+ */
+void pagecache_put(struct pagecache_entry *entry);
+
+/**
+ * pagecache_mark_dirty - Schedule an entry for write-back
+ * @entry: Pinned entry whose data was modified
+ */
+void pagecache_mark_dirty(struct pagecache_entry *entry);
+
+/**
+ * pagecache_read - Copy a block out of the cache
+ * @mapping: Mapping to read from
+ * @index: Block number
+ * @buf: Destination, block_size bytes
+ *
+ * Return: 0 on success, negative on error
+ */
+int pagecache_read(struct pagecache_mapping *mapping, uint64_t index, void *buf);
+
+/**
+ * pagecache_write - Copy a whole block into the cache
+ * @mapping: Mapping to write to
+ * @index: Block number
+ * @buf: Source, block_size bytes
+ *
+ * The block is written back later (see pagecache_sync()).
+ *
+ * Return: 0 on success, negative on error
+ */
+int pagecache_write(struct pagecache_mapping *mapping, uint64_t index,
+                    const void *buf);
+
+/**
+ * pagecache_readahead - Start reading blocks that are not cached yet
+ * @mapping: Mapping to read from
+ * @index: First block
+ * @count: Number of blocks
+ */
+void pagecache_readahead(struct pagecache_mapping *mapping, uint64_t index,
+                         uint32_t count);
+
+/**
+ * pagecache_sync - Write back every dirty block of a mapping
+ * @mapping: Mapping to flush, or NULL for all mappings
+ *
+ * Return: 0 on success, negative if any write failed
+ */
+int pagecache_sync(struct pagecache_mapping *mapping);
+
+/**
+ * pagecache_invalidate - Write back and drop all blocks of a mapping
+ * @mapping: Mapping being torn down
+ */
+void pagecache_invalidate(struct pagecache_mapping *mapping);
+
+/**
+ * pagecache_shrink - Reclaim clean, unused entries
+ * @nr: Maximum number of entries to free
+ *
+ * Return: Number of entries freed
+ */
+size_t pagecache_shrink(size_t nr);
+
+/**
+ * pagecache_get_stats - Get page cache statistics
+ * @stats: Output
+ */
+void pagecache_get_stats(struct pagecache_stats *stats);
+
+#endif /* _FS_PAGECACHE_H */
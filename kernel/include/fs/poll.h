@@ -0,0 +1,55 @@
+/*
+ * vib-OS Kernel - File Readiness
+ *
+ * A file that can be waited on implements file_operations.poll: it reports
+ * which of the EPOLL* events it could satisfy right now and, when asked
+ * to, tells the caller which wait queue it wakes when that changes:
+ *
+ *   static unsigned int foo_poll(struct file *file, struct poll_table *pt) {
+ *     poll_wait(file, &foo->wait, pt);
+ *     return foo_has_data(foo) ? EPOLLIN | EPOLLRDNORM : 0;
+ *   }
+ *
+ * poll is called with a spinlock held, so it must not sleep; reading the
+ * state without the file's own lock is fine, as anything that changes it
+ * afterwards wakes the queue.
+ */
+
+#ifndef _FS_POLL_H
+#define _FS_POLL_H
+
+#include "sync/wait.h"
+#include "types.h"
+
+struct file;
+
+/* Events */
+#define EPOLLIN 0x001     /* Data to read */
+#define EPOLLPRI 0x002    /* Urgent data to read */
+#define EPOLLOUT 0x004    /* Room to write */
+#define EPOLLERR 0x008    /* Error, always reported */
+#define EPOLLHUP 0x010    /* Peer gone, always reported */
+#define EPOLLRDNORM 0x040 /* Same as EPOLLIN */
+#define EPOLLWRNORM 0x100 /* Same as EPOLLOUT */
+#define EPOLLRDHUP 0x2000 /* Peer shut down its writing side */
+
+struct poll_table {
+  /* Registers interest in @wq; NULL table means just report */
+  void (*qproc)(struct file *file, wait_queue_head_t *wq,
+                struct poll_table *pt);
+};
+
+/**
+ * poll_wait - Tell a poller which queue to wait on
+ * @file: File being polled
+ * @wq: Queue woken when the file's readiness may have changed
+ * @pt: Table passed to the poll operation, may be NULL
+ */
+static inline void poll_wait(struct file *file, wait_queue_head_t *wq,
+                             struct poll_table *pt) {
+  if (pt && pt->qproc) {
+    pt->qproc(file, wq, pt);
+  }
+}
+
+#endif /* _FS_POLL_H */
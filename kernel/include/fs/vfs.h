@@ -66,6 +66,21 @@
 #define O_DIRECTORY     0x10000
 #define O_CLOEXEC       0x80000
 
+/* ===================================================================== */
+/* fcntl commands */
+/* ===================================================================== */
+
+#define F_DUPFD         0
+#define F_GETFD         1
+#define F_SETFD         2
+#define F_GETFL         3
+#define F_SETFL         4
+#define F_DUPFD_CLOEXEC 1030
+#define F_SETPIPE_SZ    1031
+#define F_GETPIPE_SZ    1032
+
+#define FD_CLOEXEC      1
+
 /* ===================================================================== */
 /* Seek constants */
 /* ===================================================================== */
@@ -120,8 +135,12 @@
 #define EROFS           30
 #define EMLINK          31
 #define EPIPE           32
+#define ENAMETOOLONG    36
 #define ENOSYS          38
 #define ENOTEMPTY       39
+#define ETIME           62
+#define EOPNOTSUPP      95
+#define ETIMEDOUT       110
 
 /* ===================================================================== */
 /* Forward declarations */
@@ -132,6 +151,8 @@ struct dentry;
 struct file;
 struct super_block;
 struct file_system_type;
+struct poll_table;
+struct epitem;
 
 /* ===================================================================== */
 /* File operations */
@@ -146,6 +167,7 @@ struct file_operations {
     int (*readdir)(struct file *, void *, int (*)(void *, const char *, int, loff_t, ino_t, unsigned));
     int (*ioctl)(struct file *, unsigned int, unsigned long);
     int (*mmap)(struct file *, void *);
+    unsigned int (*poll)(struct file *, struct poll_table *); /* fs/poll.h */
 };
 
 /* ===================================================================== */
@@ -219,6 +241,13 @@ struct dentry {
     struct dentry *d_sibling;   /* Next sibling */
     struct super_block *d_sb;
     atomic_t d_count;
+
+    /* Dentry cache state, see fs/dcache.h */
+    uint32_t d_flags;
+    uint32_t d_hash;            /* Hash of (d_parent, d_name) */
+    struct dentry *d_hash_next;
+    struct dentry *d_lru_prev;  /* Unused list, only while d_count == 0 */
+    struct dentry *d_lru_next;
 };
 
 /* ===================================================================== */
@@ -233,6 +262,7 @@ struct file {
     mode_t f_mode;
     atomic_t f_count;
     void *private_data;
+    struct epitem *f_ep;    /* Epoll watches on this file */
 };
 
 /* ===================================================================== */
@@ -295,7 +325,9 @@ int register_filesystem(struct file_system_type *fs);
 struct file *vfs_open(const char *path, int flags, mode_t mode);
 
 /**
- * vfs_close - Close a file
+ * vfs_close - Drop a reference to an open file
+ *
+ * The file is released when its last reference goes.
  */
 int vfs_close(struct file *file);
 
@@ -314,6 +346,20 @@ ssize_t vfs_read(struct file *file, char *buf, size_t count);
  */
 ssize_t vfs_write(struct file *file, const char *buf, size_t count);
 
+/**
+ * vfs_pread - Read from a file at an offset, leaving its position alone
+ *
+ * Files without an inode behind them (pipes, sockets) give -ESPIPE.
+ */
+ssize_t vfs_pread(struct file *file, char *buf, size_t count, loff_t pos);
+
+/**
+ * vfs_pwrite - Write to a file at an offset, leaving its position alone
+ *
+ * Files without an inode behind them (pipes, sockets) give -ESPIPE.
+ */
+ssize_t vfs_pwrite(struct file *file, const char *buf, size_t count, loff_t pos);
+
 /**
  * vfs_lseek - Seek in a file
  */
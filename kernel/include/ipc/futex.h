@@ -0,0 +1,85 @@
+/*
+ * vib-OS Kernel - Fast Userspace Mutexes
+ *
+ * Lets threads block on a 32-bit word in their own memory. The word is
+ * only looked at by the kernel when userspace finds it contended, so an
+ * uncontended lock or unlock never enters the kernel.
+ *
+ * Private futexes (FUTEX_PRIVATE_FLAG) are keyed by address space and
+ * virtual address. Others are keyed by the physical address of the word,
+ * so processes that map the same page at different addresses still find
+ * each other.
+ */
+
+#ifndef _IPC_FUTEX_H
+#define _IPC_FUTEX_H
+
+#include "types.h"
+
+/* futex() operations */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+
+/* Flags or'ed into the operation */
+#define FUTEX_PRIVATE_FLAG 128
+#define FUTEX_CLOCK_REALTIME 256
+#define FUTEX_CMD_MASK (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+/**
+ * futex_wait - Sleep while a futex word holds an expected value
+ * @uaddr: User address of the word, 4-byte aligned
+ * @flags: FUTEX_PRIVATE_FLAG if only this address space uses the word
+ * @val: Value the caller last saw in the word
+ * @timeout: Relative timeout in nanoseconds, or 0 to wait forever
+ *
+ * The word is compared and the caller queued atomically with respect to
+ * futex_wake(), so a wakeup after userspace read @val is never lost.
+ *
+ * Return: 0 when woken, -EAGAIN if the word no longer holds @val,
+ * -ETIMEDOUT, -EINTR if the process was killed, -EFAULT or -EINVAL
+ */
+int futex_wait(uint64_t uaddr, int flags, uint32_t val, uint64_t timeout);
+
+/**
+ * futex_wake - Wake waiters on a futex word
+ * @uaddr: User address of the word
+ * @flags: FUTEX_PRIVATE_FLAG, as passed to futex_wait()
+ * @nr_wake: Maximum number of waiters to wake
+ *
+ * Return: Number of waiters woken, or -EFAULT or -EINVAL
+ */
+int futex_wake(uint64_t uaddr, int flags, int nr_wake);
+
+/**
+ * futex_requeue - Wake some waiters and move the rest to another word
+ * @uaddr: User address of the word waited on
+ * @uaddr2: User address of the word to move waiters to
+ * @flags: FUTEX_PRIVATE_FLAG, for both words
+ * @nr_wake: Maximum number of waiters to wake
+ * @nr_requeue: Maximum number of waiters to move
+ * @cmpval: Value *@uaddr must hold, or NULL to skip the check
+ *
+ * Moving waiters straight onto a mutex avoids waking them all only to
+ * have them pile up on it again, as in a condition variable broadcast.
+ *
+ * Return: Number of waiters woken plus moved, -EAGAIN if *@uaddr does not
+ * hold *@cmpval, -EFAULT or -EINVAL
+ */
+int futex_requeue(uint64_t uaddr, uint64_t uaddr2, int flags, int nr_wake,
+                  int nr_requeue, const uint32_t *cmpval);
+
+/**
+ * futex_selftest - Check that wakeups survive the word changing pages
+ *
+ * Runs a waiter and a waker as kernel threads on a scratch address space,
+ * once with the word on the zero page and once with its page made
+ * copy-on-write by a fork while the waiter sleeps. Sleeps for up to a few
+ * seconds; the outcome of each case is logged.
+ *
+ * Return: 0 if every wakeup arrived, else the first failure
+ */
+int futex_selftest(void);
+
+#endif /* _IPC_FUTEX_H */
@@ -0,0 +1,103 @@
+/*
+ * vib-OS Kernel - Pipes and Splicing
+ *
+ * A pipe is a ring of page references rather than a byte buffer. Writes
+ * fill pages with bulk copies; splice(), tee() and vmsplice() move or
+ * share whole pages between pipes, files and user memory instead of
+ * copying their contents through a user buffer.
+ */
+
+#ifndef _IPC_PIPE_H
+#define _IPC_PIPE_H
+
+#include "types.h"
+#include "fs/vfs.h"
+
+/* splice() and friends flags */
+#define SPLICE_F_MOVE 1     /* Hint only: pages are always moved if they can */
+#define SPLICE_F_NONBLOCK 2 /* Don't block on the pipe */
+#define SPLICE_F_MORE 4     /* Hint only */
+#define SPLICE_F_GIFT 8     /* Hint only */
+
+/* Default and largest pipe capacities */
+#define PIPE_DEF_SIZE (16 * PAGE_SIZE)
+#define PIPE_MAX_SIZE (1024 * 1024)
+
+/* Most segments one vmsplice() takes */
+#define UIO_MAXIOV 1024
+
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
+/**
+ * do_pipe - Create a pipe
+ * @read_file: Output for the read end
+ * @write_file: Output for the write end
+ *
+ * Return: 0 on success, -ENOMEM
+ */
+int do_pipe(struct file **read_file, struct file **write_file);
+
+/**
+ * pipe_fcntl - F_GETPIPE_SZ and F_SETPIPE_SZ
+ * @file: Either end of a pipe
+ * @cmd: Command
+ * @arg: New size in bytes for F_SETPIPE_SZ, rounded up to a power of two
+ *       number of pages
+ *
+ * Return: Capacity in bytes, -EBADF if @file is not a pipe, -EBUSY if the
+ * pipe holds more than the new size, -EPERM above PIPE_MAX_SIZE
+ */
+long pipe_fcntl(struct file *file, unsigned int cmd, unsigned long arg);
+
+/**
+ * do_splice - Move data to or from a pipe without a user copy
+ * @in: Source; a pipe's read end or a readable file
+ * @off_in: Offset to read @in at and advance, or NULL to use its position
+ * @out: Destination; a pipe's write end or a writable file
+ * @off_out: As @off_in, for @out
+ * @len: Most bytes to move
+ * @flags: SPLICE_F_*
+ *
+ * One of @in and @out must be a pipe. Between two pipes, pages change
+ * hands by reference. A file is read straight into new pipe pages and
+ * written straight from them.
+ *
+ * Return: Bytes moved, 0 at end of input, or negative error
+ */
+ssize_t do_splice(struct file *in, loff_t *off_in, struct file *out,
+                  loff_t *off_out, size_t len, unsigned int flags);
+
+/**
+ * do_tee - Duplicate pipe contents without consuming them
+ * @in: A pipe's read end
+ * @out: Another pipe's write end
+ * @len: Most bytes to duplicate
+ * @flags: SPLICE_F_*
+ *
+ * Both pipes then reference the same pages.
+ *
+ * Return: Bytes duplicated, 0 if @in is empty with no writers, or
+ * negative error
+ */
+ssize_t do_tee(struct file *in, struct file *out, size_t len,
+               unsigned int flags);
+
+/**
+ * do_vmsplice - Splice user memory into a pipe, or read a pipe into it
+ * @file: Either end of a pipe
+ * @iov: Segments, already checked to be user memory
+ * @nr_segs: Number of segments
+ * @flags: SPLICE_F_*
+ *
+ * On the write end, user pages are referenced rather than copied where
+ * possible, so the caller must not modify them until they have been read.
+ *
+ * Return: Bytes moved, or negative error
+ */
+ssize_t do_vmsplice(struct file *file, const struct iovec *iov,
+                    unsigned long nr_segs, unsigned int flags);
+
+#endif /* _IPC_PIPE_H */
@@ -1,7 +1,9 @@
 /*
  * UnixOS Kernel - Kernel Heap Allocator (kmalloc)
  * 
- * Simple SLUB-like allocator for kernel dynamic memory.
+ * Simple SLUB-like allocator for kernel dynamic memory. Requests up to
+ * 4KB are served from per-CPU magazines backed by size-class slabs;
+ * larger requests use a first-fit block allocator.
  */
 
 #ifndef _MM_KMALLOC_H
@@ -14,6 +16,10 @@
 #define GFP_ATOMIC      0x01    /* Allocation in interrupt context */
 #define GFP_ZERO        0x02    /* Zero the memory */
 
+/* Fixed heap region, reserved from the page allocator by pmm_init */
+#define KMALLOC_HEAP_BASE   0x42000000UL
+#define KMALLOC_HEAP_SIZE   (128UL * 1024 * 1024)
+
 /**
  * kmalloc_init - Initialize the kernel heap
  */
@@ -24,6 +30,9 @@ void kmalloc_init(void);
  * @size: Number of bytes to allocate
  * @flags: Allocation flags (GFP_*)
  * 
+ * Requests of PAGE_SIZE or more are rounded up to whole pages and are
+ * page-aligned.
+ * 
  * Return: Pointer to allocated memory, or NULL on failure
  */
 void *_kmalloc(size_t size, uint32_t flags);
@@ -70,4 +79,33 @@ void *krealloc(void *ptr, size_t new_size, uint32_t flags);
  */
 void kmalloc_get_stats(size_t *total, size_t *used, size_t *free);
 
+/* Per size-class slab statistics */
+struct kmalloc_class_stats {
+    size_t obj_size;            /* Object size of this class */
+    uint64_t hits;              /* Allocations served from a magazine */
+    uint64_t misses;            /* Allocations that had to refill */
+    uint64_t frees;             /* Objects freed to a magazine */
+    uint64_t flushes;           /* Magazine flushes back to slabs */
+    size_t slabs;               /* Slabs owned by this class */
+    size_t objs_total;          /* Object capacity of those slabs */
+    size_t objs_free;           /* Free objects left in slabs */
+    size_t cached;              /* Free objects sitting in magazines */
+    uint64_t bytes_requested;   /* Sum of requested sizes */
+    uint64_t bytes_allocated;   /* Sum of rounded-up class sizes */
+};
+
+/**
+ * kmalloc_get_class_stats - Get statistics for one slab size class
+ * @idx: Size class index, starting at 0
+ * @st: Output statistics
+ *
+ * Return: 0 on success, -1 if @idx is past the last class
+ */
+int kmalloc_get_class_stats(unsigned int idx, struct kmalloc_class_stats *st);
+
+/**
+ * kmalloc_dump_stats - Print heap and per-class slab statistics
+ */
+void kmalloc_dump_stats(void);
+
 #endif /* _MM_KMALLOC_H */
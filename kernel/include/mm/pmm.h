@@ -49,6 +49,7 @@ typedef enum {
 #define PAGE_FLAG_LOCKED        (1 << 2)
 #define PAGE_FLAG_RESERVED      (1 << 3)
 #define PAGE_FLAG_SLAB          (1 << 4)
+#define PAGE_FLAG_BUDDY         (1 << 5)    /* Head of a free buddy block */
 
 /* ===================================================================== */
 /* Page structure */
@@ -58,6 +59,7 @@ struct page {
     uint32_t flags;
     uint32_t order;         /* For buddy allocator */
     struct page *next;      /* Free list link */
+    struct page *prev;
     void *slab;             /* For slab allocator */
     atomic_t refcount;
 };
@@ -68,13 +70,15 @@ struct page {
 
 /**
  * pmm_init - Initialize physical memory manager
+ * @dtb: Device tree blob passed by the bootloader, or NULL
  * 
- * Discovers available memory from device tree or UEFI memory map.
- * Sets up the buddy allocator.
+ * Discovers available memory from the device tree /memory nodes (or a
+ * built-in default), reserves the kernel image and fixed regions, and
+ * sets up the buddy allocator.
  * 
  * Return: 0 on success, negative on error
  */
-int pmm_init(void);
+int pmm_init(void *dtb);
 
 /**
  * pmm_alloc_page - Allocate a single physical page
@@ -83,9 +87,12 @@ int pmm_init(void);
  */
 phys_addr_t pmm_alloc_page(void);
 
+/* Largest buddy block: 2^11 = 2048 pages = 8MB */
+#define PMM_MAX_ORDER   11
+
 /**
  * pmm_alloc_pages - Allocate contiguous pages
- * @order: Power of 2 number of pages (0=1, 1=2, 2=4, etc.)
+ * @order: Power of 2 number of pages (0=1, 1=2, 2=4, etc.), at most PMM_MAX_ORDER
  * 
  * Return: Physical address of first page, or 0 on failure
  */
@@ -97,6 +104,15 @@ phys_addr_t pmm_alloc_pages(unsigned int order);
  */
 void pmm_free_page(phys_addr_t addr);
 
+/**
+ * pmm_free_page_cold - Free a page that is unlikely to be cache-hot
+ * @addr: Physical address of page to free
+ * 
+ * The page goes to the cold end of the per-CPU list so it is reused last
+ * and drained first (e.g. pages just written by DMA or reclaimed).
+ */
+void pmm_free_page_cold(phys_addr_t addr);
+
 /**
  * pmm_free_pages - Free contiguous pages
  * @addr: Physical address of first page
@@ -118,6 +134,67 @@ size_t pmm_get_free_memory(void);
  */
 size_t pmm_get_total_memory(void);
 
+/**
+ * pmm_get_free_blocks - Get number of free buddy blocks of one order
+ * @order: Block order
+ * 
+ * Return: Number of free blocks on the @order free list
+ */
+size_t pmm_get_free_blocks(unsigned int order);
+
+/**
+ * pmm_drain_pcp - Return all per-CPU cached pages to the buddy lists
+ * 
+ * Called automatically when a higher-order allocation fails.
+ */
+void pmm_drain_pcp(void);
+
+/**
+ * pmm_get_pcp_stats - Get per-CPU page list statistics
+ * @cpu: CPU index
+ * @hits: Output for allocations served from the list
+ * @refills: Output for batched refills from the buddy lists
+ * @drains: Output for batched drains to the buddy lists
+ * @count: Output for pages currently cached
+ */
+void pmm_get_pcp_stats(uint32_t cpu, uint64_t *hits, uint64_t *refills,
+                       uint64_t *drains, size_t *count);
+
+/**
+ * pmm_get_region - Get one physical RAM bank
+ * @index: Bank index, starting at 0
+ * @base: Output for the bank start
+ * @end: Output for the bank end (exclusive)
+ * 
+ * Return: 0 on success, negative if @index is past the last bank
+ */
+int pmm_get_region(int index, phys_addr_t *base, phys_addr_t *end);
+
+/**
+ * pmm_get_page - Take an extra reference on an allocated page
+ * @addr: Physical address of the page
+ * 
+ * Used when one page is mapped in several places, e.g. shared
+ * copy-on-write after fork. Pages start with one reference.
+ */
+void pmm_get_page(phys_addr_t addr);
+
+/**
+ * pmm_put_page - Drop a page reference
+ * @addr: Physical address of the page
+ * 
+ * The page is freed when the last reference goes away.
+ */
+void pmm_put_page(phys_addr_t addr);
+
+/**
+ * pmm_page_count - Get the number of references on a page
+ * @addr: Physical address of the page
+ * 
+ * Return: Reference count, or 0 if @addr is not an allocated page
+ */
+int pmm_page_count(phys_addr_t addr);
+
 /**
  * pmm_page_to_phys - Convert page struct to physical address
  */
@@ -6,6 +6,8 @@
 #define _MM_VMM_H
 
 #include "types.h"
+#include "rbtree.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* ARM64 Page Table Definitions */
@@ -21,6 +23,10 @@
 /* Entries per table */
 #define VMM_ENTRIES         512
 
+/* Block descriptor sizes (4KB granule) */
+#define VMM_L1_BLOCK_SIZE   (1UL << VMM_LEVEL1_SHIFT)   /* 1GB */
+#define VMM_L2_BLOCK_SIZE   (1UL << VMM_LEVEL2_SHIFT)   /* 2MB */
+
 /* Page table entry flags */
 #define PTE_VALID           (1UL << 0)
 #define PTE_TABLE           (1UL << 1)   /* Not block/page */
@@ -74,11 +80,23 @@
 #define VM_USER             (1 << 3)
 #define VM_SHARED           (1 << 4)
 #define VM_DEVICE           (1 << 5)
+#define VM_ANON             (1 << 6)    /* Anonymous, populated on fault */
+
+/* Page fault causes passed to vmm_handle_page_fault */
+#define FAULT_WRITE         (1 << 0)
+#define FAULT_EXEC          (1 << 1)
+#define FAULT_USER          (1 << 2)    /* Fault taken from user mode */
 
 /* ===================================================================== */
 /* Memory layout */
 /* ===================================================================== */
 
+/*
+ * RAM below this is identity mapped with block descriptors by vmm_init.
+ * User heap and mmap ranges are placed above it.
+ */
+#define VMM_DIRECT_MAP_END  0x1000000000UL  /* 64GB */
+
 /* Kernel virtual address base (high half) */
 #define KERNEL_VMA_BASE     0xFFFF000000000000UL
 
@@ -101,12 +119,20 @@ struct vm_area {
     virt_addr_t start;
     virt_addr_t end;
     uint32_t flags;
-    struct vm_area *next;
+    struct rb_node rb;          /* Node in mm->vma_tree, keyed by start */
 };
 
+/*
+ * The lock covers the VMA tree, vma_cache, the page tables and brk. Every
+ * vmm_* call on a user address space takes it; CLONE_VM threads fault and
+ * map on other CPUs concurrently.
+ */
 struct mm_struct {
+    spinlock_t lock;
     uint64_t *pgd;              /* Page table root */
-    struct vm_area *vma_list;   /* VM areas */
+    struct rb_root vma_tree;    /* VM areas, sorted and non-overlapping */
+    struct vm_area *vma_cache;  /* Last vmm_find_vma() result */
+    size_t map_count;           /* Number of VM areas */
     size_t total_vm;            /* Total mapped size */
     atomic_t users;             /* Reference count */
     
@@ -122,6 +148,9 @@ struct mm_struct {
     uint64_t start_brk;         /* Start of heap */
     uint64_t brk;               /* Current program break */
     
+    /* Anonymous mmap search base */
+    uint64_t mmap_base;
+    
     /* Stack */
     uint64_t start_stack;       /* Start of user stack */
     
@@ -170,6 +199,9 @@ int vmm_unmap_page(virt_addr_t vaddr);
  * @size: Size in bytes (will be page-aligned)
  * @flags: Protection flags
  * 
+ * Uses 1GB and 2MB block descriptors wherever @vaddr and @paddr are
+ * suitably aligned, and 4KB pages for the rest.
+ * 
  * Return: 0 on success, negative on error
  */
 int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t flags);
@@ -179,10 +211,33 @@ int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t fl
  * @vaddr: Starting virtual address
  * @size: Size in bytes
  * 
+ * Blocks that only partly overlap the range are split first.
+ * 
  * Return: 0 on success, negative on error
  */
 int vmm_unmap_range(virt_addr_t vaddr, size_t size);
 
+/**
+ * vmm_alloc_huge - Allocate a contiguous buffer backed by block mappings
+ * @size: Size in bytes
+ * @phys: Output for the physical address (may be NULL)
+ * 
+ * The buffer is zeroed, physically contiguous and naturally aligned, so
+ * buffers of 2MB or more sit on whole 2MB/1GB blocks of the linear map.
+ * Suitable for DMA and for large, frequently scanned buffers. At most
+ * one PMM_MAX_ORDER block (8MB) can be allocated this way.
+ * 
+ * Return: Kernel virtual address, or NULL on failure
+ */
+void *vmm_alloc_huge(size_t size, phys_addr_t *phys);
+
+/**
+ * vmm_free_huge - Free a buffer from vmm_alloc_huge()
+ * @buf: Buffer address
+ * @size: Size passed to vmm_alloc_huge()
+ */
+void vmm_free_huge(void *buf, size_t size);
+
 /**
  * vmm_virt_to_phys - Translate virtual to physical address
  * @vaddr: Virtual address
@@ -191,6 +246,17 @@ int vmm_unmap_range(virt_addr_t vaddr, size_t size);
  */
 phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr);
 
+/**
+ * vmm_mm_virt_to_phys - Translate an address in a given address space
+ * @mm: Address space, or NULL for the kernel's
+ * @vaddr: Virtual address
+ * 
+ * Pages that are not faulted in yet count as unmapped.
+ * 
+ * Return: Physical address, or 0 if not mapped
+ */
+phys_addr_t vmm_mm_virt_to_phys(struct mm_struct *mm, virt_addr_t vaddr);
+
 /**
  * vmm_create_address_space - Create new address space for process
  * 
@@ -201,15 +267,158 @@ struct mm_struct *vmm_create_address_space(void);
 /**
  * vmm_destroy_address_space - Free an address space
  * @mm: Address space to destroy
+ * 
+ * Releases every VM area, the pages behind them and the user page tables.
+ * @mm must not be the active address space on any CPU.
  */
 void vmm_destroy_address_space(struct mm_struct *mm);
 
+/**
+ * vmm_fork_address_space - Duplicate an address space copy-on-write
+ * @parent: Address space to copy
+ * 
+ * VM areas and page table entries are copied, but no page contents:
+ * private pages are shared read-only with an extra reference and copied
+ * on the first write fault from either side.
+ * 
+ * Return: New address space, or NULL on failure
+ */
+struct mm_struct *vmm_fork_address_space(struct mm_struct *parent);
+
 /**
  * vmm_switch_address_space - Switch to a different address space
  * @mm: Address space to switch to
  */
 void vmm_switch_address_space(struct mm_struct *mm);
 
+/**
+ * vmm_map_user_page - Map a page into a user address space
+ * @mm: Target address space
+ * @vaddr: User virtual address
+ * @paddr: Physical page
+ * @flags: Protection flags (VM_*)
+ * 
+ * Return: 0 on success, negative on error
+ */
+int vmm_map_user_page(struct mm_struct *mm, virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags);
+
+/**
+ * vmm_map_user_range - Eagerly allocate and map a user range
+ * @mm: Target address space
+ * @vaddr: Start address
+ * @size: Size in bytes
+ * @flags: Protection flags (VM_*)
+ * 
+ * Return: 0 on success, negative on error
+ */
+int vmm_map_user_range(struct mm_struct *mm, virt_addr_t vaddr, size_t size, uint32_t flags);
+
+/**
+ * vmm_add_vma - Record a VM area in an address space
+ * @mm: Target address space
+ * @start: Start address (page aligned)
+ * @end: End address (exclusive, page aligned)
+ * @flags: Protection flags (VM_*)
+ * 
+ * The new area is merged with adjacent areas that have the same flags.
+ * 
+ * Return: 0 on success, negative on error or if the range overlaps
+ * an existing area
+ */
+int vmm_add_vma(struct mm_struct *mm, virt_addr_t start, virt_addr_t end, uint32_t flags);
+
+/**
+ * vmm_find_vma - Find the VM area containing an address
+ * @mm: Address space
+ * @addr: Address to look up
+ * 
+ * The caller holds mm->lock, and may only use the result until it drops it.
+ * 
+ * Return: VM area, or NULL if @addr is not mapped
+ */
+struct vm_area *vmm_find_vma(struct mm_struct *mm, virt_addr_t addr);
+
+/**
+ * vmm_mmap_anon - Reserve an anonymous mapping
+ * @mm: Address space
+ * @hint: Preferred address, or 0
+ * @len: Length in bytes
+ * @flags: Protection flags (VM_*)
+ * 
+ * Only the VM area is created; pages are allocated on first touch.
+ * 
+ * Return: Start address, or 0 on failure
+ */
+virt_addr_t vmm_mmap_anon(struct mm_struct *mm, virt_addr_t hint, size_t len, uint32_t flags);
+
+/**
+ * vmm_map_pages - Map existing pages into a free user range
+ * @mm: Address space
+ * @pages: Physical pages, in the order they appear in the range
+ * @nr_pages: Number of pages
+ * @flags: Protection flags (VM_READ/VM_WRITE/VM_EXEC)
+ * 
+ * The mapping is shared: every page takes a reference that munmap() or
+ * the end of the address space drops, and fork() shares the pages rather
+ * than copying them. Used to hand kernel memory to userspace.
+ * 
+ * Return: Start address, or 0 on failure
+ */
+virt_addr_t vmm_map_pages(struct mm_struct *mm, const phys_addr_t *pages, size_t nr_pages,
+                          uint32_t flags);
+
+/**
+ * vmm_brk - Move the program break
+ * @mm: Address space
+ * @new_brk: Requested break
+ * 
+ * Growing only extends the heap VM area; shrinking frees the pages.
+ * 
+ * Return: The resulting program break
+ */
+uint64_t vmm_brk(struct mm_struct *mm, uint64_t new_brk);
+
+/**
+ * vmm_munmap - Remove a range from an address space
+ * @mm: Address space
+ * @start: Start address (page aligned)
+ * @len: Length in bytes
+ * 
+ * VM areas straddling the range are split; pages inside it are freed and
+ * their TLB entries invalidated on all CPUs. Holes in the range are fine.
+ * 
+ * Return: 0 on success, negative on error
+ */
+int vmm_munmap(struct mm_struct *mm, virt_addr_t start, size_t len);
+
+/**
+ * vmm_mprotect - Change the protection of a range
+ * @mm: Address space
+ * @start: Start address (page aligned)
+ * @len: Length in bytes
+ * @flags: New VM_READ/VM_WRITE/VM_EXEC bits
+ * 
+ * Splits VM areas at the range edges, rewrites the present PTEs and merges
+ * the result with neighbours that now have the same flags.
+ * 
+ * Return: 0 on success, negative if the range is not fully mapped
+ */
+int vmm_mprotect(struct mm_struct *mm, virt_addr_t start, size_t len, uint32_t flags);
+
+/**
+ * vmm_handle_page_fault - Resolve a fault on a user address
+ * @mm: Faulting address space
+ * @addr: Faulting virtual address
+ * @fault: FAULT_* flags describing the access
+ * 
+ * Populates anonymous memory on first touch: read faults map the shared
+ * zero page, write faults allocate a zeroed private page. Write faults on
+ * pages shared copy-on-write get a private copy.
+ * 
+ * Return: 0 if the access can be retried, negative if it is invalid
+ */
+int vmm_handle_page_fault(struct mm_struct *mm, virt_addr_t addr, uint32_t fault);
+
 /**
  * vmm_flush_tlb - Flush TLB entries
  */
@@ -221,6 +430,15 @@ void vmm_flush_tlb(void);
  */
 void vmm_flush_tlb_page(virt_addr_t vaddr);
 
+/**
+ * vmm_flush_tlb_range - Flush TLB entries for a range on all CPUs
+ * @start: Start address
+ * @end: End address (exclusive)
+ * 
+ * Large ranges fall back to a full flush.
+ */
+void vmm_flush_tlb_range(virt_addr_t start, virt_addr_t end);
+
 /* ===================================================================== */
 /* Inline helpers */
 /* ===================================================================== */
@@ -5,6 +5,8 @@
 #ifndef _NET_NET_H
 #define _NET_NET_H
 
+#include "sync/spinlock.h"
+#include "sync/wait.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -178,6 +180,9 @@ struct socket {
     struct sockaddr_storage local_addr;
     struct sockaddr_storage remote_addr;
     void *sk;   /* Protocol-specific data */
+    spinlock_t lock;    /* Protects the fields above */
+    atomic_t refcount;  /* Socket table, files and calls in progress */
+    wait_queue_head_t wq; /* Woken when the socket may have become ready */
 };
 
 /* Socket states */
@@ -275,6 +280,18 @@ ssize_t socket_recv(int sockfd, void *buf, size_t len, int flags);
  */
 int socket_close(int sockfd);
 
+/**
+ * socket_file - Wrap a socket in a file
+ * @sockfd: Socket descriptor
+ *
+ * The file reads and writes like recv() and send() and can be watched
+ * with epoll. It keeps the socket alive, but socket_close() still shuts
+ * it down.
+ *
+ * Return: File with one reference, or NULL
+ */
+struct file *socket_file(int sockfd);
+
 /* Utility functions */
 uint16_t htons(uint16_t hostshort);
 uint16_t ntohs(uint16_t netshort);
@@ -300,6 +317,8 @@ struct net_interface {
     /* Driver Send Function */
     int (*send)(struct net_interface *iface, const void *data, size_t len);
     void *priv; /* Driver private data */
+    
+    struct net_interface *next; /* Next registered, RCU protected */
 };
 
 /**
@@ -67,6 +67,32 @@ void panic(const char *msg) __noreturn;
  */
 int early_printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
+/* ===================================================================== */
+/* String formatting */
+/* ===================================================================== */
+
+/**
+ * snprintf - Format a string into a buffer
+ * @buf: Output buffer
+ * @size: Size of @buf, including the terminating NUL
+ * @fmt: Format string (same conversions as printk)
+ * 
+ * Return: Number of characters written, excluding the NUL
+ */
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * vsnprintf - Format a string into a buffer with va_list
+ * @buf: Output buffer
+ * @size: Size of @buf
+ * @fmt: Format string
+ * @args: Variable argument list
+ * 
+ * Return: Number of characters written, excluding the NUL
+ */
+int vsnprintf(char *buf, size_t size, const char *fmt, __builtin_va_list args);
+
 /* ===================================================================== */
 /* Kernel assertion */
 /* ===================================================================== */
@@ -0,0 +1,86 @@
+/*
+ * Vib-OS Kernel - Red-Black Tree
+ *
+ * Intrusive balanced binary tree, modelled on the Linux rbtree API.
+ * Users embed a struct rb_node in their own structure, do the ordered
+ * descent themselves, then call rb_link_node() + rb_insert_color().
+ */
+
+#ifndef _KERNEL_RBTREE_H
+#define _KERNEL_RBTREE_H
+
+#include "types.h"
+
+#define RB_RED      0
+#define RB_BLACK    1
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define RB_ROOT             ((struct rb_root){ NULL })
+#define RB_EMPTY_ROOT(root) ((root)->node == NULL)
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+/**
+ * rb_link_node - Attach a new node at a leaf position found by descent
+ * @node: Node to insert
+ * @parent: Parent found during the descent (NULL for an empty tree)
+ * @link: Pointer to the parent's left/right slot (or root->node)
+ */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+/**
+ * rb_insert_color - Rebalance the tree after rb_link_node()
+ * @node: Newly linked node
+ * @root: Tree root
+ */
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+
+/**
+ * rb_erase - Remove a node from the tree
+ * @node: Node to remove
+ * @root: Tree root
+ */
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+/**
+ * rb_first - Leftmost (smallest) node, or NULL
+ * @root: Tree root
+ */
+struct rb_node *rb_first(const struct rb_root *root);
+
+/**
+ * rb_last - Rightmost (largest) node, or NULL
+ * @root: Tree root
+ */
+struct rb_node *rb_last(const struct rb_root *root);
+
+/**
+ * rb_next - In-order successor, or NULL
+ * @node: Current node
+ */
+struct rb_node *rb_next(const struct rb_node *node);
+
+/**
+ * rb_prev - In-order predecessor, or NULL
+ * @node: Current node
+ */
+struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif /* _KERNEL_RBTREE_H */
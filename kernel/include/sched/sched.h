@@ -6,6 +6,8 @@
 #define _SCHED_SCHED_H
 
 #include "mm/vmm.h"
+#include "rbtree.h"
+#include "sync/spinlock.h"
 #include "types.h"
 
 /* ===================================================================== */
@@ -32,6 +34,9 @@ typedef enum {
 #define NICE_MIN -20
 #define NICE_MAX 19
 
+/* Load weight of a nice 0 task; each nice step changes the CPU share ~10% */
+#define NICE_0_LOAD 1024
+
 /* ===================================================================== */
 /* CPU context for ARM64 */
 /* ===================================================================== */
@@ -90,6 +95,9 @@ struct task_struct {
   struct mm_struct *mm;        /* User address space */
   struct mm_struct *active_mm; /* Current address space */
 
+  /* Open file descriptors, possibly shared (CLONE_FILES) */
+  struct files_struct *files;
+
   /* Kernel stack */
   void *stack;
   size_t stack_size;
@@ -99,9 +107,19 @@ struct task_struct {
   struct list_head children;
   struct list_head sibling;
 
+  /* Fair scheduling */
+  struct rb_node run_node;   /* Run queue timeline node, keyed by vruntime */
+  int on_rq;                 /* Counted in its run queue's load */
+  unsigned int load_weight;  /* Derived from nice */
+  uint64_t vruntime;         /* Weighted run time, in timer ticks */
+  uint64_t exec_start;       /* Timer count when runtime was last charged */
+  uint64_t sum_exec_runtime; /* Total run time, in timer ticks */
+  uint64_t prev_sum_exec;    /* sum_exec_runtime when it was last picked */
+
   /* Scheduler links */
-  struct task_struct *next; /* Run queue next */
-  struct task_struct *prev; /* Run queue prev */
+  int cpu;                  /* Run queue the task belongs to */
+  volatile int on_cpu;      /* Context still live on a CPU, don't migrate */
+  uint64_t last_ran;        /* Timer count when it last left a CPU */
 
   /* Timing */
   uint64_t start_time;
@@ -141,22 +159,59 @@ struct task_struct {
 #define USER_STACK_TOP 0x7FFFFFFFF000ULL  /* Top of user stack */
 #define USER_STACK_SIZE (2 * 1024 * 1024) /* 2MB user stack */
 #define USER_CODE_BASE 0x400000ULL        /* User code start */
-#define USER_HEAP_BASE 0x10000000ULL      /* User heap start */
+#define USER_HEAP_BASE 0x2000000000ULL    /* User heap start (above RAM map) */
 #define USER_MMAP_BASE 0x7F0000000000ULL  /* mmap region */
 
 /* ===================================================================== */
 /* Per-CPU run queue */
 /* ===================================================================== */
 
+/* Load balancing counters of one run queue */
+struct sched_stats {
+  uint64_t balance_runs;   /* Periodic balancing passes */
+  uint64_t idle_balance;   /* Times the CPU ran dry and looked for work */
+  uint64_t steal_attempts; /* Passes that found an imbalance to fix */
+  uint64_t steal_success;  /* Attempts that moved at least one task */
+  uint64_t migrations;     /* Tasks pulled onto this CPU */
+  uint64_t hot_skipped;    /* Candidates left behind as cache-hot */
+  unsigned int nr_running; /* Snapshot of the queue length */
+};
+
 struct rq {
+  spinlock_t lock;             /* Protects the queue and nr_running */
+  int cpu;                     /* CPU this queue belongs to */
   struct task_struct *current; /* Currently running task */
   struct task_struct *idle;    /* Idle task */
-  struct task_struct *head;    /* Run queue head */
-  struct task_struct *tail;    /* Run queue tail */
-  unsigned int nr_running;     /* Number of runnable tasks */
+  struct rb_root timeline;     /* Waiting tasks, ordered by vruntime */
+  struct rb_node *leftmost;    /* Cached smallest vruntime, next to run */
+  uint64_t min_vruntime;       /* Monotonic floor of the queue's vruntimes */
+  unsigned long load;          /* Sum of the runnable tasks' weights */
+  volatile int need_resched;   /* Current should give up the CPU */
+  unsigned int nr_running;     /* Number of runnable tasks, incl. current */
   uint64_t clock;              /* Run queue clock */
+  struct task_struct *prev;    /* Task switched away from, until it is off CPU */
+  unsigned int nr_balance_failed; /* Balancing passes in a row that moved nothing */
+  struct sched_stats stats;
 };
 
+/* Ticks between periodic load balancing passes */
+#define SCHED_BALANCE_TICKS 10
+
+/* A task that ran this recently is cache-hot and costly to migrate */
+#define SCHED_MIGRATION_COST_US 500
+
+/* Failed balancing passes before cache-hot tasks may be stolen too */
+#define SCHED_CACHE_NICE_TRIES 2
+
+/* Period in which every runnable task runs once, while few are queued */
+#define SCHED_LATENCY_US 6000
+
+/* Shortest slice a task gets; stretches the period when many are queued */
+#define SCHED_MIN_GRANULARITY_US 750
+
+/* vruntime lead a woken task needs before it preempts the current one */
+#define SCHED_WAKEUP_GRANULARITY_US 1000
+
 /* ===================================================================== */
 /* Function declarations */
 /* ===================================================================== */
@@ -166,6 +221,60 @@ struct rq {
  */
 void sched_init(void);
 
+/**
+ * sched_init_cpu - Set up the run queue of a secondary CPU
+ * @cpu: CPU being brought online
+ *
+ * Must run on @cpu before it enables interrupts.
+ */
+void sched_init_cpu(int cpu);
+
+/**
+ * scheduler_tick - Per-CPU timer tick
+ *
+ * Advances the local run queue clock and runs periodic load balancing.
+ * Called from the timer interrupt on every CPU.
+ */
+void scheduler_tick(void);
+
+/**
+ * sched_get_stats - Get the load balancing counters of a CPU
+ * @cpu: CPU ID
+ * @stats: Output counters
+ *
+ * Return: 0 on success, -1 if @cpu is not online
+ */
+int sched_get_stats(int cpu, struct sched_stats *stats);
+
+/**
+ * need_resched - Check whether the current task should yield
+ *
+ * Set by the tick when the current task has used up its slice and by
+ * wakeups of tasks that are owed CPU time. Checked on return from system
+ * calls.
+ *
+ * Return: Non-zero if schedule() should be called
+ */
+int need_resched(void);
+
+/**
+ * sched_set_nice - Change the nice value of a task
+ * @pid: Task ID, or 0 for the current task
+ * @nice: New nice value, clamped to NICE_MIN..NICE_MAX
+ *
+ * Return: 0 on success, -3 (ESRCH) if there is no such task
+ */
+int sched_set_nice(pid_t pid, int nice);
+
+/**
+ * sched_get_nice - Get the nice value of a task
+ * @pid: Task ID, or 0 for the current task
+ * @nice: Output nice value
+ *
+ * Return: 0 on success, -3 (ESRCH) if there is no such task
+ */
+int sched_get_nice(pid_t pid, int *nice);
+
 /**
  * schedule - Invoke the scheduler
  *
@@ -0,0 +1,97 @@
+/*
+ * vib-OS Kernel - Read-Copy-Update
+ *
+ * For read-mostly data reached through pointers. Readers take no lock and
+ * write no shared memory:
+ *
+ *   rcu_read_lock();
+ *   p = rcu_dereference(list);
+ *   ... use p ...
+ *   rcu_read_unlock();
+ *
+ * Writers serialize among themselves with an ordinary lock, publish new
+ * objects with rcu_assign_pointer() and unlink old ones, then free them
+ * with call_rcu() or after synchronize_rcu(), once every reader that
+ * could still see them has finished.
+ *
+ * A read section disables preemption and must not sleep. A CPU that is
+ * preemptible on a tick, switches context or goes idle can therefore
+ * hold no references, which is all a grace period waits for.
+ */
+
+#ifndef _SYNC_RCU_H
+#define _SYNC_RCU_H
+
+#include "../types.h"
+#include "spinlock.h"
+
+/* Embedded in an object to free it after a grace period */
+struct rcu_head {
+  struct rcu_head *next;
+  void (*func)(struct rcu_head *head);
+  uint64_t gp; /* Grace period number to wait for */
+};
+
+/**
+ * rcu_read_lock - Start a read section
+ *
+ * Nests. Objects reached through rcu_dereference() stay valid until the
+ * matching rcu_read_unlock().
+ */
+static inline void rcu_read_lock(void) { preempt_disable(); }
+
+/**
+ * rcu_read_unlock - End a read section
+ */
+static inline void rcu_read_unlock(void) { preempt_enable(); }
+
+/* Load an RCU-protected pointer inside a read section */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/* Publish a pointer: the object's contents are visible before it is */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/**
+ * call_rcu - Run a function once current readers are done
+ * @head: Head embedded in the object
+ * @func: Called with @head after a grace period, with interrupts disabled
+ *
+ * Never sleeps, so it can be used from interrupt context. @func must not
+ * sleep either; freeing the object and waking a waiter are fine.
+ */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+/**
+ * synchronize_rcu - Wait for a grace period
+ *
+ * Sleeps until every read section that had started when it was called has
+ * finished. Not for interrupt context or inside a read section.
+ */
+void synchronize_rcu(void);
+
+/**
+ * rcu_note_context_switch - Report a voluntary context switch
+ *
+ * Called by the scheduler; a quiescent state if no lock is held.
+ */
+void rcu_note_context_switch(void);
+
+/**
+ * rcu_tick - Report a timer tick that found this CPU preemptible
+ */
+void rcu_tick(void);
+
+/**
+ * rcu_idle_enter - This CPU sleeps until an interrupt, with them masked
+ *
+ * Grace periods stop waiting for it until rcu_idle_exit(), which must come
+ * before interrupts are unmasked again.
+ */
+void rcu_idle_enter(void);
+
+/**
+ * rcu_idle_exit - This CPU is back from rcu_idle_enter()
+ */
+void rcu_idle_exit(void);
+
+#endif /* _SYNC_RCU_H */
@@ -0,0 +1,92 @@
+/*
+ * vib-OS Kernel - Sequence Locks
+ *
+ * For small, read-mostly data that readers copy out. Writers serialize on
+ * a spinlock and bump a sequence count before and after each update;
+ * readers take no lock at all and retry if the count was odd (update in
+ * progress) or changed while they read:
+ *
+ *   do {
+ *     seq = read_seqbegin(&sl);
+ *     copy = shared;
+ *   } while (read_seqretry(&sl, seq));
+ *
+ * Readers never write shared memory, so they don't bounce cache lines
+ * between CPUs. They must not follow pointers that a writer may free.
+ */
+
+#ifndef _SYNC_SEQLOCK_H
+#define _SYNC_SEQLOCK_H
+
+#include "../types.h"
+#include "spinlock.h"
+
+typedef struct {
+  volatile uint32_t sequence; /* Odd while a writer is updating */
+  spinlock_t lock;            /* Serializes writers */
+} seqlock_t;
+
+#define __SEQLOCK_INIT(cname) {.sequence = 0, .lock = __SPINLOCK_INIT(cname)}
+#define DEFINE_SEQLOCK(name) seqlock_t name = __SEQLOCK_INIT(#name)
+
+#define seqlock_init(sl)                                                       \
+  do {                                                                         \
+    (sl)->sequence = 0;                                                        \
+    spin_lock_init(&(sl)->lock);                                               \
+  } while (0)
+
+/**
+ * read_seqbegin - Start a lockless read section
+ * @sl: Sequence lock
+ *
+ * Return: Sequence count to pass to read_seqretry()
+ */
+static inline uint32_t read_seqbegin(const seqlock_t *sl) {
+  uint32_t seq;
+
+  while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1) {
+#ifdef ARCH_ARM64
+    asm volatile("yield" ::: "memory");
+#elif defined(ARCH_X86_64) || defined(ARCH_X86)
+    asm volatile("pause" ::: "memory");
+#endif
+  }
+  return seq;
+}
+
+/**
+ * read_seqretry - End a lockless read section
+ * @sl: Sequence lock
+ * @start: Value from read_seqbegin()
+ *
+ * Return: Nonzero if a writer got in and the read must be repeated
+ */
+static inline int read_seqretry(const seqlock_t *sl, uint32_t start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return sl->sequence != start;
+}
+
+/**
+ * write_seqlock - Start an update, excluding other writers
+ * @sl: Sequence lock
+ *
+ * Interrupts are left alone, so a lock written from interrupt context
+ * needs its writers to run with interrupts disabled.
+ */
+static inline void write_seqlock(seqlock_t *sl) {
+  spin_lock(&sl->lock);
+  sl->sequence++;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * write_sequnlock - Finish an update
+ * @sl: Sequence lock
+ */
+static inline void write_sequnlock(seqlock_t *sl) {
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  sl->sequence++;
+  spin_unlock(&sl->lock);
+}
+
+#endif /* _SYNC_SEQLOCK_H */
@@ -3,6 +3,19 @@
  *
  * Provides mutual exclusion primitives for protecting critical sections.
  * IRQ-safe variants disable interrupts to prevent deadlocks.
+ *
+ * Locks are queued (MCS): a contended waiter appends a per-CPU node to
+ * the lock's queue and spins on that node only, so a release touches just
+ * the next waiter's cache line and the lock is handed out in arrival
+ * order. The lock itself stays a single 32-bit word.
+ *
+ * Holding or waiting for a lock disables timer preemption on the CPU, so
+ * nobody ends up spinning behind a holder or queued waiter that is not
+ * running.
+ *
+ * Built with CONFIG_LOCKSTAT (make LOCKSTAT=1), every lock also records
+ * acquisitions, contentions and the longest hold time for its class: the
+ * place it was defined or initialized.
  */
 
 #ifndef _SYNC_SPINLOCK_H
@@ -10,21 +23,55 @@
 
 #include "../types.h"
 
+struct lock_class;
+
 /* Spinlock structure */
 typedef struct spinlock {
-  volatile uint32_t lock;
+  volatile uint32_t lock; /* Locked byte, queue tail above it */
+#ifdef CONFIG_LOCKSTAT
+  struct lock_class *class; /* NULL: counted as unnamed */
+  uint64_t acquired_at;     /* Counter value when last taken */
+#endif
 #ifdef DEBUG_SPINLOCK
   const char *name;
   int held_by_cpu;
 #endif
 } spinlock_t;
 
-/* Static initializer */
-#define SPINLOCK_INIT {.lock = 0}
-#define DEFINE_SPINLOCK(name) spinlock_t name = SPINLOCK_INIT
+#ifdef CONFIG_LOCKSTAT
+/* Statistics shared by every lock defined or initialized at one place */
+struct lock_class {
+  const char *name;
+  volatile uint64_t acquisitions;
+  volatile uint64_t contentions; /* Acquisitions that had to queue */
+  volatile uint64_t hold_max;    /* Longest hold, in counter ticks */
+  volatile int registered;       /* On the list lockstat_get_class() walks */
+  struct lock_class *next;
+};
+
+/* A file-scope compound literal is static, so each definition gets one */
+#define __SPINLOCK_INIT(cname)                                                 \
+  {.lock = 0, .class = &(struct lock_class){.name = (cname)}}
+
+#define spin_lock_init(l)                                                      \
+  do {                                                                         \
+    static struct lock_class __class = {.name = #l};                           \
+    __spin_lock_init((l), &__class);                                           \
+  } while (0)
+#else
+#define __SPINLOCK_INIT(cname) {.lock = 0}
+#define spin_lock_init(l) __spin_lock_init((l), NULL)
+#endif
+
+#define __SPINLOCK_STR(x) #x
+#define __SPINLOCK_XSTR(x) __SPINLOCK_STR(x)
+
+/* Static initializers */
+#define SPINLOCK_INIT __SPINLOCK_INIT(__FILE__ ":" __SPINLOCK_XSTR(__LINE__))
+#define DEFINE_SPINLOCK(name) spinlock_t name = __SPINLOCK_INIT(#name)
 
 /* Spinlock API */
-void spin_lock_init(spinlock_t *lock);
+void __spin_lock_init(spinlock_t *lock, struct lock_class *class);
 void spin_lock(spinlock_t *lock);
 void spin_unlock(spinlock_t *lock);
 int spin_trylock(spinlock_t *lock);
@@ -33,6 +80,44 @@ int spin_trylock(spinlock_t *lock);
 uint64_t spin_lock_irqsave(spinlock_t *lock);
 void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags);
 
+/**
+ * preempt_disable - Keep the timer from switching this CPU to another process
+ *
+ * Nests. spin_lock() and spin_unlock() do this themselves.
+ */
+void preempt_disable(void);
+
+/**
+ * preempt_enable - Undo one preempt_disable()
+ */
+void preempt_enable(void);
+
+/**
+ * preemptible - Whether the timer may switch this CPU to another process
+ *
+ * Return: 1 if no spinlock is held or awaited on this CPU, 0 otherwise
+ */
+int preemptible(void);
+
+/* One lock class's statistics, as returned by lockstat_get_class() */
+struct lockstat_info {
+  const char *name;
+  uint64_t acquisitions;
+  uint64_t contentions;
+  uint64_t hold_max_ns;
+};
+
+/**
+ * lockstat_get_class - Read the statistics of one lock class
+ * @idx: Class index, from 0
+ * @info: Filled in on success
+ *
+ * Classes appear once one of their locks has been taken.
+ *
+ * Return: 0 on success, -1 past the last class or without CONFIG_LOCKSTAT
+ */
+int lockstat_get_class(unsigned int idx, struct lockstat_info *info);
+
 /* Architecture-specific interrupt control */
 static inline uint64_t arch_irq_save_local(void) {
   uint64_t flags;
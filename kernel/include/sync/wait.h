@@ -0,0 +1,185 @@
+/*
+ * vib-OS Kernel - Wait Queues
+ *
+ * Lets a caller sleep until a condition becomes true instead of polling.
+ * Sleepers leave the run queue entirely and are made runnable again by
+ * wake_up() on the queue they wait on.
+ *
+ * A sleeper is whatever is running on the CPU: a process from
+ * core/process.c, a task from the scheduler, or the kernel context itself,
+ * which runs other processes or idles in the meantime.
+ *
+ * An entry can also carry a function instead of a sleeper. It stays on the
+ * queue across wakeups and the function is called for each one, which is
+ * how epoll hears about many files without sleeping on all of them.
+ *
+ * Lock order: a queue's lock is taken before the process table and run
+ * queue locks, so wake_up() must not be called with those held.
+ */
+
+#ifndef _SYNC_WAIT_H
+#define _SYNC_WAIT_H
+
+#include "../types.h"
+#include "spinlock.h"
+
+/* Kind of sleeper a wait queue entry belongs to */
+#define WAITER_KERNEL 0  /* Kernel context, no process or task */
+#define WAITER_PROCESS 1 /* struct process */
+#define WAITER_TASK 2    /* struct task_struct */
+#define WAITER_CALLBACK 3 /* Function called on wakeup, stays queued */
+
+struct wait_queue_head;
+struct wait_queue_entry;
+
+/* Called by wake_up() with the queue lock held and interrupts disabled */
+typedef void (*wait_queue_func_t)(struct wait_queue_entry *entry);
+
+struct wait_queue_entry {
+  struct wait_queue_head *wq; /* Queue it waits on */
+  int kind;
+  void *waiter;
+  uint32_t cpu; /* CPU a kernel-context sleeper idles on */
+  wait_queue_func_t func; /* WAITER_CALLBACK only */
+  volatile int queued;
+  struct wait_queue_entry *next;
+  struct wait_queue_entry *prev;
+};
+
+typedef struct wait_queue_head {
+  spinlock_t lock;
+  struct wait_queue_entry *head;
+  struct wait_queue_entry *tail;
+} wait_queue_head_t;
+
+#define WAIT_QUEUE_HEAD_INIT {.lock = SPINLOCK_INIT, .head = NULL, .tail = NULL}
+#define DECLARE_WAIT_QUEUE_HEAD(name) wait_queue_head_t name = WAIT_QUEUE_HEAD_INIT
+
+/**
+ * init_waitqueue_head - Initialize a wait queue at runtime
+ * @wq: Wait queue
+ */
+void init_waitqueue_head(wait_queue_head_t *wq);
+
+/**
+ * init_waitqueue_func_entry - Set up an entry that calls a function
+ * @entry: Entry, usually embedded in the object @func works on
+ * @func: Called on every wakeup of the queue the entry is added to; must
+ *        not sleep or touch the queue
+ */
+void init_waitqueue_func_entry(struct wait_queue_entry *entry,
+                               wait_queue_func_t func);
+
+/**
+ * add_wait_queue - Add a function entry to a wait queue
+ * @wq: Wait queue
+ * @entry: Entry from init_waitqueue_func_entry()
+ */
+void add_wait_queue(wait_queue_head_t *wq, struct wait_queue_entry *entry);
+
+/**
+ * remove_wait_queue - Take a function entry off its wait queue
+ * @wq: Wait queue
+ * @entry: Entry passed to add_wait_queue()
+ *
+ * Once this returns the function is not running and won't be called again.
+ */
+void remove_wait_queue(wait_queue_head_t *wq, struct wait_queue_entry *entry);
+
+/**
+ * prepare_to_wait - Queue the caller and mark it as sleeping
+ * @wq: Wait queue
+ * @entry: Caller's entry, usually on its stack
+ *
+ * The condition must be checked after this and before wait_sleep(), so a
+ * wakeup in between is not lost.
+ */
+void prepare_to_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry);
+
+/**
+ * wait_sleep - Give up the CPU until woken
+ * @entry: Entry passed to prepare_to_wait()
+ *
+ * Returns at once if the caller was already woken.
+ */
+void wait_sleep(struct wait_queue_entry *entry);
+
+/**
+ * wait_sleep_killable - Like wait_sleep(), but returns if the process dies
+ * @entry: Entry passed to prepare_to_wait()
+ *
+ * wait_sleep() makes a killed process exit on the spot. This variant
+ * returns instead, so the caller can release what it set up for the wait.
+ *
+ * Return: 0, or -4 (EINTR) if the sleeping process was killed
+ */
+int wait_sleep_killable(struct wait_queue_entry *entry);
+
+/**
+ * finish_wait - Dequeue the caller and mark it running again
+ * @wq: Wait queue
+ * @entry: Entry passed to prepare_to_wait()
+ */
+void finish_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry);
+
+/**
+ * wake_up - Wake every sleeper on a wait queue
+ * @wq: Wait queue
+ *
+ * Woken sleepers recheck their condition and may go back to sleep.
+ */
+void wake_up(wait_queue_head_t *wq);
+
+/**
+ * waitqueue_active - Check for sleepers without taking the queue lock
+ * @wq: Wait queue
+ *
+ * Only a hint: a sleeper being added at the same time may be missed.
+ */
+static inline int waitqueue_active(wait_queue_head_t *wq) {
+  return __atomic_load_n(&wq->head, __ATOMIC_RELAXED) != NULL;
+}
+
+/**
+ * wait_event - Sleep until a condition is true
+ * @wq: Wait queue that is woken when @condition may have changed
+ * @condition: Expression re-evaluated after every wakeup
+ */
+#define wait_event(wq, condition)                                              \
+  do {                                                                         \
+    struct wait_queue_entry __wait;                                            \
+    __wait.queued = 0;                                                         \
+    for (;;) {                                                                 \
+      prepare_to_wait(&(wq), &__wait);                                         \
+      if (condition)                                                           \
+        break;                                                                 \
+      wait_sleep(&__wait);                                                     \
+    }                                                                          \
+    finish_wait(&(wq), &__wait);                                               \
+  } while (0)
+
+/**
+ * wait_event_killable - Sleep until a condition is true or the process dies
+ * @wq: Wait queue that is woken when @condition may have changed
+ * @condition: Expression re-evaluated after every wakeup
+ *
+ * Return: 0 once @condition is true, -4 (EINTR) if the process was killed
+ */
+#define wait_event_killable(wq, condition)                                     \
+  ({                                                                           \
+    struct wait_queue_entry __wait;                                            \
+    int __ret = 0;                                                             \
+    __wait.queued = 0;                                                         \
+    for (;;) {                                                                 \
+      prepare_to_wait(&(wq), &__wait);                                         \
+      if (condition)                                                           \
+        break;                                                                 \
+      __ret = wait_sleep_killable(&__wait);                                    \
+      if (__ret)                                                               \
+        break;                                                                 \
+    }                                                                          \
+    finish_wait(&(wq), &__wait);                                               \
+    __ret;                                                                     \
+  })
+
+#endif /* _SYNC_WAIT_H */
@@ -287,6 +287,8 @@
 #define SYS_pkey_alloc          289
 #define SYS_pkey_free           290
 #define SYS_statx               291
+#define SYS_io_uring_setup      425
+#define SYS_io_uring_enter      426
 
 #define NR_syscalls             512
 
@@ -318,6 +320,40 @@ void syscall_init(void);
  */
 long handle_syscall(struct pt_regs *regs);
 
+/**
+ * is_valid_user_ptr - Check a buffer passed in from userspace
+ * @ptr: User address
+ * @len: Buffer size
+ * 
+ * Return: 1 if the range may be accessed on the task's behalf, 0 if not
+ */
+int is_valid_user_ptr(uint64_t ptr, size_t len);
+
+/* Latency histogram: bucket i counts calls under SYSCALL_HIST_BASE_NS << i,
+ * the last bucket everything slower */
+#define SYSCALL_HIST_BUCKETS    16
+#define SYSCALL_HIST_BASE_NS    256ULL
+
+/* One system call's statistics, as returned by syscall_get_stats() */
+struct syscall_stat_info {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[SYSCALL_HIST_BUCKETS];
+};
+
+/**
+ * syscall_get_stats - Read the statistics of one system call
+ * @nr: System call number
+ * @info: Filled in on success
+ * 
+ * Latency runs from dispatch to return, so it includes any time the
+ * call spent blocked.
+ * 
+ * Return: 0 on success, -1 for a bad @nr or without CONFIG_SYSCALL_STATS
+ */
+int syscall_get_stats(unsigned int nr, struct syscall_stat_info *info);
+
 /**
  * handle_sync_exception - Handle synchronous exception
  * @regs: Pointer to saved registers
@@ -0,0 +1,146 @@
+/*
+ * vib-OS Kernel - High-Resolution Timers
+ *
+ * One-shot timers with nanosecond expiry times. Each CPU keeps its pending
+ * timers in a red-black tree ordered by expiry and programs the hardware
+ * timer for the earliest one only, so there are no interrupts between
+ * deadlines. Callbacks run in interrupt context on the CPU the timer was
+ * started on.
+ */
+
+#ifndef _TIME_HRTIMER_H
+#define _TIME_HRTIMER_H
+
+#include "rbtree.h"
+#include "sync/wait.h"
+#include "types.h"
+
+/* Nanoseconds since boot */
+typedef uint64_t ktime_t;
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+enum hrtimer_restart {
+  HRTIMER_NORESTART, /* Timer is done */
+  HRTIMER_RESTART,   /* Requeue at the (forwarded) expiry time */
+};
+
+enum hrtimer_mode {
+  HRTIMER_MODE_ABS, /* Expiry is a ktime_get() value */
+  HRTIMER_MODE_REL, /* Expiry is relative to now */
+};
+
+/* hrtimer state bits */
+#define HRTIMER_STATE_INACTIVE 0
+#define HRTIMER_STATE_ENQUEUED (1 << 0)
+#define HRTIMER_STATE_CALLBACK (1 << 1)
+
+struct hrtimer {
+  struct rb_node node;
+  ktime_t expires;
+  enum hrtimer_restart (*function)(struct hrtimer *timer);
+  int cpu;            /* CPU whose queue it is on */
+  volatile int state; /* HRTIMER_STATE_* */
+};
+
+/* A timer that wakes a wait queue when it expires */
+struct hrtimer_sleeper {
+  struct hrtimer timer;
+  wait_queue_head_t *wq;
+  volatile int expired;
+};
+
+/**
+ * ktime_get - Monotonic time since boot
+ *
+ * Return: Nanoseconds, at the resolution of the architecture counter
+ */
+ktime_t ktime_get(void);
+
+/**
+ * hrtimer_init - Prepare a timer for use
+ * @timer: Timer
+ * @function: Callback, run in interrupt context when the timer expires
+ */
+void hrtimer_init(struct hrtimer *timer,
+                  enum hrtimer_restart (*function)(struct hrtimer *));
+
+/**
+ * hrtimer_start - (Re)start a timer on the calling CPU
+ * @timer: Timer
+ * @time: Expiry time
+ * @mode: Whether @time is absolute or relative to now
+ *
+ * A timer that is already queued is moved to the new expiry time.
+ */
+void hrtimer_start(struct hrtimer *timer, ktime_t time, enum hrtimer_mode mode);
+
+/**
+ * hrtimer_cancel - Stop a timer and wait for its callback to finish
+ * @timer: Timer
+ *
+ * Must not be called from the timer's own callback.
+ *
+ * Return: 1 if the timer was queued, 0 otherwise
+ */
+int hrtimer_cancel(struct hrtimer *timer);
+
+/**
+ * hrtimer_forward_now - Move a periodic timer's expiry past the current time
+ * @timer: Timer, usually from within its callback
+ * @interval: Period
+ *
+ * Return: Number of periods skipped
+ */
+uint64_t hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
+
+/**
+ * hrtimer_interrupt - Run expired timers and program the next event
+ *
+ * Called from the architecture timer interrupt.
+ */
+void hrtimer_interrupt(void);
+
+/**
+ * hrtimer_sleeper_start - Arm a timer that wakes @wq after @timeout ns
+ * @sl: Sleeper, usually on the caller's stack
+ * @wq: Wait queue to wake
+ * @timeout: Relative timeout in nanoseconds
+ *
+ * The caller must hrtimer_cancel(&sl->timer) before @sl goes away.
+ */
+void hrtimer_sleeper_start(struct hrtimer_sleeper *sl, wait_queue_head_t *wq,
+                           ktime_t timeout);
+
+/**
+ * hrtimer_sleep - Sleep for a number of nanoseconds
+ * @ns: Duration
+ *
+ * Return: 0, or -4 (EINTR) if the sleeping process was killed
+ */
+int hrtimer_sleep(ktime_t ns);
+
+/**
+ * wait_event_timeout - Sleep until a condition is true or a timeout passes
+ * @wq: Wait queue that is woken when @condition may have changed
+ * @condition: Expression re-evaluated after every wakeup
+ * @timeout: Relative timeout in nanoseconds
+ *
+ * Return: 1 if @condition became true, 0 on timeout, -4 (EINTR) if the
+ * sleeping process was killed
+ */
+#define wait_event_timeout(wq, condition, timeout)                            \
+  ({                                                                           \
+    struct hrtimer_sleeper __sl;                                               \
+    int __ret;                                                                 \
+    hrtimer_sleeper_start(&__sl, &(wq), (timeout));                            \
+    __ret = wait_event_killable(wq, (condition) || __sl.expired);              \
+    hrtimer_cancel(&__sl.timer);                                               \
+    if (__ret == 0)                                                            \
+      __ret = (condition) ? 1 : 0;                                             \
+    __ret;                                                                     \
+  })
+
+#endif /* _TIME_HRTIMER_H */
@@ -0,0 +1,37 @@
+/*
+ * vib-OS Kernel - Scheduler Tick
+ *
+ * The periodic tick is an hrtimer per CPU. It drives preemption and
+ * scheduler bookkeeping while a CPU has work, and is stopped while the CPU
+ * idles so that only real timer deadlines wake it.
+ */
+
+#ifndef _TIME_TICK_H
+#define _TIME_TICK_H
+
+#include "time/hrtimer.h"
+
+/* Tick rate (100Hz = 10ms period) */
+#define HZ 100
+#define TICK_NSEC (NSEC_PER_SEC / HZ)
+
+/**
+ * tick_cpu_init - Start the tick on the calling CPU
+ */
+void tick_cpu_init(void);
+
+/**
+ * tick_nohz_idle_enter - Stop the tick before the CPU idles
+ *
+ * Call with interrupts disabled.
+ */
+void tick_nohz_idle_enter(void);
+
+/**
+ * tick_nohz_idle_exit - Restart the tick once the CPU has work again
+ *
+ * Safe from interrupt context, and a no-op while the tick is running.
+ */
+void tick_nohz_idle_exit(void);
+
+#endif /* _TIME_TICK_H */
@@ -0,0 +1,126 @@
+/*
+ * vib-OS Kernel - vDSO Time Data
+ *
+ * One page, mapped read-only into every process at VDSO_DATA_ADDR, holding
+ * what it takes to turn a counter read into a time: the counter frequency,
+ * a mult/shift pair that replaces the 64-bit divide, and the wall-clock
+ * time at which the counter read zero. clock_gettime() then runs entirely
+ * in userspace. The kernel bumps the sequence count before and after each
+ * update, so readers copy the fields out the way seqlock readers do:
+ *
+ *   do {
+ *     while ((seq = vd->seq) & 1)
+ *       ;
+ *     mult = vd->mult; ...
+ *   } while (vd->seq != seq);
+ *
+ * A clock_mode of VDSO_CLOCKMODE_NONE means the counter can't be read from
+ * userspace on this architecture, and the syscall must be used instead.
+ */
+
+#ifndef _TIME_VDSO_H
+#define _TIME_VDSO_H
+
+#include "time/hrtimer.h"
+#include "types.h"
+
+struct mm_struct;
+
+/* Fixed user address of the data page, just above the initial stack */
+#define VDSO_DATA_ADDR 0x00007FFFFFFFE000UL
+
+/* vdso_data.clock_mode */
+#define VDSO_CLOCKMODE_NONE 0   /* Use the clock_gettime() syscall */
+#define VDSO_CLOCKMODE_CNTVCT 1 /* Read cntvct_el0 */
+
+/* Clock IDs, Linux numbering */
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define CLOCK_MONOTONIC_RAW 4
+#define CLOCK_BOOTTIME 7
+
+/* The userspace copy of this layout is in libc/src/syscall.c */
+struct vdso_data {
+  volatile uint32_t seq; /* Odd while the kernel updates the page */
+  uint32_t clock_mode;   /* VDSO_CLOCKMODE_* */
+  uint64_t freq;         /* Counter frequency, Hz */
+  uint64_t mult;         /* ns = (counter * mult) >> shift, in 128 bits */
+  uint32_t shift;
+  uint32_t __pad;
+  int64_t realtime_offset; /* CLOCK_REALTIME minus CLOCK_MONOTONIC, ns */
+};
+
+/**
+ * vdso_cycles_to_ns - Convert a counter value to nanoseconds
+ * @vd: Data page
+ * @cycles: Counter value
+ *
+ * The product is kept in 128 bits, so there is no range to run out of.
+ * Targets without a 128-bit type build it from 32-bit halves.
+ */
+static inline uint64_t vdso_cycles_to_ns(const struct vdso_data *vd,
+                                         uint64_t cycles) {
+#ifdef __SIZEOF_INT128__
+  return (uint64_t)(((unsigned __int128)cycles * vd->mult) >> vd->shift);
+#else
+  uint64_t a_lo = (uint32_t)cycles, a_hi = cycles >> 32;
+  uint64_t b_lo = (uint32_t)vd->mult, b_hi = vd->mult >> 32;
+  uint64_t lo = a_lo * b_lo;
+  uint64_t m1 = a_hi * b_lo;
+  uint64_t m2 = a_lo * b_hi;
+  uint64_t mid = (lo >> 32) + (uint32_t)m1 + (uint32_t)m2;
+  uint64_t hi = a_hi * b_hi + (m1 >> 32) + (m2 >> 32) + (mid >> 32);
+
+  lo = (mid << 32) | (uint32_t)lo;
+  if (vd->shift == 0) {
+    return lo;
+  }
+  if (vd->shift >= 64) {
+    return hi >> (vd->shift - 64);
+  }
+  return (lo >> vd->shift) | (hi << (64 - vd->shift));
+#endif
+}
+
+/**
+ * vdso_init - Allocate and fill in the data page
+ *
+ * Called once the timer and the page allocator are up.
+ *
+ * Return: 0, or -1 if there is no page for it
+ */
+int vdso_init(void);
+
+/**
+ * vdso_map - Map the data page into an address space
+ * @mm: Address space
+ *
+ * Does nothing if the page is already there, as it is after fork().
+ *
+ * Return: 0, or -1 if the page could not be mapped
+ */
+int vdso_map(struct mm_struct *mm);
+
+/**
+ * vdso_clock_ns - CLOCK_MONOTONIC in nanoseconds
+ *
+ * Same clock as userspace computes from the data page, without a divide.
+ */
+uint64_t vdso_clock_ns(void);
+
+/**
+ * vdso_clock_gettime - Read a clock
+ * @clock: CLOCK_* ID
+ * @ns: Set to the clock's value in nanoseconds
+ *
+ * Return: 0, or -EINVAL for an unknown clock
+ */
+int vdso_clock_gettime(int clock, int64_t *ns);
+
+/**
+ * vdso_set_realtime - Set CLOCK_REALTIME
+ * @ns: Nanoseconds since the epoch
+ */
+void vdso_set_realtime(int64_t ns);
+
+#endif /* _TIME_VDSO_H */
@@ -0,0 +1,309 @@
+/*
+ * vib-OS Kernel - Fast Userspace Mutexes
+ *
+ * Waiters hang off a fixed hash table indexed by a key for the futex word:
+ * the address space and virtual address for a private futex, the physical
+ * address otherwise. Each waiter sleeps on a wait queue of its own, so a wake
+ * picks exactly the waiters it wants, oldest first, and a requeue just
+ * relinks them onto another bucket.
+ *
+ * Lock order: a bucket lock is taken before wait queue locks; requeue
+ * takes two bucket locks in address order.
+ */
+
+#include "ipc/futex.h"
+#include "fs/vfs.h"
+#include "mm/vmm.h"
+#include "sched/sched.h"
+#include "sync/spinlock.h"
+#include "sync/wait.h"
+#include "time/hrtimer.h"
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+struct futex_hash_bucket;
+
+/*
+ * Names a futex word. Private futexes use (mm, uaddr), which stays put
+ * when a write fault moves the word to a new page (zero page or COW after
+ * fork); shared ones have a NULL mm and the physical address.
+ */
+struct futex_key {
+  struct mm_struct *mm;
+  uint64_t word;
+};
+
+/* One sleeping thread, on its stack for the duration of futex_wait() */
+struct futex_q {
+  struct futex_key key;                      /* Word it waits on */
+  struct futex_hash_bucket *volatile bucket; /* Changed by requeue */
+  int queued;                                /* On the bucket's list */
+  volatile int woken;
+  wait_queue_head_t wq;
+  struct futex_q *next;
+  struct futex_q *prev;
+};
+
+struct futex_hash_bucket {
+  spinlock_t lock;
+  struct futex_q *head;
+  struct futex_q *tail;
+};
+
+static struct futex_hash_bucket futex_queues[FUTEX_HASH_SIZE];
+
+/* ===================================================================== */
+/* Keys and buckets */
+/* ===================================================================== */
+
+/*
+ * Make the page holding the word writable and private to this address
+ * space before keying on it or reading it: a word still on the zero page
+ * or shared COW would otherwise move on the waker's first write.
+ */
+static void futex_fault_in(struct mm_struct *mm, uint64_t uaddr) {
+  if (mm) {
+    /* Fails for memory outside any VMA, which is mapped up front anyway */
+    vmm_handle_page_fault(mm, uaddr, FAULT_WRITE | FAULT_USER);
+  }
+}
+
+static int get_futex_key(uint64_t uaddr, int flags, struct futex_key *key) {
+  if (uaddr & 3) {
+    return -EINVAL;
+  }
+
+  struct task_struct *task = get_current();
+  struct mm_struct *mm = task ? task->mm : NULL;
+  futex_fault_in(mm, uaddr);
+
+  phys_addr_t phys = vmm_mm_virt_to_phys(mm, uaddr);
+  if (!phys) {
+    return -EFAULT;
+  }
+
+  /* Tasks without an mm all share the kernel's, so private keys need one */
+  if ((flags & FUTEX_PRIVATE_FLAG) && mm) {
+    key->mm = mm;
+    key->word = uaddr;
+  } else {
+    key->mm = NULL;
+    key->word = phys;
+  }
+  return 0;
+}
+
+static inline int futex_key_equal(const struct futex_key *a,
+                                  const struct futex_key *b) {
+  return a->mm == b->mm && a->word == b->word;
+}
+
+static struct futex_hash_bucket *hash_futex(const struct futex_key *key) {
+  uint64_t h = (key->word >> 2) ^ (uint64_t)(uintptr_t)key->mm;
+  return &futex_queues[(h * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS)];
+}
+
+/*
+ * Read the word through the page it is on now, which a write fault since
+ * get_futex_key() may have changed. Called with the bucket lock held, so
+ * a waker that wrote the word after this read still finds the waiter.
+ */
+static int futex_value(uint64_t uaddr, uint32_t *val) {
+  struct task_struct *task = get_current();
+  phys_addr_t phys = vmm_mm_virt_to_phys(task ? task->mm : NULL, uaddr);
+  if (!phys) {
+    return -EFAULT;
+  }
+  *val = *(volatile uint32_t *)phys;
+  return 0;
+}
+
+/* hb->lock held */
+static void futex_enqueue(struct futex_hash_bucket *hb, struct futex_q *q) {
+  q->next = NULL;
+  q->prev = hb->tail;
+  if (hb->tail) {
+    hb->tail->next = q;
+  } else {
+    hb->head = q;
+  }
+  hb->tail = q;
+  q->bucket = hb;
+  q->queued = 1;
+}
+
+/* hb->lock held */
+static void futex_dequeue(struct futex_hash_bucket *hb, struct futex_q *q) {
+  if (q->prev) {
+    q->prev->next = q->next;
+  } else {
+    hb->head = q->next;
+  }
+  if (q->next) {
+    q->next->prev = q->prev;
+  } else {
+    hb->tail = q->prev;
+  }
+  q->next = q->prev = NULL;
+  q->queued = 0;
+}
+
+/* hb->lock held; the lock keeps @q alive until wake_up() is done with it */
+static void futex_wake_one(struct futex_hash_bucket *hb, struct futex_q *q) {
+  futex_dequeue(hb, q);
+  q->woken = 1;
+  wake_up(&q->wq);
+}
+
+/*
+ * Leave the bucket after sleeping. Taking the lock also waits out a waker
+ * that is still inside futex_wake_one() for us. A requeue may move us
+ * while we wait for the lock, hence the recheck.
+ */
+static void futex_unqueue(struct futex_q *q) {
+  for (;;) {
+    struct futex_hash_bucket *hb = q->bucket;
+    uint64_t flags = spin_lock_irqsave(&hb->lock);
+
+    if (hb == q->bucket) {
+      if (q->queued) {
+        futex_dequeue(hb, q);
+      }
+      spin_unlock_irqrestore(&hb->lock, flags);
+      return;
+    }
+    spin_unlock_irqrestore(&hb->lock, flags);
+  }
+}
+
+/* ===================================================================== */
+/* Operations */
+/* ===================================================================== */
+
+int futex_wait(uint64_t uaddr, int flags, uint32_t val, uint64_t timeout) {
+  struct futex_q q;
+  int ret = get_futex_key(uaddr, flags, &q.key);
+  if (ret < 0) {
+    return ret;
+  }
+
+  init_waitqueue_head(&q.wq);
+  q.woken = 0;
+  q.queued = 0;
+
+  /* Compare and queue under the bucket lock: a waker that changed the word
+   * after we read it must take the same lock, and will then find us */
+  struct futex_hash_bucket *hb = hash_futex(&q.key);
+  uint64_t irqflags = spin_lock_irqsave(&hb->lock);
+  uint32_t cur;
+  ret = futex_value(uaddr, &cur);
+  if (ret < 0 || cur != val) {
+    spin_unlock_irqrestore(&hb->lock, irqflags);
+    return ret < 0 ? ret : -EAGAIN;
+  }
+  futex_enqueue(hb, &q);
+  spin_unlock_irqrestore(&hb->lock, irqflags);
+
+  if (timeout) {
+    ret = wait_event_timeout(q.wq, q.woken, timeout);
+  } else {
+    ret = wait_event_killable(q.wq, q.woken);
+  }
+
+  futex_unqueue(&q);
+
+  if (q.woken) {
+    return 0;
+  }
+  return ret < 0 ? -EINTR : -ETIMEDOUT;
+}
+
+int futex_wake(uint64_t uaddr, int flags, int nr_wake) {
+  struct futex_key key;
+  int ret = get_futex_key(uaddr, flags, &key);
+  if (ret < 0) {
+    return ret;
+  }
+
+  struct futex_hash_bucket *hb = hash_futex(&key);
+  uint64_t irqflags = spin_lock_irqsave(&hb->lock);
+
+  int woken = 0;
+  struct futex_q *q = hb->head;
+  while (q && woken < nr_wake) {
+    struct futex_q *next = q->next;
+    if (futex_key_equal(&q->key, &key)) {
+      futex_wake_one(hb, q);
+      woken++;
+    }
+    q = next;
+  }
+
+  spin_unlock_irqrestore(&hb->lock, irqflags);
+  return woken;
+}
+
+int futex_requeue(uint64_t uaddr, uint64_t uaddr2, int flags, int nr_wake,
+                  int nr_requeue, const uint32_t *cmpval) {
+  struct futex_key key1, key2;
+  int ret = get_futex_key(uaddr, flags, &key1);
+  if (ret < 0) {
+    return ret;
+  }
+  ret = get_futex_key(uaddr2, flags, &key2);
+  if (ret < 0) {
+    return ret;
+  }
+
+  struct futex_hash_bucket *hb1 = hash_futex(&key1);
+  struct futex_hash_bucket *hb2 = hash_futex(&key2);
+  struct futex_hash_bucket *first = hb1 < hb2 ? hb1 : hb2;
+  struct futex_hash_bucket *second = hb1 < hb2 ? hb2 : hb1;
+
+  uint64_t irqflags = spin_lock_irqsave(&first->lock);
+  if (second != first) {
+    spin_lock(&second->lock);
+  }
+
+  int count = 0, woken = 0, moved = 0;
+  if (cmpval) {
+    uint32_t cur;
+    count = futex_value(uaddr, &cur);
+    if (count < 0) {
+      goto out;
+    }
+    if (cur != *cmpval) {
+      count = -EAGAIN;
+      goto out;
+    }
+  }
+
+  struct futex_q *q = hb1->head;
+  while (q && (woken < nr_wake || moved < nr_requeue)) {
+    struct futex_q *next = q->next;
+    if (futex_key_equal(&q->key, &key1)) {
+      if (woken < nr_wake) {
+        futex_wake_one(hb1, q);
+        woken++;
+      } else {
+        /* Still asleep: it just waits on the other word from now on */
+        if (hb1 != hb2) {
+          futex_dequeue(hb1, q);
+          futex_enqueue(hb2, q);
+        }
+        q->key = key2;
+        moved++;
+      }
+    }
+    q = next;
+  }
+  count = woken + moved;
+
+out:
+  if (second != first) {
+    spin_unlock(&second->lock);
+  }
+  spin_unlock_irqrestore(&first->lock, irqflags);
+  return count;
+}
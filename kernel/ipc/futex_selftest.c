@@ -0,0 +1,183 @@
+/*
+ * vib-OS Kernel - Futex Self-Test
+ *
+ * A futex wakeup must reach a waiter even when the word moves to another
+ * physical page between futex_wait() and futex_wake(). Two cases do that
+ * on a scratch address space, with kernel threads standing in for the
+ * user threads: a word only read so far, still on the zero page, and a
+ * word whose page a fork() makes copy-on-write while the waiter sleeps.
+ * The waker's write fault then gives it a new page in both.
+ */
+
+#include "fs/vfs.h"
+#include "ipc/futex.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "printk.h"
+#include "sched/sched.h"
+#include "time/hrtimer.h"
+
+/* How long the waiter sleeps before calling it a lost wakeup */
+#define FT_WAIT_NS (2 * NSEC_PER_SEC)
+
+/* Time given to the waiter to queue itself before the page is moved */
+#define FT_SETTLE_NS (50 * NSEC_PER_MSEC)
+
+enum ft_case {
+  FT_ZERO_PAGE,
+  FT_COW,
+};
+
+struct ft_run {
+  enum ft_case which;
+  uint64_t uaddr;
+  volatile int waiter_done;
+  volatile int waiter_ret;
+  volatile int done;
+  volatile int result;
+};
+
+/*
+ * Kernel threads switch to whatever mm they carry, and may leave it loaded
+ * after they exit, so the scratch address space lives for good and each
+ * run only maps and unmaps a page in it.
+ */
+static struct mm_struct *ft_mm;
+
+static void ft_adopt(void) {
+  struct task_struct *task = get_current();
+  task->mm = ft_mm;
+  task->active_mm = ft_mm;
+  atomic_inc(&ft_mm->users);
+  vmm_switch_address_space(ft_mm);
+}
+
+static void ft_exit(void) {
+  atomic_dec(&ft_mm->users);
+  exit_task(0);
+}
+
+static void ft_waiter(void *arg) {
+  struct ft_run *run = arg;
+
+  ft_adopt();
+  run->waiter_ret = futex_wait(run->uaddr, FUTEX_PRIVATE_FLAG, 0, FT_WAIT_NS);
+  __atomic_store_n(&run->waiter_done, 1, __ATOMIC_RELEASE);
+  ft_exit();
+}
+
+/* Store to the word as a user write would: fault, then write the page */
+static int ft_store(uint64_t uaddr, uint32_t val) {
+  if (vmm_handle_page_fault(ft_mm, uaddr, FAULT_WRITE | FAULT_USER) < 0) {
+    return -EFAULT;
+  }
+  phys_addr_t phys = vmm_mm_virt_to_phys(ft_mm, uaddr);
+  if (!phys) {
+    return -EFAULT;
+  }
+  *(volatile uint32_t *)phys = val;
+  return 0;
+}
+
+/* One attempt; -EAGAIN if the waiter saw the store before it slept */
+static int ft_run_once(struct ft_run *run) {
+  struct mm_struct *child = NULL;
+  int ret;
+
+  run->uaddr = vmm_mmap_anon(ft_mm, 0, PAGE_SIZE, VM_READ | VM_WRITE);
+  if (!run->uaddr) {
+    return -ENOMEM;
+  }
+
+  /* A read fault leaves the word on the shared zero page */
+  vmm_handle_page_fault(ft_mm, run->uaddr, FAULT_USER);
+  if (run->which == FT_COW && (ret = ft_store(run->uaddr, 0)) < 0) {
+    goto out;
+  }
+
+  run->waiter_done = 0;
+  if (!create_task(ft_waiter, run, PF_KTHREAD)) {
+    ret = -ENOMEM;
+    goto out;
+  }
+  hrtimer_sleep(FT_SETTLE_NS);
+
+  if (run->which == FT_COW) {
+    /* The waiter's page is now shared; the store below copies it */
+    child = vmm_fork_address_space(ft_mm);
+    if (!child) {
+      ret = -ENOMEM;
+      goto wait;
+    }
+  }
+
+  ret = ft_store(run->uaddr, 1);
+  if (ret == 0) {
+    /* Retry until the waiter is woken or gives up on its own */
+    while (futex_wake(run->uaddr, FUTEX_PRIVATE_FLAG, 1) == 0 &&
+           !__atomic_load_n(&run->waiter_done, __ATOMIC_ACQUIRE)) {
+      hrtimer_sleep(NSEC_PER_MSEC);
+    }
+  }
+
+wait:
+  while (!__atomic_load_n(&run->waiter_done, __ATOMIC_ACQUIRE)) {
+    hrtimer_sleep(NSEC_PER_MSEC);
+  }
+  if (ret == 0) {
+    ret = run->waiter_ret;
+  }
+
+out:
+  if (child) {
+    /* Never ran, so no CPU has it loaded */
+    vmm_destroy_address_space(child);
+  }
+  vmm_munmap(ft_mm, run->uaddr, PAGE_SIZE);
+  return ret;
+}
+
+static void ft_driver(void *arg) {
+  struct ft_run *run = arg;
+  int ret;
+
+  ft_adopt();
+  for (int tries = 0; tries < 5; tries++) {
+    ret = ft_run_once(run);
+    if (ret != -EAGAIN) {
+      break;
+    }
+  }
+
+  run->result = ret;
+  __atomic_store_n(&run->done, 1, __ATOMIC_RELEASE);
+  ft_exit();
+}
+
+static int ft_case_run(enum ft_case which, const char *name) {
+  struct ft_run run = {.which = which};
+
+  if (!create_task(ft_driver, &run, PF_KTHREAD)) {
+    return -ENOMEM;
+  }
+  while (!__atomic_load_n(&run.done, __ATOMIC_ACQUIRE)) {
+    hrtimer_sleep(10 * NSEC_PER_MSEC);
+  }
+
+  printk(KERN_INFO "futex selftest: %s: %s (%d)\n", name,
+         run.result == 0 ? "ok" : "FAILED", run.result);
+  return run.result;
+}
+
+int futex_selftest(void) {
+  if (!ft_mm) {
+    ft_mm = vmm_create_address_space();
+    if (!ft_mm) {
+      return -ENOMEM;
+    }
+  }
+
+  int ret = ft_case_run(FT_ZERO_PAGE, "zero page");
+  int ret2 = ft_case_run(FT_COW, "COW after fork");
+  return ret < 0 ? ret : ret2;
+}
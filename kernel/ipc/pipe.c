@@ -1,45 +1,182 @@
 /*
  * UnixOS Kernel - Pipe Implementation
+ *
+ * The pipe holds a ring of buffers, each a reference to (part of) a
+ * physical page. Writes top up the newest page and then add fresh ones;
+ * reads copy out and drop pages as they empty. Splicing moves buffers
+ * between pipes, or shares their pages, without touching the data.
  */
 
+#include "ipc/pipe.h"
+#include "fs/poll.h"
 #include "fs/vfs.h"
 #include "mm/kmalloc.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
 #include "printk.h"
+#include "sched/sched.h"
+#include "string.h"
+#include "sync/spinlock.h"
+#include "sync/wait.h"
 
 /* ===================================================================== */
 /* Pipe structure */
 /* ===================================================================== */
 
-#define PIPE_SIZE 4096 /* Pipe buffer size */
+#define PIPE_BUF_CAN_MERGE 1 /* Page is ours alone: writes may append */
+
+struct pipe_buffer {
+  phys_addr_t page; /* One page reference per buffer */
+  uint32_t offset;  /* Start of the data in the page */
+  uint32_t len;     /* Bytes of data */
+  uint32_t flags;
+};
 
 struct pipe {
-  uint8_t *buffer;   /* Ring buffer */
-  size_t read_pos;   /* Read position */
-  size_t write_pos;  /* Write position */
-  size_t count;      /* Bytes in buffer */
-  int readers;       /* Number of readers */
-  int writers;       /* Number of writers */
-  volatile int lock; /* Simple spinlock */
+  struct pipe_buffer *bufs;    /* Ring of ring_size buffers */
+  unsigned int ring_size;      /* Power of two */
+  volatile unsigned int head;  /* Next slot to fill, free-running */
+  volatile unsigned int tail;  /* Oldest filled slot, free-running */
+  size_t count;                /* Bytes in all buffers */
+  volatile int readers;        /* Number of readers */
+  volatile int writers;        /* Number of writers */
+  atomic_t refs;               /* One per open end; last put frees */
+  volatile int locked;         /* Sleeping lock protecting the above */
+  wait_queue_head_t lock_wait; /* Waiting for the lock */
+  wait_queue_head_t rd_wait;   /* Readers waiting for data or EOF */
+  wait_queue_head_t wr_wait;   /* Writers waiting for space */
 };
 
+static const struct file_operations pipe_read_ops;
+static const struct file_operations pipe_write_ops;
+
 /* ===================================================================== */
-/* Pipe operations */
+/* Helpers */
 /* ===================================================================== */
 
+/*
+ * Copies to and from user memory can fault or take a while, so the pipe
+ * lock sleeps rather than spins.
+ */
 static void pipe_lock(struct pipe *p) {
-  while (__atomic_test_and_set(&p->lock, __ATOMIC_ACQUIRE)) {
-#ifdef ARCH_ARM64
-    asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-    asm volatile("pause");
-#endif
+  while (__atomic_exchange_n(&p->locked, 1, __ATOMIC_ACQUIRE)) {
+    wait_event(p->lock_wait, !p->locked);
   }
 }
 
 static void pipe_unlock(struct pipe *p) {
-  __atomic_clear(&p->lock, __ATOMIC_RELEASE);
+  __atomic_store_n(&p->locked, 0, __ATOMIC_RELEASE);
+  wake_up(&p->lock_wait);
+}
+
+/* Lock two pipes in address order */
+static void pipe_double_lock(struct pipe *a, struct pipe *b) {
+  if (a < b) {
+    pipe_lock(a);
+    pipe_lock(b);
+  } else {
+    pipe_lock(b);
+    pipe_lock(a);
+  }
+}
+
+static inline int pipe_empty(struct pipe *p) { return p->head == p->tail; }
+
+static inline int pipe_full(struct pipe *p) {
+  return p->head - p->tail >= p->ring_size;
+}
+
+static inline struct pipe_buffer *pipe_slot(struct pipe *p, unsigned int n) {
+  return &p->bufs[n & (p->ring_size - 1)];
+}
+
+/* Pages are identity mapped in the kernel, as in vmm.c */
+static inline uint8_t *buf_data(struct pipe_buffer *buf) {
+  return (uint8_t *)buf->page + buf->offset;
+}
+
+static inline void pipe_buf_release(struct pipe_buffer *buf) {
+  pmm_put_page(buf->page);
+  buf->page = 0;
+}
+
+/* Append a buffer, taking over its page reference; p locked, not full */
+static void pipe_push(struct pipe *p, phys_addr_t page, uint32_t offset,
+                      uint32_t len, uint32_t flags) {
+  struct pipe_buffer *buf = pipe_slot(p, p->head);
+
+  buf->page = page;
+  buf->offset = offset;
+  buf->len = len;
+  buf->flags = flags;
+  p->head++;
+  p->count += len;
+}
+
+/* Drop @n bytes from the oldest buffer; p locked */
+static void pipe_consume(struct pipe *p, size_t n) {
+  struct pipe_buffer *buf = pipe_slot(p, p->tail);
+
+  buf->offset += n;
+  buf->len -= n;
+  p->count -= n;
+  if (buf->len == 0) {
+    pipe_buf_release(buf);
+    p->tail++;
+  }
+}
+
+static struct pipe *get_pipe(struct file *file,
+                             const struct file_operations *ops) {
+  if (!file || file->f_op != ops) {
+    return NULL;
+  }
+  return (struct pipe *)file->private_data;
 }
 
+/*
+ * Wait with p locked until there is data. Return: 0 when there is, 1 at
+ * EOF, -EAGAIN for SPLICE_F_NONBLOCK.
+ */
+static int pipe_wait_readable(struct pipe *p, unsigned int flags) {
+  while (pipe_empty(p)) {
+    if (p->writers == 0) {
+      return 1;
+    }
+    if (flags & SPLICE_F_NONBLOCK) {
+      return -EAGAIN;
+    }
+    pipe_unlock(p);
+    wait_event(p->rd_wait, !pipe_empty(p) || p->writers == 0);
+    pipe_lock(p);
+  }
+  return 0;
+}
+
+/* Wait with p locked until a buffer can be added */
+static int pipe_wait_writable(struct pipe *p, unsigned int flags) {
+  while (pipe_full(p) && p->readers > 0) {
+    if (flags & SPLICE_F_NONBLOCK) {
+      return -EAGAIN;
+    }
+    /* Let readers drain what is there while we wait */
+    pipe_unlock(p);
+    wake_up(&p->rd_wait);
+    wait_event(p->wr_wait, !pipe_full(p) || p->readers == 0);
+    pipe_lock(p);
+  }
+  return p->readers > 0 ? 0 : -EPIPE;
+}
+
+/* Wait flags for a read or write through @file */
+static inline unsigned int file_wait_flags(struct file *file) {
+  return (file->f_flags & O_NONBLOCK) ? SPLICE_F_NONBLOCK : 0;
+}
+
+/* ===================================================================== */
+/* Pipe operations */
+/* ===================================================================== */
+
 static ssize_t pipe_read(struct file *file, char *buf, size_t count,
                          loff_t *pos) {
   (void)pos;
@@ -51,35 +188,30 @@ static ssize_t pipe_read(struct file *file, char *buf, size_t count,
 
   pipe_lock(p);
 
-  /* No writers and empty buffer = EOF */
-  if (p->writers == 0 && p->count == 0) {
-    pipe_unlock(p);
-    return 0;
-  }
-
-  /* Wait for data (busy wait for now) */
-  while (p->count == 0 && p->writers > 0) {
+  /* Sleep until there is data; no writers and nothing left = EOF */
+  int ret = pipe_wait_readable(p, file_wait_flags(file));
+  if (ret) {
     pipe_unlock(p);
-#ifdef ARCH_ARM64
-    asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-    asm volatile("pause");
-#endif
-    pipe_lock(p);
+    return ret < 0 ? ret : 0;
   }
 
-  size_t to_read = count < p->count ? count : p->count;
+  size_t done = 0;
+  while (done < count && !pipe_empty(p)) {
+    struct pipe_buffer *b = pipe_slot(p, p->tail);
+    size_t n = count - done < b->len ? count - done : b->len;
 
-  for (size_t i = 0; i < to_read; i++) {
-    buf[i] = p->buffer[p->read_pos];
-    p->read_pos = (p->read_pos + 1) % PIPE_SIZE;
+    memcpy(buf + done, buf_data(b), n);
+    done += n;
+    pipe_consume(p, n);
   }
 
-  p->count -= to_read;
-
   pipe_unlock(p);
 
-  return to_read;
+  if (done > 0) {
+    wake_up(&p->wr_wait);
+  }
+
+  return done;
 }
 
 static ssize_t pipe_write(struct file *file, const char *buf, size_t count,
@@ -100,39 +232,67 @@ static ssize_t pipe_write(struct file *file, const char *buf, size_t count,
   }
 
   size_t written = 0;
+  ssize_t err = 0;
+
+  /* Top up the newest page if it is ours to write */
+  if (!pipe_empty(p)) {
+    struct pipe_buffer *b = pipe_slot(p, p->head - 1);
+    size_t room = PAGE_SIZE - (b->offset + b->len);
+
+    if ((b->flags & PIPE_BUF_CAN_MERGE) && room > 0) {
+      size_t n = count < room ? count : room;
+      memcpy(buf_data(b) + b->len, buf, n);
+      b->len += n;
+      p->count += n;
+      written += n;
+    }
+  }
 
   while (written < count) {
-    /* Wait for space */
-    while (p->count >= PIPE_SIZE && p->readers > 0) {
-      pipe_unlock(p);
-#ifdef ARCH_ARM64
-      asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-      asm volatile("pause");
-#endif
-      pipe_lock(p);
+    err = pipe_wait_writable(p, file_wait_flags(file));
+    if (err < 0) {
+      break;
     }
 
-    if (p->readers == 0) {
-      pipe_unlock(p);
-      return written > 0 ? written : -EPIPE;
+    phys_addr_t page = pmm_alloc_page();
+    if (!page) {
+      err = -ENOMEM;
+      break;
     }
 
-    size_t space = PIPE_SIZE - p->count;
-    size_t to_write = (count - written) < space ? (count - written) : space;
+    size_t n = count - written < PAGE_SIZE ? count - written : PAGE_SIZE;
+    memcpy((void *)page, buf + written, n);
+    pipe_push(p, page, 0, n, PIPE_BUF_CAN_MERGE);
+    written += n;
+  }
 
-    for (size_t i = 0; i < to_write; i++) {
-      p->buffer[p->write_pos] = buf[written + i];
-      p->write_pos = (p->write_pos + 1) % PIPE_SIZE;
-    }
+  pipe_unlock(p);
 
-    p->count += to_write;
-    written += to_write;
+  if (written > 0) {
+    wake_up(&p->rd_wait);
+    return written;
   }
+  return err;
+}
 
-  pipe_unlock(p);
+static void pipe_free(struct pipe *p) {
+  while (!pipe_empty(p)) {
+    pipe_buf_release(pipe_slot(p, p->tail));
+    p->tail++;
+  }
+  kfree(p->bufs);
+  kfree(p);
+}
 
-  return written;
+/*
+ * The other end may be released at the same time, so the pipe is only
+ * freed by whichever release drops the last reference, after its own
+ * unlock and wakeups are done.
+ */
+static void pipe_put(struct pipe *p) {
+  if (atomic_dec_and_test(&p->refs)) {
+    pipe_free(p);
+  }
 }
 
 static int pipe_release_read(struct inode *inode, struct file *file) {
@@ -142,15 +302,11 @@ static int pipe_release_read(struct inode *inode, struct file *file) {
   if (p) {
     pipe_lock(p);
     p->readers--;
+    pipe_unlock(p);
 
-    /* Free pipe if no users */
-    if (p->readers == 0 && p->writers == 0) {
-      pipe_unlock(p);
-      kfree(p->buffer);
-      kfree(p);
-    } else {
-      pipe_unlock(p);
-    }
+    /* Writers blocked on a full pipe now get EPIPE */
+    wake_up(&p->wr_wait);
+    pipe_put(p);
   }
 
   return 0;
@@ -163,31 +319,448 @@ static int pipe_release_write(struct inode *inode, struct file *file) {
   if (p) {
     pipe_lock(p);
     p->writers--;
+    pipe_unlock(p);
 
-    if (p->readers == 0 && p->writers == 0) {
-      pipe_unlock(p);
-      kfree(p->buffer);
-      kfree(p);
-    } else {
-      pipe_unlock(p);
-    }
+    /* Readers blocked on an empty pipe now see EOF */
+    wake_up(&p->rd_wait);
+    pipe_put(p);
   }
 
   return 0;
 }
 
+/* Lockless; see fs/poll.h */
+static unsigned int pipe_poll_read(struct file *file, struct poll_table *pt) {
+  struct pipe *p = (struct pipe *)file->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(file, &p->rd_wait, pt);
+  if (!pipe_empty(p)) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  if (p->writers == 0) {
+    mask |= EPOLLHUP;
+  }
+  return mask;
+}
+
+static unsigned int pipe_poll_write(struct file *file, struct poll_table *pt) {
+  struct pipe *p = (struct pipe *)file->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(file, &p->wr_wait, pt);
+  if (!pipe_full(p)) {
+    mask |= EPOLLOUT | EPOLLWRNORM;
+  }
+  if (p->readers == 0) {
+    mask |= EPOLLERR;
+  }
+  return mask;
+}
+
 static const struct file_operations pipe_read_ops = {
     .read = pipe_read,
     .write = NULL,
     .release = pipe_release_read,
+    .poll = pipe_poll_read,
 };
 
 static const struct file_operations pipe_write_ops = {
     .read = NULL,
     .write = pipe_write,
     .release = pipe_release_write,
+    .poll = pipe_poll_write,
 };
 
+/* ===================================================================== */
+/* Pipe size */
+/* ===================================================================== */
+
+static long pipe_set_size(struct pipe *p, unsigned long size) {
+  if (size > PIPE_MAX_SIZE) {
+    return -EPERM;
+  }
+
+  unsigned int slots = 1;
+  while ((unsigned long)slots * PAGE_SIZE < size) {
+    slots <<= 1;
+  }
+
+  struct pipe_buffer *bufs = kmalloc(slots * sizeof(*bufs), GFP_KERNEL);
+  if (!bufs) {
+    return -ENOMEM;
+  }
+
+  pipe_lock(p);
+
+  unsigned int used = p->head - p->tail;
+  if (used > slots) {
+    pipe_unlock(p);
+    kfree(bufs);
+    return -EBUSY;
+  }
+
+  /* Keep the buffers in order, starting at slot 0 */
+  for (unsigned int i = 0; i < used; i++) {
+    bufs[i] = *pipe_slot(p, p->tail + i);
+  }
+
+  struct pipe_buffer *old = p->bufs;
+  p->bufs = bufs;
+  p->ring_size = slots;
+  p->tail = 0;
+  p->head = used;
+
+  pipe_unlock(p);
+
+  kfree(old);
+  wake_up(&p->wr_wait);
+
+  return (long)slots * PAGE_SIZE;
+}
+
+long pipe_fcntl(struct file *file, unsigned int cmd, unsigned long arg) {
+  struct pipe *p = get_pipe(file, &pipe_read_ops);
+  if (!p) {
+    p = get_pipe(file, &pipe_write_ops);
+  }
+  if (!p) {
+    return -EBADF;
+  }
+
+  switch (cmd) {
+  case F_GETPIPE_SZ:
+    return (long)p->ring_size * PAGE_SIZE;
+  case F_SETPIPE_SZ:
+    return pipe_set_size(p, arg);
+  default:
+    return -EINVAL;
+  }
+}
+
+/* ===================================================================== */
+/* Splicing */
+/* ===================================================================== */
+
+/* Wait until @ipipe has data and @opipe has room, and return both locked */
+static int pipe_double_lock_ready(struct pipe *ipipe, struct pipe *opipe,
+                                  unsigned int flags) {
+  for (;;) {
+    pipe_lock(ipipe);
+    int ret = pipe_wait_readable(ipipe, flags);
+    pipe_unlock(ipipe);
+    if (ret) {
+      return ret;
+    }
+
+    pipe_lock(opipe);
+    ret = pipe_wait_writable(opipe, flags);
+    pipe_unlock(opipe);
+    if (ret) {
+      return ret;
+    }
+
+    /* Both may have changed while neither was locked */
+    pipe_double_lock(ipipe, opipe);
+    if (!pipe_empty(ipipe) && !pipe_full(opipe) && opipe->readers > 0) {
+      return 0;
+    }
+    pipe_unlock(ipipe);
+    pipe_unlock(opipe);
+  }
+}
+
+/* Hand whole buffers over; split the last one by sharing its page */
+static ssize_t splice_pipe_to_pipe(struct pipe *ipipe, struct pipe *opipe,
+                                   size_t len, unsigned int flags) {
+  int ret = pipe_double_lock_ready(ipipe, opipe, flags);
+  if (ret) {
+    return ret > 0 ? 0 : ret;
+  }
+
+  size_t moved = 0;
+  while (moved < len && !pipe_empty(ipipe) && !pipe_full(opipe)) {
+    struct pipe_buffer *ib = pipe_slot(ipipe, ipipe->tail);
+    size_t left = len - moved;
+
+    if (ib->len <= left) {
+      pipe_push(opipe, ib->page, ib->offset, ib->len, ib->flags);
+      moved += ib->len;
+      ipipe->count -= ib->len;
+      ib->page = 0;
+      ipipe->tail++;
+    } else {
+      /* The front of the page goes over; appending to it would overwrite
+       * what stays behind */
+      pmm_get_page(ib->page);
+      pipe_push(opipe, ib->page, ib->offset, left, 0);
+      moved += left;
+      pipe_consume(ipipe, left);
+    }
+  }
+
+  pipe_unlock(ipipe);
+  pipe_unlock(opipe);
+
+  wake_up(&ipipe->wr_wait);
+  wake_up(&opipe->rd_wait);
+  return moved;
+}
+
+/* Read a file straight into new pipe pages */
+static ssize_t splice_file_to_pipe(struct file *in, loff_t *off_in,
+                                   struct pipe *opipe, size_t len,
+                                   unsigned int flags) {
+  if (!in->f_op || !in->f_op->read) {
+    return -EINVAL;
+  }
+
+  loff_t pos = off_in ? *off_in : in->f_pos;
+  ssize_t moved = 0;
+  ssize_t err = 0;
+
+  pipe_lock(opipe);
+  while ((size_t)moved < len) {
+    /* Block only until the first page is in */
+    err = pipe_wait_writable(opipe, moved > 0 ? SPLICE_F_NONBLOCK : flags);
+    if (err < 0) {
+      break;
+    }
+
+    phys_addr_t page = pmm_alloc_page();
+    if (!page) {
+      err = -ENOMEM;
+      break;
+    }
+
+    size_t n = len - moved < PAGE_SIZE ? len - moved : PAGE_SIZE;
+    ssize_t got = in->f_op->read(in, (char *)page, n, &pos);
+    if (got <= 0) {
+      pmm_put_page(page);
+      err = got;
+      break;
+    }
+
+    pipe_push(opipe, page, 0, got, PIPE_BUF_CAN_MERGE);
+    moved += got;
+    if ((size_t)got < n) {
+      break; /* End of file */
+    }
+  }
+  pipe_unlock(opipe);
+
+  if (off_in) {
+    *off_in = pos;
+  } else {
+    in->f_pos = pos;
+  }
+
+  if (moved > 0) {
+    wake_up(&opipe->rd_wait);
+    return moved;
+  }
+  return err;
+}
+
+/* Write a file straight from the pipe's pages */
+static ssize_t splice_pipe_to_file(struct pipe *ipipe, struct file *out,
+                                   loff_t *off_out, size_t len,
+                                   unsigned int flags) {
+  if (!out->f_op || !out->f_op->write) {
+    return -EINVAL;
+  }
+
+  pipe_lock(ipipe);
+  int ret = pipe_wait_readable(ipipe, flags);
+  if (ret) {
+    pipe_unlock(ipipe);
+    return ret > 0 ? 0 : ret;
+  }
+
+  loff_t pos = off_out ? *off_out : out->f_pos;
+  ssize_t moved = 0;
+  ssize_t err = 0;
+
+  while ((size_t)moved < len && !pipe_empty(ipipe)) {
+    struct pipe_buffer *b = pipe_slot(ipipe, ipipe->tail);
+    size_t n = len - moved < b->len ? len - moved : b->len;
+
+    ssize_t put = out->f_op->write(out, (const char *)buf_data(b), n, &pos);
+    if (put <= 0) {
+      err = put < 0 ? put : -EIO;
+      break;
+    }
+
+    moved += put;
+    pipe_consume(ipipe, put);
+    if ((size_t)put < n) {
+      break;
+    }
+  }
+  pipe_unlock(ipipe);
+
+  if (off_out) {
+    *off_out = pos;
+  } else {
+    out->f_pos = pos;
+  }
+
+  if (moved > 0) {
+    wake_up(&ipipe->wr_wait);
+    return moved;
+  }
+  return err;
+}
+
+ssize_t do_splice(struct file *in, loff_t *off_in, struct file *out,
+                  loff_t *off_out, size_t len, unsigned int flags) {
+  struct pipe *ipipe = get_pipe(in, &pipe_read_ops);
+  struct pipe *opipe = get_pipe(out, &pipe_write_ops);
+
+  if ((ipipe && off_in) || (opipe && off_out)) {
+    return -ESPIPE;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  if (ipipe && opipe) {
+    if (ipipe == opipe) {
+      return -EINVAL;
+    }
+    return splice_pipe_to_pipe(ipipe, opipe, len, flags);
+  }
+  if (ipipe) {
+    return splice_pipe_to_file(ipipe, out, off_out, len, flags);
+  }
+  if (opipe) {
+    return splice_file_to_pipe(in, off_in, opipe, len, flags);
+  }
+  return -EINVAL;
+}
+
+ssize_t do_tee(struct file *in, struct file *out, size_t len,
+               unsigned int flags) {
+  struct pipe *ipipe = get_pipe(in, &pipe_read_ops);
+  struct pipe *opipe = get_pipe(out, &pipe_write_ops);
+
+  if (!ipipe || !opipe || ipipe == opipe) {
+    return -EINVAL;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  int ret = pipe_double_lock_ready(ipipe, opipe, flags);
+  if (ret) {
+    return ret > 0 ? 0 : ret;
+  }
+
+  size_t copied = 0;
+  unsigned int i = ipipe->tail;
+  while (copied < len && i != ipipe->head && !pipe_full(opipe)) {
+    struct pipe_buffer *ib = pipe_slot(ipipe, i++);
+    size_t n = len - copied < ib->len ? len - copied : ib->len;
+
+    /* Shared from now on, so neither side may append in place */
+    ib->flags &= ~PIPE_BUF_CAN_MERGE;
+    pmm_get_page(ib->page);
+    pipe_push(opipe, ib->page, ib->offset, n, 0);
+    copied += n;
+  }
+
+  pipe_unlock(ipipe);
+  pipe_unlock(opipe);
+
+  wake_up(&opipe->rd_wait);
+  return copied;
+}
+
+/* Reference user pages where they are counted pages, else copy them */
+static ssize_t vmsplice_to_pipe(struct pipe *p, const struct iovec *iov,
+                                unsigned long nr_segs, unsigned int flags) {
+  struct task_struct *task = get_current();
+  struct mm_struct *mm = task ? task->mm : NULL;
+  ssize_t moved = 0;
+  ssize_t err = 0;
+
+  pipe_lock(p);
+  for (unsigned long s = 0; s < nr_segs && !err; s++) {
+    uint64_t uaddr = (uint64_t)iov[s].iov_base;
+    size_t left = iov[s].iov_len;
+
+    while (left > 0) {
+      err = pipe_wait_writable(p, moved > 0 ? SPLICE_F_NONBLOCK : flags);
+      if (err < 0) {
+        break;
+      }
+
+      size_t offset = uaddr & (PAGE_SIZE - 1);
+      size_t n = PAGE_SIZE - offset < left ? PAGE_SIZE - offset : left;
+
+      phys_addr_t phys = vmm_mm_virt_to_phys(mm, uaddr);
+      if (!phys) {
+        err = -EFAULT;
+        break;
+      }
+
+      phys_addr_t page = phys & ~(PAGE_SIZE - 1);
+      if (pmm_page_count(page) > 0) {
+        pmm_get_page(page);
+        pipe_push(p, page, offset, n, 0);
+      } else {
+        phys_addr_t copy = pmm_alloc_page();
+        if (!copy) {
+          err = -ENOMEM;
+          break;
+        }
+        memcpy((void *)copy, (const void *)uaddr, n);
+        pipe_push(p, copy, 0, n, PIPE_BUF_CAN_MERGE);
+      }
+
+      uaddr += n;
+      left -= n;
+      moved += n;
+    }
+  }
+  pipe_unlock(p);
+
+  if (moved > 0) {
+    wake_up(&p->rd_wait);
+    return moved;
+  }
+  return err;
+}
+
+ssize_t do_vmsplice(struct file *file, const struct iovec *iov,
+                    unsigned long nr_segs, unsigned int flags) {
+  struct pipe *p = get_pipe(file, &pipe_write_ops);
+  if (p) {
+    return vmsplice_to_pipe(p, iov, nr_segs, flags);
+  }
+
+  if (!get_pipe(file, &pipe_read_ops)) {
+    return -EBADF;
+  }
+
+  /* From the read end it is just a scattered read */
+  ssize_t total = 0;
+  for (unsigned long s = 0; s < nr_segs; s++) {
+    if (iov[s].iov_len == 0) {
+      continue;
+    }
+    ssize_t got = pipe_read(file, iov[s].iov_base, iov[s].iov_len, NULL);
+    if (got <= 0) {
+      return total > 0 ? total : got;
+    }
+    total += got;
+    if ((size_t)got < iov[s].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
 /* ===================================================================== */
 /* Pipe creation */
 /* ===================================================================== */
@@ -199,18 +772,23 @@ int do_pipe(struct file **read_file, struct file **write_file) {
     return -ENOMEM;
   }
 
-  p->buffer = kmalloc(PIPE_SIZE, GFP_KERNEL);
-  if (!p->buffer) {
+  p->ring_size = PIPE_DEF_SIZE / PAGE_SIZE;
+  p->bufs = kmalloc(p->ring_size * sizeof(struct pipe_buffer), GFP_KERNEL);
+  if (!p->bufs) {
     kfree(p);
     return -ENOMEM;
   }
 
-  p->read_pos = 0;
-  p->write_pos = 0;
+  p->head = 0;
+  p->tail = 0;
   p->count = 0;
   p->readers = 1;
   p->writers = 1;
-  p->lock = 0;
+  p->refs.counter = 2;
+  p->locked = 0;
+  init_waitqueue_head(&p->lock_wait);
+  init_waitqueue_head(&p->rd_wait);
+  init_waitqueue_head(&p->wr_wait);
 
   /* Allocate file structures */
   struct file *rf = kzalloc(sizeof(struct file), GFP_KERNEL);
@@ -219,7 +797,7 @@ int do_pipe(struct file **read_file, struct file **write_file) {
   if (!rf || !wf) {
     kfree(rf);
     kfree(wf);
-    kfree(p->buffer);
+    kfree(p->bufs);
     kfree(p);
     return -ENOMEM;
   }
@@ -0,0 +1,160 @@
+/*
+ * Vib-OS - Flattened Device Tree (DTB) Helpers
+ *
+ * Walks the structure block of a DTB without allocating memory, so it can
+ * run before the physical memory manager is initialized.
+ */
+
+#include "fdt.h"
+#include "string.h"
+
+/* DTB header - all fields are big-endian */
+struct fdt_header {
+  uint32_t magic;
+  uint32_t totalsize;
+  uint32_t off_dt_struct;
+  uint32_t off_dt_strings;
+  uint32_t off_mem_rsvmap;
+  uint32_t version;
+  uint32_t last_comp_version;
+  uint32_t boot_cpuid_phys;
+  uint32_t size_dt_strings;
+  uint32_t size_dt_struct;
+};
+
+/* Sanity limit: no DTB we boot with is anywhere near this big */
+#define FDT_MAX_SIZE (2 * 1024 * 1024)
+
+static inline uint32_t fdt32_to_cpu(uint32_t v) {
+  return ((v & 0xFF) << 24) | ((v & 0xFF00) << 8) | ((v >> 8) & 0xFF00) |
+         (v >> 24);
+}
+
+static inline uint32_t fdt_read32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* Read a value made of @cells big-endian 32-bit cells */
+static uint64_t fdt_read_cells(const uint8_t *p, uint32_t cells) {
+  uint64_t val = 0;
+  for (uint32_t i = 0; i < cells; i++) {
+    val = (val << 32) | fdt_read32(p + i * 4);
+  }
+  return val;
+}
+
+int fdt_check(const void *fdt) {
+  const struct fdt_header *hdr = fdt;
+
+  if (!fdt || ((uintptr_t)fdt & 3)) {
+    return -1;
+  }
+  if (fdt32_to_cpu(hdr->magic) != FDT_MAGIC) {
+    return -1;
+  }
+
+  uint32_t size = fdt32_to_cpu(hdr->totalsize);
+  if (size < sizeof(*hdr) || size > FDT_MAX_SIZE) {
+    return -1;
+  }
+  if (fdt32_to_cpu(hdr->off_dt_struct) >= size ||
+      fdt32_to_cpu(hdr->off_dt_strings) >= size) {
+    return -1;
+  }
+  return 0;
+}
+
+size_t fdt_totalsize(const void *fdt) {
+  const struct fdt_header *hdr = fdt;
+  return fdt32_to_cpu(hdr->totalsize);
+}
+
+static int is_memory_node(const char *name) {
+  return strcmp(name, "memory") == 0 || strncmp(name, "memory@", 7) == 0;
+}
+
+int fdt_get_memory(const void *fdt, struct fdt_mem_region *regions, int max) {
+  if (fdt_check(fdt) < 0) {
+    return -1;
+  }
+
+  const struct fdt_header *hdr = fdt;
+  const uint8_t *base = fdt;
+  const uint8_t *p = base + fdt32_to_cpu(hdr->off_dt_struct);
+  const uint8_t *end = p + fdt32_to_cpu(hdr->size_dt_struct);
+  const char *strings = (const char *)base + fdt32_to_cpu(hdr->off_dt_strings);
+
+  /* Defaults from the DT spec, overridden by the root node */
+  uint32_t addr_cells = 2;
+  uint32_t size_cells = 1;
+  int depth = 0;
+  int in_memory = 0;
+  int count = 0;
+
+  while (p + 4 <= end) {
+    uint32_t token = fdt_read32(p);
+    p += 4;
+
+    switch (token) {
+    case FDT_BEGIN_NODE: {
+      const char *name = (const char *)p;
+      size_t len = strlen(name);
+      depth++;
+      in_memory = (depth == 2 && is_memory_node(name));
+      p += ALIGN(len + 1, 4);
+      break;
+    }
+
+    case FDT_END_NODE:
+      depth--;
+      in_memory = 0;
+      if (depth < 0) {
+        return -1;
+      }
+      break;
+
+    case FDT_PROP: {
+      uint32_t len = fdt_read32(p);
+      const char *name = strings + fdt_read32(p + 4);
+      const uint8_t *val = p + 8;
+      p = val + ALIGN(len, 4);
+      if (p > end) {
+        return -1;
+      }
+
+      if (depth == 1 && strcmp(name, "#address-cells") == 0 && len == 4) {
+        addr_cells = fdt_read32(val);
+      } else if (depth == 1 && strcmp(name, "#size-cells") == 0 && len == 4) {
+        size_cells = fdt_read32(val);
+      } else if (in_memory && strcmp(name, "reg") == 0) {
+        uint32_t entry = (addr_cells + size_cells) * 4;
+        if (entry == 0 || addr_cells > 2 || size_cells > 2) {
+          return -1;
+        }
+        for (uint32_t off = 0; off + entry <= len && count < max;
+             off += entry) {
+          regions[count].base = fdt_read_cells(val + off, addr_cells);
+          regions[count].size =
+              fdt_read_cells(val + off + addr_cells * 4, size_cells);
+          if (regions[count].size) {
+            count++;
+          }
+        }
+      }
+      break;
+    }
+
+    case FDT_NOP:
+      break;
+
+    case FDT_END:
+      return count;
+
+    default:
+      return -1;
+    }
+  }
+
+  return count;
+}
@@ -0,0 +1,274 @@
+/*
+ * Vib-OS - Red-Black Tree
+ *
+ * Classic red-black tree with parent pointers and NULL leaves. Insert and
+ * erase are O(log n) with at most three rotations.
+ */
+
+#include "rbtree.h"
+
+static inline int rb_is_black(const struct rb_node *node) {
+  return !node || node->color == RB_BLACK;
+}
+
+static void rb_change_child(struct rb_node *old, struct rb_node *new,
+                            struct rb_node *parent, struct rb_root *root) {
+  if (!parent) {
+    root->node = new;
+  } else if (parent->left == old) {
+    parent->left = new;
+  } else {
+    parent->right = new;
+  }
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *right = node->right;
+  struct rb_node *parent = node->parent;
+
+  node->right = right->left;
+  if (right->left) {
+    right->left->parent = node;
+  }
+  right->left = node;
+  right->parent = parent;
+  rb_change_child(node, right, parent, root);
+  node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *left = node->left;
+  struct rb_node *parent = node->parent;
+
+  node->left = left->right;
+  if (left->right) {
+    left->right->parent = node;
+  }
+  left->right = node;
+  left->parent = parent;
+  rb_change_child(node, left, parent, root);
+  node->parent = left;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *parent, *gparent;
+
+  while ((parent = node->parent) && parent->color == RB_RED) {
+    gparent = parent->parent;
+
+    if (parent == gparent->left) {
+      struct rb_node *uncle = gparent->right;
+      if (uncle && uncle->color == RB_RED) {
+        uncle->color = RB_BLACK;
+        parent->color = RB_BLACK;
+        gparent->color = RB_RED;
+        node = gparent;
+        continue;
+      }
+      if (parent->right == node) {
+        rb_rotate_left(parent, root);
+        struct rb_node *tmp = parent;
+        parent = node;
+        node = tmp;
+      }
+      parent->color = RB_BLACK;
+      gparent->color = RB_RED;
+      rb_rotate_right(gparent, root);
+    } else {
+      struct rb_node *uncle = gparent->left;
+      if (uncle && uncle->color == RB_RED) {
+        uncle->color = RB_BLACK;
+        parent->color = RB_BLACK;
+        gparent->color = RB_RED;
+        node = gparent;
+        continue;
+      }
+      if (parent->left == node) {
+        rb_rotate_right(parent, root);
+        struct rb_node *tmp = parent;
+        parent = node;
+        node = tmp;
+      }
+      parent->color = RB_BLACK;
+      gparent->color = RB_RED;
+      rb_rotate_left(gparent, root);
+    }
+  }
+
+  root->node->color = RB_BLACK;
+}
+
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent,
+                           struct rb_root *root) {
+  struct rb_node *other;
+
+  while (rb_is_black(node) && node != root->node) {
+    if (parent->left == node) {
+      other = parent->right;
+      if (other->color == RB_RED) {
+        other->color = RB_BLACK;
+        parent->color = RB_RED;
+        rb_rotate_left(parent, root);
+        other = parent->right;
+      }
+      if (rb_is_black(other->left) && rb_is_black(other->right)) {
+        other->color = RB_RED;
+        node = parent;
+        parent = node->parent;
+      } else {
+        if (rb_is_black(other->right)) {
+          other->left->color = RB_BLACK;
+          other->color = RB_RED;
+          rb_rotate_right(other, root);
+          other = parent->right;
+        }
+        other->color = parent->color;
+        parent->color = RB_BLACK;
+        other->right->color = RB_BLACK;
+        rb_rotate_left(parent, root);
+        node = root->node;
+        break;
+      }
+    } else {
+      other = parent->left;
+      if (other->color == RB_RED) {
+        other->color = RB_BLACK;
+        parent->color = RB_RED;
+        rb_rotate_right(parent, root);
+        other = parent->left;
+      }
+      if (rb_is_black(other->left) && rb_is_black(other->right)) {
+        other->color = RB_RED;
+        node = parent;
+        parent = node->parent;
+      } else {
+        if (rb_is_black(other->left)) {
+          other->right->color = RB_BLACK;
+          other->color = RB_RED;
+          rb_rotate_left(other, root);
+          other = parent->left;
+        }
+        other->color = parent->color;
+        parent->color = RB_BLACK;
+        other->left->color = RB_BLACK;
+        rb_rotate_right(parent, root);
+        node = root->node;
+        break;
+      }
+    }
+  }
+
+  if (node) {
+    node->color = RB_BLACK;
+  }
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *child, *parent;
+  int color;
+
+  if (!node->left) {
+    child = node->right;
+  } else if (!node->right) {
+    child = node->left;
+  } else {
+    /* Two children: splice the in-order successor into node's place */
+    struct rb_node *old = node, *left;
+
+    node = node->right;
+    while ((left = node->left)) {
+      node = left;
+    }
+
+    rb_change_child(old, node, old->parent, root);
+
+    child = node->right;
+    parent = node->parent;
+    color = node->color;
+
+    if (parent == old) {
+      parent = node;
+    } else {
+      if (child) {
+        child->parent = parent;
+      }
+      parent->left = child;
+      node->right = old->right;
+      old->right->parent = node;
+    }
+
+    node->parent = old->parent;
+    node->color = old->color;
+    node->left = old->left;
+    old->left->parent = node;
+    goto color;
+  }
+
+  parent = node->parent;
+  color = node->color;
+  if (child) {
+    child->parent = parent;
+  }
+  rb_change_child(node, child, parent, root);
+
+color:
+  if (color == RB_BLACK) {
+    rb_erase_color(child, parent, root);
+  }
+}
+
+struct rb_node *rb_first(const struct rb_root *root) {
+  struct rb_node *n = root->node;
+  if (!n) {
+    return NULL;
+  }
+  while (n->left) {
+    n = n->left;
+  }
+  return n;
+}
+
+struct rb_node *rb_last(const struct rb_root *root) {
+  struct rb_node *n = root->node;
+  if (!n) {
+    return NULL;
+  }
+  while (n->right) {
+    n = n->right;
+  }
+  return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node) {
+  struct rb_node *parent;
+
+  if (node->right) {
+    node = node->right;
+    while (node->left) {
+      node = node->left;
+    }
+    return (struct rb_node *)node;
+  }
+
+  while ((parent = node->parent) && node == parent->right) {
+    node = parent;
+  }
+  return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node) {
+  struct rb_node *parent;
+
+  if (node->left) {
+    node = node->left;
+    while (node->right) {
+      node = node->right;
+    }
+    return (struct rb_node *)node;
+  }
+
+  while ((parent = node->parent) && node == parent->left) {
+    node = parent;
+  }
+  return parent;
+}
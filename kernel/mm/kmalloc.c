@@ -1,27 +1,35 @@
 /*
  * UnixOS Kernel - Kernel Heap Allocator Implementation
  *
- * A simple bucket-based allocator for kernel memory.
+ * Two-level allocator for kernel memory:
+ *  - a slab front end with power-of-two-ish size classes (32B - 2KB) and
+ *    per-CPU object magazines, so small hot objects avoid the global lock
+ *  - a first-fit block allocator for large requests, which also supplies
+ *    the backing memory for slabs; requests of PAGE_SIZE or more get whole,
+ *    page-aligned pages
  * Fixed to use direct memory region like VibeOS for reliability.
  */
 
+#include "arch/arch.h"
 #include "mm/kmalloc.h"
 #include "mm/pmm.h"
 #include "printk.h"
+#include "string.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Configuration */
 /* ===================================================================== */
 
 #define HEAP_SIZE                                                              \
-  (128 * 1024 * 1024) /* 128MB kernel heap - 4K wallpapers need space */
+  KMALLOC_HEAP_SIZE /* 128MB kernel heap - 4K wallpapers need space */
 #define MIN_ALLOC 32  /* Minimum allocation size */
 #define MAX_ALLOC                                                              \
   (32 * 1024 * 1024) /* Maximum single allocation (32MB for large images) */
 
 /* Fixed heap location - after kernel at 0x42000000 */
 /* Kernel loads at 0x40200000, so 0x42000000 gives 30MB for kernel code/data */
-#define HEAP_BASE 0x42000000
+#define HEAP_BASE KMALLOC_HEAP_BASE
 
 /* Block header */
 struct block_header {
@@ -37,6 +45,51 @@ struct block_header {
 
 #define BLOCK_FLAG_FREE 0x01
 
+/* Slab front end */
+#define SLAB_SHIFT 15
+#define SLAB_SIZE (1UL << SLAB_SHIFT) /* 32KB per slab */
+#define SLAB_BATCH 8                  /* Slabs carved per block refill */
+#define SLAB_HDR_SIZE 64              /* Header padded to a cache line */
+#define SLAB_MAGIC 0x51AB51AB
+#define SLAB_MAX_OBJ 2048 /* Larger requests go to the block allocator */
+#define SLAB_NR_CLASSES 9
+
+#define MAG_SIZE 32  /* Objects cached per CPU per class */
+#define MAG_BATCH 16 /* Objects moved per refill/flush */
+
+/* Slab header, lives at the start of every SLAB_SIZE-aligned slab */
+struct slab {
+  uint32_t magic;
+  uint16_t class_idx;
+  uint16_t inuse;     /* Objects handed out (including magazines) */
+  uint16_t total;     /* Objects in this slab */
+  uint16_t on_partial; /* Linked on the class partial list */
+  void *freelist;     /* Free objects, linked through their first word */
+  struct slab *next;
+  struct slab *prev;
+};
+
+/* Size class: shared slab lists, protected by @lock */
+struct kmem_class {
+  size_t size;
+  spinlock_t lock;
+  struct slab *partial; /* Slabs with at least one free object */
+  size_t nr_slabs;
+  size_t nr_full;
+};
+
+/* Per-CPU magazine for one size class - only touched with IRQs off */
+struct kmem_magazine {
+  uint32_t count;
+  void *objs[MAG_SIZE];
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t frees;
+  uint64_t flushes;
+  uint64_t bytes_requested;
+  uint64_t bytes_allocated;
+};
+
 /* ===================================================================== */
 /* Static data */
 /* ===================================================================== */
@@ -48,20 +101,28 @@ static size_t heap_total;
 static size_t heap_used;
 static bool heap_initialized = false;
 
-/* Simple spinlock for heap operations */
-static volatile int heap_lock = 0;
+/* Protects the block allocator's free list and counters */
+static DEFINE_SPINLOCK(heap_lock);
 
-static void lock_heap(void) {
-  while (__atomic_test_and_set(&heap_lock, __ATOMIC_ACQUIRE)) {
-#ifdef ARCH_ARM64
-    asm volatile("yield");
-#elif defined(ARCH_X86_64) || defined(ARCH_X86)
-    asm volatile("pause");
-#endif
-  }
-}
+static void lock_heap(void) { spin_lock(&heap_lock); }
+
+static void unlock_heap(void) { spin_unlock(&heap_lock); }
 
-static void unlock_heap(void) { __atomic_clear(&heap_lock, __ATOMIC_RELEASE); }
+/* Slab state */
+static const size_t class_sizes[SLAB_NR_CLASSES] = {
+    32, 64, 96, 128, 192, 256, 512, 1024, 2048};
+static struct kmem_class classes[SLAB_NR_CLASSES];
+static struct kmem_magazine magazines[MAX_CPUS][SLAB_NR_CLASSES];
+
+/* Pool of empty slabs shared by all classes */
+static DEFINE_SPINLOCK(slab_pool_lock);
+static struct slab *slab_pool;
+static size_t slab_pool_count;
+static size_t slab_carved;   /* Total slabs carved from the block allocator */
+static size_t slab_overhead; /* Alignment slack lost while carving */
+
+/* One byte per SLAB_SIZE chunk of the heap: non-zero if chunk is a slab */
+static uint8_t slab_map[HEAP_SIZE >> SLAB_SHIFT];
 
 /* ===================================================================== */
 /* Helper functions */
@@ -99,6 +160,11 @@ void kmalloc_init(void) {
   free_list->next = NULL;
   free_list->prev = NULL;
 
+  for (int i = 0; i < SLAB_NR_CLASSES; i++) {
+    classes[i].size = class_sizes[i];
+    spin_lock_init(&classes[i].lock);
+  }
+
   heap_initialized = true;
 
   printk(KERN_INFO "KMALLOC: Heap at 0x%lx - 0x%lx (%lu KB)\n",
@@ -107,23 +173,14 @@ void kmalloc_init(void) {
 }
 
 /* ===================================================================== */
-/* Allocation */
+/* Block allocator (large requests and slab backing) */
 /* ===================================================================== */
 
-void *_kmalloc(size_t size, uint32_t flags) {
-  if (!heap_initialized) {
-    kmalloc_init();
-    if (!heap_initialized) {
-      return NULL;
-    }
-  }
-
-  if (size == 0 || size > MAX_ALLOC) {
-    return NULL;
-  }
-
+/* @align: 0, or a power of two the returned pointer is aligned to */
+static void *block_alloc(size_t size, size_t align, uint32_t flags) {
   /* Align size and add header */
   size_t total_size = align_up(size + sizeof(struct block_header), MIN_ALLOC);
+  size_t lead = 0;
 
   lock_heap();
 
@@ -138,7 +195,20 @@ void *_kmalloc(size_t size, uint32_t flags) {
       return NULL;
     }
 
-    if (block->size >= total_size) {
+    /*
+     * Space to skip so the data lands on an @align boundary. A gap too
+     * small to stay behind as a free block moves to the next boundary.
+     */
+    lead = 0;
+    if (align) {
+      uintptr_t data = (uintptr_t)block_data(block);
+      lead = align_up(data, align) - data;
+      if (lead && lead < sizeof(struct block_header) + MIN_ALLOC) {
+        lead += align;
+      }
+    }
+
+    if (block->size >= lead + total_size) {
       /* Found a suitable block */
       break;
     }
@@ -153,6 +223,23 @@ void *_kmalloc(size_t size, uint32_t flags) {
     return NULL;
   }
 
+  /* Leave the gap before an aligned block on the free list */
+  if (lead) {
+    struct block_header *gap = block;
+    block = (struct block_header *)((uint8_t *)gap + lead);
+    block->size = gap->size - lead;
+    block->magic = BLOCK_MAGIC_FREE;
+    block->flags = BLOCK_FLAG_FREE;
+    block->next = gap->next;
+    block->prev = gap;
+    if (gap->next) {
+      gap->next->prev = block;
+    }
+    gap->size = lead;
+    gap->next = block;
+    prev_free = gap;
+  }
+
   /* Split block if it's much larger than needed */
   if (block->size >= total_size + sizeof(struct block_header) + MIN_ALLOC) {
     /* Create new free block from remainder */
@@ -196,28 +283,13 @@ void *_kmalloc(size_t size, uint32_t flags) {
 
   /* Zero if requested */
   if (flags & GFP_ZERO) {
-    uint8_t *p = (uint8_t *)ptr;
-    for (size_t i = 0; i < size; i++) {
-      p[i] = 0;
-    }
+    memset(ptr, 0, size);
   }
 
   return ptr;
 }
 
-void *kzalloc(size_t size, uint32_t flags) {
-  return kmalloc(size, flags | GFP_ZERO);
-}
-
-/* ===================================================================== */
-/* Deallocation */
-/* ===================================================================== */
-
-void kfree(void *ptr) {
-  if (!ptr) {
-    return;
-  }
-
+static void block_free(void *ptr) {
   struct block_header *block = data_to_block(ptr);
 
   /* Validate block */
@@ -266,6 +338,303 @@ void kfree(void *ptr) {
   unlock_heap();
 }
 
+
+/* ===================================================================== */
+/* Slab front end */
+/* ===================================================================== */
+
+static inline unsigned int this_cpu(void) {
+  uint32_t cpu = arch_cpu_id();
+  return cpu < MAX_CPUS ? cpu : 0;
+}
+
+static inline int size_to_class(size_t size) {
+  for (int i = 0; i < SLAB_NR_CLASSES; i++) {
+    if (size <= class_sizes[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static inline size_t slab_map_index(const void *ptr) {
+  return (size_t)((const uint8_t *)ptr - heap_start) >> SLAB_SHIFT;
+}
+
+/* Return the slab owning @ptr, or NULL if it came from the block allocator */
+static inline struct slab *ptr_to_slab(const void *ptr) {
+  if ((const uint8_t *)ptr < heap_start || (const uint8_t *)ptr >= heap_end) {
+    return NULL;
+  }
+  if (!slab_map[slab_map_index(ptr)]) {
+    return NULL;
+  }
+  return (struct slab *)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+}
+
+/*
+ * Carve SLAB_BATCH aligned slabs out of one block allocation and put them
+ * in the empty-slab pool. Slabs are never handed back to the block
+ * allocator; empty ones are recycled across classes via the pool.
+ * Called with slab_pool_lock held.
+ */
+static int slab_pool_grow(void) {
+  size_t len = SLAB_BATCH * SLAB_SIZE + SLAB_SIZE;
+  uint8_t *raw = block_alloc(len, 0, 0);
+  if (!raw) {
+    return -1;
+  }
+
+  uint8_t *base = (uint8_t *)align_up((size_t)raw, SLAB_SIZE);
+  slab_overhead += SLAB_SIZE;
+
+  for (int i = 0; i < SLAB_BATCH; i++) {
+    struct slab *slab = (struct slab *)(base + i * SLAB_SIZE);
+    slab->magic = SLAB_MAGIC;
+    slab->next = slab_pool;
+    slab_pool = slab;
+    slab_map[slab_map_index(slab)] = 1;
+  }
+  slab_pool_count += SLAB_BATCH;
+  slab_carved += SLAB_BATCH;
+  return 0;
+}
+
+static struct slab *slab_get_empty(void) {
+  struct slab *slab = NULL;
+
+  spin_lock(&slab_pool_lock);
+  if (slab_pool || slab_pool_grow() == 0) {
+    slab = slab_pool;
+    slab_pool = slab->next;
+    slab_pool_count--;
+  }
+  spin_unlock(&slab_pool_lock);
+
+  return slab;
+}
+
+static void slab_put_empty(struct slab *slab) {
+  spin_lock(&slab_pool_lock);
+  slab->next = slab_pool;
+  slab_pool = slab;
+  slab_pool_count++;
+  spin_unlock(&slab_pool_lock);
+}
+
+/* Format a fresh slab for @idx and thread all objects onto its freelist */
+static void slab_format(struct slab *slab, int idx) {
+  size_t size = class_sizes[idx];
+  uint8_t *obj = (uint8_t *)slab + SLAB_HDR_SIZE;
+
+  slab->magic = SLAB_MAGIC;
+  slab->class_idx = (uint16_t)idx;
+  slab->inuse = 0;
+  slab->total = (uint16_t)((SLAB_SIZE - SLAB_HDR_SIZE) / size);
+  slab->on_partial = 0;
+  slab->freelist = NULL;
+
+  for (int i = slab->total - 1; i >= 0; i--) {
+    void **o = (void **)(obj + (size_t)i * size);
+    *o = slab->freelist;
+    slab->freelist = o;
+  }
+}
+
+static void partial_add(struct kmem_class *cls, struct slab *slab) {
+  slab->prev = NULL;
+  slab->next = cls->partial;
+  if (cls->partial) {
+    cls->partial->prev = slab;
+  }
+  cls->partial = slab;
+  slab->on_partial = 1;
+}
+
+static void partial_del(struct kmem_class *cls, struct slab *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    cls->partial = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = slab->prev = NULL;
+  slab->on_partial = 0;
+}
+
+/*
+ * Move up to MAG_BATCH objects from the class slabs into @mag.
+ * Called with IRQs disabled.
+ */
+static void magazine_refill(int idx, struct kmem_magazine *mag) {
+  struct kmem_class *cls = &classes[idx];
+
+  spin_lock(&cls->lock);
+  while (mag->count < MAG_BATCH) {
+    struct slab *slab = cls->partial;
+
+    if (!slab) {
+      /* Drop the class lock while touching the pool/block allocator */
+      spin_unlock(&cls->lock);
+      slab = slab_get_empty();
+      spin_lock(&cls->lock);
+      if (!slab) {
+        break;
+      }
+      slab_format(slab, idx);
+      cls->nr_slabs++;
+      partial_add(cls, slab);
+    }
+
+    while (slab->freelist && mag->count < MAG_BATCH) {
+      void **obj = slab->freelist;
+      slab->freelist = *obj;
+      slab->inuse++;
+      mag->objs[mag->count++] = obj;
+    }
+
+    if (!slab->freelist) {
+      partial_del(cls, slab);
+      cls->nr_full++;
+    }
+  }
+  spin_unlock(&cls->lock);
+}
+
+/*
+ * Return the oldest MAG_BATCH objects of a full magazine to their slabs.
+ * Called with IRQs disabled.
+ */
+static void magazine_flush(int idx, struct kmem_magazine *mag) {
+  struct kmem_class *cls = &classes[idx];
+  struct slab *empty = NULL;
+
+  spin_lock(&cls->lock);
+  for (uint32_t i = 0; i < MAG_BATCH; i++) {
+    void **obj = mag->objs[i];
+    struct slab *slab = (struct slab *)((uintptr_t)obj & ~(SLAB_SIZE - 1));
+
+    *obj = slab->freelist;
+    slab->freelist = obj;
+    if (!slab->on_partial) {
+      cls->nr_full--;
+      partial_add(cls, slab);
+    }
+
+    /* Give empty slabs back to the pool, but keep a class's last slab */
+    if (--slab->inuse == 0 && cls->nr_slabs > 1) {
+      partial_del(cls, slab);
+      cls->nr_slabs--;
+      slab->next = empty;
+      empty = slab;
+    }
+  }
+  spin_unlock(&cls->lock);
+
+  mag->count -= MAG_BATCH;
+  memmove(&mag->objs[0], &mag->objs[MAG_BATCH], mag->count * sizeof(void *));
+  mag->flushes++;
+
+  while (empty) {
+    struct slab *next = empty->next;
+    slab_put_empty(empty);
+    empty = next;
+  }
+}
+
+static void *slab_alloc(int idx, size_t size, uint32_t flags) {
+  uint64_t irq = arch_irq_save_local();
+  struct kmem_magazine *mag = &magazines[this_cpu()][idx];
+  void *obj = NULL;
+
+  if (mag->count) {
+    mag->hits++;
+  } else {
+    mag->misses++;
+    magazine_refill(idx, mag);
+  }
+
+  if (mag->count) {
+    obj = mag->objs[--mag->count];
+    mag->bytes_requested += size;
+    mag->bytes_allocated += class_sizes[idx];
+  }
+  arch_irq_restore_local(irq);
+
+  if (obj && (flags & GFP_ZERO)) {
+    memset(obj, 0, size);
+  }
+  return obj;
+}
+
+static void slab_free(struct slab *slab, void *ptr) {
+  int idx = slab->class_idx;
+  uint64_t irq = arch_irq_save_local();
+  struct kmem_magazine *mag = &magazines[this_cpu()][idx];
+
+  if (mag->count == MAG_SIZE) {
+    magazine_flush(idx, mag);
+  }
+  mag->objs[mag->count++] = ptr;
+  mag->frees++;
+  arch_irq_restore_local(irq);
+}
+
+/* ===================================================================== */
+/* Public allocation API */
+/* ===================================================================== */
+
+void *_kmalloc(size_t size, uint32_t flags) {
+  if (!heap_initialized) {
+    kmalloc_init();
+    if (!heap_initialized) {
+      return NULL;
+    }
+  }
+
+  if (size == 0 || size > MAX_ALLOC) {
+    return NULL;
+  }
+
+  if (size <= SLAB_MAX_OBJ) {
+    void *ptr = slab_alloc(size_to_class(size), size, flags);
+    if (ptr) {
+      return ptr;
+    }
+    /* Slab pool exhausted - fall back to the block allocator */
+  }
+
+  /* Whole pages, so page-sized buffers are page-aligned */
+  if (size >= PAGE_SIZE) {
+    return block_alloc(align_up(size, PAGE_SIZE), PAGE_SIZE, flags);
+  }
+  return block_alloc(size, 0, flags);
+}
+
+void *kzalloc(size_t size, uint32_t flags) {
+  return kmalloc(size, flags | GFP_ZERO);
+}
+
+void kfree(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+
+  struct slab *slab = ptr_to_slab(ptr);
+  if (slab) {
+    if (slab->magic != SLAB_MAGIC) {
+      printk(KERN_ERR "KMALLOC: kfree of %p in corrupted slab\n", ptr);
+      return;
+    }
+    slab_free(slab, ptr);
+    return;
+  }
+
+  block_free(ptr);
+}
+
 /* ===================================================================== */
 /* Reallocation */
 /* ===================================================================== */
@@ -280,8 +649,14 @@ void *krealloc(void *ptr, size_t new_size, uint32_t flags) {
     return NULL;
   }
 
-  struct block_header *block = data_to_block(ptr);
-  size_t old_size = block->size - sizeof(struct block_header);
+  size_t old_size;
+  struct slab *slab = ptr_to_slab(ptr);
+  if (slab) {
+    old_size = class_sizes[slab->class_idx];
+  } else {
+    struct block_header *block = data_to_block(ptr);
+    old_size = block->size - sizeof(struct block_header);
+  }
 
   /* If new size fits in current block, just return */
   if (new_size <= old_size) {
@@ -295,11 +670,7 @@ void *krealloc(void *ptr, size_t new_size, uint32_t flags) {
   }
 
   /* Copy old data */
-  uint8_t *src = (uint8_t *)ptr;
-  uint8_t *dst = (uint8_t *)new_ptr;
-  for (size_t i = 0; i < old_size; i++) {
-    dst[i] = src[i];
-  }
+  memcpy(new_ptr, ptr, old_size);
 
   /* Free old block */
   kfree(ptr);
@@ -319,3 +690,69 @@ void kmalloc_get_stats(size_t *total, size_t *used, size_t *free_mem) {
   if (free_mem)
     *free_mem = heap_total - heap_used;
 }
+
+int kmalloc_get_class_stats(unsigned int idx, struct kmalloc_class_stats *st) {
+  if (idx >= SLAB_NR_CLASSES || !st) {
+    return -1;
+  }
+
+  struct kmem_class *cls = &classes[idx];
+  memset(st, 0, sizeof(*st));
+  st->obj_size = class_sizes[idx];
+
+  for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+    struct kmem_magazine *mag = &magazines[cpu][idx];
+    st->hits += mag->hits;
+    st->misses += mag->misses;
+    st->frees += mag->frees;
+    st->flushes += mag->flushes;
+    st->cached += mag->count;
+    st->bytes_requested += mag->bytes_requested;
+    st->bytes_allocated += mag->bytes_allocated;
+  }
+
+  uint64_t irq = spin_lock_irqsave(&cls->lock);
+  size_t per_slab = (SLAB_SIZE - SLAB_HDR_SIZE) / class_sizes[idx];
+  st->slabs = cls->nr_slabs;
+  st->objs_total = cls->nr_slabs * per_slab;
+  for (struct slab *s = cls->partial; s; s = s->next) {
+    st->objs_free += s->total - s->inuse;
+  }
+  spin_unlock_irqrestore(&cls->lock, irq);
+
+  return 0;
+}
+
+void kmalloc_dump_stats(void) {
+  struct kmalloc_class_stats st;
+
+  printk(KERN_INFO "KMALLOC: heap %lu KB used / %lu KB, %lu slabs carved "
+                   "(%lu in pool, %lu KB alignment slack)\n",
+         (unsigned long)(heap_used / 1024), (unsigned long)(heap_total / 1024),
+         (unsigned long)slab_carved, (unsigned long)slab_pool_count,
+         (unsigned long)(slab_overhead / 1024));
+  printk(KERN_INFO "  size     hits   misses    slabs  inuse%%  waste%%\n");
+
+  for (unsigned int i = 0; i < SLAB_NR_CLASSES; i++) {
+    kmalloc_get_class_stats(i, &st);
+
+    /* External fragmentation: free objects stranded in partial slabs */
+    unsigned long used_pct = 0;
+    if (st.objs_total) {
+      used_pct = (unsigned long)((st.objs_total - st.objs_free - st.cached) *
+                                 100 / st.objs_total);
+    }
+    /* Internal fragmentation: rounding up to the class size */
+    unsigned long waste_pct = 0;
+    if (st.bytes_allocated) {
+      waste_pct =
+          (unsigned long)((st.bytes_allocated - st.bytes_requested) * 100 /
+                          st.bytes_allocated);
+    }
+
+    printk(KERN_INFO "  %4lu %8lu %8lu %8lu %6lu %7lu\n",
+           (unsigned long)st.obj_size, (unsigned long)st.hits,
+           (unsigned long)st.misses, (unsigned long)st.slabs, used_pct,
+           waste_pct);
+  }
+}
@@ -1,29 +1,74 @@
 /*
  * UnixOS Kernel - Physical Memory Manager Implementation
- * 
+ *
  * Buddy allocator for physical page allocation.
+ *
+ * Memory banks come from the device tree /memory nodes (falling back to
+ * a fixed default when no DTB is passed). A struct page array covering
+ * all banks is carved from free memory at boot; every non-reserved page
+ * is then handed to per-order doubly-linked free lists, giving O(log n)
+ * split and coalesce.
+ *
+ * Order-0 pages are served from per-CPU hot/cold lists (pcp) that are
+ * refilled from and drained to the buddy lists in batches, so the common
+ * single-page path only touches CPU-local state.
  */
 
+#include "arch/arch.h"
+#include "fdt.h"
+#include "mm/kmalloc.h"
 #include "mm/pmm.h"
+#include "mm/vmm.h"
 #include "printk.h"
+#include "string.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Constants */
 /* ===================================================================== */
 
-#define MAX_ORDER           11      /* Maximum order (2^11 = 2048 pages = 8MB) */
+#define MAX_ORDER           PMM_MAX_ORDER
 #define BUDDY_MAX_PAGES     (1UL << MAX_ORDER)
 
-/* Initial memory layout - will be updated from DTB/UEFI */
+/* Default memory layout when no device tree is available */
 #define MEMORY_BASE         0x40000000  /* 1GB - typical for ARM64 */
 #define MEMORY_SIZE         (256UL * 1024 * 1024)  /* 256MB - matches QEMU default */
 
+/*
+ * vmm_init identity-maps the RAM banks found here, and page tables are
+ * accessed through that mapping, so nothing above its limit is used.
+ */
+#define DIRECT_MAP_END      VMM_DIRECT_MAP_END
+
+/* Fixed program load window used by core/process.c (see is_valid_user_ptr) */
+#define PROGRAM_LOAD_BASE   0x44000000UL
+#define PROGRAM_LOAD_END    0x50000000UL
+
+/* Per-CPU page list tuning */
+#define PCP_BATCH           16      /* Pages moved per refill/drain */
+#define PCP_HIGH            64      /* Drain when a list grows past this */
+
+#define PMM_MAX_REGIONS     8
+#define PMM_MAX_RESERVED    16
+
 /* ===================================================================== */
 /* Static data */
 /* ===================================================================== */
 
+struct pmm_range {
+    phys_addr_t base;
+    phys_addr_t end;
+};
+
+/* Memory banks and boot-time reservations */
+static struct pmm_range mem_regions[PMM_MAX_REGIONS];
+static int nr_mem_regions;
+static struct pmm_range reserved[PMM_MAX_RESERVED];
+static int nr_reserved;
+
 /* Free lists for each order */
 static struct page *free_lists[MAX_ORDER + 1];
+static size_t free_count[MAX_ORDER + 1];
 
 /* Page array - describes all physical pages */
 static struct page *page_array;
@@ -35,11 +80,26 @@ static size_t total_memory;
 static phys_addr_t memory_start;
 static phys_addr_t memory_end;
 
-/* Bitmap for early page tracking before page_array is set up */
-/* Track 64K pages = 256MB - enough for initial boot */
-#define EARLY_BITMAP_SIZE   (64 * 1024 / 8)  /* 8KB bitmap */
-static uint8_t early_bitmap[EARLY_BITMAP_SIZE];
-static bool early_mode = true;
+/* Protects free lists and page state */
+static DEFINE_SPINLOCK(pmm_lock);
+
+/*
+ * Per-CPU order-0 page list. Hot (recently freed, likely cache-warm) pages
+ * sit at the head, cold pages at the tail. The lock is only contended when
+ * another CPU drains this list.
+ */
+struct per_cpu_pages {
+    spinlock_t lock;
+    struct page *head;
+    struct page *tail;
+    int count;
+    uint64_t hits;
+    uint64_t refills;
+    uint64_t drains;
+};
+
+static struct per_cpu_pages pcp_lists[MAX_CPUS];
+static bool pcp_enabled;
 
 /* ===================================================================== */
 /* Helper functions */
@@ -55,63 +115,95 @@ static inline size_t order_to_size(unsigned int order)
     return order_to_pages(order) * PAGE_SIZE;
 }
 
-static inline unsigned int size_to_order(size_t size)
-{
-    unsigned int order = 0;
-    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    
-    while ((1UL << order) < pages && order < MAX_ORDER) {
-        order++;
-    }
-    
-    return order;
-}
-
 /* ===================================================================== */
-/* Early boot allocator (bitmap-based) */
+/* Boot-time memory map */
 /* ===================================================================== */
 
-static void early_mark_used(phys_addr_t addr)
+static void add_region(phys_addr_t base, phys_addr_t end)
 {
-    size_t pfn = PHYS_TO_PFN(addr - memory_start);
-    if (pfn < EARLY_BITMAP_SIZE * 8) {
-        early_bitmap[pfn / 8] |= (1 << (pfn % 8));
+    base = PAGE_ALIGN(base);
+    end = PAGE_ALIGN_DOWN(end);
+    if (end > DIRECT_MAP_END) {
+        end = DIRECT_MAP_END;
+    }
+    if (base >= end || nr_mem_regions >= PMM_MAX_REGIONS) {
+        return;
     }
+    mem_regions[nr_mem_regions].base = base;
+    mem_regions[nr_mem_regions].end = end;
+    nr_mem_regions++;
 }
 
-static void early_mark_free(phys_addr_t addr)
+static void reserve_range(phys_addr_t base, phys_addr_t end)
 {
-    size_t pfn = PHYS_TO_PFN(addr - memory_start);
-    if (pfn < EARLY_BITMAP_SIZE * 8) {
-        early_bitmap[pfn / 8] &= ~(1 << (pfn % 8));
+    if (nr_reserved >= PMM_MAX_RESERVED) {
+        printk(KERN_WARNING "PMM: Too many reserved ranges\n");
+        return;
     }
+    reserved[nr_reserved].base = PAGE_ALIGN_DOWN(base);
+    reserved[nr_reserved].end = PAGE_ALIGN(end);
+    nr_reserved++;
 }
 
-static bool early_is_free(phys_addr_t addr)
+/* Return the end of the reservation overlapping [base, end), or 0 */
+static phys_addr_t reserved_overlap(phys_addr_t base, phys_addr_t end)
 {
-    size_t pfn = PHYS_TO_PFN(addr - memory_start);
-    if (pfn >= EARLY_BITMAP_SIZE * 8) {
-        return false;
+    for (int i = 0; i < nr_reserved; i++) {
+        if (base < reserved[i].end && end > reserved[i].base) {
+            return reserved[i].end;
+        }
     }
-    return !(early_bitmap[pfn / 8] & (1 << (pfn % 8)));
+    return 0;
 }
 
-static phys_addr_t early_alloc_page(void)
+/* Find free, unreserved, @align-aligned memory before the buddy lists exist */
+static phys_addr_t early_find_free(size_t size, size_t align)
 {
-    for (size_t i = 0; i < EARLY_BITMAP_SIZE; i++) {
-        if (early_bitmap[i] != 0xFF) {
-            for (int j = 0; j < 8; j++) {
-                if (!(early_bitmap[i] & (1 << j))) {
-                    early_bitmap[i] |= (1 << j);
-                    phys_addr_t addr = memory_start + (i * 8 + j) * PAGE_SIZE;
-                    return addr;
-                }
+    for (int r = 0; r < nr_mem_regions; r++) {
+        phys_addr_t addr = ALIGN(mem_regions[r].base, align);
+        phys_addr_t skip;
+
+        while (addr + size <= mem_regions[r].end) {
+            skip = reserved_overlap(addr, addr + size);
+            if (!skip) {
+                return addr;
             }
+            addr = ALIGN(skip, align);
         }
     }
     return 0;
 }
 
+static void discover_memory(void *dtb)
+{
+    struct fdt_mem_region banks[PMM_MAX_REGIONS];
+    int n = fdt_get_memory(dtb, banks, PMM_MAX_REGIONS);
+
+    for (int i = 0; i < n; i++) {
+        add_region(banks[i].base, banks[i].base + banks[i].size);
+    }
+
+    if (nr_mem_regions > 0) {
+        printk(KERN_INFO "PMM: %d memory bank(s) from device tree\n",
+               nr_mem_regions);
+        reserve_range((phys_addr_t)dtb, (phys_addr_t)dtb + fdt_totalsize(dtb));
+    } else {
+        printk(KERN_INFO "PMM: No device tree memory map, using default\n");
+        add_region(MEMORY_BASE, MEMORY_BASE + MEMORY_SIZE);
+    }
+
+    memory_start = mem_regions[0].base;
+    memory_end = mem_regions[0].end;
+    for (int i = 1; i < nr_mem_regions; i++) {
+        if (mem_regions[i].base < memory_start) {
+            memory_start = mem_regions[i].base;
+        }
+        if (mem_regions[i].end > memory_end) {
+            memory_end = mem_regions[i].end;
+        }
+    }
+}
+
 /* ===================================================================== */
 /* Buddy allocator */
 /* ===================================================================== */
@@ -121,88 +213,346 @@ static inline phys_addr_t buddy_address(phys_addr_t addr, unsigned int order)
     return addr ^ (PAGE_SIZE << order);
 }
 
-static void buddy_add_to_list(phys_addr_t addr, unsigned int order)
+static void buddy_add_to_list(struct page *page, unsigned int order)
 {
-    struct page *page = pmm_phys_to_page(addr);
     page->order = order;
-    page->flags = PAGE_FLAG_FREE;
+    page->flags = PAGE_FLAG_BUDDY;
+    page->prev = NULL;
     page->next = free_lists[order];
+    if (free_lists[order]) {
+        free_lists[order]->prev = page;
+    }
     free_lists[order] = page;
+    free_count[order]++;
 }
 
-static phys_addr_t buddy_remove_from_list(unsigned int order)
+static void buddy_del_from_list(struct page *page, unsigned int order)
 {
-    if (!free_lists[order]) {
-        return 0;
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        free_lists[order] = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
     }
-    
-    struct page *page = free_lists[order];
-    free_lists[order] = page->next;
     page->next = NULL;
-    page->flags = PAGE_FLAG_USED;
-    
-    return pmm_page_to_phys(page);
+    page->prev = NULL;
+    page->flags = PAGE_FLAG_FREE;
+    free_count[order]--;
+}
+
+/* Give [start, end) to the free lists as maximal naturally-aligned blocks */
+static void buddy_free_range(phys_addr_t start, phys_addr_t end)
+{
+    while (start < end) {
+        unsigned int order = MAX_ORDER;
+
+        while (order > 0 &&
+               (!IS_ALIGNED(start, order_to_size(order)) ||
+                start + order_to_size(order) > end)) {
+            order--;
+        }
+
+        buddy_add_to_list(pmm_phys_to_page(start), order);
+        free_pages_count += order_to_pages(order);
+        start += order_to_size(order);
+    }
+}
+
+static phys_addr_t __alloc_pages(unsigned int order)
+{
+    for (unsigned int o = order; o <= MAX_ORDER; o++) {
+        struct page *page = free_lists[o];
+        if (!page) {
+            continue;
+        }
+
+        buddy_del_from_list(page, o);
+        phys_addr_t addr = pmm_page_to_phys(page);
+
+        /* Split larger blocks, returning the upper halves */
+        while (o > order) {
+            o--;
+            buddy_add_to_list(pmm_phys_to_page(buddy_address(addr, o)), o);
+        }
+
+        page->flags = PAGE_FLAG_USED;
+        page->order = order;
+        atomic_set(&page->refcount, 1);
+        free_pages_count -= order_to_pages(order);
+        return addr;
+    }
+
+    return 0;
+}
+
+static void __free_pages(phys_addr_t addr, unsigned int order)
+{
+    struct page *page = pmm_phys_to_page(addr);
+
+    if (!page || (page->flags & (PAGE_FLAG_BUDDY | PAGE_FLAG_RESERVED))) {
+        printk(KERN_ERR "PMM: Bad free of 0x%lx (order %u)\n",
+               (unsigned long)addr, order);
+        return;
+    }
+
+    page->flags = PAGE_FLAG_FREE;
+    free_pages_count += order_to_pages(order);
+
+    /* Coalesce with free buddies of the same order */
+    while (order < MAX_ORDER) {
+        phys_addr_t buddy = buddy_address(addr, order);
+        struct page *buddy_page = pmm_phys_to_page(buddy);
+
+        if (!buddy_page || !(buddy_page->flags & PAGE_FLAG_BUDDY) ||
+            buddy_page->order != order) {
+            break;
+        }
+
+        buddy_del_from_list(buddy_page, order);
+        if (buddy < addr) {
+            addr = buddy;
+        }
+        order++;
+    }
+
+    buddy_add_to_list(pmm_phys_to_page(addr), order);
+}
+
+/* ===================================================================== */
+/* Per-CPU page lists */
+/* ===================================================================== */
+
+static inline struct per_cpu_pages *this_pcp(void)
+{
+    uint32_t cpu = arch_cpu_id();
+    return &pcp_lists[cpu < MAX_CPUS ? cpu : 0];
+}
+
+static void pcp_add_head(struct per_cpu_pages *pcp, struct page *page)
+{
+    page->prev = NULL;
+    page->next = pcp->head;
+    if (pcp->head) {
+        pcp->head->prev = page;
+    } else {
+        pcp->tail = page;
+    }
+    pcp->head = page;
+    pcp->count++;
+}
+
+static void pcp_add_tail(struct per_cpu_pages *pcp, struct page *page)
+{
+    page->next = NULL;
+    page->prev = pcp->tail;
+    if (pcp->tail) {
+        pcp->tail->next = page;
+    } else {
+        pcp->head = page;
+    }
+    pcp->tail = page;
+    pcp->count++;
+}
+
+static struct page *pcp_del(struct per_cpu_pages *pcp, struct page *page)
+{
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        pcp->head = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    } else {
+        pcp->tail = page->prev;
+    }
+    page->next = NULL;
+    page->prev = NULL;
+    pcp->count--;
+    return page;
+}
+
+/* Pull PCP_BATCH pages from the buddy lists. Called with pcp->lock held. */
+static void pcp_refill(struct per_cpu_pages *pcp)
+{
+    spin_lock(&pmm_lock);
+    for (int i = 0; i < PCP_BATCH; i++) {
+        phys_addr_t addr = __alloc_pages(0);
+        if (!addr) {
+            break;
+        }
+        struct page *page = pmm_phys_to_page(addr);
+        page->flags = PAGE_FLAG_FREE;
+        pcp_add_tail(pcp, page);
+    }
+    spin_unlock(&pmm_lock);
+    pcp->refills++;
+}
+
+/* Return up to @count of the coldest pages. Called with pcp->lock held. */
+static void pcp_drain(struct per_cpu_pages *pcp, int count)
+{
+    spin_lock(&pmm_lock);
+    while (count-- > 0 && pcp->tail) {
+        struct page *page = pcp_del(pcp, pcp->tail);
+        page->flags = PAGE_FLAG_USED;
+        __free_pages(pmm_page_to_phys(page), 0);
+    }
+    spin_unlock(&pmm_lock);
+    pcp->drains++;
+}
+
+static phys_addr_t pcp_alloc_page(void)
+{
+    uint64_t flags = arch_irq_save_local();
+    struct per_cpu_pages *pcp = this_pcp();
+    struct page *page = NULL;
+
+    spin_lock(&pcp->lock);
+    if (pcp->head) {
+        pcp->hits++;
+    } else {
+        pcp_refill(pcp);
+    }
+    if (pcp->head) {
+        page = pcp_del(pcp, pcp->head);
+        page->flags = PAGE_FLAG_USED;
+        page->order = 0;
+        atomic_set(&page->refcount, 1);
+    }
+    spin_unlock(&pcp->lock);
+    arch_irq_restore_local(flags);
+
+    return page ? pmm_page_to_phys(page) : 0;
+}
+
+static void pcp_free_page(phys_addr_t addr, bool cold)
+{
+    struct page *page = pmm_phys_to_page(addr);
+
+    if (!page || page->flags != PAGE_FLAG_USED) {
+        printk(KERN_ERR "PMM: Bad free of 0x%lx\n", (unsigned long)addr);
+        return;
+    }
+
+    uint64_t flags = arch_irq_save_local();
+    struct per_cpu_pages *pcp = this_pcp();
+
+    spin_lock(&pcp->lock);
+    page->flags = PAGE_FLAG_FREE;
+    if (cold) {
+        pcp_add_tail(pcp, page);
+    } else {
+        pcp_add_head(pcp, page);
+    }
+    if (pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+    spin_unlock(&pcp->lock);
+    arch_irq_restore_local(flags);
+}
+
+void pmm_drain_pcp(void)
+{
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct per_cpu_pages *pcp = &pcp_lists[cpu];
+        uint64_t flags = spin_lock_irqsave(&pcp->lock);
+        if (pcp->count) {
+            pcp_drain(pcp, pcp->count);
+        }
+        spin_unlock_irqrestore(&pcp->lock, flags);
+    }
 }
 
 /* ===================================================================== */
 /* Public functions */
 /* ===================================================================== */
 
-int pmm_init(void)
+int pmm_init(void *dtb)
 {
     printk("PMM: Starting init\n");
-    
-    /* For now, use hardcoded memory range */
-    /* TODO: Parse device tree or UEFI memory map */
-    
-    memory_start = MEMORY_BASE;
-    memory_end = MEMORY_BASE + MEMORY_SIZE;
-    total_memory = MEMORY_SIZE;
-    total_pages = total_memory / PAGE_SIZE;
-    
-    printk("PMM: Memory configured\n");
-    
-    /* Initialize free lists */
+
+    discover_memory(dtb);
+    total_pages = PHYS_TO_PFN(memory_end - memory_start);
+
+    /* Reserve kernel image (including boot stack) */
+    extern char __kernel_start[];
+    extern char __kernel_end[];
+    reserve_range((phys_addr_t)__kernel_start, (phys_addr_t)__kernel_end);
+
+    /* Fixed regions used outside the page allocator */
+    reserve_range(KMALLOC_HEAP_BASE, KMALLOC_HEAP_BASE + KMALLOC_HEAP_SIZE);
+    reserve_range(PROGRAM_LOAD_BASE, PROGRAM_LOAD_END);
+
+    /* Carve the page array out of free memory */
+    size_t array_size = PAGE_ALIGN(total_pages * sizeof(struct page));
+    phys_addr_t array_phys = early_find_free(array_size, PAGE_SIZE);
+    if (!array_phys) {
+        printk(KERN_ERR "PMM: No room for %lu KB page array\n",
+               (unsigned long)(array_size / 1024));
+        return -1;
+    }
+    reserve_range(array_phys, array_phys + array_size);
+    page_array = (struct page *)array_phys;
+    memset(page_array, 0, array_size);
+
+    /* Everything starts reserved; holes between banks stay that way */
+    for (size_t i = 0; i < total_pages; i++) {
+        page_array[i].flags = PAGE_FLAG_RESERVED;
+    }
+
     for (int i = 0; i <= MAX_ORDER; i++) {
         free_lists[i] = NULL;
+        free_count[i] = 0;
     }
-    
-    printk("PMM: Free lists cleared\n");
-    
-    /* Skip bitmap clearing - BSS should already be zero */
-    printk("PMM: Skipping bitmap clear (BSS pre-zeroed)\n");
-    
-    /* Reserve kernel memory */
-    extern char __kernel_start[];
-    extern char __kernel_end[];
-    
-    phys_addr_t kernel_start = (phys_addr_t)__kernel_start;
-    phys_addr_t kernel_end = (phys_addr_t)__kernel_end;
-    
-    printk("PMM: Got kernel addresses\n");
-    
-    /* Mark kernel pages as used */
-    for (phys_addr_t addr = PAGE_ALIGN_DOWN(kernel_start);
-         addr < PAGE_ALIGN(kernel_end);
-         addr += PAGE_SIZE) {
-        early_mark_used(addr);
-    }
-    
-    printk("PMM: Kernel pages marked\n");
-    
-    /* Count free pages */
     free_pages_count = 0;
-    for (size_t i = 0; i < total_pages && i < EARLY_BITMAP_SIZE * 8; i++) {
-        if (!(early_bitmap[i / 8] & (1 << (i % 8)))) {
-            free_pages_count++;
+    total_memory = 0;
+
+    /* Release every unreserved page run in each bank to the buddy lists */
+    for (int r = 0; r < nr_mem_regions; r++) {
+        phys_addr_t run = 0;
+        total_memory += mem_regions[r].end - mem_regions[r].base;
+
+        for (phys_addr_t addr = mem_regions[r].base;
+             addr < mem_regions[r].end;
+             addr += PAGE_SIZE) {
+            phys_addr_t skip = reserved_overlap(addr, addr + PAGE_SIZE);
+            if (!skip) {
+                pmm_phys_to_page(addr)->flags = PAGE_FLAG_FREE;
+                if (!run) {
+                    run = addr;
+                }
+                continue;
+            }
+            if (run) {
+                buddy_free_range(run, addr);
+                run = 0;
+            }
+            /* Jump to the end of the reservation */
+            if (skip > addr + PAGE_SIZE) {
+                addr = (skip < mem_regions[r].end ? skip : mem_regions[r].end)
+                       - PAGE_SIZE;
+            }
+        }
+        if (run) {
+            buddy_free_range(run, mem_regions[r].end);
         }
     }
-    
-    printk("PMM: Init complete\n");
-    
-    /* TODO: Initialize buddy allocator with free pages */
-    /* For now, we stay in early mode using bitmap */
-    
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        spin_lock_init(&pcp_lists[cpu].lock);
+    }
+    pcp_enabled = true;
+
+    printk(KERN_INFO "PMM: 0x%lx-0x%lx, %lu MB total, %lu MB free, "
+                     "page array %lu KB at 0x%lx\n",
+           (unsigned long)memory_start, (unsigned long)memory_end,
+           (unsigned long)(total_memory >> 20),
+           (unsigned long)((free_pages_count * PAGE_SIZE) >> 20),
+           (unsigned long)(array_size / 1024), (unsigned long)array_phys);
+
     return 0;
 }
 
@@ -216,52 +566,27 @@ phys_addr_t pmm_alloc_pages(unsigned int order)
     if (order > MAX_ORDER) {
         return 0;
     }
-    
-    if (early_mode) {
-        /* Allocate contiguous pages in early mode */
-        size_t count = order_to_pages(order);
-        phys_addr_t start = 0;
-        size_t found = 0;
-        
-        for (phys_addr_t addr = memory_start;
-             addr < memory_end;
-             addr += PAGE_SIZE) {
-            if (early_is_free(addr)) {
-                if (found == 0) {
-                    start = addr;
-                }
-                found++;
-                if (found == count) {
-                    /* Mark all as used */
-                    for (size_t i = 0; i < count; i++) {
-                        early_mark_used(start + i * PAGE_SIZE);
-                    }
-                    free_pages_count -= count;
-                    return start;
-                }
-            } else {
-                found = 0;
-            }
-        }
-        return 0;
-    }
-    
-    /* Buddy allocator */
-    for (unsigned int o = order; o <= MAX_ORDER; o++) {
-        phys_addr_t addr = buddy_remove_from_list(o);
+
+    if (order == 0 && pcp_enabled) {
+        phys_addr_t addr = pcp_alloc_page();
         if (addr) {
-            /* Split larger blocks if needed */
-            while (o > order) {
-                o--;
-                phys_addr_t buddy = buddy_address(addr, o);
-                buddy_add_to_list(buddy, o);
-            }
-            free_pages_count -= order_to_pages(order);
             return addr;
         }
     }
-    
-    return 0;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    phys_addr_t addr = __alloc_pages(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    /* Pages parked on per-CPU lists may be fragmenting higher orders */
+    if (!addr && pcp_enabled) {
+        pmm_drain_pcp();
+        flags = spin_lock_irqsave(&pmm_lock);
+        addr = __alloc_pages(order);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    return addr;
 }
 
 void pmm_free_page(phys_addr_t addr)
@@ -269,49 +594,42 @@ void pmm_free_page(phys_addr_t addr)
     pmm_free_pages(addr, 0);
 }
 
-void pmm_free_pages(phys_addr_t addr, unsigned int order)
+void pmm_free_page_cold(phys_addr_t addr)
 {
-    if (!addr || order > MAX_ORDER) {
+    if (!addr || !IS_ALIGNED(addr, PAGE_SIZE)) {
         return;
     }
-    
-    if (early_mode) {
-        size_t count = order_to_pages(order);
-        for (size_t i = 0; i < count; i++) {
-            early_mark_free(addr + i * PAGE_SIZE);
-        }
-        free_pages_count += count;
+    if (pcp_enabled) {
+        pcp_free_page(addr, true);
+    } else {
+        pmm_free_pages(addr, 0);
+    }
+}
+
+void pmm_free_pages(phys_addr_t addr, unsigned int order)
+{
+    if (!addr || order > MAX_ORDER || !IS_ALIGNED(addr, order_to_size(order))) {
         return;
     }
-    
-    /* Buddy allocator - coalesce with buddy if possible */
-    while (order < MAX_ORDER) {
-        phys_addr_t buddy = buddy_address(addr, order);
-        struct page *buddy_page = pmm_phys_to_page(buddy);
-        
-        /* Check if buddy is free and same order */
-        if (buddy_page && buddy_page->flags == PAGE_FLAG_FREE &&
-            buddy_page->order == order) {
-            /* Remove buddy from free list */
-            /* ... */
-            
-            /* Merge with buddy */
-            if (buddy < addr) {
-                addr = buddy;
-            }
-            order++;
-        } else {
-            break;
-        }
+
+    if (order == 0 && pcp_enabled) {
+        pcp_free_page(addr, false);
+        return;
     }
-    
-    buddy_add_to_list(addr, order);
-    free_pages_count += order_to_pages(order);
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    __free_pages(addr, order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
 size_t pmm_get_free_memory(void)
 {
-    return free_pages_count * PAGE_SIZE;
+    size_t pages = free_pages_count;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pages += pcp_lists[cpu].count;
+    }
+    return pages * PAGE_SIZE;
 }
 
 size_t pmm_get_total_memory(void)
@@ -319,6 +637,73 @@ size_t pmm_get_total_memory(void)
     return total_memory;
 }
 
+size_t pmm_get_free_blocks(unsigned int order)
+{
+    return order <= MAX_ORDER ? free_count[order] : 0;
+}
+
+void pmm_get_pcp_stats(uint32_t cpu, uint64_t *hits, uint64_t *refills,
+                       uint64_t *drains, size_t *count)
+{
+    struct per_cpu_pages *pcp = &pcp_lists[cpu < MAX_CPUS ? cpu : 0];
+
+    if (hits)
+        *hits = pcp->hits;
+    if (refills)
+        *refills = pcp->refills;
+    if (drains)
+        *drains = pcp->drains;
+    if (count)
+        *count = pcp->count;
+}
+
+int pmm_get_region(int index, phys_addr_t *base, phys_addr_t *end)
+{
+    if (index < 0 || index >= nr_mem_regions) {
+        return -1;
+    }
+    *base = mem_regions[index].base;
+    *end = mem_regions[index].end;
+    return 0;
+}
+
+/* Only allocated pages carry a meaningful reference count */
+static struct page *counted_page(phys_addr_t addr)
+{
+    struct page *page = pmm_phys_to_page(addr);
+
+    if (!page || !(page->flags & PAGE_FLAG_USED) ||
+        (page->flags & PAGE_FLAG_RESERVED)) {
+        return NULL;
+    }
+    return page;
+}
+
+void pmm_get_page(phys_addr_t addr)
+{
+    struct page *page = counted_page(addr);
+
+    if (page) {
+        atomic_inc(&page->refcount);
+    }
+}
+
+void pmm_put_page(phys_addr_t addr)
+{
+    struct page *page = counted_page(addr);
+
+    if (page && atomic_dec_and_test(&page->refcount)) {
+        pmm_free_page(addr);
+    }
+}
+
+int pmm_page_count(phys_addr_t addr)
+{
+    struct page *page = counted_page(addr);
+
+    return page ? atomic_read(&page->refcount) : 0;
+}
+
 phys_addr_t pmm_page_to_phys(struct page *page)
 {
     if (!page_array || !page) {
@@ -3,8 +3,11 @@
  */
 
 #include "mm/vmm.h"
+#include "mm/kmalloc.h"
 #include "mm/pmm.h"
 #include "printk.h"
+#include "sched/sched.h"
+#include "string.h"
 
 /* ===================================================================== */
 /* Static data */
@@ -24,6 +27,16 @@ uint64_t *get_kernel_pgd(void)
 static uint64_t early_tables[EARLY_TABLES_COUNT][VMM_ENTRIES] __aligned(PAGE_SIZE);
 static size_t early_table_index = 0;
 
+/* Shared all-zero page, mapped read-only for read faults on anonymous memory */
+static phys_addr_t zero_page;
+
+/* Above this many pages a range flush invalidates the whole TLB instead */
+#define TLB_RANGE_FLUSH_MAX 64
+
+/* Kernel load area, mapped as RAM even when no bank reaches that far */
+#define RAM_FLOOR_BASE      0x40000000UL
+#define RAM_FLOOR_END       0x80000000UL
+
 /* ===================================================================== */
 /* Helper functions */
 /* ===================================================================== */
@@ -51,6 +64,12 @@ static inline bool pte_is_table(uint64_t pte)
     return (pte & (PTE_VALID | PTE_TABLE)) == (PTE_VALID | PTE_TABLE);
 }
 
+/* Bytes covered by one entry at @level */
+static inline uint64_t level_size(int level)
+{
+    return 1UL << (VMM_LEVEL3_SHIFT + 9 * (3 - level));
+}
+
 static inline phys_addr_t pte_to_phys(uint64_t pte)
 {
     return pte & PTE_ADDR_MASK;
@@ -115,15 +134,53 @@ static uint64_t *alloc_page_table(void)
     return table;
 }
 
+static void free_page_table(uint64_t *table)
+{
+    /* Early boot tables are static and never returned */
+    if (table >= early_tables[0] && table <= early_tables[EARLY_TABLES_COUNT - 1]) {
+        return;
+    }
+    pmm_free_page((phys_addr_t)table);
+}
+
+/*
+ * Free the user page tables below @table. @kernel is the matching kernel
+ * table (or NULL); entries shared with it belong to the kernel and are
+ * left alone. Only the lower half of the PGD is ever user-owned.
+ */
+static void free_user_tables(uint64_t *table, const uint64_t *kernel, int level)
+{
+    int count = (level == 0) ? VMM_ENTRIES / 2 : VMM_ENTRIES;
+    
+    for (int i = 0; i < count; i++) {
+        uint64_t pte = table[i];
+        if (!pte_is_table(pte) || (kernel && kernel[i] == pte)) {
+            continue;
+        }
+        
+        uint64_t *child = (uint64_t *)pte_to_phys(pte);
+        if (level < 2) {
+            const uint64_t *kchild = NULL;
+            if (kernel && pte_is_table(kernel[i])) {
+                kchild = (const uint64_t *)pte_to_phys(kernel[i]);
+            }
+            free_user_tables(child, kchild, level + 1);
+        }
+        free_page_table(child);
+        table[i] = 0;
+    }
+}
+
 /* ===================================================================== */
 /* Page table walking */
 /* ===================================================================== */
 
-static uint64_t *walk_page_table(uint64_t *pgd, virt_addr_t vaddr, bool allocate)
+/* Return the table at @target level covering @vaddr */
+static uint64_t *walk_to_level(uint64_t *pgd, virt_addr_t vaddr, int target, bool allocate)
 {
     uint64_t *table = pgd;
     
-    for (int level = 0; level < 3; level++) {
+    for (int level = 0; level < target; level++) {
         int idx = pte_index(vaddr, level);
         uint64_t pte = table[idx];
         
@@ -152,6 +209,106 @@ static uint64_t *walk_page_table(uint64_t *pgd, virt_addr_t vaddr, bool allocate
     return table;
 }
 
+static uint64_t *walk_page_table(uint64_t *pgd, virt_addr_t vaddr, bool allocate)
+{
+    return walk_to_level(pgd, vaddr, 3, allocate);
+}
+
+/*
+ * Find the entry that terminates the walk for @vaddr: a page, a block, or
+ * the invalid entry where the walk stops. *level is set to its level.
+ */
+static uint64_t *find_leaf(uint64_t *pgd, virt_addr_t vaddr, int *level)
+{
+    uint64_t *table = pgd;
+    
+    for (int l = 0; l <= 3; l++) {
+        uint64_t *ptep = &table[pte_index(vaddr, l)];
+        if (l == 3 || !pte_is_table(*ptep)) {
+            *level = l;
+            return ptep;
+        }
+        table = (uint64_t *)pte_to_phys(*ptep);
+    }
+    return NULL;
+}
+
+/* Install one page (level 3) or block (level 1/2); fails if the slot is used */
+static int map_entry(uint64_t *pgd, virt_addr_t vaddr, phys_addr_t paddr,
+                     int level, uint32_t flags)
+{
+    uint64_t *table = walk_to_level(pgd, vaddr, level, true);
+    if (!table) {
+        return -1;
+    }
+    
+    uint64_t *ptep = &table[pte_index(vaddr, level)];
+    if (pte_is_valid(*ptep)) {
+        return -1;
+    }
+    
+    uint64_t pte_flags = vm_flags_to_pte(flags);
+    if (level < 3) {
+        pte_flags &= ~PTE_TABLE;    /* Block descriptor */
+    }
+    *ptep = phys_to_pte(paddr, pte_flags);
+    return 0;
+}
+
+/*
+ * Replace a level 1 or 2 block with a table of next-level entries that
+ * map the same memory with the same attributes.
+ */
+static int split_block(uint64_t *ptep, int level)
+{
+    uint64_t *table = alloc_page_table();
+    if (!table) {
+        return -1;
+    }
+    
+    phys_addr_t base = pte_to_phys(*ptep);
+    uint64_t attrs = *ptep & ~PTE_ADDR_MASK;
+    uint64_t child_size = level_size(level + 1);
+    if (level + 1 == 3) {
+        attrs |= PTE_PAGE;
+    }
+    
+    for (int i = 0; i < VMM_ENTRIES; i++) {
+        table[i] = (base + i * child_size) | attrs;
+    }
+    
+    /*
+     * Old and new entries translate identically, so a stale block entry in
+     * the TLB is harmless until the flush below.
+     */
+    *ptep = phys_to_pte((phys_addr_t)table, PTE_VALID | PTE_TABLE);
+    vmm_flush_tlb();
+    return 0;
+}
+
+/*
+ * Identity map the part of a RAM bank outside the 1GB floor, which is
+ * already covered by a single block.
+ */
+static int map_ram_bank(phys_addr_t base, phys_addr_t end)
+{
+    uint32_t flags = VM_READ | VM_WRITE | VM_EXEC;
+    
+    if (base < RAM_FLOOR_BASE) {
+        phys_addr_t low_end = MIN(end, RAM_FLOOR_BASE);
+        if (vmm_map_range(base, base, low_end - base, flags) < 0) {
+            return -1;
+        }
+    }
+    if (end > RAM_FLOOR_END) {
+        phys_addr_t high_base = MAX(base, RAM_FLOOR_END);
+        if (vmm_map_range(high_base, high_base, end - high_base, flags) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /* ===================================================================== */
 /* Public functions */
 /* ===================================================================== */
@@ -214,7 +371,7 @@ int vmm_init(void)
                   PTE_VALID | PTE_BLOCK | PTE_ATTR_DEVICE | PTE_SH_NONE | PTE_ACCESSED;
     
     /* Map 0x40000000-0x7FFFFFFF as normal memory (kernel load area) */
-    l1_table[1] = (0x40000000UL & PTE_ADDR_MASK) | 
+    l1_table[1] = (RAM_FLOOR_BASE & PTE_ADDR_MASK) | 
                   PTE_VALID | PTE_BLOCK | PTE_ATTR_NORMAL | PTE_SH_INNER | PTE_ACCESSED;
     
     /* Map High PCI ECAM region (0x40_0000_0000) for 1GB (covers 0x40_1000_0000) */
@@ -223,7 +380,19 @@ int vmm_init(void)
     l1_table[256] = (0x4000000000ULL & PTE_ADDR_MASK) | 
                     PTE_VALID | PTE_BLOCK | PTE_ATTR_DEVICE | PTE_SH_NONE | PTE_ACCESSED;
     
-    printk("VMM: RAM identity mapped (0-2GB) + High PCI ECAM (256GB base)\n");
+    /* Identity map the rest of every RAM bank with the largest blocks */
+    phys_addr_t bank_base, bank_end;
+    for (int i = 0; pmm_get_region(i, &bank_base, &bank_end) == 0; i++) {
+        if (map_ram_bank(bank_base, bank_end) < 0) {
+            printk(KERN_ERR "VMM: Failed to map RAM 0x%lx-0x%lx\n",
+                   (unsigned long)bank_base, (unsigned long)bank_end);
+            return -1;
+        }
+        printk("VMM: RAM 0x%lx-0x%lx identity mapped\n",
+               (unsigned long)bank_base, (unsigned long)bank_end);
+    }
+    
+    printk("VMM: Devices identity mapped (0-1GB) + High PCI ECAM (256GB base)\n");
     
     /* Map device region 0x08000000-0x10000000 for GIC, UART etc */
     /* This is at L1 index 0, but we need L2 tables for finer control */
@@ -275,55 +444,71 @@ int vmm_init(void)
     
     printk(KERN_INFO "VMM: MMU enabled! Page tables active.\n");
     
+    zero_page = pmm_alloc_page();
+    if (!zero_page) {
+        printk(KERN_ERR "VMM: Failed to allocate zero page\n");
+        return -1;
+    }
+    memset((void *)zero_page, 0, PAGE_SIZE);
+    
     return 0;
 }
 
 int vmm_map_page(virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags)
 {
     /* Walk to level 3 table, allocating as needed */
-    uint64_t *pte_table = walk_page_table(kernel_pgd, vaddr, true);
-    if (!pte_table) {
-        return -1;
+    if (map_entry(kernel_pgd, vaddr, paddr, 3, flags) < 0) {
+        return -1;  /* Already mapped, or covered by a block */
     }
     
-    /* Get level 3 index */
-    int idx = pte_index(vaddr, 3);
-    
-    /* Check if already mapped */
-    if (pte_is_valid(pte_table[idx])) {
-        return -1;  /* Already mapped */
-    }
-    
-    /* Install the page mapping */
-    uint64_t pte_flags = vm_flags_to_pte(flags);
-    pte_table[idx] = phys_to_pte(paddr, pte_flags);
-    
     /* Flush TLB for this page */
     vmm_flush_tlb_page(vaddr);
     
     return 0;
 }
 
-int vmm_unmap_page(virt_addr_t vaddr)
+/* Clear [start, end) in the kernel tables, splitting blocks at the edges */
+static int unmap_kernel_range(virt_addr_t start, virt_addr_t end)
 {
-    uint64_t *pte_table = walk_page_table(kernel_pgd, vaddr, false);
-    if (!pte_table) {
-        return -1;
+    virt_addr_t addr = start;
+    
+    while (addr < end) {
+        int level;
+        uint64_t *ptep = find_leaf(kernel_pgd, addr, &level);
+        uint64_t size = level_size(level);
+        virt_addr_t base = ALIGN_DOWN(addr, size);
+        
+        if (!pte_is_valid(*ptep)) {
+            addr = base + size;
+            continue;
+        }
+        
+        if (level < 3 && (base < start || base + size > end)) {
+            if (split_block(ptep, level) < 0) {
+                return -1;
+            }
+            continue;   /* Retry at the finer level */
+        }
+        
+        *ptep = 0;
+        addr = base + size;
     }
     
-    int idx = pte_index(vaddr, 3);
+    vmm_flush_tlb_range(start, end);
+    return 0;
+}
+
+int vmm_unmap_page(virt_addr_t vaddr)
+{
+    int level;
+    uint64_t *ptep = find_leaf(kernel_pgd, vaddr, &level);
     
-    if (!pte_is_valid(pte_table[idx])) {
+    if (!pte_is_valid(*ptep)) {
         return -1;  /* Not mapped */
     }
     
-    /* Clear the entry */
-    pte_table[idx] = 0;
-    
-    /* Flush TLB */
-    vmm_flush_tlb_page(vaddr);
-    
-    return 0;
+    vaddr = PAGE_ALIGN_DOWN(vaddr);
+    return unmap_kernel_range(vaddr, vaddr + PAGE_SIZE);
 }
 
 int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t flags)
@@ -332,15 +517,31 @@ int vmm_map_range(virt_addr_t vaddr, phys_addr_t paddr, size_t size, uint32_t fl
     paddr = PAGE_ALIGN_DOWN(paddr);
     size = PAGE_ALIGN(size);
     
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        int ret = vmm_map_page(vaddr + offset, paddr + offset, flags);
-        if (ret < 0) {
+    virt_addr_t end = vaddr + size;
+    virt_addr_t addr = vaddr;
+    
+    while (addr < end) {
+        phys_addr_t pa = paddr + (addr - vaddr);
+        int level;
+        
+        /* Largest block that fits the alignment and the remaining size */
+        for (level = 1; level < 3; level++) {
+            uint64_t block = level_size(level);
+            if (IS_ALIGNED(addr | pa, block) && end - addr >= block &&
+                map_entry(kernel_pgd, addr, pa, level, flags) == 0) {
+                break;
+            }
+        }
+        
+        if (level == 3 && map_entry(kernel_pgd, addr, pa, 3, flags) < 0) {
             /* Rollback on failure */
-            vmm_unmap_range(vaddr, offset);
-            return ret;
+            vmm_unmap_range(vaddr, addr - vaddr);
+            return -1;
         }
+        addr += level_size(level);
     }
     
+    vmm_flush_tlb_range(vaddr, end);
     return 0;
 }
 
@@ -349,58 +550,138 @@ int vmm_unmap_range(virt_addr_t vaddr, size_t size)
     vaddr = PAGE_ALIGN_DOWN(vaddr);
     size = PAGE_ALIGN(size);
     
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        vmm_unmap_page(vaddr + offset);
+    if (size == 0) {
+        return 0;
     }
-    
-    return 0;
+    return unmap_kernel_range(vaddr, vaddr + size);
 }
 
 phys_addr_t vmm_virt_to_phys(virt_addr_t vaddr)
 {
-    uint64_t *pte_table = walk_page_table(kernel_pgd, vaddr, false);
-    if (!pte_table) {
+    int level;
+    uint64_t *ptep = find_leaf(kernel_pgd, vaddr, &level);
+    
+    if (!pte_is_valid(*ptep)) {
         return 0;
     }
     
-    int idx = pte_index(vaddr, 3);
-    uint64_t pte = pte_table[idx];
-    
-    if (!pte_is_valid(pte)) {
-        return 0;
+    return pte_to_phys(*ptep) | (vaddr & (level_size(level) - 1));
+}
+
+phys_addr_t vmm_mm_virt_to_phys(struct mm_struct *mm, virt_addr_t vaddr)
+{
+    if (!mm || !mm->pgd) {
+        return vmm_virt_to_phys(vaddr);
     }
     
-    return pte_to_phys(pte) | (vaddr & (PAGE_SIZE - 1));
+    int level;
+    phys_addr_t paddr = 0;
+    
+    spin_lock(&mm->lock);
+    uint64_t *ptep = find_leaf(mm->pgd, vaddr, &level);
+    if (pte_is_valid(*ptep)) {
+        paddr = pte_to_phys(*ptep) | (vaddr & (level_size(level) - 1));
+    }
+    spin_unlock(&mm->lock);
+    return paddr;
 }
 
-struct mm_struct *vmm_create_address_space(void)
+void *vmm_alloc_huge(size_t size, phys_addr_t *phys)
 {
-    /* Allocate mm_struct */
-    /* TODO: Use kmalloc when available */
-    static struct mm_struct mm_pool[64];
-    static int mm_index = 0;
+    if (size == 0) {
+        return NULL;
+    }
+    
+    /*
+     * Buddy blocks are naturally aligned, so anything of 2MB or more
+     * starts on a block boundary of the linear map.
+     */
+    unsigned int order = 0;
+    while ((PAGE_SIZE << order) < size) {
+        if (++order > PMM_MAX_ORDER) {
+            return NULL;    /* Larger than any buddy block */
+        }
+    }
     
-    if (mm_index >= 64) {
+    phys_addr_t paddr = pmm_alloc_pages(order);
+    if (!paddr) {
         return NULL;
     }
     
-    struct mm_struct *mm = &mm_pool[mm_index++];
+    void *buf = (void *)paddr;  /* Identity mapped */
+    memset(buf, 0, PAGE_SIZE << order);
+    if (phys) {
+        *phys = paddr;
+    }
+    return buf;
+}
+
+void vmm_free_huge(void *buf, size_t size)
+{
+    if (!buf || size == 0) {
+        return;
+    }
+    
+    unsigned int order = 0;
+    while ((PAGE_SIZE << order) < size) {
+        if (++order > PMM_MAX_ORDER) {
+            return;         /* Never allocated */
+        }
+    }
+    pmm_free_pages((phys_addr_t)buf, order);
+}
+
+/* Defined with the VM area tree below */
+static void vma_unlink(struct mm_struct *mm, struct vm_area *vma);
+static void unmap_user_pages(struct mm_struct *mm, virt_addr_t start, virt_addr_t end);
+
+struct mm_struct *vmm_create_address_space(void)
+{
+    struct mm_struct *mm = kzalloc(sizeof(struct mm_struct), GFP_KERNEL);
+    if (!mm) {
+        return NULL;
+    }
     
     /* Allocate page table */
     mm->pgd = alloc_page_table();
     if (!mm->pgd) {
+        kfree(mm);
         return NULL;
     }
     
-    mm->vma_list = NULL;
-    mm->total_vm = 0;
+    spin_lock_init(&mm->lock);
+    mm->vma_tree = RB_ROOT;
     mm->users.counter = 1;
+    mm->start_brk = USER_HEAP_BASE;
+    mm->brk = USER_HEAP_BASE;
+    mm->mmap_base = USER_MMAP_BASE;
     
     /* Copy kernel mappings (upper half) */
     for (int i = VMM_ENTRIES / 2; i < VMM_ENTRIES; i++) {
         mm->pgd[i] = kernel_pgd[i];
     }
     
+    /*
+     * The kernel runs from the identity map in L0 slot 0, so it must stay
+     * visible after a TTBR0 switch. Give the address space a private copy
+     * of that L1 table so user mappings in the same 512GB slot don't leak
+     * into the kernel tables.
+     */
+    int idx0 = pte_index(0, 0);
+    if (pte_is_table(kernel_pgd[idx0])) {
+        uint64_t *kernel_l1 = (uint64_t *)pte_to_phys(kernel_pgd[idx0]);
+        uint64_t *l1 = alloc_page_table();
+        if (!l1) {
+            free_page_table(mm->pgd);
+            kfree(mm);
+            return NULL;
+        }
+        for (int i = 0; i < VMM_ENTRIES; i++) {
+            l1[i] = kernel_l1[i];
+        }
+        mm->pgd[idx0] = phys_to_pte((phys_addr_t)l1, PTE_VALID | PTE_TABLE);
+    }
+    
     return mm;
 }
 
@@ -410,127 +691,256 @@ void vmm_destroy_address_space(struct mm_struct *mm)
         return;
     }
     
-    /* Free all VMAs */
-    struct vm_area *vma = mm->vma_list;
-    while (vma) {
-        struct vm_area *next = vma->next;
-        /* Note: Should use kfree but avoiding for now */
-        vma = next;
+    /* Free all VMAs and the pages behind them */
+    struct rb_node *node;
+    while ((node = rb_first(&mm->vma_tree))) {
+        struct vm_area *vma = rb_entry(node, struct vm_area, rb);
+        unmap_user_pages(mm, vma->start, vma->end);
+        vma_unlink(mm, vma);
+        kfree(vma);
     }
     
-    /* TODO: Free all user page tables recursively */
-    /* For now, just clear the lower half */
     if (mm->pgd) {
-        for (int i = 0; i < VMM_ENTRIES / 2; i++) {
-            mm->pgd[i] = 0;
-        }
+        free_user_tables(mm->pgd, kernel_pgd, 0);
+        free_page_table(mm->pgd);
+        mm->pgd = NULL;
     }
     
-    mm->pgd = NULL;
-    mm->vma_list = NULL;
+    /* Nobody runs on these tables any more, but stale walks may be cached */
+    vmm_flush_tlb();
+    kfree(mm);
 }
 
 /* ===================================================================== */
 /* User Address Space Management */
 /* ===================================================================== */
 
-/* Map a page in user address space */
-int vmm_map_user_page(struct mm_struct *mm, virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags)
+/* User page descriptor flags for a VMA protection */
+static uint64_t user_pte_flags(uint32_t flags)
 {
-    if (!mm || !mm->pgd) return -1;
+    uint64_t pte_flags = PTE_VALID | PTE_PAGE | PTE_ATTR_NORMAL | 
+                         PTE_SH_INNER | PTE_ACCESSED | PTE_NOT_GLOBAL;
+    
+    /* PROT_NONE pages stay mapped but are unreachable from EL0 */
+    if (flags & (VM_READ | VM_WRITE | VM_EXEC)) pte_flags |= PTE_USER;
+    if (!(flags & VM_WRITE)) pte_flags |= PTE_RDONLY;
+    if (!(flags & VM_EXEC)) pte_flags |= PTE_UXN;
+    pte_flags |= PTE_PXN;  /* Always disable privileged execute */
     
+    return pte_flags;
+}
+
+/* Find (and optionally create) the L3 entry for a user address */
+static uint64_t *user_pte(struct mm_struct *mm, virt_addr_t vaddr, bool allocate)
+{
+    uint64_t *l3 = walk_page_table(mm->pgd, vaddr, allocate);
+    if (!l3) {
+        return NULL;
+    }
+    return &l3[pte_index(vaddr, 3)];
+}
+
+/* Map a page in user address space; mm->lock held */
+static int map_user_page_locked(struct mm_struct *mm, virt_addr_t vaddr, phys_addr_t paddr,
+                                uint32_t flags)
+{
     /* Ensure this is a user address */
     if (vaddr >= USER_VMA_END) return -1;
     
-    /* Save and switch page tables temporarily if needed */
-    uint64_t *saved_pgd = get_kernel_pgd();
-    
-    /* Use mm's page tables */
-    /* For simplicity, we manipulate the tables directly */
+    uint64_t *ptep = user_pte(mm, vaddr, true);
+    if (!ptep) return -1;
     
-    /* Build page table indices */
-    int l0_idx = (vaddr >> VMM_LEVEL0_SHIFT) & (VMM_ENTRIES - 1);
-    int l1_idx = (vaddr >> VMM_LEVEL1_SHIFT) & (VMM_ENTRIES - 1);
-    int l2_idx = (vaddr >> VMM_LEVEL2_SHIFT) & (VMM_ENTRIES - 1);
-    int l3_idx = (vaddr >> VMM_LEVEL3_SHIFT) & (VMM_ENTRIES - 1);
-    
-    uint64_t *l0 = mm->pgd;
+    *ptep = (paddr & PTE_ADDR_MASK) | user_pte_flags(flags);
+    vmm_flush_tlb_page(vaddr);
+    return 0;
+}
+
+int vmm_map_user_page(struct mm_struct *mm, virt_addr_t vaddr, phys_addr_t paddr, uint32_t flags)
+{
+    if (!mm || !mm->pgd) return -1;
     
-    /* Walk/create L1 */
-    if (!(l0[l0_idx] & PTE_VALID)) {
-        uint64_t *l1 = alloc_page_table();
-        if (!l1) return -1;
-        l0[l0_idx] = ((uint64_t)l1 & PTE_ADDR_MASK) | PTE_VALID | PTE_TABLE;
+    spin_lock(&mm->lock);
+    int ret = map_user_page_locked(mm, vaddr, paddr, flags);
+    spin_unlock(&mm->lock);
+    return ret;
+}
+
+/* ===================================================================== */
+/* VM area tree */
+/* ===================================================================== */
+
+static inline struct vm_area *vma_of(struct rb_node *node)
+{
+    return node ? rb_entry(node, struct vm_area, rb) : NULL;
+}
+
+static inline struct vm_area *vma_next(struct vm_area *vma)
+{
+    return vma_of(rb_next(&vma->rb));
+}
+
+static inline struct vm_area *vma_prev(struct vm_area *vma)
+{
+    return vma_of(rb_prev(&vma->rb));
+}
+
+/* Lowest VMA ending above @addr: the one containing it, or the next one */
+static struct vm_area *vma_lookup_above(struct mm_struct *mm, virt_addr_t addr)
+{
+    struct rb_node *node = mm->vma_tree.node;
+    struct vm_area *found = NULL;
+    
+    while (node) {
+        struct vm_area *vma = vma_of(node);
+        if (addr < vma->end) {
+            found = vma;
+            if (addr >= vma->start) {
+                break;
+            }
+            node = node->left;
+        } else {
+            node = node->right;
+        }
     }
-    uint64_t *l1 = (uint64_t *)(l0[l0_idx] & PTE_ADDR_MASK);
+    return found;
+}
+
+static void vma_link(struct mm_struct *mm, struct vm_area *vma)
+{
+    struct rb_node **link = &mm->vma_tree.node;
+    struct rb_node *parent = NULL;
     
-    /* Walk/create L2 */
-    if (!(l1[l1_idx] & PTE_VALID)) {
-        uint64_t *l2 = alloc_page_table();
-        if (!l2) return -1;
-        l1[l1_idx] = ((uint64_t)l2 & PTE_ADDR_MASK) | PTE_VALID | PTE_TABLE;
+    while (*link) {
+        parent = *link;
+        if (vma->start < vma_of(parent)->start) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
     }
-    uint64_t *l2 = (uint64_t *)(l1[l1_idx] & PTE_ADDR_MASK);
-    
-    /* Walk/create L3 */
-    if (!(l2[l2_idx] & PTE_VALID)) {
-        uint64_t *l3 = alloc_page_table();
-        if (!l3) return -1;
-        l2[l2_idx] = ((uint64_t)l3 & PTE_ADDR_MASK) | PTE_VALID | PTE_TABLE;
+    rb_link_node(&vma->rb, parent, link);
+    rb_insert_color(&vma->rb, &mm->vma_tree);
+    mm->map_count++;
+}
+
+static void vma_unlink(struct mm_struct *mm, struct vm_area *vma)
+{
+    rb_erase(&vma->rb, &mm->vma_tree);
+    mm->map_count--;
+    if (mm->vma_cache == vma) {
+        mm->vma_cache = NULL;
+    }
+}
+
+/* Split @vma at @addr; the upper half is a new VMA and is returned */
+static struct vm_area *vma_split(struct mm_struct *mm, struct vm_area *vma, virt_addr_t addr)
+{
+    struct vm_area *upper = kzalloc(sizeof(struct vm_area), GFP_KERNEL);
+    if (!upper) {
+        return NULL;
     }
-    uint64_t *l3 = (uint64_t *)(l2[l2_idx] & PTE_ADDR_MASK);
-    
-    /* Convert VM flags to page table flags */
-    uint64_t pte_flags = PTE_VALID | PTE_PAGE | PTE_USER | PTE_ATTR_NORMAL | 
-                         PTE_SH_INNER | PTE_ACCESSED;
-    
-    if (!(flags & VM_WRITE)) pte_flags |= PTE_RDONLY;
-    if (!(flags & VM_EXEC)) pte_flags |= PTE_UXN;
-    pte_flags |= PTE_PXN;  /* Always disable privileged execute */
     
-    /* Set the page */
-    l3[l3_idx] = (paddr & PTE_ADDR_MASK) | pte_flags;
+    upper->start = addr;
+    upper->end = vma->end;
+    upper->flags = vma->flags;
+    vma->end = addr;
+    vma_link(mm, upper);
+    return upper;
+}
+
+/* Make sure no VMA straddles @start or @end */
+static int vma_split_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
+{
+    struct vm_area *vma = vma_lookup_above(mm, start);
+    if (vma && vma->start < start) {
+        if (!vma_split(mm, vma, start)) {
+            return -1;
+        }
+    }
     
-    (void)saved_pgd;  /* Not used currently */
+    vma = vma_lookup_above(mm, end);
+    if (vma && vma->start < end) {
+        if (!vma_split(mm, vma, end)) {
+            return -1;
+        }
+    }
     return 0;
 }
 
-/* Add a VM area to the address space */
-int vmm_add_vma(struct mm_struct *mm, virt_addr_t start, virt_addr_t end, uint32_t flags)
+/* Coalesce adjacent VMAs with identical flags in and around [start, end] */
+static void vma_merge_range(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
 {
-    if (!mm) return -1;
+    struct vm_area *vma = vma_lookup_above(mm, start);
+    if (!vma) {
+        return;
+    }
+    if (vma_prev(vma)) {
+        vma = vma_prev(vma);
+    }
     
-    /* Allocate VMA from static pool (should use kmalloc) */
-    static struct vm_area vma_pool[256];
-    static int vma_index = 0;
+    while (vma && vma->start <= end) {
+        struct vm_area *next = vma_next(vma);
+        if (next && next->start == vma->end && next->flags == vma->flags) {
+            vma->end = next->end;
+            vma_unlink(mm, next);
+            kfree(next);
+        } else {
+            vma = next;
+        }
+    }
+}
+
+/* Add a VM area to the address space; mm->lock held */
+static int add_vma_locked(struct mm_struct *mm, virt_addr_t start, virt_addr_t end,
+                          uint32_t flags)
+{
+    if (start >= end || end > USER_VMA_END) return -1;
+    if ((start | end) & (PAGE_SIZE - 1)) return -1;
+    
+    /* VMAs never overlap */
+    struct vm_area *next = vma_lookup_above(mm, start);
+    if (next && next->start < end) return -1;
     
-    if (vma_index >= 256) return -1;
+    struct vm_area *vma = kzalloc(sizeof(struct vm_area), GFP_KERNEL);
+    if (!vma) return -1;
     
-    struct vm_area *vma = &vma_pool[vma_index++];
     vma->start = start;
     vma->end = end;
     vma->flags = flags;
-    vma->next = mm->vma_list;
-    mm->vma_list = vma;
-    
+    vma_link(mm, vma);
     mm->total_vm += (end - start);
     
+    vma_merge_range(mm, start, end);
     return 0;
 }
 
-/* Find a VM area containing an address */
+int vmm_add_vma(struct mm_struct *mm, virt_addr_t start, virt_addr_t end, uint32_t flags)
+{
+    if (!mm) return -1;
+    
+    spin_lock(&mm->lock);
+    int ret = add_vma_locked(mm, start, end, flags);
+    spin_unlock(&mm->lock);
+    return ret;
+}
+
+/* Find a VM area containing an address; mm->lock held */
 struct vm_area *vmm_find_vma(struct mm_struct *mm, virt_addr_t addr)
 {
     if (!mm) return NULL;
     
-    struct vm_area *vma = mm->vma_list;
-    while (vma) {
-        if (addr >= vma->start && addr < vma->end) {
-            return vma;
-        }
-        vma = vma->next;
+    /* Faults tend to hit the same VMA repeatedly */
+    struct vm_area *vma = mm->vma_cache;
+    if (vma && addr >= vma->start && addr < vma->end) {
+        return vma;
     }
-    return NULL;
+    
+    vma = vma_lookup_above(mm, addr);
+    if (!vma || addr < vma->start) {
+        return NULL;
+    }
+    mm->vma_cache = vma;
+    return vma;
 }
 
 /* Map user address range with physical pages */
@@ -540,28 +950,491 @@ int vmm_map_user_range(struct mm_struct *mm, virt_addr_t vaddr, size_t size, uin
     
     virt_addr_t end = (vaddr + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     vaddr = vaddr & ~(PAGE_SIZE - 1);
+    int ret = 0;
+    
+    spin_lock(&mm->lock);
     
     /* Add VMA */
-    vmm_add_vma(mm, vaddr, end, flags);
+    if (add_vma_locked(mm, vaddr, end, flags) < 0) {
+        ret = -1;
+        goto out;
+    }
     
     /* Allocate and map pages */
     for (virt_addr_t addr = vaddr; addr < end; addr += PAGE_SIZE) {
         phys_addr_t paddr = pmm_alloc_page();
         if (!paddr) {
             printk(KERN_ERR "vmm_map_user_range: out of memory\n");
-            return -1;
+            ret = -1;
+            goto out;
         }
         
-        int ret = vmm_map_user_page(mm, addr, paddr, flags);
+        ret = map_user_page_locked(mm, addr, paddr, flags);
         if (ret != 0) {
             pmm_free_page(paddr);
-            return ret;
+            goto out;
         }
     }
     
+out:
+    spin_unlock(&mm->lock);
+    return ret;
+}
+
+/* ===================================================================== */
+/* Demand paging for anonymous memory */
+/* ===================================================================== */
+
+/* Does [start, end) overlap any VMA? */
+static bool range_is_mapped(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
+{
+    struct vm_area *vma = vma_lookup_above(mm, start);
+    return vma && vma->start < end;
+}
+
+/*
+ * Drop PTEs in [start, end) and free any private pages behind them.
+ * The caller flushes the TLB for the range once afterwards.
+ */
+static void unmap_user_pages(struct mm_struct *mm, virt_addr_t start, virt_addr_t end)
+{
+    for (virt_addr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        uint64_t *ptep = user_pte(mm, addr, false);
+        if (!ptep || !pte_is_valid(*ptep)) {
+            continue;
+        }
+        phys_addr_t paddr = pte_to_phys(*ptep);
+        *ptep = 0;
+        if (paddr != zero_page) {
+            /* Pages shared after fork survive until the last mapping goes */
+            pmm_put_page(paddr);
+        }
+    }
+}
+
+/* Rewrite the permissions of present PTEs in [start, end) */
+static void change_user_prot(struct mm_struct *mm, virt_addr_t start, virt_addr_t end,
+                             uint32_t flags)
+{
+    for (virt_addr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        uint64_t *ptep = user_pte(mm, addr, false);
+        if (!ptep || !pte_is_valid(*ptep)) {
+            continue;
+        }
+        phys_addr_t paddr = pte_to_phys(*ptep);
+        uint32_t page_flags = flags;
+        if (paddr == zero_page ||
+            (!(flags & VM_SHARED) && pmm_page_count(paddr) > 1)) {
+            /* Still needs a private copy on the first write */
+            page_flags &= ~VM_WRITE;
+        }
+        *ptep = (paddr & PTE_ADDR_MASK) | user_pte_flags(page_flags);
+    }
+}
+
+/*
+ * Pick where a new mapping of @len bytes goes: @hint if it is free,
+ * otherwise the first gap above mmap_base that fits. 0 if there is none.
+ */
+static virt_addr_t find_free_range(struct mm_struct *mm, virt_addr_t hint, size_t len)
+{
+    virt_addr_t addr = hint;
+    if (addr && addr + len <= USER_VMA_END && !range_is_mapped(mm, addr, addr + len)) {
+        return addr;
+    }
+    
+    /* Walk the VMAs in order */
+    addr = mm->mmap_base;
+    for (struct vm_area *vma = vma_lookup_above(mm, addr); vma; vma = vma_next(vma)) {
+        if (addr + len <= vma->start) {
+            break;
+        }
+        addr = vma->end;
+    }
+    return addr + len <= USER_VMA_END ? addr : 0;
+}
+
+virt_addr_t vmm_mmap_anon(struct mm_struct *mm, virt_addr_t hint, size_t len, uint32_t flags)
+{
+    if (!mm || len == 0) {
+        return 0;
+    }
+    
+    len = PAGE_ALIGN(len);
+    spin_lock(&mm->lock);
+    virt_addr_t addr = find_free_range(mm, PAGE_ALIGN_DOWN(hint), len);
+    
+    /* No pages are allocated here - they arrive on first touch */
+    if (addr && add_vma_locked(mm, addr, addr + len, flags | VM_USER | VM_ANON) < 0) {
+        addr = 0;
+    }
+    spin_unlock(&mm->lock);
+    return addr;
+}
+
+static int munmap_locked(struct mm_struct *mm, virt_addr_t start, size_t len);
+
+virt_addr_t vmm_map_pages(struct mm_struct *mm, const phys_addr_t *pages, size_t nr_pages,
+                          uint32_t flags)
+{
+    if (!mm || nr_pages == 0) {
+        return 0;
+    }
+    
+    size_t len = nr_pages * PAGE_SIZE;
+    spin_lock(&mm->lock);
+    virt_addr_t addr = find_free_range(mm, 0, len);
+    
+    /* Not VM_ANON: nothing is populated on fault, and fork shares the pages */
+    flags = (flags & (VM_READ | VM_WRITE | VM_EXEC)) | VM_USER | VM_SHARED;
+    if (!addr || add_vma_locked(mm, addr, addr + len, flags) < 0) {
+        spin_unlock(&mm->lock);
+        return 0;
+    }
+    
+    for (size_t i = 0; i < nr_pages; i++) {
+        if (map_user_page_locked(mm, addr + i * PAGE_SIZE, pages[i], flags) < 0) {
+            /* Drops the references taken so far along with the VMA */
+            munmap_locked(mm, addr, len);
+            addr = 0;
+            break;
+        }
+        pmm_get_page(pages[i]);
+    }
+    spin_unlock(&mm->lock);
+    return addr;
+}
+
+uint64_t vmm_brk(struct mm_struct *mm, uint64_t new_brk)
+{
+    if (!mm) {
+        return 0;
+    }
+    
+    spin_lock(&mm->lock);
+    if (new_brk < mm->start_brk) {
+        goto out;
+    }
+    
+    virt_addr_t old_end = PAGE_ALIGN(mm->brk);
+    virt_addr_t new_end = PAGE_ALIGN(new_brk);
+    
+    if (new_end > old_end) {
+        /* Merges into the existing heap VMA; fails if something is in the way */
+        if (add_vma_locked(mm, old_end, new_end,
+                           VM_READ | VM_WRITE | VM_USER | VM_ANON) < 0) {
+            goto out;
+        }
+    } else if (new_end < old_end) {
+        /* Shrinking releases the pages immediately */
+        munmap_locked(mm, new_end, old_end - new_end);
+    }
+    
+    mm->brk = new_brk;
+out:
+    new_brk = mm->brk;
+    spin_unlock(&mm->lock);
+    return new_brk;
+}
+
+static int munmap_locked(struct mm_struct *mm, virt_addr_t start, size_t len)
+{
+    if (len == 0 || (start & (PAGE_SIZE - 1))) {
+        return -1;
+    }
+    
+    virt_addr_t end = start + PAGE_ALIGN(len);
+    if (end <= start || end > USER_VMA_END) {
+        return -1;
+    }
+    
+    if (vma_split_range(mm, start, end) < 0) {
+        return -1;
+    }
+    
+    struct vm_area *vma = vma_lookup_above(mm, start);
+    while (vma && vma->start < end) {
+        struct vm_area *next = vma_next(vma);
+        unmap_user_pages(mm, vma->start, vma->end);
+        mm->total_vm -= vma->end - vma->start;
+        vma_unlink(mm, vma);
+        kfree(vma);
+        vma = next;
+    }
+    
+    /* Pages are already back in the allocator; no CPU may keep using them */
+    vmm_flush_tlb_range(start, end);
     return 0;
 }
 
+int vmm_munmap(struct mm_struct *mm, virt_addr_t start, size_t len)
+{
+    if (!mm) {
+        return -1;
+    }
+    
+    spin_lock(&mm->lock);
+    int ret = munmap_locked(mm, start, len);
+    spin_unlock(&mm->lock);
+    return ret;
+}
+
+static int mprotect_locked(struct mm_struct *mm, virt_addr_t start, size_t len, uint32_t flags)
+{
+    if (len == 0 || (start & (PAGE_SIZE - 1))) {
+        return -1;
+    }
+    
+    virt_addr_t end = start + PAGE_ALIGN(len);
+    if (end <= start || end > USER_VMA_END) {
+        return -1;
+    }
+    flags &= VM_READ | VM_WRITE | VM_EXEC;
+    
+    /* The whole range must be covered by VMAs, without holes */
+    virt_addr_t addr = start;
+    for (struct vm_area *vma = vma_lookup_above(mm, start);
+         vma && vma->start <= addr && addr < end; vma = vma_next(vma)) {
+        addr = vma->end;
+    }
+    if (addr < end) {
+        return -1;
+    }
+    
+    if (vma_split_range(mm, start, end) < 0) {
+        return -1;
+    }
+    
+    struct vm_area *vma = vma_lookup_above(mm, start);
+    while (vma && vma->start < end) {
+        vma->flags = (vma->flags & ~(VM_READ | VM_WRITE | VM_EXEC)) | flags;
+        change_user_prot(mm, vma->start, vma->end, vma->flags);
+        vma = vma_next(vma);
+    }
+    vmm_flush_tlb_range(start, end);
+    
+    vma_merge_range(mm, start, end);
+    return 0;
+}
+
+int vmm_mprotect(struct mm_struct *mm, virt_addr_t start, size_t len, uint32_t flags)
+{
+    if (!mm) {
+        return -1;
+    }
+    
+    spin_lock(&mm->lock);
+    int ret = mprotect_locked(mm, start, len, flags);
+    spin_unlock(&mm->lock);
+    return ret;
+}
+
+/* ===================================================================== */
+/* Copy-on-write fork */
+/* ===================================================================== */
+
+/*
+ * Share every present page of @vma with @dst. Private pages lose write
+ * access in both address spaces and are copied by do_wp_page() on the
+ * first write; shared mappings stay writable.
+ */
+static int copy_user_ptes(struct mm_struct *dst, struct mm_struct *src, struct vm_area *vma)
+{
+    for (virt_addr_t addr = vma->start; addr < vma->end; addr += PAGE_SIZE) {
+        uint64_t *src_pte = user_pte(src, addr, false);
+        if (!src_pte) {
+            /* No L3 table: skip to the last page of this 2MB region */
+            addr = (addr | (LARGE_PAGE_SIZE - 1)) - (PAGE_SIZE - 1);
+            continue;
+        }
+        if (!pte_is_valid(*src_pte)) {
+            continue;
+        }
+        
+        phys_addr_t paddr = pte_to_phys(*src_pte);
+        if (paddr != zero_page && !(vma->flags & VM_SHARED)) {
+            *src_pte |= PTE_RDONLY;
+        }
+        
+        uint64_t *dst_pte = user_pte(dst, addr, true);
+        if (!dst_pte) {
+            return -1;
+        }
+        if (paddr != zero_page) {
+            pmm_get_page(paddr);
+        }
+        *dst_pte = *src_pte;
+    }
+    return 0;
+}
+
+struct mm_struct *vmm_fork_address_space(struct mm_struct *parent)
+{
+    if (!parent) {
+        return NULL;
+    }
+    
+    struct mm_struct *mm = vmm_create_address_space();
+    if (!mm) {
+        return NULL;
+    }
+    
+    /* Nobody else can see the child yet; the parent's threads must wait */
+    spin_lock(&parent->lock);
+    mm->start_code = parent->start_code;
+    mm->end_code = parent->end_code;
+    mm->start_data = parent->start_data;
+    mm->end_data = parent->end_data;
+    mm->start_brk = parent->start_brk;
+    mm->brk = parent->brk;
+    mm->mmap_base = parent->mmap_base;
+    mm->start_stack = parent->start_stack;
+    mm->arg_start = parent->arg_start;
+    mm->arg_end = parent->arg_end;
+    mm->env_start = parent->env_start;
+    mm->env_end = parent->env_end;
+    
+    int ret = 0;
+    for (struct rb_node *node = rb_first(&parent->vma_tree); node; node = rb_next(node)) {
+        struct vm_area *vma = vma_of(node);
+        struct vm_area *copy = kzalloc(sizeof(struct vm_area), GFP_KERNEL);
+        if (!copy) {
+            ret = -1;
+            break;
+        }
+        
+        copy->start = vma->start;
+        copy->end = vma->end;
+        copy->flags = vma->flags;
+        vma_link(mm, copy);
+        mm->total_vm += vma->end - vma->start;
+        
+        ret = copy_user_ptes(mm, parent, vma);
+        if (ret < 0) {
+            break;
+        }
+    }
+    
+    /* The parent's private pages just became read-only */
+    vmm_flush_tlb();
+    spin_unlock(&parent->lock);
+    
+    if (ret < 0) {
+        vmm_destroy_address_space(mm);
+        return NULL;
+    }
+    return mm;
+}
+
+/*
+ * Write to a present read-only page in a writable VMA. The page is either
+ * the zero page or shared copy-on-write with another address space.
+ */
+static int do_wp_page(struct vm_area *vma, virt_addr_t addr, uint64_t *ptep)
+{
+    phys_addr_t old = pte_to_phys(*ptep);
+    
+    if (old != zero_page && pmm_page_count(old) == 1) {
+        /* Every other sharer already took a copy - reuse the page */
+        *ptep = (old & PTE_ADDR_MASK) | user_pte_flags(vma->flags);
+        vmm_flush_tlb_page(addr);
+        return 0;
+    }
+    
+    phys_addr_t paddr = pmm_alloc_page();
+    if (!paddr) {
+        printk(KERN_ERR "VMM: Out of memory on COW at 0x%lx\n",
+               (unsigned long)addr);
+        return -1;
+    }
+    
+    if (old == zero_page) {
+        memset((void *)paddr, 0, PAGE_SIZE);
+    } else {
+        memcpy((void *)paddr, (void *)old, PAGE_SIZE);
+    }
+    
+    *ptep = (paddr & PTE_ADDR_MASK) | user_pte_flags(vma->flags);
+    vmm_flush_tlb_page(addr);
+    
+    if (old != zero_page) {
+        pmm_put_page(old);
+    }
+    return 0;
+}
+
+/* Resolve a fault; mm->lock held */
+static int handle_page_fault_locked(struct mm_struct *mm, virt_addr_t addr, uint32_t fault)
+{
+    struct vm_area *vma = vmm_find_vma(mm, addr);
+    if (!vma) {
+        return -1;
+    }
+    
+    if (!(vma->flags & (VM_READ | VM_WRITE | VM_EXEC))) {
+        return -1;
+    }
+    if ((fault & FAULT_WRITE) && !(vma->flags & VM_WRITE)) {
+        return -1;
+    }
+    if ((fault & FAULT_EXEC) && !(vma->flags & VM_EXEC)) {
+        return -1;
+    }
+    
+    addr = PAGE_ALIGN_DOWN(addr);
+    uint64_t *ptep = user_pte(mm, addr, true);
+    if (!ptep) {
+        return -1;
+    }
+    
+    if (pte_is_valid(*ptep)) {
+        if (!(fault & FAULT_WRITE) || !(*ptep & PTE_RDONLY)) {
+            /* Raced with another fault or a stale TLB entry */
+            vmm_flush_tlb_page(addr);
+            return 0;
+        }
+        return do_wp_page(vma, addr, ptep);
+    }
+    
+    /* Only anonymous memory is populated on demand */
+    if (!(vma->flags & VM_ANON)) {
+        return -1;
+    }
+    
+    if (!(fault & FAULT_WRITE)) {
+        /* Read of untouched memory: map the zero page read-only */
+        *ptep = (zero_page & PTE_ADDR_MASK) |
+                user_pte_flags(vma->flags & ~VM_WRITE);
+        vmm_flush_tlb_page(addr);
+        return 0;
+    }
+    
+    phys_addr_t paddr = pmm_alloc_page();
+    if (!paddr) {
+        printk(KERN_ERR "VMM: Out of memory on fault at 0x%lx\n",
+               (unsigned long)addr);
+        return -1;
+    }
+    memset((void *)paddr, 0, PAGE_SIZE);
+    
+    *ptep = (paddr & PTE_ADDR_MASK) | user_pte_flags(vma->flags);
+    vmm_flush_tlb_page(addr);
+    return 0;
+}
+
+int vmm_handle_page_fault(struct mm_struct *mm, virt_addr_t addr, uint32_t fault)
+{
+    if (!mm || !mm->pgd) {
+        return -1;
+    }
+    
+    /* Also keeps do_wp_page()'s refcount check and its PTE update together */
+    spin_lock(&mm->lock);
+    int ret = handle_page_fault_locked(mm, addr, fault);
+    spin_unlock(&mm->lock);
+    return ret;
+}
+
 void vmm_switch_address_space(struct mm_struct *mm)
 {
     if (!mm || !mm->pgd) {
@@ -617,3 +1490,28 @@ void vmm_flush_tlb_page(virt_addr_t vaddr)
     asm volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
 #endif
 }
+
+void vmm_flush_tlb_range(virt_addr_t start, virt_addr_t end)
+{
+    start = PAGE_ALIGN_DOWN(start);
+    if (end <= start) {
+        return;
+    }
+    if ((end - start) >> PAGE_SHIFT > TLB_RANGE_FLUSH_MAX) {
+        vmm_flush_tlb();
+        return;
+    }
+    
+#ifdef ARCH_ARM64
+    /* The inner-shareable TLBI is broadcast, so this is the shootdown too */
+    asm volatile("dsb ishst");
+    for (virt_addr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        asm volatile("tlbi vale1is, %0" : : "r" (addr >> 12));
+    }
+    asm volatile("dsb ish\n" "isb");
+#elif defined(ARCH_X86_64) || defined(ARCH_X86)
+    for (virt_addr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+    }
+#endif
+}
@@ -7,6 +7,8 @@
 #include "types.h"
 #include "printk.h"
 #include "mm/kmalloc.h"
+#include "sync/rcu.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* DNS Constants */
@@ -65,15 +67,22 @@ struct dns_answer {
 
 #define DNS_CACHE_SIZE  64
 
+/*
+ * An RCU list, newest entry first, so lookups take no lock. Entries are
+ * replaced rather than changed, and freed after a grace period.
+ */
 struct dns_cache_entry {
     char name[DNS_MAX_NAME_LEN];
     uint32_t ip;
     uint32_t ttl;
     uint64_t timestamp;
-    bool valid;
+    struct dns_cache_entry *next;
+    struct rcu_head rcu;
 };
 
-static struct dns_cache_entry dns_cache[DNS_CACHE_SIZE];
+static struct dns_cache_entry *dns_cache;
+static int dns_cache_count;
+static DEFINE_SPINLOCK(dns_cache_lock);   /* Serializes updates */
 static uint32_t dns_servers[4] = { 0x08080808, 0x08080404, 0, 0 }; /* Google DNS */
 static int num_dns_servers = 2;
 static uint16_t dns_query_id = 1;
@@ -264,49 +273,78 @@ static int dns_parse_response(const uint8_t *response, size_t len, uint32_t *ip_
     return -1;
 }
 
-/* Cache lookup */
-static struct dns_cache_entry *dns_cache_lookup(const char *name)
+static bool dns_name_equal(const char *a, const char *b)
 {
-    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
-        if (dns_cache[i].valid) {
-            /* Compare names */
-            bool match = true;
-            for (int j = 0; name[j] || dns_cache[i].name[j]; j++) {
-                if (name[j] != dns_cache[i].name[j]) {
-                    match = false;
-                    break;
-                }
-            }
-            if (match) return &dns_cache[i];
+    for (int j = 0; a[j] || b[j]; j++) {
+        if (a[j] != b[j]) return false;
+    }
+    return true;
+}
+
+/* Cache lookup; copies the address out, as the entry may go right after */
+static bool dns_cache_lookup(const char *name, uint32_t *ip_out)
+{
+    bool found = false;
+    
+    rcu_read_lock();
+    for (struct dns_cache_entry *e = rcu_dereference(dns_cache); e;
+         e = rcu_dereference(e->next)) {
+        if (dns_name_equal(name, e->name)) {
+            *ip_out = e->ip;
+            found = true;
+            break;
         }
     }
-    return NULL;
+    rcu_read_unlock();
+    
+    return found;
+}
+
+static void dns_cache_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct dns_cache_entry, rcu));
 }
 
 /* Add to cache */
 static void dns_cache_add(const char *name, uint32_t ip, uint32_t ttl)
 {
-    int slot = -1;
+    struct dns_cache_entry *new = kmalloc(sizeof(*new));
+    if (!new) return;
     
-    /* Find empty or oldest slot */
-    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
-        if (!dns_cache[i].valid) {
-            slot = i;
-            break;
-        }
+    new->ip = ip;
+    new->ttl = ttl;
+    new->timestamp = 0;  /* TODO: get_time() */
+    new->name[0] = '\0';
+    for (int i = 0; i < DNS_MAX_NAME_LEN - 1 && name[i]; i++) {
+        new->name[i] = name[i];
+        new->name[i + 1] = '\0';
     }
     
-    if (slot < 0) slot = 0;  /* Evict first */
+    uint64_t flags = spin_lock_irqsave(&dns_cache_lock);
     
-    dns_cache[slot].valid = true;
-    dns_cache[slot].ip = ip;
-    dns_cache[slot].ttl = ttl;
-    dns_cache[slot].timestamp = 0;  /* TODO: get_time() */
+    /* Unlink the entry this replaces, or the oldest if the cache is full */
+    struct dns_cache_entry **pp = &dns_cache;
+    struct dns_cache_entry **last = NULL;
+    while (*pp && !dns_name_equal((*pp)->name, new->name)) {
+        last = pp;
+        pp = &(*pp)->next;
+    }
+    if (!*pp && dns_cache_count >= DNS_CACHE_SIZE) {
+        pp = last;
+    }
     
-    for (int i = 0; i < DNS_MAX_NAME_LEN - 1 && name[i]; i++) {
-        dns_cache[slot].name[i] = name[i];
-        dns_cache[slot].name[i + 1] = '\0';
+    struct dns_cache_entry *old = *pp;
+    if (old) {
+        __atomic_store_n(pp, old->next, __ATOMIC_RELAXED);
+        dns_cache_count--;
+        call_rcu(&old->rcu, dns_cache_free_rcu);
     }
+    
+    new->next = dns_cache;
+    rcu_assign_pointer(dns_cache, new);
+    dns_cache_count++;
+    
+    spin_unlock_irqrestore(&dns_cache_lock, flags);
 }
 
 /* ===================================================================== */
@@ -318,9 +356,7 @@ int dns_resolve(const char *hostname, uint32_t *ip_out)
     printk(KERN_DEBUG "DNS: Resolving %s\n", hostname);
     
     /* Check cache first */
-    struct dns_cache_entry *cached = dns_cache_lookup(hostname);
-    if (cached) {
-        *ip_out = cached->ip;
+    if (dns_cache_lookup(hostname, ip_out)) {
         printk(KERN_DEBUG "DNS: Found in cache\n");
         return 0;
     }
@@ -357,9 +393,5 @@ void dns_init(void)
 {
     printk(KERN_INFO "DNS: Initializing resolver\n");
     
-    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
-        dns_cache[i].valid = false;
-    }
-    
     printk(KERN_INFO "DNS: Using servers 8.8.8.8, 8.8.4.4\n");
 }
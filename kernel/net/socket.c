@@ -2,6 +2,7 @@
  * UnixOS Kernel - Network Stack Implementation
  */
 
+#include "fs/poll.h"
 #include "fs/vfs.h"
 #include "mm/kmalloc.h"
 #include "net/net.h"
@@ -33,6 +34,34 @@
 static struct socket *socket_table[MAX_SOCKETS];
 static int next_sockfd = 0;
 
+/* Protects socket_table and next_sockfd. Each socket has its own lock for
+ * its state, and a reference count so close can't free it under a call
+ * running on another CPU. */
+static DEFINE_SPINLOCK(socket_table_lock);
+
+/* Referenced socket for a descriptor, or NULL */
+static struct socket *sock_get(int sockfd) {
+  struct socket *sock = NULL;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCKETS) {
+    return NULL;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&socket_table_lock);
+  sock = socket_table[sockfd];
+  if (sock) {
+    atomic_inc(&sock->refcount);
+  }
+  spin_unlock_irqrestore(&socket_table_lock, flags);
+  return sock;
+}
+
+static void sock_put(struct socket *sock) {
+  if (atomic_dec_and_test(&sock->refcount)) {
+    kfree(sock);
+  }
+}
+
 /* ===================================================================== */
 /* Byte order functions */
 /* ===================================================================== */
@@ -82,9 +111,11 @@ void net_init(void) {
   printk(KERN_INFO "NET: Initializing network stack\n");
 
   /* Clear socket table */
+  uint64_t flags = spin_lock_irqsave(&socket_table_lock);
   for (int i = 0; i < MAX_SOCKETS; i++) {
     socket_table[i] = NULL;
   }
+  spin_unlock_irqrestore(&socket_table_lock, flags);
 
   printk(KERN_INFO "NET: TCP/IP stack initialized\n");
   printk(KERN_INFO "NET: IPv4 support enabled\n");
@@ -94,14 +125,19 @@ void net_init(void) {
 /* Socket operations */
 /* ===================================================================== */
 
-static int alloc_sockfd(void) {
+/* Install a socket in a free slot */
+static int alloc_sockfd(struct socket *sock) {
+  uint64_t flags = spin_lock_irqsave(&socket_table_lock);
   for (int i = 0; i < MAX_SOCKETS; i++) {
     int fd = (next_sockfd + i) % MAX_SOCKETS;
     if (!socket_table[fd]) {
+      socket_table[fd] = sock;
       next_sockfd = fd + 1;
+      spin_unlock_irqrestore(&socket_table_lock, flags);
       return fd;
     }
   }
+  spin_unlock_irqrestore(&socket_table_lock, flags);
   return -EMFILE;
 }
 
@@ -114,11 +150,6 @@ int socket_create(int family, int type, int protocol) {
     return -ESOCKTNOSUPPORT;
   }
 
-  int fd = alloc_sockfd();
-  if (fd < 0) {
-    return fd;
-  }
-
   struct socket *sock = kzalloc(sizeof(struct socket), GFP_KERNEL);
   if (!sock) {
     return -ENOMEM;
@@ -130,8 +161,15 @@ int socket_create(int family, int type, int protocol) {
   sock->local_addr.ss_family = family;
   sock->remote_addr.ss_family = family;
   sock->sk = NULL;
+  spin_lock_init(&sock->lock);
+  atomic_set(&sock->refcount, 1); /* The table's */
+  init_waitqueue_head(&sock->wq);
 
-  socket_table[fd] = sock;
+  int fd = alloc_sockfd(sock);
+  if (fd < 0) {
+    kfree(sock);
+    return fd;
+  }
 
   printk(KERN_DEBUG "NET: Created socket %d (type=%d)\n", fd, type);
 
@@ -139,22 +177,24 @@ int socket_create(int family, int type, int protocol) {
 }
 
 int socket_bind(int sockfd, const struct sockaddr *addr, unsigned int addrlen) {
-  if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd]) {
-    return -EBADF;
-  }
-
   if (!addr || addrlen < sizeof(struct sockaddr)) {
     return -EINVAL;
   }
 
-  struct socket *sock = socket_table[sockfd];
+  struct socket *sock = sock_get(sockfd);
+  if (!sock) {
+    return -EBADF;
+  }
 
   /* Copy address */
+  uint64_t flags = spin_lock_irqsave(&sock->lock);
   uint8_t *dst = (uint8_t *)&sock->local_addr;
   const uint8_t *src = (const uint8_t *)addr;
   for (unsigned int i = 0; i < addrlen && i < sizeof(sock->local_addr); i++) {
     dst[i] = src[i];
   }
+  spin_unlock_irqrestore(&sock->lock, flags);
+  sock_put(sock);
 
   printk(KERN_DEBUG "NET: Socket %d bound\n", sockfd);
 
@@ -162,18 +202,21 @@ int socket_bind(int sockfd, const struct sockaddr *addr, unsigned int addrlen) {
 }
 
 int socket_listen(int sockfd, int backlog) {
-  if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd]) {
+  struct socket *sock = sock_get(sockfd);
+  if (!sock) {
     return -EBADF;
   }
 
-  struct socket *sock = socket_table[sockfd];
-
   if (sock->type != SOCK_STREAM) {
+    sock_put(sock);
     return -EOPNOTSUPP;
   }
 
   (void)backlog;
+  uint64_t flags = spin_lock_irqsave(&sock->lock);
   sock->state = SS_UNCONNECTED; /* Listening state would be set here */
+  spin_unlock_irqrestore(&sock->lock, flags);
+  sock_put(sock);
 
   printk(KERN_DEBUG "NET: Socket %d listening\n", sockfd);
 
@@ -181,9 +224,11 @@ int socket_listen(int sockfd, int backlog) {
 }
 
 int socket_accept(int sockfd, struct sockaddr *addr, unsigned int *addrlen) {
-  if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd]) {
+  struct socket *sock = sock_get(sockfd);
+  if (!sock) {
     return -EBADF;
   }
+  sock_put(sock);
 
   (void)addr;
   (void)addrlen;
@@ -194,17 +239,17 @@ int socket_accept(int sockfd, struct sockaddr *addr, unsigned int *addrlen) {
 
 int socket_connect(int sockfd, const struct sockaddr *addr,
                    unsigned int addrlen) {
-  if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd]) {
-    return -EBADF;
-  }
-
   if (!addr || addrlen < sizeof(struct sockaddr)) {
     return -EINVAL;
   }
 
-  struct socket *sock = socket_table[sockfd];
+  struct socket *sock = sock_get(sockfd);
+  if (!sock) {
+    return -EBADF;
+  }
 
   /* Copy remote address */
+  uint64_t flags = spin_lock_irqsave(&sock->lock);
   uint8_t *dst = (uint8_t *)&sock->remote_addr;
   const uint8_t *src = (const uint8_t *)addr;
   for (unsigned int i = 0; i < addrlen && i < sizeof(sock->remote_addr); i++) {
@@ -215,61 +260,159 @@ int socket_connect(int sockfd, const struct sockaddr *addr,
 
   /* Stub - immediate "connection" */
   sock->state = SS_CONNECTED;
+  spin_unlock_irqrestore(&sock->lock, flags);
+  wake_up(&sock->wq);
+  sock_put(sock);
 
   return 0;
 }
 
-ssize_t socket_send(int sockfd, const void *buf, size_t len, int flags) {
-  if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd]) {
-    return -EBADF;
+static inline int sock_connected(struct socket *sock) {
+  return sock->state == SS_CONNECTED || sock->type != SOCK_STREAM;
+}
+
+static ssize_t sock_do_send(struct socket *sock, size_t len) {
+  if (!sock_connected(sock)) {
+    return -ENOTCONN;
+  }
+
+  /* Stub - pretend we sent all data */
+  return len;
+}
+
+static ssize_t sock_do_recv(struct socket *sock) {
+  if (!sock_connected(sock)) {
+    return -ENOTCONN;
   }
 
+  /* Stub - no data available */
+  return 0;
+}
+
+ssize_t socket_send(int sockfd, const void *buf, size_t len, int flags) {
   if (!buf) {
     return -EINVAL;
   }
 
   (void)flags;
 
-  struct socket *sock = socket_table[sockfd];
-
-  if (sock->state != SS_CONNECTED && sock->type == SOCK_STREAM) {
-    return -ENOTCONN;
+  struct socket *sock = sock_get(sockfd);
+  if (!sock) {
+    return -EBADF;
   }
 
-  /* Stub - pretend we sent all data */
-  return len;
+  ssize_t ret = sock_do_send(sock, len);
+  sock_put(sock);
+  return ret;
 }
 
 ssize_t socket_recv(int sockfd, void *buf, size_t len, int flags) {
-  if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd]) {
-    return -EBADF;
-  }
-
   if (!buf) {
     return -EINVAL;
   }
 
+  (void)len;
   (void)flags;
 
-  struct socket *sock = socket_table[sockfd];
-
-  if (sock->state != SS_CONNECTED && sock->type == SOCK_STREAM) {
-    return -ENOTCONN;
+  struct socket *sock = sock_get(sockfd);
+  if (!sock) {
+    return -EBADF;
   }
 
-  /* Stub - no data available */
-  return 0;
+  ssize_t ret = sock_do_recv(sock);
+  sock_put(sock);
+  return ret;
 }
 
 int socket_close(int sockfd) {
-  if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd]) {
+  if (sockfd < 0 || sockfd >= MAX_SOCKETS) {
     return -EBADF;
   }
 
+  uint64_t flags = spin_lock_irqsave(&socket_table_lock);
   struct socket *sock = socket_table[sockfd];
-
-  kfree(sock);
   socket_table[sockfd] = NULL;
+  spin_unlock_irqrestore(&socket_table_lock, flags);
+
+  if (!sock) {
+    return -EBADF;
+  }
 
+  /* Pollers holding a file see it hang up */
+  flags = spin_lock_irqsave(&sock->lock);
+  sock->state = SS_DISCONNECTING;
+  spin_unlock_irqrestore(&sock->lock, flags);
+  wake_up(&sock->wq);
+
+  /* Freed once calls still using it are done */
+  sock_put(sock);
+
+  return 0;
+}
+
+/* ===================================================================== */
+/* Socket files */
+/* ===================================================================== */
+
+static ssize_t sock_file_read(struct file *file, char *buf, size_t count,
+                              loff_t *pos) {
+  (void)buf;
+  (void)count;
+  (void)pos;
+  return sock_do_recv((struct socket *)file->private_data);
+}
+
+static ssize_t sock_file_write(struct file *file, const char *buf,
+                               size_t count, loff_t *pos) {
+  (void)buf;
+  (void)pos;
+  return sock_do_send((struct socket *)file->private_data, count);
+}
+
+/* Lockless; see fs/poll.h */
+static unsigned int sock_file_poll(struct file *file, struct poll_table *pt) {
+  struct socket *sock = (struct socket *)file->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(file, &sock->wq, pt);
+  if (sock->state == SS_DISCONNECTING) {
+    return EPOLLHUP;
+  }
+  /* Sends always complete and nothing is ever received yet */
+  if (sock_connected(sock)) {
+    mask |= EPOLLOUT | EPOLLWRNORM;
+  }
+  return mask;
+}
+
+static int sock_file_release(struct inode *inode, struct file *file) {
+  (void)inode;
+  sock_put((struct socket *)file->private_data);
   return 0;
 }
+
+static const struct file_operations socket_file_ops = {
+    .read = sock_file_read,
+    .write = sock_file_write,
+    .release = sock_file_release,
+    .poll = sock_file_poll,
+};
+
+struct file *socket_file(int sockfd) {
+  struct file *f = kzalloc(sizeof(struct file), GFP_KERNEL);
+  if (!f) {
+    return NULL;
+  }
+
+  struct socket *sock = sock_get(sockfd);
+  if (!sock) {
+    kfree(f);
+    return NULL;
+  }
+
+  f->f_op = &socket_file_ops;
+  f->f_flags = O_RDWR;
+  f->private_data = sock; /* Holds the reference from sock_get() */
+  f->f_count.counter = 1;
+  return f;
+}
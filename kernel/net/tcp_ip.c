@@ -8,6 +8,9 @@
 #include "printk.h"
 #include "mm/kmalloc.h"
 #include "types.h"
+#include "arch/arch.h"
+#include "sync/rcu.h"
+#include "sync/spinlock.h"
 
 /* ===================================================================== */
 /* Protocol Constants */
@@ -116,18 +119,25 @@ struct tcp_hdr {
 #define ARP_CACHE_SIZE  64
 #define ARP_TIMEOUT     300  /* 5 minutes */
 
+/*
+ * The cache is an RCU list, newest entry first. Entries are never changed
+ * in place: an update publishes a new entry and frees the old one once
+ * lookups in progress are done with it.
+ */
 struct arp_entry {
     uint32_t ip;
     uint8_t mac[ETH_ALEN];
-    uint64_t timestamp;
-    bool valid;
+    struct arp_entry *next;
+    struct rcu_head rcu;
 };
 
-static struct arp_entry arp_cache[ARP_CACHE_SIZE];
+static struct arp_entry *arp_cache;
+static int arp_count;
+static DEFINE_SPINLOCK(arp_lock);   /* Serializes updates */
 
 /* Forward declarations */
 static void arp_add(uint32_t ip, uint8_t *mac);
-static struct arp_entry *arp_lookup(uint32_t ip);
+static bool arp_lookup(uint32_t ip, uint8_t *mac);
 
 /* ===================================================================== */
 /* Network Interface Globals */
@@ -137,6 +147,33 @@ static struct arp_entry *arp_lookup(uint32_t ip);
 static struct net_interface interfaces[MAX_INTERFACES];
 static int num_interfaces = 0;
 
+/* Registered interfaces in order, an RCU list; updates under iface_lock */
+static struct net_interface *iface_list;
+static DEFINE_SPINLOCK(iface_lock);
+
+/*
+ * The interface everything is sent through: the first one registered.
+ * Interfaces are never unregistered, so it stays valid after the read
+ * section.
+ */
+static struct net_interface *net_primary_interface(void)
+{
+    rcu_read_lock();
+    struct net_interface *iface = rcu_dereference(iface_list);
+    rcu_read_unlock();
+    return iface;
+}
+
+/* Append a set-up interface; iface_lock held */
+static void net_publish_interface(struct net_interface *iface)
+{
+    struct net_interface **pp = &iface_list;
+    while (*pp) pp = &(*pp)->next;
+    
+    iface->next = NULL;
+    rcu_assign_pointer(*pp, iface);
+}
+
 /* ===================================================================== */
 /* RX Handler */
 /* ===================================================================== */
@@ -295,12 +332,21 @@ struct tcp_connection {
     uint8_t *send_buf;
     size_t send_len;
     size_t send_capacity;
-    bool in_use;
+    bool in_use;        /* Changed under both locks */
+    spinlock_t lock;    /* Protects the connection's state and buffers */
 };
 
 static struct tcp_connection tcp_connections[MAX_TCP_CONNECTIONS];
 static uint16_t next_ephemeral_port = 49152;
 
+/*
+ * Protects slot allocation, the addresses lookups match on, the port and
+ * ISN generators. Lock order: a connection's lock, then the table lock.
+ * Lookups therefore find a connection under the table lock, lock it after
+ * dropping the table lock and then check it is still the one they found.
+ */
+static DEFINE_SPINLOCK(tcp_table_lock);
+
 /* ===================================================================== */
 /* Checksum Calculation */
 /* ===================================================================== */
@@ -367,46 +413,73 @@ static uint16_t tcp_checksum(struct ip_hdr *ip, struct tcp_hdr *tcp, size_t tcp_
 /* ARP Functions */
 /* ===================================================================== */
 
-static struct arp_entry *arp_lookup(uint32_t ip)
+/* Copy out the MAC cached for @ip; lockless */
+static bool arp_lookup(uint32_t ip, uint8_t *mac)
 {
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            return &arp_cache[i];
+    bool found = false;
+    
+    rcu_read_lock();
+    for (struct arp_entry *e = rcu_dereference(arp_cache); e;
+         e = rcu_dereference(e->next)) {
+        if (e->ip == ip) {
+            for (int i = 0; i < ETH_ALEN; i++) {
+                mac[i] = e->mac[i];
+            }
+            found = true;
+            break;
         }
     }
-    return NULL;
+    rcu_read_unlock();
+    
+    return found;
+}
+
+static void arp_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct arp_entry, rcu));
 }
 
 static void arp_add(uint32_t ip, uint8_t *mac)
 {
-    /* Find empty or oldest slot */
-    int oldest = 0;
-    uint64_t oldest_time = ~0ULL;
+    struct arp_entry *new = kmalloc(sizeof(*new));
+    if (!new) return;
     
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (!arp_cache[i].valid) {
-            oldest = i;
-            break;
-        }
-        if (arp_cache[i].timestamp < oldest_time) {
-            oldest_time = arp_cache[i].timestamp;
-            oldest = i;
-        }
+    new->ip = ip;
+    for (int i = 0; i < ETH_ALEN; i++) {
+        new->mac[i] = mac[i];
     }
     
-    arp_cache[oldest].ip = ip;
-    for (int i = 0; i < ETH_ALEN; i++) {
-        arp_cache[oldest].mac[i] = mac[i];
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    
+    /* Unlink the entry this replaces, or the oldest if the cache is full */
+    struct arp_entry **pp = &arp_cache;
+    struct arp_entry **last = NULL;
+    while (*pp && (*pp)->ip != ip) {
+        last = pp;
+        pp = &(*pp)->next;
     }
-    arp_cache[oldest].timestamp = 0; /* TODO: get_time() */
-    arp_cache[oldest].valid = true;
+    if (!*pp && arp_count >= ARP_CACHE_SIZE) {
+        pp = last;
+    }
+    
+    struct arp_entry *old = *pp;
+    if (old) {
+        __atomic_store_n(pp, old->next, __ATOMIC_RELAXED);
+        arp_count--;
+        call_rcu(&old->rcu, arp_free_rcu);
+    }
+    
+    new->next = arp_cache;
+    rcu_assign_pointer(arp_cache, new);
+    arp_count++;
+    
+    spin_unlock_irqrestore(&arp_lock, flags);
 }
 
 int arp_send_request(uint32_t target_ip)
 {
-    if (num_interfaces == 0) return -1;
-    
-    struct net_interface *iface = &interfaces[0];
+    struct net_interface *iface = net_primary_interface();
+    if (!iface) return -1;
     
     /* Build ARP request */
     uint8_t packet[ETH_HLEN + sizeof(struct arp_hdr)];
@@ -450,7 +523,8 @@ int arp_send_request(uint32_t target_ip)
 
 int icmp_send_echo(uint32_t dest_ip, uint16_t id, uint16_t seq)
 {
-    if (num_interfaces == 0) return -1;
+    struct net_interface *iface = net_primary_interface();
+    if (!iface) return -1;
     
     printk(KERN_DEBUG "ICMP: Sending echo request\n");
     
@@ -464,8 +538,6 @@ int icmp_send_echo(uint32_t dest_ip, uint16_t id, uint16_t seq)
     struct icmp_hdr *icmp = (struct icmp_hdr *)(packet + ETH_HLEN + sizeof(struct ip_hdr));
     
     /* Fill headers */
-    struct net_interface *iface = &interfaces[0];
-    
     /* Ethernet - need ARP lookup */
     eth->type = htons(ETH_P_IP);
     for (int i = 0; i < ETH_ALEN; i++) {
@@ -509,17 +581,29 @@ int icmp_send_echo(uint32_t dest_ip, uint16_t id, uint16_t seq)
 /* TCP Functions */
 /* ===================================================================== */
 
+/* Returns the new connection locked; call with interrupts disabled */
 static struct tcp_connection *tcp_alloc_connection(void)
 {
+    /* Buffers first: no allocating under the table lock */
+    uint8_t *recv_buf = kmalloc(65536);
+    uint8_t *send_buf = kmalloc(65536);
+    
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
     for (int i = 0; i < MAX_TCP_CONNECTIONS; i++) {
         if (!tcp_connections[i].in_use) {
             struct tcp_connection *conn = &tcp_connections[i];
             conn->in_use = true;
+            /* Match no lookup until the caller fills the addresses in */
+            conn->local_ip = conn->remote_ip = 0;
+            conn->local_port = conn->remote_port = 0;
+            spin_unlock_irqrestore(&tcp_table_lock, flags);
+            
+            spin_lock(&conn->lock);
             conn->state = TCP_CLOSED;
             conn->recv_capacity = 65536;
             conn->send_capacity = 65536;
-            conn->recv_buf = kmalloc(conn->recv_capacity);
-            conn->send_buf = kmalloc(conn->send_capacity);
+            conn->recv_buf = recv_buf;
+            conn->send_buf = send_buf;
             conn->recv_len = 0;
             conn->send_len = 0;
             conn->recv_wnd = 65535;
@@ -527,22 +611,32 @@ static struct tcp_connection *tcp_alloc_connection(void)
             return conn;
         }
     }
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
+    
+    if (recv_buf) kfree(recv_buf);
+    if (send_buf) kfree(send_buf);
     return NULL;
 }
 
+/* conn->lock held; the caller still unlocks it */
 static void tcp_free_connection(struct tcp_connection *conn)
 {
     if (conn->recv_buf) kfree(conn->recv_buf);
     if (conn->send_buf) kfree(conn->send_buf);
+    conn->recv_buf = NULL;
+    conn->send_buf = NULL;
+    
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
     conn->in_use = false;
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
 }
 
 /* Build and send a TCP packet */
 static int tcp_send_packet(struct tcp_connection *conn, uint8_t flags, 
                            const void *data, size_t data_len)
 {
-    if (num_interfaces == 0) return -1;
-    struct net_interface *iface = &interfaces[0];
+    struct net_interface *iface = net_primary_interface();
+    if (!iface) return -1;
     
     size_t tcp_len = sizeof(struct tcp_hdr) + data_len;
     size_t total_len = ETH_HLEN + sizeof(struct ip_hdr) + tcp_len;
@@ -607,7 +701,8 @@ static int tcp_send_packet(struct tcp_connection *conn, uint8_t flags,
     return 0;
 }
 
-/* Simple pseudo-random number generator for initial sequence numbers */
+/* Simple pseudo-random number generator for initial sequence numbers;
+ * tcp_table_lock held */
 static uint32_t tcp_isn_counter = 0x12345678;
 static uint32_t tcp_generate_isn(void)
 {
@@ -617,16 +712,24 @@ static uint32_t tcp_generate_isn(void)
 
 int tcp_connect(uint32_t dest_ip, uint16_t dest_port)
 {
+    /* Segments arrive in interrupt context and take conn->lock too */
+    uint64_t irqflags = arch_irq_save_local();
     struct tcp_connection *conn = tcp_alloc_connection();
-    if (!conn) return -1;
+    if (!conn) {
+        arch_irq_restore_local(irqflags);
+        return -1;
+    }
     
-    if (num_interfaces == 0) {
+    struct net_interface *iface = net_primary_interface();
+    if (!iface) {
         tcp_free_connection(conn);
+        spin_unlock(&conn->lock);
+        arch_irq_restore_local(irqflags);
         return -1;
     }
     
-    struct net_interface *iface = &interfaces[0];
-    
+    /* Publish the addresses together, so a lookup sees all or none */
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
     conn->local_ip = iface->ip;
     conn->local_port = next_ephemeral_port++;
     if (next_ephemeral_port > 65000) next_ephemeral_port = 49152;
@@ -634,6 +737,7 @@ int tcp_connect(uint32_t dest_ip, uint16_t dest_port)
     conn->remote_ip = dest_ip;
     conn->remote_port = dest_port;
     conn->seq = tcp_generate_isn();
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
     conn->ack = 0;
     conn->state = TCP_SYN_SENT;
     
@@ -645,10 +749,14 @@ int tcp_connect(uint32_t dest_ip, uint16_t dest_port)
     int ret = tcp_send_packet(conn, TCP_SYN, NULL, 0);
     if (ret < 0) {
         tcp_free_connection(conn);
+        spin_unlock(&conn->lock);
+        arch_irq_restore_local(irqflags);
         return -1;
     }
     
     conn->seq++; /* SYN consumes one sequence number */
+    spin_unlock(&conn->lock);
+    arch_irq_restore_local(irqflags);
     
     /* Return connection index for tracking */
     return (int)(conn - tcp_connections);
@@ -656,10 +764,13 @@ int tcp_connect(uint32_t dest_ip, uint16_t dest_port)
 
 int tcp_send(struct tcp_connection *conn, const void *data, size_t len)
 {
-    if (conn->state != TCP_ESTABLISHED) return -1;
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    int ret = -1;
+    
+    if (conn->state != TCP_ESTABLISHED) goto out;
     
     if (conn->send_len + len > conn->send_capacity) {
-        return -1;  /* Buffer full */
+        goto out;  /* Buffer full */
     }
     
     /* Copy to send buffer */
@@ -668,17 +779,24 @@ int tcp_send(struct tcp_connection *conn, const void *data, size_t len)
     }
     
     /* Send data with PSH+ACK flags */
-    int ret = tcp_send_packet(conn, TCP_PSH | TCP_ACK, data, len);
+    ret = tcp_send_packet(conn, TCP_PSH | TCP_ACK, data, len);
     if (ret == 0) {
         conn->seq += len;
     }
     
+out:
+    spin_unlock_irqrestore(&conn->lock, flags);
     return ret == 0 ? (int)len : -1;
 }
 
 int tcp_recv(struct tcp_connection *conn, void *data, size_t len)
 {
-    if (conn->recv_len == 0) return 0;
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    
+    if (conn->recv_len == 0) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return 0;
+    }
     
     size_t to_copy = (len < conn->recv_len) ? len : conn->recv_len;
     
@@ -692,12 +810,19 @@ int tcp_recv(struct tcp_connection *conn, void *data, size_t len)
     }
     conn->recv_len -= to_copy;
     
+    spin_unlock_irqrestore(&conn->lock, flags);
     return to_copy;
 }
 
 int tcp_close(struct tcp_connection *conn)
 {
-    if (!conn || !conn->in_use) return -1;
+    if (!conn) return -1;
+    
+    uint64_t flags = spin_lock_irqsave(&conn->lock);
+    if (!conn->in_use) {
+        spin_unlock_irqrestore(&conn->lock, flags);
+        return -1;
+    }
     
     switch (conn->state) {
         case TCP_ESTABLISHED:
@@ -720,30 +845,51 @@ int tcp_close(struct tcp_connection *conn)
         case TCP_LISTEN:
             /* Just close immediately */
             tcp_free_connection(conn);
-            return 0;
+            break;
             
         default:
             /* Already closing */
             break;
     }
     
-    /* Don't free immediately - wait for state machine to complete */
+    /* Otherwise don't free immediately - wait for state machine to complete */
+    spin_unlock_irqrestore(&conn->lock, flags);
     return 0;
 }
 
-/* Find a connection by remote IP/port */
+static bool tcp_matches(struct tcp_connection *c, uint32_t remote_ip, uint16_t remote_port,
+                        uint32_t local_ip, uint16_t local_port)
+{
+    return c->in_use &&
+           c->remote_ip == remote_ip && c->remote_port == remote_port &&
+           c->local_ip == local_ip && c->local_port == local_port;
+}
+
+/* Find a connection by remote IP/port and return it locked */
 static struct tcp_connection *tcp_find_connection(uint32_t remote_ip, uint16_t remote_port,
                                                    uint32_t local_ip, uint16_t local_port)
 {
+    struct tcp_connection *found = NULL;
+    
+    uint64_t flags = spin_lock_irqsave(&tcp_table_lock);
     for (int i = 0; i < MAX_TCP_CONNECTIONS; i++) {
         struct tcp_connection *c = &tcp_connections[i];
-        if (c->in_use &&
-            c->remote_ip == remote_ip && c->remote_port == remote_port &&
-            c->local_ip == local_ip && c->local_port == local_port) {
-            return c;
+        if (tcp_matches(c, remote_ip, remote_port, local_ip, local_port)) {
+            found = c;
+            break;
         }
     }
-    return NULL;
+    spin_unlock_irqrestore(&tcp_table_lock, flags);
+    
+    if (!found) return NULL;
+    
+    /* It may have been closed, or even reused, before we got the lock */
+    spin_lock(&found->lock);
+    if (!tcp_matches(found, remote_ip, remote_port, local_ip, local_port)) {
+        spin_unlock(&found->lock);
+        return NULL;
+    }
+    return found;
 }
 
 /* Handle incoming TCP segment - called from IP layer */
@@ -756,10 +902,12 @@ void tcp_handle_segment(uint32_t src_ip, uint32_t dst_ip,
     uint32_t ack = ntohl(tcp->ack);
     uint8_t flags = tcp->flags;
     
+    uint64_t irqflags = arch_irq_save_local();
     struct tcp_connection *conn = tcp_find_connection(src_ip, src_port, dst_ip, dst_port);
     
     if (!conn) {
         /* No connection - send RST if not a RST */
+        arch_irq_restore_local(irqflags);
         if (!(flags & TCP_RST)) {
             printk(KERN_DEBUG "TCP: No connection for port %u, would send RST\n", dst_port);
         }
@@ -859,6 +1007,9 @@ void tcp_handle_segment(uint32_t src_ip, uint32_t dst_ip,
         default:
             break;
     }
+    
+    spin_unlock(&conn->lock);
+    arch_irq_restore_local(irqflags);
 }
 
 /* ===================================================================== */
@@ -868,7 +1019,8 @@ void tcp_handle_segment(uint32_t src_ip, uint32_t dst_ip,
 int udp_send(uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
              const void *data, size_t len)
 {
-    if (num_interfaces == 0) return -1;
+    struct net_interface *iface = net_primary_interface();
+    if (!iface) return -1;
     
     size_t total_len = ETH_HLEN + sizeof(struct ip_hdr) + 
                        sizeof(struct udp_hdr) + len;
@@ -880,8 +1032,6 @@ int udp_send(uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
     struct udp_hdr *udp = (struct udp_hdr *)(packet + ETH_HLEN + sizeof(struct ip_hdr));
     uint8_t *payload = packet + ETH_HLEN + sizeof(struct ip_hdr) + sizeof(struct udp_hdr);
     
-    struct net_interface *iface = &interfaces[0];
-    
     /* Ethernet */
     eth->type = htons(ETH_P_IP);
     for (int i = 0; i < ETH_ALEN; i++) {
@@ -932,23 +1082,22 @@ void tcpip_init(void)
 {
     printk(KERN_INFO "NET: Initializing network stack\n");
     
-    /* Clear ARP cache */
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        arp_cache[i].valid = false;
-    }
-    
     /* Clear TCP connections */
     for (int i = 0; i < MAX_TCP_CONNECTIONS; i++) {
         tcp_connections[i].in_use = false;
+        spin_lock_init(&tcp_connections[i].lock);
     }
     
     /* Create loopback interface */
+    uint64_t flags = spin_lock_irqsave(&iface_lock);
     struct net_interface *lo = &interfaces[num_interfaces++];
     lo->name[0] = 'l'; lo->name[1] = 'o'; lo->name[2] = '\0';
     lo->ip = 0x7F000001;  /* 127.0.0.1 */
     lo->netmask = 0xFF000000;
     lo->gateway = 0;
     lo->up = true;
+    net_publish_interface(lo);
+    spin_unlock_irqrestore(&iface_lock, flags);
     
     printk(KERN_INFO "NET: Loopback interface configured\n");
     printk(KERN_INFO "NET: TCP/IP stack initialized\n");
@@ -958,7 +1107,11 @@ void tcpip_init(void)
 struct net_interface *net_add_interface(const char *name, uint8_t *mac, uint32_t ip, 
                       uint32_t netmask, uint32_t gateway)
 {
-    if (num_interfaces >= MAX_INTERFACES) return NULL;
+    uint64_t flags = spin_lock_irqsave(&iface_lock);
+    if (num_interfaces >= MAX_INTERFACES) {
+        spin_unlock_irqrestore(&iface_lock, flags);
+        return NULL;
+    }
     
     struct net_interface *iface = &interfaces[num_interfaces++];
     
@@ -976,6 +1129,10 @@ struct net_interface *net_add_interface(const char *name, uint8_t *mac, uint32_t
     iface->up = true;
     iface->send = NULL; /* Default */
     
+    /* Lookups only see it once it is filled in */
+    net_publish_interface(iface);
+    spin_unlock_irqrestore(&iface_lock, flags);
+    
     printk(KERN_INFO "NET: Added interface %s\n", name);
     
     return iface;
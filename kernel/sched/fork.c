@@ -4,11 +4,13 @@
  * Implements process creation (fork) and program loading (exec).
  */
 
+#include "fs/fdtable.h"
 #include "fs/vfs.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
 #include "printk.h"
 #include "sched/sched.h"
+#include "time/vdso.h"
 
 /* Forward declaration */
 static void fork_entry(void *arg);
@@ -56,14 +58,24 @@ struct elf64_phdr {
 /* Fork implementation */
 /* ===================================================================== */
 
-static int copy_mm(struct task_struct *child, struct task_struct *parent) {
+static int copy_mm(struct task_struct *child, struct task_struct *parent,
+                   unsigned long flags) {
   if (!parent->mm) {
     child->mm = NULL;
     child->active_mm = parent->active_mm;
     return 0;
   }
 
-  child->mm = vmm_create_address_space();
+  if (flags & CLONE_VM) {
+    /* Threads share the address space outright */
+    atomic_inc(&parent->mm->users);
+    child->mm = parent->mm;
+    child->active_mm = parent->mm;
+    return 0;
+  }
+
+  /* Page tables are copied, page contents only on the first write */
+  child->mm = vmm_fork_address_space(parent->mm);
   if (!child->mm) {
     return -1;
   }
@@ -72,6 +84,29 @@ static int copy_mm(struct task_struct *child, struct task_struct *parent) {
   return 0;
 }
 
+static int copy_files(struct task_struct *child, struct task_struct *parent,
+                      unsigned long flags) {
+  if (flags & CLONE_FILES) {
+    /* Both must see the same table, even if neither has opened anything */
+    struct files_struct *files = task_files(parent);
+    if (!files) {
+      return -1;
+    }
+    files_get(files);
+    child->files = files;
+    return 0;
+  }
+
+  if (!parent->files) {
+    /* Gets a fresh table on first use */
+    child->files = NULL;
+    return 0;
+  }
+
+  child->files = files_dup(parent->files);
+  return child->files ? 0 : -1;
+}
+
 static void copy_thread(struct task_struct *child, struct task_struct *parent) {
   child->cpu_context = parent->cpu_context;
 }
@@ -87,7 +122,11 @@ long do_fork(unsigned long flags) {
     return -1;
   }
 
-  if (copy_mm(child, current_task) < 0) {
+  if (copy_mm(child, current_task, flags) < 0) {
+    return -1;
+  }
+
+  if (copy_files(child, current_task, flags) < 0) {
     return -1;
   }
 
@@ -205,12 +244,21 @@ long do_execve(const char *filename, char *const argv[], char *const envp[]) {
     current_task->active_mm = current_task->mm;
   }
 
+  /* libc reads the clocks from it unconditionally */
+  if (vdso_map(current_task->mm) < 0) {
+    return -1;
+  }
+
   if (load_elf_binary(filename, &entry_point) < 0) {
     return -1;
   }
 
   uint64_t user_sp = setup_user_stack(argv, envp);
 
+  if (current_task->files) {
+    files_close_on_exec(current_task->files);
+  }
+
   const char *name = filename;
   while (*filename) {
     if (*filename == '/')
@@ -1,8 +1,23 @@
 /*
  * UnixOS Kernel - Scheduler Implementation
+ *
+ * Each CPU has its own run queue. Tasks are scheduled fairly by virtual
+ * runtime: the time a task has run, scaled down by its nice weight. Waiting
+ * tasks sit in a red-black tree ordered by vruntime and the leftmost one
+ * runs next, so a task gets CPU time in proportion to its weight. Tasks
+ * that slept are placed just behind the queue's minimum vruntime and may
+ * preempt the current task when they wake, which keeps interactive tasks
+ * responsive while CPU-bound ones still progress.
+ *
+ * New and woken tasks are placed on the least loaded CPU. Load is evened out by work stealing: a CPU that runs
+ * out of tasks, and every CPU periodically, pulls half of the imbalance
+ * from the busiest queue. Tasks that ran within the migration cost window
+ * are cache-hot and are left where they are unless balancing keeps failing.
  */
 
 #include "sched/sched.h"
+#include "arch/arch.h"
+#include "fs/fdtable.h"
 #include "mm/pmm.h"
 #include "printk.h"
 
@@ -10,8 +25,8 @@
 /* Static data */
 /* ===================================================================== */
 
-/* Global run queue (single CPU for now) */
-static struct rq runqueue;
+/* Per-CPU run queues */
+static struct rq runqueues[MAX_CPUS];
 
 /* Task pool (simple allocation for now) */
 #define MAX_TASKS   256
@@ -21,7 +36,10 @@ static int task_pool_index = 0;
 /* PID counter */
 static pid_t next_pid = 1;
 
-/* Init task (PID 0 / swapper) */
+/* Protects task_pool_index and next_pid */
+static DEFINE_SPINLOCK(task_pool_lock);
+
+/* Init task (PID 0 / swapper), the idle task of CPU 0 */
 static struct task_struct init_task = {
     .state = TASK_RUNNING,
     .prio = PRIO_DEFAULT,
@@ -33,13 +51,53 @@ static struct task_struct init_task = {
     .flags = PF_KTHREAD | PF_IDLE,
 };
 
+/* Idle tasks of the secondary CPUs */
+static struct task_struct idle_tasks[MAX_CPUS];
+
+/* SCHED_MIGRATION_COST_US in timer ticks */
+static uint64_t migration_cost;
+
+/* SCHED_LATENCY_US, SCHED_MIN_GRANULARITY_US and SCHED_WAKEUP_GRANULARITY_US
+ * in timer ticks */
+static uint64_t sched_latency;
+static uint64_t sched_min_granularity;
+static uint64_t sched_wakeup_granularity;
+
+/*
+ * Load weight per nice level, NICE_MIN first. Neighbouring levels differ by
+ * a factor of ~1.25, so one nice step moves about 10% of the CPU between
+ * two competing tasks.
+ */
+static const unsigned int nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
 /* ===================================================================== */
 /* Helper functions */
 /* ===================================================================== */
 
+static inline struct rq *this_rq(void)
+{
+    return &runqueues[arch_cpu_id()];
+}
+
+static inline struct rq *cpu_rq(int cpu)
+{
+    return &runqueues[cpu];
+}
+
 static struct task_struct *alloc_task(void)
 {
+    uint64_t flags = spin_lock_irqsave(&task_pool_lock);
     if (task_pool_index >= MAX_TASKS) {
+        spin_unlock_irqrestore(&task_pool_lock, flags);
         return NULL;
     }
     
@@ -51,6 +109,9 @@ static struct task_struct *alloc_task(void)
         p[i] = 0;
     }
     
+    task->pid = next_pid++;
+    spin_unlock_irqrestore(&task_pool_lock, flags);
+    
     return task;
 }
 
@@ -70,57 +131,452 @@ static void *alloc_stack(size_t size)
     return (void *)paddr;  /* Identity mapped for now */
 }
 
-static void enqueue_task(struct task_struct *task)
+static void set_task_nice(struct task_struct *task, int nice)
 {
-    task->state = TASK_RUNNING;
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
     
-    if (!runqueue.head) {
-        runqueue.head = runqueue.tail = task;
-        task->next = task->prev = NULL;
-    } else {
-        task->prev = runqueue.tail;
-        task->next = NULL;
-        runqueue.tail->next = task;
-        runqueue.tail = task;
+    task->nice = nice;
+    task->prio = nice;
+    task->static_prio = nice;
+    task->load_weight = nice_to_weight[nice - NICE_MIN];
+}
+
+static inline struct task_struct *task_of(struct rb_node *node)
+{
+    return rb_entry(node, struct task_struct, run_node);
+}
+
+/* Wrap-safe vruntime comparison */
+static inline int vruntime_before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+/* Convert real run time to vruntime: heavier tasks age more slowly */
+static uint64_t calc_delta_fair(uint64_t delta, struct task_struct *task)
+{
+    if (task->load_weight == NICE_0_LOAD) {
+        return delta;
+    }
+    return delta * NICE_0_LOAD / task->load_weight;
+}
+
+/* rq->lock held */
+static void timeline_insert(struct rq *rq, struct task_struct *task)
+{
+    struct rb_node **link = &rq->timeline.node;
+    struct rb_node *parent = NULL;
+    int leftmost = 1;
+    
+    /* Equal keys go right, so tasks with the same vruntime run in order */
+    while (*link) {
+        parent = *link;
+        if (vruntime_before(task->vruntime, task_of(parent)->vruntime)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
     }
     
-    runqueue.nr_running++;
+    if (leftmost) {
+        rq->leftmost = &task->run_node;
+    }
+    rb_link_node(&task->run_node, parent, link);
+    rb_insert_color(&task->run_node, &rq->timeline);
 }
 
-static void dequeue_task(struct task_struct *task)
+/* rq->lock held */
+static void timeline_remove(struct rq *rq, struct task_struct *task)
 {
-    if (task->prev) {
-        task->prev->next = task->next;
-    } else {
-        runqueue.head = task->next;
+    if (rq->leftmost == &task->run_node) {
+        rq->leftmost = rb_next(&task->run_node);
     }
+    rb_erase(&task->run_node, &rq->timeline);
+}
+
+/* Advance min_vruntime to the smallest vruntime still runnable; rq->lock held */
+static void update_min_vruntime(struct rq *rq)
+{
+    struct task_struct *curr = rq->current;
+    uint64_t vruntime = rq->min_vruntime;
+    int have = 0;
     
-    if (task->next) {
-        task->next->prev = task->prev;
-    } else {
-        runqueue.tail = task->prev;
+    if (curr != rq->idle && curr->on_rq) {
+        vruntime = curr->vruntime;
+        have = 1;
+    }
+    if (rq->leftmost) {
+        uint64_t left = task_of(rq->leftmost)->vruntime;
+        if (!have || vruntime_before(left, vruntime)) {
+            vruntime = left;
+        }
+    }
+    
+    if (vruntime_before(rq->min_vruntime, vruntime)) {
+        rq->min_vruntime = vruntime;
+    }
+}
+
+/* Charge the current task for the time it has run; rq->lock held */
+static void update_curr(struct rq *rq)
+{
+    struct task_struct *curr = rq->current;
+    uint64_t now = arch_timer_get_ticks();
+    
+    if (curr == rq->idle) {
+        return;
+    }
+    
+    int64_t delta = (int64_t)(now - curr->exec_start);
+    if (delta <= 0) {
+        return;
+    }
+    
+    curr->exec_start = now;
+    curr->sum_exec_runtime += (uint64_t)delta;
+    curr->vruntime += calc_delta_fair((uint64_t)delta, curr);
+    update_min_vruntime(rq);
+}
+
+/*
+ * Slice of the scheduling period a task is entitled to: the period is
+ * SCHED_LATENCY_US, stretched so nobody gets less than the minimum
+ * granularity, and shared out by weight. rq->lock held.
+ */
+static uint64_t sched_slice(struct rq *rq, struct task_struct *task)
+{
+    uint64_t period = sched_latency;
+    uint64_t nr_latency = SCHED_LATENCY_US / SCHED_MIN_GRANULARITY_US;
+    
+    if (rq->nr_running > nr_latency) {
+        period = rq->nr_running * sched_min_granularity;
+    }
+    if (!rq->load) {
+        return period;
     }
+    return period * task->load_weight / rq->load;
+}
+
+/*
+ * Set the vruntime of a task joining the queue. New tasks start one slice
+ * behind the queue so forking can't be used to grab CPU time; tasks that
+ * slept get up to half a latency period of credit so they run soon after
+ * waking, but never more, so sleeping can't bank unbounded time.
+ * rq->lock held.
+ */
+static void place_task(struct rq *rq, struct task_struct *task, int initial)
+{
+    uint64_t vruntime = rq->min_vruntime;
     
-    task->next = task->prev = NULL;
+    if (initial) {
+        vruntime += calc_delta_fair(sched_slice(rq, task), task);
+        task->vruntime = vruntime;
+        return;
+    }
     
-    if (runqueue.nr_running > 0) {
-        runqueue.nr_running--;
+    vruntime -= sched_latency / 2;
+    if (vruntime_before(task->vruntime, vruntime)) {
+        task->vruntime = vruntime;
     }
 }
 
-static struct task_struct *pick_next_task(void)
+/* Add a runnable task to the queue's load and timeline; rq->lock held */
+static void enqueue_task(struct rq *rq, struct task_struct *task)
+{
+    task->state = TASK_RUNNING;
+    task->cpu = rq->cpu;
+    task->on_rq = 1;
+    
+    timeline_insert(rq, task);
+    rq->load += task->load_weight;
+    rq->nr_running++;
+}
+
+/* Remove a task from the queue; the running task is not in the timeline.
+ * rq->lock held */
+static void dequeue_task(struct rq *rq, struct task_struct *task)
 {
-    /* Simple round-robin: pick head of queue */
-    struct task_struct *next = runqueue.head;
+    if (!task->on_rq) {
+        return;
+    }
     
-    if (!next) {
+    if (task != rq->current) {
+        timeline_remove(rq, task);
+    }
+    task->on_rq = 0;
+    rq->load -= task->load_weight;
+    rq->nr_running--;
+}
+
+/* Take the task with the smallest vruntime off the timeline to run it;
+ * rq->lock held */
+static struct task_struct *pick_next_task(struct rq *rq)
+{
+    if (!rq->leftmost) {
         /* No runnable tasks - return idle task */
-        return runqueue.idle;
+        return rq->idle;
     }
     
+    struct task_struct *next = task_of(rq->leftmost);
+    timeline_remove(rq, next);
+    next->exec_start = arch_timer_get_ticks();
+    next->prev_sum_exec = next->sum_exec_runtime;
     return next;
 }
 
+/* Preempt the current task once it has used up its slice; rq->lock held */
+static void check_preempt_tick(struct rq *rq)
+{
+    struct task_struct *curr = rq->current;
+    
+    if (curr == rq->idle) {
+        if (rq->leftmost) {
+            rq->need_resched = 1;
+        }
+        return;
+    }
+    if (!rq->leftmost) {
+        return;
+    }
+    
+    uint64_t ran = curr->sum_exec_runtime - curr->prev_sum_exec;
+    if (ran > sched_slice(rq, curr)) {
+        rq->need_resched = 1;
+        return;
+    }
+    
+    /* Let it have at least the minimum granularity, after that give way
+     * to a task that is more than a slice behind */
+    if (ran < sched_min_granularity) {
+        return;
+    }
+    struct task_struct *left = task_of(rq->leftmost);
+    if (vruntime_before(left->vruntime, curr->vruntime) &&
+        curr->vruntime - left->vruntime > sched_slice(rq, curr)) {
+        rq->need_resched = 1;
+    }
+}
+
+/* Preempt the current task for a woken one that is owed enough CPU time;
+ * rq->lock held */
+static void check_preempt_wakeup(struct rq *rq, struct task_struct *task)
+{
+    struct task_struct *curr = rq->current;
+    
+    if (curr == rq->idle) {
+        rq->need_resched = 1;
+        return;
+    }
+    
+    update_curr(rq);
+    uint64_t gran = calc_delta_fair(sched_wakeup_granularity, task);
+    if (vruntime_before(task->vruntime, curr->vruntime) &&
+        curr->vruntime - task->vruntime > gran) {
+        rq->need_resched = 1;
+    }
+}
+
+/*
+ * Choose a run queue for a task that is becoming runnable: the least
+ * loaded online CPU, staying on the task's previous CPU on a tie so its
+ * cache footprint is reused.
+ */
+static struct rq *select_task_rq(struct task_struct *task)
+{
+    int ncpus = (int)arch_cpu_count();
+    int best = (task->cpu >= 0 && task->cpu < ncpus) ? task->cpu : 0;
+    
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        if (cpu_rq(cpu)->nr_running < cpu_rq(best)->nr_running) {
+            best = cpu;
+        }
+    }
+    
+    return cpu_rq(best);
+}
+
+/*
+ * Put a runnable task on a queue and kick that CPU if it is not us.
+ * @initial is set for new tasks and clear for wakeups.
+ */
+static void activate_task(struct task_struct *task, int initial)
+{
+    /* A sleeper still switching out stays on its CPU until it is off */
+    struct rq *rq = task->on_cpu ? cpu_rq(task->cpu) : select_task_rq(task);
+    struct rq *old_rq = cpu_rq(task->cpu);
+    
+    /* vruntime is kept relative to the queue it is compared against */
+    if (!initial && old_rq != rq) {
+        task->vruntime = task->vruntime - old_rq->min_vruntime + rq->min_vruntime;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    update_curr(rq);
+    place_task(rq, task, initial);
+    enqueue_task(rq, task);
+    check_preempt_wakeup(rq, task);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    
+    if (rq != this_rq()) {
+        arch_smp_send_reschedule(rq->cpu);
+    }
+}
+
+/* Lock two run queues in a fixed order to avoid ABBA deadlocks */
+static void double_rq_lock(struct rq *a, struct rq *b)
+{
+    if (a->cpu < b->cpu) {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
+    } else {
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
+    }
+}
+
+static void double_rq_unlock(struct rq *a, struct rq *b)
+{
+    spin_unlock(&a->lock);
+    spin_unlock(&b->lock);
+}
+
+/* Did the task leave a CPU recently enough that its cache is still warm? */
+static int task_hot(struct task_struct *task, uint64_t now)
+{
+    return now - task->last_ran < migration_cost;
+}
+
+/* Both queues locked */
+static int can_migrate_task(struct rq *this, struct rq *src,
+                            struct task_struct *task, uint64_t now)
+{
+    /* Never move a task whose registers are live on a CPU */
+    if (task == src->current || task->on_cpu || (task->flags & PF_IDLE)) {
+        return 0;
+    }
+    
+    /* Moving a cache-hot task costs more than the imbalance, unless we
+     * have already failed to balance a few times in a row */
+    if (task_hot(task, now) && this->nr_balance_failed < SCHED_CACHE_NICE_TRIES) {
+        this->stats.hot_skipped++;
+        return 0;
+    }
+    
+    return 1;
+}
+
+static struct rq *find_busiest_queue(struct rq *this)
+{
+    int ncpus = (int)arch_cpu_count();
+    struct rq *busiest = NULL;
+    
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        struct rq *rq = cpu_rq(cpu);
+        if (rq == this) {
+            continue;
+        }
+        if (!busiest || rq->nr_running > busiest->nr_running) {
+            busiest = rq;
+        }
+    }
+    
+    return busiest;
+}
+
+/*
+ * Steal half of the imbalance from @busiest, starting with the tasks that
+ * are furthest behind since they have waited longest for a CPU. Their lag
+ * is carried over by rebasing vruntime onto this queue.
+ * Both queues locked.
+ */
+static unsigned int steal_tasks(struct rq *this, struct rq *busiest)
+{
+    unsigned int want = (busiest->nr_running - this->nr_running) / 2;
+    unsigned int moved = 0;
+    uint64_t now = arch_timer_get_ticks();
+    
+    struct rb_node *node = busiest->leftmost;
+    while (node && moved < want) {
+        struct rb_node *next = rb_next(node);
+        struct task_struct *task = task_of(node);
+        if (can_migrate_task(this, busiest, task, now)) {
+            dequeue_task(busiest, task);
+            task->vruntime = task->vruntime - busiest->min_vruntime +
+                             this->min_vruntime;
+            enqueue_task(this, task);
+            moved++;
+        }
+        node = next;
+    }
+    
+    if (moved && this->current == this->idle) {
+        this->need_resched = 1;
+    }
+    return moved;
+}
+
+/*
+ * Pull work from the busiest queue if it has at least two more runnable
+ * tasks than ours. Called when this CPU goes idle and periodically from
+ * the tick. Interrupts must be disabled and this->lock not held.
+ *
+ * Return: Number of tasks pulled
+ */
+static unsigned int load_balance(struct rq *this)
+{
+    struct rq *busiest = find_busiest_queue(this);
+    
+    if (!busiest || busiest->nr_running < this->nr_running + 2) {
+        return 0;
+    }
+    
+    double_rq_lock(this, busiest);
+    
+    unsigned int moved = 0;
+    /* Recheck under the locks */
+    if (busiest->nr_running >= this->nr_running + 2) {
+        this->stats.steal_attempts++;
+        moved = steal_tasks(this, busiest);
+        if (moved) {
+            this->stats.steal_success++;
+            this->stats.migrations += moved;
+            this->nr_balance_failed = 0;
+        } else {
+            this->nr_balance_failed++;
+        }
+    }
+    
+    double_rq_unlock(this, busiest);
+    return moved;
+}
+
+static void init_rq(int cpu, struct task_struct *idle)
+{
+    struct rq *rq = cpu_rq(cpu);
+    
+    spin_lock_init(&rq->lock);
+    rq->cpu = cpu;
+    rq->current = idle;
+    rq->idle = idle;
+    rq->timeline = RB_ROOT;
+    rq->leftmost = NULL;
+    rq->min_vruntime = 0;
+    rq->load = 0;
+    rq->need_resched = 0;
+    rq->nr_running = 0;
+    rq->clock = 0;
+    rq->prev = NULL;
+    rq->nr_balance_failed = 0;
+    
+    idle->cpu = cpu;
+    idle->on_cpu = 1;
+}
+
 /* ===================================================================== */
 /* Public functions */
 /* ===================================================================== */
@@ -129,41 +585,126 @@ void sched_init(void)
 {
     printk(KERN_INFO "SCHED: Initializing scheduler\n");
     
-    /* Initialize run queue */
-    runqueue.current = &init_task;
-    runqueue.idle = &init_task;
-    runqueue.head = NULL;
-    runqueue.tail = NULL;
-    runqueue.nr_running = 0;
-    runqueue.clock = 0;
+    uint64_t freq = arch_timer_get_frequency();
+    migration_cost = freq * SCHED_MIGRATION_COST_US / 1000000;
+    sched_latency = freq * SCHED_LATENCY_US / 1000000;
+    sched_min_granularity = freq * SCHED_MIN_GRANULARITY_US / 1000000;
+    sched_wakeup_granularity = freq * SCHED_WAKEUP_GRANULARITY_US / 1000000;
+    init_task.load_weight = NICE_0_LOAD;
+    
+    /* CPU 0 runs init_task; the other queues are set up as CPUs come up */
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        init_rq(cpu, cpu == 0 ? &init_task : &idle_tasks[cpu]);
+    }
+    
+    printk(KERN_INFO "SCHED: Scheduler initialized (%d run queues)\n", MAX_CPUS);
+}
+
+void sched_init_cpu(int cpu)
+{
+    struct task_struct *idle = &idle_tasks[cpu];
+    
+    idle->state = TASK_RUNNING;
+    idle->prio = PRIO_DEFAULT;
+    idle->static_prio = PRIO_DEFAULT;
+    idle->load_weight = NICE_0_LOAD;
+    idle->pid = 0;
+    idle->flags = PF_KTHREAD | PF_IDLE;
+    
+    const char *name = "swapper/";
+    int i = 0;
+    while (name[i]) {
+        idle->comm[i] = name[i];
+        i++;
+    }
+    idle->comm[i++] = (char)('0' + cpu);
+    idle->comm[i] = '\0';
+    
+    init_rq(cpu, idle);
+}
+
+void scheduler_tick(void)
+{
+    struct rq *rq = this_rq();
+    
+    spin_lock(&rq->lock);
+    update_curr(rq);
+    check_preempt_tick(rq);
+    spin_unlock(&rq->lock);
+    
+    rq->clock++;
+    if (rq->clock % SCHED_BALANCE_TICKS == 0) {
+        rq->stats.balance_runs++;
+        load_balance(rq);
+    }
+}
+
+int sched_get_stats(int cpu, struct sched_stats *stats)
+{
+    if (cpu < 0 || cpu >= (int)arch_cpu_count()) {
+        return -1;
+    }
     
-    printk(KERN_INFO "SCHED: Scheduler initialized\n");
+    struct rq *rq = cpu_rq(cpu);
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    *stats = rq->stats;
+    stats->nr_running = rq->nr_running;
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return 0;
 }
 
 void schedule(void)
 {
-    struct task_struct *prev = runqueue.current;
-    struct task_struct *next;
+    uint64_t flags = arch_irq_save();
+    struct rq *rq = this_rq();
+    
+    /* Out of work: try to steal some before settling for the idle task */
+    if (!rq->leftmost) {
+        rq->stats.idle_balance++;
+        load_balance(rq);
+    }
     
-    /* Don't schedule if interrupts disabled (should check) */
+    spin_lock(&rq->lock);
+    
+    struct task_struct *prev = rq->current;
+    update_curr(rq);
+    rq->need_resched = 0;
+    
+    if (prev != rq->idle) {
+        if (prev->state != TASK_RUNNING) {
+            /* Going to sleep or exiting: no longer runnable */
+            dequeue_task(rq, prev);
+        } else if (prev->on_rq) {
+            /* Preempted or yielding: back into the timeline */
+            timeline_insert(rq, prev);
+        }
+    }
     
-    /* Pick next task */
-    next = pick_next_task();
+    struct task_struct *next = pick_next_task(rq);
     
     if (next == prev) {
         /* Same task, no switch needed */
+        spin_unlock(&rq->lock);
+        arch_irq_restore(flags);
         return;
     }
     
-    /* Move current to end of queue if still runnable */
-    if (prev->state == TASK_RUNNING && prev != runqueue.idle) {
-        dequeue_task(prev);
-        enqueue_task(prev);
-    }
+    /* prev stays pinned here until its registers are saved */
+    prev->last_ran = arch_timer_get_ticks();
+    next->on_cpu = 1;
+    rq->current = next;
+    rq->prev = prev;
+    spin_unlock(&rq->lock);
     
-    /* Perform context switch */
-    runqueue.current = next;
     context_switch(prev, next);
+    
+    /* Back on some CPU: the task we switched away from is now off CPU */
+    rq = this_rq();
+    if (rq->prev) {
+        rq->prev->on_cpu = 0;
+        rq->prev = NULL;
+    }
+    arch_irq_restore(flags);
 }
 
 int wake_up_process(struct task_struct *task)
@@ -172,13 +713,27 @@ int wake_up_process(struct task_struct *task)
         return 0;
     }
     
-    if (task->state == TASK_RUNNING) {
+    /* Only one waker gets to move the task out of its sleeping state */
+    task_state_t state = task->state;
+    if (state != TASK_INTERRUPTIBLE && state != TASK_UNINTERRUPTIBLE) {
         return 0;  /* Already running */
     }
+    if (!__atomic_compare_exchange_n(&task->state, &state, TASK_RUNNING, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    
+    /* Woken before schedule() took it off the queue: it just keeps going */
+    struct rq *rq = cpu_rq(task->cpu);
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    int queued = task->on_rq;
+    spin_unlock_irqrestore(&rq->lock, flags);
+    if (queued) {
+        return 1;
+    }
     
     /* Make runnable */
-    task->state = TASK_RUNNING;
-    enqueue_task(task);
+    activate_task(task, 0);
     
     return 1;
 }
@@ -199,17 +754,15 @@ struct task_struct *create_task(void (*entry)(void *), void *arg, uint32_t flags
         return NULL;
     }
     
-    /* Initialize task */
+    /* Initialize task, inheriting the creator's nice value */
     task->state = TASK_RUNNING;
-    task->prio = PRIO_DEFAULT;
-    task->static_prio = PRIO_DEFAULT;
-    task->nice = 0;
-    task->pid = next_pid++;
+    task->parent = get_current();
+    set_task_nice(task, task->parent ? task->parent->nice : 0);
     task->tgid = task->pid;
     task->flags = flags;
     task->stack = stack;
     task->stack_size = KERNEL_STACK_SIZE;
-    task->parent = runqueue.current;
+    task->cpu = arch_cpu_id();
     
     /* Set up initial CPU context */
     task->cpu_context.sp = (uint64_t)stack + KERNEL_STACK_SIZE;
@@ -225,23 +778,33 @@ struct task_struct *create_task(void (*entry)(void *), void *arg, uint32_t flags
     printk(KERN_INFO "SCHED: Created task %d '%s'\n", task->pid, task->comm);
     
     /* Add to run queue */
-    enqueue_task(task);
+    activate_task(task, 1);
     
     return task;
 }
 
 void exit_task(int code)
 {
-    struct task_struct *current = runqueue.current;
+    struct task_struct *current = get_current();
     
     printk(KERN_INFO "SCHED: Task %d exiting with code %d\n", current->pid, code);
     
+    /* Close its descriptors unless a CLONE_FILES sibling still uses them;
+     * may sleep, so before it stops being runnable */
+    files_put(current->files);
+    current->files = NULL;
+    
     current->exit_code = code;
     current->state = TASK_ZOMBIE;
     current->flags |= PF_EXITING;
     
     /* Remove from run queue */
-    dequeue_task(current);
+    uint64_t flags = arch_irq_save();
+    struct rq *rq = this_rq();
+    spin_lock(&rq->lock);
+    dequeue_task(rq, current);
+    spin_unlock(&rq->lock);
+    arch_irq_restore(flags);
     
     /* TODO: Notify parent */
     /* TODO: Reparent children */
@@ -265,7 +828,7 @@ void exit_task(int code)
 
 pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clone_flags)
 {
-    struct task_struct *parent = runqueue.current;
+    struct task_struct *parent = get_current();
     struct task_struct *task = alloc_task();
     
     if (!task) {
@@ -275,15 +838,13 @@ pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clon
     
     /* Initialize thread - inherit most things from parent */
     task->state = TASK_RUNNING;
-    task->prio = parent->prio;
-    task->static_prio = parent->static_prio;
-    task->nice = parent->nice;
-    task->pid = next_pid++;
+    set_task_nice(task, parent->nice);
     task->tgid = (clone_flags & CLONE_THREAD) ? parent->tgid : task->pid;
     task->flags = PF_THREAD;
     task->parent = parent;
     task->uid = parent->uid;
     task->gid = parent->gid;
+    task->cpu = parent->cpu;
     
     /* Copy name with " [thread]" suffix */
     int i;
@@ -305,6 +866,24 @@ pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clon
         task->active_mm = parent->active_mm;
     }
     
+    /* Share the descriptor table if CLONE_FILES is set, else copy it.
+     * A shared table is created now so both sides end up with the same one */
+    if (clone_flags & CLONE_FILES) {
+        struct files_struct *files = task_files(parent);
+        if (!files) {
+            printk(KERN_ERR "SCHED: Failed to create thread files\n");
+            return -1;
+        }
+        files_get(files);
+        task->files = files;
+    } else if (parent->files) {
+        task->files = files_dup(parent->files);
+        if (!task->files) {
+            printk(KERN_ERR "SCHED: Failed to copy thread files\n");
+            return -1;
+        }
+    }
+    
     /* Use provided stack or allocate new one */
     if (stack) {
         task->stack = stack;
@@ -328,7 +907,7 @@ pid_t create_thread(void (*entry)(void *), void *arg, void *stack, uint32_t clon
            task->pid, task->tgid, parent->comm);
     
     /* Add to run queue */
-    enqueue_task(task);
+    activate_task(task, 1);
     
     return task->pid;
 }
@@ -370,17 +949,70 @@ int sched_kill_task(pid_t pid)
     task->pending_signals |= (1ULL << 9);  /* SIGKILL */
     
     /* If sleeping, wake it up */
-    if (task->state == TASK_INTERRUPTIBLE || task->state == TASK_UNINTERRUPTIBLE) {
-        task->state = TASK_RUNNING;
-        enqueue_task(task);
-    }
+    wake_up_process(task);
     
     return 0;
 }
 
 struct task_struct *get_current(void)
 {
-    return runqueue.current;
+    return this_rq()->current;
+}
+
+int need_resched(void)
+{
+    return this_rq()->need_resched;
+}
+
+int sched_set_nice(pid_t pid, int nice)
+{
+    struct task_struct *task = pid ? get_task_by_pid(pid) : get_current();
+    
+    if (!task || (task->flags & PF_IDLE)) {
+        return -3;  /* ESRCH - No such process */
+    }
+    
+    struct rq *rq = cpu_rq(task->cpu);
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    
+    /* Reweight in place: the load and the timeline key both change */
+    int queued = task->on_rq && task != rq->current;
+    if (task == rq->current) {
+        update_curr(rq);
+    }
+    if (queued) {
+        timeline_remove(rq, task);
+    }
+    if (task->on_rq) {
+        rq->load -= task->load_weight;
+    }
+    
+    set_task_nice(task, nice);
+    
+    if (task->on_rq) {
+        rq->load += task->load_weight;
+    }
+    if (queued) {
+        timeline_insert(rq, task);
+    }
+    if (task == rq->current) {
+        check_preempt_tick(rq);
+    }
+    
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return 0;
+}
+
+int sched_get_nice(pid_t pid, int *nice)
+{
+    struct task_struct *task = pid ? get_task_by_pid(pid) : get_current();
+    
+    if (!task) {
+        return -3;  /* ESRCH - No such process */
+    }
+    
+    *nice = task->nice;
+    return 0;
 }
 
 void context_switch(struct task_struct *prev, struct task_struct *next)
@@ -0,0 +1,167 @@
+/*
+ * vib-OS Kernel - Read-Copy-Update
+ *
+ * Grace periods are numbered: rcu_gp_seq counts starts and ends, so it is
+ * odd while one is running. Starting one records every online CPU that is
+ * not idle; each then clears its bit at its next quiescent state - a
+ * voluntary context switch, a tick that finds it preemptible, or entering
+ * idle - and the last one ends the grace period.
+ *
+ * Callbacks queue in order, tagged with the grace period that has to end
+ * before they run. They run on whichever CPU next passes a quiescent state
+ * or ticks after that.
+ */
+
+#include "../include/sync/rcu.h"
+#include "../include/arch/arch.h"
+#include "../include/sync/wait.h"
+
+static DEFINE_SPINLOCK(rcu_lock);
+
+/* Grace periods started plus those ended */
+static volatile uint64_t rcu_gp_seq;
+
+/* Highest grace period number anyone is waiting for */
+static uint64_t rcu_gp_needed;
+
+/* CPUs the running grace period still waits for, one bit each */
+static volatile uint32_t rcu_qs_pending;
+
+/* CPUs between rcu_idle_enter() and rcu_idle_exit() */
+static volatile uint32_t rcu_idle_mask;
+
+/* Pending callbacks, oldest first */
+static struct rcu_head *rcu_cbs;
+static struct rcu_head **rcu_cbs_tail = &rcu_cbs;
+
+static DECLARE_WAIT_QUEUE_HEAD(rcu_gp_wq);
+
+/* The first grace period that starts after now; rcu_lock held */
+static inline uint64_t rcu_gp_snap(void) { return (rcu_gp_seq + 3) & ~1ULL; }
+
+static inline int rcu_gp_done(uint64_t gp) {
+  return __atomic_load_n(&rcu_gp_seq, __ATOMIC_ACQUIRE) >= gp;
+}
+
+/* rcu_lock held */
+static void rcu_start_gp_locked(void) {
+  while (!(rcu_gp_seq & 1) && rcu_gp_seq < rcu_gp_needed) {
+    rcu_gp_seq++;
+
+    /* Readers that start after this point see every update made before
+     * it, so CPUs idle now need not be waited for */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t online = (1U << arch_cpu_count()) - 1;
+    uint32_t pending =
+        online & ~__atomic_load_n(&rcu_idle_mask, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rcu_qs_pending, pending, __ATOMIC_SEQ_CST);
+
+    if (pending) {
+      break;
+    }
+    __atomic_store_n(&rcu_gp_seq, rcu_gp_seq + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* Run the callbacks whose grace period is over */
+static void rcu_do_callbacks(void) {
+  if (!__atomic_load_n(&rcu_cbs, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  struct rcu_head *done = NULL;
+  struct rcu_head **tail = &done;
+
+  uint64_t flags = spin_lock_irqsave(&rcu_lock);
+  while (rcu_cbs && rcu_cbs->gp <= rcu_gp_seq) {
+    *tail = rcu_cbs;
+    tail = &rcu_cbs->next;
+    rcu_cbs = rcu_cbs->next;
+  }
+  *tail = NULL;
+  if (!rcu_cbs) {
+    rcu_cbs_tail = &rcu_cbs;
+  }
+  spin_unlock_irqrestore(&rcu_lock, flags);
+
+  flags = arch_irq_save_local();
+  while (done) {
+    struct rcu_head *next = done->next;
+    done->func(done);
+    done = next;
+  }
+  arch_irq_restore_local(flags);
+}
+
+/* This CPU holds no RCU references right now */
+static void rcu_report_qs(void) {
+  uint32_t bit = 1U << arch_cpu_id();
+  int ended = 0;
+
+  if (__atomic_load_n(&rcu_qs_pending, __ATOMIC_SEQ_CST) & bit) {
+    uint64_t flags = spin_lock_irqsave(&rcu_lock);
+    if (rcu_qs_pending & bit) {
+      rcu_qs_pending &= ~bit;
+      if (!rcu_qs_pending) {
+        __atomic_store_n(&rcu_gp_seq, rcu_gp_seq + 1, __ATOMIC_RELEASE);
+        ended = 1;
+        rcu_start_gp_locked();
+      }
+    }
+    spin_unlock_irqrestore(&rcu_lock, flags);
+  }
+
+  if (ended) {
+    wake_up(&rcu_gp_wq);
+  }
+  rcu_do_callbacks();
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+  head->func = func;
+  head->next = NULL;
+
+  uint64_t flags = spin_lock_irqsave(&rcu_lock);
+  head->gp = rcu_gp_snap();
+  if (head->gp > rcu_gp_needed) {
+    rcu_gp_needed = head->gp;
+  }
+  *rcu_cbs_tail = head;
+  rcu_cbs_tail = &head->next;
+  rcu_start_gp_locked();
+  spin_unlock_irqrestore(&rcu_lock, flags);
+}
+
+void synchronize_rcu(void) {
+  /* The only CPU is outside any read section, so everyone is */
+  if (arch_cpu_count() == 1) {
+    return;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&rcu_lock);
+  uint64_t gp = rcu_gp_snap();
+  if (gp > rcu_gp_needed) {
+    rcu_gp_needed = gp;
+  }
+  rcu_start_gp_locked();
+  spin_unlock_irqrestore(&rcu_lock, flags);
+
+  wait_event(rcu_gp_wq, rcu_gp_done(gp));
+}
+
+void rcu_note_context_switch(void) {
+  if (preemptible()) {
+    rcu_report_qs();
+  }
+}
+
+void rcu_tick(void) { rcu_report_qs(); }
+
+void rcu_idle_enter(void) {
+  __atomic_fetch_or(&rcu_idle_mask, 1U << arch_cpu_id(), __ATOMIC_SEQ_CST);
+  rcu_report_qs();
+}
+
+void rcu_idle_exit(void) {
+  __atomic_fetch_and(&rcu_idle_mask, ~(1U << arch_cpu_id()), __ATOMIC_SEQ_CST);
+}
@@ -1,148 +1,289 @@
 /*
  * vib-OS Kernel - Spinlock Implementation
  *
- * Architecture-specific spinlock implementations using atomic operations.
- * Provides mutual exclusion for multiprocessor and interrupt safety.
+ * Queued spinlocks after Mellor-Crummey and Scott. The lock word holds a
+ * locked byte and, above it, the tail of a queue of waiters encoded as a
+ * (CPU, nesting level) pair:
+ *
+ *   bits  0-7   locked byte, 1 while held
+ *   bits  8-31  tail: 1 + index of the last queued node, 0 if none
+ *
+ * An uncontended lock is a single compare-and-swap. A contended one
+ * appends this CPU's node to the queue and spins on the node until its
+ * predecessor hands over the head; only the head spins on the lock word.
+ * Each CPU has one node per context that can nest a lock acquisition
+ * (process, interrupt), so no allocation is ever needed.
  */
 
 #include "../include/sync/spinlock.h"
+#include "../include/arch/arch.h"
 
-/* Initialize a spinlock */
-void spin_lock_init(spinlock_t *lock) {
-  lock->lock = 0;
-#ifdef DEBUG_SPINLOCK
-  lock->name = NULL;
-  lock->held_by_cpu = -1;
+#define Q_LOCKED_VAL 1U
+#define Q_LOCKED_MASK 0xFFU
+#define Q_TAIL_SHIFT 8
+#define Q_TAIL_MASK (~Q_LOCKED_MASK)
+
+#define MCS_NODES_PER_CPU 4
+
+struct mcs_node {
+  struct mcs_node *volatile next; /* Waiter queued behind us */
+  volatile int locked;            /* Set when we become the head */
+  int count;                      /* Nodes in use, kept in node 0 only */
+} __aligned(64);
+
+static struct mcs_node mcs_nodes[MAX_CPUS][MCS_NODES_PER_CPU];
+
+/* Locks held or awaited per CPU; the timer does not preempt while nonzero */
+static volatile uint32_t preempt_count[MAX_CPUS];
+
+static inline void cpu_relax(void) {
+#ifdef ARCH_ARM64
+  asm volatile("yield" ::: "memory");
+#elif defined(ARCH_X86_64) || defined(ARCH_X86)
+  asm volatile("pause" ::: "memory");
+#else
+  asm volatile("" ::: "memory");
 #endif
 }
 
-#ifdef ARCH_ARM64
-/*
- * ARM64 spinlock using Load-Exclusive/Store-Exclusive
- * LDAXR provides acquire semantics, STXR provides release semantics
- */
-void spin_lock(spinlock_t *lock) {
-  uint32_t tmp;
-  asm volatile("   sevl\n"                   /* Set event locally */
-               "1: wfe\n"                    /* Wait for event (power saving) */
-               "2: ldaxr   %w0, [%1]\n"      /* Load exclusive with acquire */
-               "   cbnz    %w0, 1b\n"        /* If locked, wait for event */
-               "   stxr    %w0, %w2, [%1]\n" /* Try to acquire */
-               "   cbnz    %w0, 2b\n"        /* If failed, retry load */
-               : "=&r"(tmp)
-               : "r"(&lock->lock), "r"(1)
-               : "memory");
+/* ===================================================================== */
+/* Preemption */
+/* ===================================================================== */
+
+void preempt_disable(void) {
+  /* Read the CPU and count on it without moving to another in between */
+  uint64_t flags = arch_irq_save_local();
+  preempt_count[arch_cpu_id()]++;
+  arch_irq_restore_local(flags);
 }
 
-void spin_unlock(spinlock_t *lock) {
-  asm volatile("stlr wzr, [%0]" /* Store release (0) - release lock */
-               :
-               : "r"(&lock->lock)
-               : "memory");
+void preempt_enable(void) {
+  /* Not preemptible until this, so still on the CPU that disabled it */
+  preempt_count[arch_cpu_id()]--;
 }
 
-int spin_trylock(spinlock_t *lock) {
-  uint32_t tmp, result;
-  asm volatile("   ldaxr   %w0, [%2]\n"      /* Load exclusive with acquire */
-               "   cbnz    %w0, 1f\n"        /* If already locked, fail */
-               "   stxr    %w0, %w3, [%2]\n" /* Try to acquire */
-               "   cbz     %w0, 2f\n"        /* If succeeded, return 1 */
-               "1: mov     %w1, #0\n"        /* Failure path */
-               "   b       3f\n"
-               "2: mov     %w1, #1\n" /* Success path */
-               "3:\n"
-               : "=&r"(tmp), "=r"(result)
-               : "r"(&lock->lock), "r"(1)
-               : "memory");
-  return result;
-}
-
-#elif defined(ARCH_X86_64)
-/*
- * x86_64 spinlock using XCHG (implicit lock prefix)
- */
-void spin_lock(spinlock_t *lock) {
-  while (1) {
-    /* Spin on read first to avoid cache line bouncing */
-    while (lock->lock) {
-      asm volatile("pause" ::: "memory");
-    }
+int preemptible(void) { return preempt_count[arch_cpu_id()] == 0; }
 
-    /* Try to acquire */
-    uint32_t expected = 0;
-    uint32_t desired = 1;
-    uint32_t old;
-    asm volatile("lock cmpxchgl %2, %1"
-                 : "=a"(old), "+m"(lock->lock)
-                 : "r"(desired), "0"(expected)
-                 : "memory", "cc");
-    if (old == 0) {
-      return; /* Acquired */
-    }
+/* ===================================================================== */
+/* Lock statistics */
+/* ===================================================================== */
+
+#ifdef CONFIG_LOCKSTAT
+/* Locks set up without an initializer, e.g. in zeroed memory */
+static struct lock_class lockstat_unnamed = {.name = "(unnamed)"};
+
+/* Every class seen so far, newest first; only ever pushed to */
+static struct lock_class *volatile lockstat_classes;
+
+static struct lock_class *lock_class_of(spinlock_t *lock) {
+  struct lock_class *class = lock->class ? lock->class : &lockstat_unnamed;
+
+  if (!class->registered &&
+      !__atomic_exchange_n(&class->registered, 1, __ATOMIC_ACQ_REL)) {
+    struct lock_class *head = lockstat_classes;
+    do {
+      class->next = head;
+    } while (!__atomic_compare_exchange_n(&lockstat_classes, &head, class, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
   }
+  return class;
 }
 
-void spin_unlock(spinlock_t *lock) {
-  asm volatile("movl $0, %0" : "=m"(lock->lock) : : "memory");
+static inline void lockstat_acquired(spinlock_t *lock, int contended) {
+  struct lock_class *class = lock_class_of(lock);
+
+  __atomic_fetch_add(&class->acquisitions, 1, __ATOMIC_RELAXED);
+  if (contended) {
+    __atomic_fetch_add(&class->contentions, 1, __ATOMIC_RELAXED);
+  }
+  lock->acquired_at = arch_timer_get_ticks();
 }
 
-int spin_trylock(spinlock_t *lock) {
-  uint32_t old;
-  asm volatile("lock xchgl %0, %1"
-               : "=r"(old), "+m"(lock->lock)
-               : "0"(1)
-               : "memory");
-  return old == 0;
+static inline void lockstat_release(spinlock_t *lock) {
+  struct lock_class *class = lock_class_of(lock);
+  uint64_t held = arch_timer_get_ticks() - lock->acquired_at;
+  uint64_t max = class->hold_max;
+
+  while (held > max &&
+         !__atomic_compare_exchange_n(&class->hold_max, &max, held, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
 }
 
-#elif defined(ARCH_X86)
-/*
- * x86 32-bit spinlock
- */
-void spin_lock(spinlock_t *lock) {
-  while (1) {
-    while (lock->lock) {
-      asm volatile("pause" ::: "memory");
-    }
+int lockstat_get_class(unsigned int idx, struct lockstat_info *info) {
+  struct lock_class *class = lockstat_classes;
 
-    uint32_t old;
-    asm volatile("lock xchgl %0, %1"
-                 : "=r"(old), "+m"(lock->lock)
-                 : "0"(1)
-                 : "memory");
-    if (old == 0) {
-      return;
-    }
+  while (class && idx--) {
+    class = class->next;
   }
+  if (!class) {
+    return -1;
+  }
+
+  uint64_t freq = arch_timer_get_frequency();
+  uint64_t hold = class->hold_max;
+
+  info->name = class->name;
+  info->acquisitions = class->acquisitions;
+  info->contentions = class->contentions;
+  info->hold_max_ns = freq ? (hold / freq) * 1000000000ULL +
+                                 (hold % freq) * 1000000000ULL / freq
+                           : 0;
+  return 0;
+}
+#else
+static inline void lockstat_acquired(spinlock_t *lock, int contended) {
+  (void)lock;
+  (void)contended;
 }
 
-void spin_unlock(spinlock_t *lock) {
-  asm volatile("movl $0, %0" : "=m"(lock->lock) : : "memory");
+static inline void lockstat_release(spinlock_t *lock) { (void)lock; }
+
+int lockstat_get_class(unsigned int idx, struct lockstat_info *info) {
+  (void)idx;
+  (void)info;
+  return -1;
 }
+#endif
 
-int spin_trylock(spinlock_t *lock) {
-  uint32_t old;
-  asm volatile("lock xchgl %0, %1"
-               : "=r"(old), "+m"(lock->lock)
-               : "0"(1)
-               : "memory");
-  return old == 0;
+/* ===================================================================== */
+/* Queued lock */
+/* ===================================================================== */
+
+static inline uint32_t encode_tail(uint32_t cpu, unsigned int idx) {
+  return (cpu * MCS_NODES_PER_CPU + idx + 1) << Q_TAIL_SHIFT;
+}
+
+static inline struct mcs_node *decode_tail(uint32_t tail) {
+  uint32_t nr = (tail >> Q_TAIL_SHIFT) - 1;
+  return &mcs_nodes[nr / MCS_NODES_PER_CPU][nr % MCS_NODES_PER_CPU];
 }
 
+static inline int queued_spin_trylock(spinlock_t *lock) {
+  uint32_t val = 0;
+
+  /* Only a free lock with nobody queued can be taken outright */
+  return __atomic_compare_exchange_n(&lock->lock, &val, Q_LOCKED_VAL, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void queued_spin_lock_slowpath(spinlock_t *lock) {
+  uint32_t cpu = arch_cpu_id();
+
+  if (cpu >= MAX_CPUS) {
+    while (!queued_spin_trylock(lock)) {
+      cpu_relax();
+    }
+    return;
+  }
+
+  /* Interrupts nest strictly, so node use is a stack per CPU */
+  unsigned int idx = mcs_nodes[cpu][0].count++;
+  if (idx >= MCS_NODES_PER_CPU) {
+    while (!queued_spin_trylock(lock)) {
+      cpu_relax();
+    }
+    mcs_nodes[cpu][0].count--;
+    return;
+  }
+
+  struct mcs_node *node = &mcs_nodes[cpu][idx];
+  node->next = NULL;
+  node->locked = 0;
+
+  /* Become the new tail, keeping the locked byte as it is */
+  uint32_t tail = encode_tail(cpu, idx);
+  uint32_t old = lock->lock;
+  while (!__atomic_compare_exchange_n(&lock->lock, &old,
+                                      (old & Q_LOCKED_MASK) | tail, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+  }
+
+  /* Someone was ahead of us: link in and wait to be made the head */
+  if (old & Q_TAIL_MASK) {
+    struct mcs_node *prev = decode_tail(old);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+      cpu_relax();
+    }
+  }
+
+  /* Head of the queue: wait for the owner to let go */
+  uint32_t val;
+  while ((val = __atomic_load_n(&lock->lock, __ATOMIC_ACQUIRE)) &
+         Q_LOCKED_MASK) {
+    cpu_relax();
+  }
+
+  /* Nobody behind us: take the lock and empty the queue in one go. With a
+   * queue the fast path can't get in, so only the tail can change here. */
+  while ((val & Q_TAIL_MASK) == tail) {
+    if (__atomic_compare_exchange_n(&lock->lock, &val, Q_LOCKED_VAL, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      goto out;
+    }
+  }
+
+  /* Take the lock, then pass the head on once the next waiter has linked */
+  __atomic_fetch_or(&lock->lock, Q_LOCKED_VAL, __ATOMIC_ACQUIRE);
+
+  struct mcs_node *next;
+  while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+    cpu_relax();
+  }
+  __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+
+out:
+  mcs_nodes[cpu][0].count--;
+}
+
+/* ===================================================================== */
+/* Spinlock API */
+/* ===================================================================== */
+
+void __spin_lock_init(spinlock_t *lock, struct lock_class *class) {
+  lock->lock = 0;
+#ifdef CONFIG_LOCKSTAT
+  lock->class = class;
+  lock->acquired_at = 0;
 #else
-/* Fallback for unsupported architectures - not safe for SMP! */
+  (void)class;
+#endif
+#ifdef DEBUG_SPINLOCK
+  lock->name = NULL;
+  lock->held_by_cpu = -1;
+#endif
+}
+
 void spin_lock(spinlock_t *lock) {
-  while (__sync_lock_test_and_set(&lock->lock, 1)) {
-    /* spin */
+  int contended = 0;
+
+  preempt_disable();
+  if (!queued_spin_trylock(lock)) {
+    queued_spin_lock_slowpath(lock);
+    contended = 1;
   }
+  lockstat_acquired(lock, contended);
 }
 
-void spin_unlock(spinlock_t *lock) { __sync_lock_release(&lock->lock); }
+void spin_unlock(spinlock_t *lock) {
+  lockstat_release(lock);
+
+  /* Clear just the locked byte; waiters may be updating the tail. The lock
+   * word is little-endian on every supported architecture. */
+  __atomic_store_n((volatile uint8_t *)&lock->lock, 0, __ATOMIC_RELEASE);
+  preempt_enable();
+}
 
 int spin_trylock(spinlock_t *lock) {
-  return __sync_lock_test_and_set(&lock->lock, 1) == 0;
+  preempt_disable();
+  if (!queued_spin_trylock(lock)) {
+    preempt_enable();
+    return 0;
+  }
+  lockstat_acquired(lock, 0);
+  return 1;
 }
-#endif
 
 /*
  * IRQ-safe spinlock variants
@@ -0,0 +1,186 @@
+/*
+ * vib-OS Kernel - Wait Queues
+ *
+ * Sleepers are identified when they queue: a process running on this CPU,
+ * otherwise a scheduler task, otherwise the kernel context. Processes and
+ * tasks are taken off their run queue until woken. The kernel context has
+ * no run queue of its own; it runs processes or idles in wfi, and wakers
+ * send its CPU a reschedule IPI.
+ */
+
+#include "../include/sync/wait.h"
+#include "../include/arch/arch.h"
+#include "../include/sched/sched.h"
+#include "../core/process.h"
+
+void init_waitqueue_head(wait_queue_head_t *wq) {
+  spin_lock_init(&wq->lock);
+  wq->head = NULL;
+  wq->tail = NULL;
+}
+
+/* wq->lock held */
+static void wq_add_tail(wait_queue_head_t *wq, struct wait_queue_entry *entry) {
+  entry->next = NULL;
+  entry->prev = wq->tail;
+  if (wq->tail) {
+    wq->tail->next = entry;
+  } else {
+    wq->head = entry;
+  }
+  wq->tail = entry;
+  entry->queued = 1;
+}
+
+/* wq->lock held */
+static void wq_del(wait_queue_head_t *wq, struct wait_queue_entry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    wq->head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    wq->tail = entry->prev;
+  }
+  entry->next = entry->prev = NULL;
+  entry->queued = 0;
+}
+
+void init_waitqueue_func_entry(struct wait_queue_entry *entry,
+                               wait_queue_func_t func) {
+  entry->wq = NULL;
+  entry->kind = WAITER_CALLBACK;
+  entry->waiter = NULL;
+  entry->cpu = 0;
+  entry->func = func;
+  entry->queued = 0;
+  entry->next = entry->prev = NULL;
+}
+
+void add_wait_queue(wait_queue_head_t *wq, struct wait_queue_entry *entry) {
+  uint64_t flags = spin_lock_irqsave(&wq->lock);
+  entry->wq = wq;
+  wq_add_tail(wq, entry);
+  spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void remove_wait_queue(wait_queue_head_t *wq, struct wait_queue_entry *entry) {
+  uint64_t flags = spin_lock_irqsave(&wq->lock);
+  if (entry->queued) {
+    wq_del(wq, entry);
+  }
+  spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void prepare_to_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry) {
+  process_t *proc = process_current();
+  struct task_struct *task = get_current();
+
+  if (proc) {
+    entry->kind = WAITER_PROCESS;
+    entry->waiter = proc;
+    process_sleep_prepare(proc);
+  } else if (task && !(task->flags & PF_IDLE)) {
+    entry->kind = WAITER_TASK;
+    entry->waiter = task;
+    task->state = TASK_INTERRUPTIBLE;
+  } else {
+    entry->kind = WAITER_KERNEL;
+    entry->waiter = NULL;
+  }
+  entry->cpu = arch_cpu_id();
+  entry->wq = wq;
+
+  /* Marked as sleeping before queueing: a wakeup either finds the entry
+   * or happened before the caller checks its condition */
+  uint64_t flags = spin_lock_irqsave(&wq->lock);
+  if (!entry->queued) {
+    wq_add_tail(wq, entry);
+  }
+  spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void finish_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry) {
+  if (entry->queued) {
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (entry->queued) {
+      wq_del(wq, entry);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+  }
+
+  if (entry->kind == WAITER_PROCESS) {
+    process_sleep_cancel((process_t *)entry->waiter);
+  } else if (entry->kind == WAITER_TASK) {
+    ((struct task_struct *)entry->waiter)->state = TASK_RUNNING;
+  }
+}
+
+int wait_sleep_killable(struct wait_queue_entry *entry) {
+  switch (entry->kind) {
+  case WAITER_PROCESS: {
+    process_t *proc = (process_t *)entry->waiter;
+    if (entry->queued && !proc->kill_pending) {
+      process_schedule();
+    }
+    return proc->kill_pending ? -4 : 0; /* EINTR */
+  }
+  case WAITER_TASK:
+    if (entry->queued) {
+      schedule();
+    }
+    break;
+  default:
+    /* Runs other processes, or idles until the next interrupt */
+    if (entry->queued) {
+      process_schedule();
+    }
+    break;
+  }
+  return 0;
+}
+
+void wait_sleep(struct wait_queue_entry *entry) {
+  if (wait_sleep_killable(entry)) {
+    /* Killed while asleep: the entry is on our stack, unlink it first */
+    finish_wait(entry->wq, entry);
+    process_exit(-1);
+  }
+}
+
+void wake_up(wait_queue_head_t *wq) {
+  uint32_t self = arch_cpu_id();
+  uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+  struct wait_queue_entry *entry = wq->head;
+  while (entry) {
+    struct wait_queue_entry *next = entry->next;
+
+    /* Function entries stay queued until their owner removes them */
+    if (entry->kind == WAITER_CALLBACK) {
+      entry->func(entry);
+      entry = next;
+      continue;
+    }
+
+    int kind = entry->kind;
+    void *waiter = entry->waiter;
+    uint32_t cpu = entry->cpu;
+
+    /* Once dequeued the entry may vanish with the sleeper's stack */
+    wq_del(wq, entry);
+
+    if (kind == WAITER_PROCESS) {
+      process_wake((process_t *)waiter);
+    } else if (kind == WAITER_TASK) {
+      wake_up_process((struct task_struct *)waiter);
+    } else if (cpu != self) {
+      arch_smp_send_reschedule(cpu);
+    }
+    entry = next;
+  }
+
+  spin_unlock_irqrestore(&wq->lock, flags);
+}
@@ -6,70 +6,54 @@
 #include "apps/kapi.h"
 #include "arch/arch.h"
 #include "drivers/uart.h"
+#include "fs/eventpoll.h"
+#include "fs/fdtable.h"
+#include "fs/io_uring.h"
 #include "fs/vfs.h"
+#include "ipc/futex.h"
+#include "ipc/pipe.h"
 #include "mm/kmalloc.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
 #include "printk.h"
 #include "sched/sched.h"
+#include "string.h"
+#include "time/hrtimer.h"
+#include "time/vdso.h"
 
 /* ===================================================================== */
 /* File Descriptor Table */
 /* ===================================================================== */
 
-#define MAX_FDS 256
-
-/* File descriptor entry */
-struct fd_entry {
-  struct file *file;
-  int flags;
-  int in_use;
-};
-
-/* Global FD table (per-process would be better, but simpler for now) */
-static struct fd_entry fd_table[MAX_FDS];
-static int fd_table_initialized = 0;
-
-static void init_fd_table(void) {
-  if (fd_table_initialized)
-    return;
-
-  for (int i = 0; i < MAX_FDS; i++) {
-    fd_table[i].file = NULL;
-    fd_table[i].flags = 0;
-    fd_table[i].in_use = 0;
-  }
-
-  /* Reserve stdin/stdout/stderr */
-  fd_table[0].in_use = 1; /* stdin */
-  fd_table[1].in_use = 1; /* stdout */
-  fd_table[2].in_use = 1; /* stderr */
-
-  fd_table_initialized = 1;
+/* The calling task's table, created on first use */
+static struct files_struct *current_files(void) {
+  struct task_struct *task = get_current();
+  return task ? task_files(task) : NULL;
 }
 
 static int alloc_fd(void) {
-  init_fd_table();
-  for (int i = 3; i < MAX_FDS; i++) {
-    if (!fd_table[i].in_use) {
-      fd_table[i].in_use = 1;
-      return i;
-    }
-  }
-  return -1;
+  struct files_struct *files = current_files();
+  return files ? fd_alloc(files, FIRST_FILE_FD) : -EMFILE;
 }
 
-static void free_fd(int fd) {
-  if (fd >= 0 && fd < MAX_FDS) {
-    fd_table[fd].file = NULL;
-    fd_table[fd].flags = 0;
-    fd_table[fd].in_use = 0;
-  }
+/* Point a descriptor from alloc_fd() at an open file */
+static void install_fd(int fd, struct file *f, int cloexec) {
+  fd_install(current_files(), fd, f, cloexec);
 }
 
+/* Release a descriptor from alloc_fd() that never got a file */
+static void free_fd(int fd) { fd_free(current_files(), fd); }
+
+/* Detach an open descriptor; returns its file, still referenced */
+static struct file *close_fd(int fd) {
+  struct files_struct *files = current_files();
+  return files ? fd_close(files, fd) : NULL;
+}
+
+/* Look up a descriptor; the caller drops the reference with vfs_close() */
 static struct file *get_file(int fd) {
-  if (fd < 0 || fd >= MAX_FDS || !fd_table[fd].in_use) {
-    return NULL;
-  }
-  return fd_table[fd].file;
+  struct files_struct *files = current_files();
+  return files ? fd_get(files, fd) : NULL;
 }
 
 /* ===================================================================== */
@@ -81,7 +65,7 @@ static struct file *get_file(int fd) {
 #define KERNEL_END 0x50000000UL
 
 /* Check if pointer is in valid user-accessible memory range */
-static int is_valid_user_ptr(uint64_t ptr, size_t len) {
+int is_valid_user_ptr(uint64_t ptr, size_t len) {
   if (ptr == 0)
     return 0;
 
@@ -127,15 +111,15 @@ static long sys_read(uint64_t fd, uint64_t buf, uint64_t count, uint64_t a3,
   (void)a4;
   (void)a5;
 
-  init_fd_table();
-
   /* Validate user buffer */
   if (!is_valid_user_ptr(buf, count)) {
     return -EFAULT;
   }
 
-  /* Handle stdin specially */
-  if (fd == 0) {
+  struct file *f = get_file((int)fd);
+
+  /* Handle stdin specially unless it has been redirected */
+  if (!f && fd == 0) {
     kapi_t *api = kapi_get();
     char *p = (char *)buf;
     size_t n = 0;
@@ -163,20 +147,20 @@ static long sys_read(uint64_t fd, uint64_t buf, uint64_t count, uint64_t a3,
           return n;
         }
 
-        /* Nothing read yet, yield and wait */
-        extern void process_yield(void);
-        process_yield();
+        /* Nothing read yet, sleep until a key arrives */
+        kapi_wait_key();
       }
     }
     return n;
   }
 
-  struct file *f = get_file((int)fd);
   if (!f) {
     return -EBADF;
   }
 
-  return vfs_read(f, (char *)buf, count);
+  ssize_t ret = vfs_read(f, (char *)buf, count);
+  vfs_close(f);
+  return ret;
 }
 
 static long sys_write(uint64_t fd, uint64_t buf, uint64_t count, uint64_t a3,
@@ -185,10 +169,11 @@ static long sys_write(uint64_t fd, uint64_t buf, uint64_t count, uint64_t a3,
   (void)a4;
   (void)a5;
 
-  init_fd_table();
+  struct file *f = get_file((int)fd);
 
-  /* Special case: stdout/stderr (fd 1 and 2) go to console */
-  if (fd == 1 || fd == 2) {
+  /* Special case: stdout/stderr (fd 1 and 2) go to console unless they
+   * have been redirected */
+  if (!f && (fd == 1 || fd == 2)) {
     const char *str = (const char *)buf;
     for (size_t i = 0; i < count; i++) {
       uart_putc(str[i]);
@@ -196,12 +181,13 @@ static long sys_write(uint64_t fd, uint64_t buf, uint64_t count, uint64_t a3,
     return count;
   }
 
-  struct file *f = get_file((int)fd);
   if (!f) {
     return -EBADF;
   }
 
-  return vfs_write(f, (const char *)buf, count);
+  ssize_t ret = vfs_write(f, (const char *)buf, count);
+  vfs_close(f);
+  return ret;
 }
 
 static long sys_openat(uint64_t dirfd, uint64_t pathname, uint64_t flags,
@@ -210,8 +196,6 @@ static long sys_openat(uint64_t dirfd, uint64_t pathname, uint64_t flags,
   (void)a5;
   (void)dirfd; /* dirfd ignored - always use absolute paths */
 
-  init_fd_table();
-
   const char *path = (const char *)pathname;
 
   /* Allocate file descriptor */
@@ -227,8 +211,7 @@ static long sys_openat(uint64_t dirfd, uint64_t pathname, uint64_t flags,
     return -ENOENT;
   }
 
-  fd_table[fd].file = f;
-  fd_table[fd].flags = (int)flags;
+  install_fd(fd, f, (flags & O_CLOEXEC) != 0);
 
   return fd;
 }
@@ -241,38 +224,430 @@ static long sys_close(uint64_t fd, uint64_t a1, uint64_t a2, uint64_t a3,
   (void)a4;
   (void)a5;
 
-  init_fd_table();
+  struct file *f = close_fd((int)fd);
+  if (!f) {
+    /* stdin/stdout/stderr on the console can't be closed */
+    return fd < FIRST_FILE_FD ? 0 : -EBADF;
+  }
+
+  vfs_close(f);
+
+  return 0;
+}
+
+static long sys_lseek(uint64_t fd, uint64_t offset, uint64_t whence,
+                      uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  struct file *f = get_file((int)fd);
+  if (!f) {
+    return -EBADF;
+  }
+
+  loff_t ret = vfs_lseek(f, (loff_t)offset, (int)whence);
+  vfs_close(f);
+  return ret;
+}
+
+static long sys_dup(uint64_t oldfd, uint64_t a1, uint64_t a2, uint64_t a3,
+                    uint64_t a4, uint64_t a5) {
+  (void)a1;
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  struct files_struct *files = current_files();
+  if (!files) {
+    return -EMFILE;
+  }
+  return fd_dup(files, (int)oldfd, -1, 0, 0);
+}
+
+static long sys_dup3(uint64_t oldfd, uint64_t newfd, uint64_t flags,
+                     uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (oldfd == newfd || (flags & ~(uint64_t)O_CLOEXEC)) {
+    return -EINVAL;
+  }
+  if (newfd >= MAX_FDS) {
+    return -EBADF;
+  }
+
+  struct files_struct *files = current_files();
+  if (!files) {
+    return -EMFILE;
+  }
+  return fd_dup(files, (int)oldfd, (int)newfd, 0, (flags & O_CLOEXEC) != 0);
+}
+
+static long sys_pipe2(uint64_t pipefd, uint64_t flags, uint64_t a2,
+                      uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (!is_valid_user_ptr(pipefd, 2 * sizeof(int))) {
+    return -EFAULT;
+  }
+
+  struct file *rf, *wf;
+  int ret = do_pipe(&rf, &wf);
+  if (ret < 0) {
+    return ret;
+  }
+
+  int rfd = alloc_fd();
+  int wfd = alloc_fd();
+  if (rfd < 0 || wfd < 0) {
+    if (rfd >= 0) {
+      free_fd(rfd);
+    }
+    if (wfd >= 0) {
+      free_fd(wfd);
+    }
+    vfs_close(rf);
+    vfs_close(wf);
+    return -EMFILE;
+  }
+
+  if (flags & O_NONBLOCK) {
+    rf->f_flags |= O_NONBLOCK;
+    wf->f_flags |= O_NONBLOCK;
+  }
+
+  install_fd(rfd, rf, (flags & O_CLOEXEC) != 0);
+  install_fd(wfd, wf, (flags & O_CLOEXEC) != 0);
+
+  int *fds = (int *)pipefd;
+  fds[0] = rfd;
+  fds[1] = wfd;
+  return 0;
+}
+
+static long sys_fcntl(uint64_t fd, uint64_t cmd, uint64_t arg, uint64_t a3,
+                      uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
 
-  /* Don't close stdin/stdout/stderr */
-  if (fd < 3) {
+  /* Commands on the descriptor rather than the file */
+  struct files_struct *files = current_files();
+  if (!files) {
+    return -EBADF;
+  }
+  switch (cmd) {
+  case F_DUPFD:
+  case F_DUPFD_CLOEXEC:
+    if (arg >= MAX_FDS) {
+      return -EINVAL;
+    }
+    return fd_dup(files, (int)fd, -1, (int)arg, cmd == F_DUPFD_CLOEXEC);
+  case F_GETFD:
+    /* FD_CLOEXEC is the only descriptor flag, and it is 1 */
+    return fd_get_cloexec(files, (int)fd);
+  case F_SETFD:
+    return fd_set_cloexec(files, (int)fd, (arg & FD_CLOEXEC) != 0);
+  }
+
+  struct file *f = fd_get(files, (int)fd);
+  if (!f) {
+    return -EBADF;
+  }
+
+  long ret;
+  switch (cmd) {
+  case F_GETFL:
+    ret = f->f_flags;
+    break;
+  case F_SETFL:
+    /* Only the status flags can change */
+    f->f_flags = (f->f_flags & ~(O_APPEND | O_NONBLOCK)) |
+                 ((uint32_t)arg & (O_APPEND | O_NONBLOCK));
+    ret = 0;
+    break;
+  case F_GETPIPE_SZ:
+  case F_SETPIPE_SZ:
+    ret = pipe_fcntl(f, (unsigned int)cmd, arg);
+    break;
+  default:
+    ret = -EINVAL;
+    break;
+  }
+
+  vfs_close(f);
+  return ret;
+}
+
+/* Read an optional user offset for splice() */
+static int get_user_off(uint64_t uoff, loff_t *off, loff_t **offp) {
+  *offp = NULL;
+  if (!uoff) {
     return 0;
   }
+  if (!is_valid_user_ptr(uoff, sizeof(loff_t))) {
+    return -EFAULT;
+  }
+  *off = *(loff_t *)uoff;
+  *offp = off;
+  return 0;
+}
+
+static long sys_splice(uint64_t fd_in, uint64_t uoff_in, uint64_t fd_out,
+                       uint64_t uoff_out, uint64_t len, uint64_t flags) {
+  loff_t off_in, off_out, *off_inp, *off_outp;
+  if (get_user_off(uoff_in, &off_in, &off_inp) < 0 ||
+      get_user_off(uoff_out, &off_out, &off_outp) < 0) {
+    return -EFAULT;
+  }
+
+  struct file *in = get_file((int)fd_in);
+  if (!in) {
+    return -EBADF;
+  }
+  struct file *out = get_file((int)fd_out);
+  if (!out) {
+    vfs_close(in);
+    return -EBADF;
+  }
+
+  ssize_t ret =
+      do_splice(in, off_inp, out, off_outp, (size_t)len, (unsigned int)flags);
+
+  if (off_inp) {
+    *(loff_t *)uoff_in = off_in;
+  }
+  if (off_outp) {
+    *(loff_t *)uoff_out = off_out;
+  }
+
+  vfs_close(out);
+  vfs_close(in);
+  return ret;
+}
+
+static long sys_tee(uint64_t fd_in, uint64_t fd_out, uint64_t len,
+                    uint64_t flags, uint64_t a4, uint64_t a5) {
+  (void)a4;
+  (void)a5;
+
+  struct file *in = get_file((int)fd_in);
+  if (!in) {
+    return -EBADF;
+  }
+  struct file *out = get_file((int)fd_out);
+  if (!out) {
+    vfs_close(in);
+    return -EBADF;
+  }
+
+  ssize_t ret = do_tee(in, out, (size_t)len, (unsigned int)flags);
+
+  vfs_close(out);
+  vfs_close(in);
+  return ret;
+}
+
+static long sys_vmsplice(uint64_t fd, uint64_t uiov, uint64_t nr_segs,
+                         uint64_t flags, uint64_t a4, uint64_t a5) {
+  (void)a4;
+  (void)a5;
+
+  if (nr_segs > UIO_MAXIOV) {
+    return -EINVAL;
+  }
+  if (!is_valid_user_ptr(uiov, nr_segs * sizeof(struct iovec))) {
+    return -EFAULT;
+  }
+
+  /* Take a stable copy before checking the segments */
+  struct iovec *iov = kmalloc(nr_segs * sizeof(struct iovec));
+  if (!iov) {
+    return -ENOMEM;
+  }
+  memcpy(iov, (const void *)uiov, nr_segs * sizeof(struct iovec));
+
+  for (uint64_t i = 0; i < nr_segs; i++) {
+    if (iov[i].iov_len &&
+        !is_valid_user_ptr((uint64_t)iov[i].iov_base, iov[i].iov_len)) {
+      kfree(iov);
+      return -EFAULT;
+    }
+  }
 
   struct file *f = get_file((int)fd);
   if (!f) {
+    kfree(iov);
     return -EBADF;
   }
 
+  ssize_t ret = do_vmsplice(f, iov, (unsigned long)nr_segs, (unsigned int)flags);
+
   vfs_close(f);
-  free_fd((int)fd);
+  kfree(iov);
+  return ret;
+}
 
-  return 0;
+static long sys_epoll_create1(uint64_t flags, uint64_t a1, uint64_t a2,
+                              uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a1;
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (flags & ~(uint64_t)O_CLOEXEC) {
+    return -EINVAL;
+  }
+
+  int fd = alloc_fd();
+  if (fd < 0) {
+    return -EMFILE;
+  }
+
+  struct file *f;
+  int ret = eventpoll_create(&f);
+  if (ret < 0) {
+    free_fd(fd);
+    return ret;
+  }
+
+  install_fd(fd, f, (flags & O_CLOEXEC) != 0);
+  return fd;
 }
 
-static long sys_lseek(uint64_t fd, uint64_t offset, uint64_t whence,
-                      uint64_t a3, uint64_t a4, uint64_t a5) {
+static long sys_epoll_ctl(uint64_t epfd, uint64_t op, uint64_t fd,
+                          uint64_t uevent, uint64_t a4, uint64_t a5) {
+  (void)a4;
+  (void)a5;
+
+  struct epoll_event ev = {0};
+  if (op != EPOLL_CTL_DEL) {
+    if (!is_valid_user_ptr(uevent, sizeof(ev))) {
+      return -EFAULT;
+    }
+    memcpy(&ev, (const void *)uevent, sizeof(ev));
+  }
+
+  struct file *ep = get_file((int)epfd);
+  if (!ep) {
+    return -EBADF;
+  }
+
+  /* A console stdin is watched through the keyboard queue */
+  struct file *f = get_file((int)fd);
+  if (!f && fd == 0) {
+    f = kapi_input_file();
+  }
+  if (!f) {
+    vfs_close(ep);
+    return -EBADF;
+  }
+
+  int ret = eventpoll_ctl(ep, (int)op, (int)fd, f, &ev);
+
+  vfs_close(f);
+  vfs_close(ep);
+  return ret;
+}
+
+static long sys_epoll_pwait(uint64_t epfd, uint64_t uevents,
+                            uint64_t maxevents, uint64_t timeout_ms,
+                            uint64_t sigmask, uint64_t sigsetsize) {
+  /* Signals are not delivered to sleepers, so there is nothing to mask */
+  (void)sigmask;
+  (void)sigsetsize;
+
+  int max = (int)maxevents;
+  if (max <= 0) {
+    return -EINVAL;
+  }
+  if (max > EP_MAX_EVENTS) {
+    max = EP_MAX_EVENTS;
+  }
+  if (!is_valid_user_ptr(uevents, max * sizeof(struct epoll_event))) {
+    return -EFAULT;
+  }
+
+  struct epoll_event *events = kmalloc(max * sizeof(struct epoll_event));
+  if (!events) {
+    return -ENOMEM;
+  }
+
+  struct file *ep = get_file((int)epfd);
+  if (!ep) {
+    kfree(events);
+    return -EBADF;
+  }
+
+  int ms = (int)timeout_ms;
+  int64_t timeout = ms < 0 ? -1 : (int64_t)ms * (int64_t)NSEC_PER_MSEC;
+  int n = eventpoll_wait(ep, events, max, timeout);
+  vfs_close(ep);
+
+  if (n > 0) {
+    memcpy((void *)uevents, events, n * sizeof(struct epoll_event));
+  }
+  kfree(events);
+  return n;
+}
+
+static long sys_io_uring_setup(uint64_t entries, uint64_t uparams, uint64_t a2,
+                               uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
   (void)a3;
   (void)a4;
   (void)a5;
 
-  init_fd_table();
+  struct io_uring_params p;
+  if (!is_valid_user_ptr(uparams, sizeof(p))) {
+    return -EFAULT;
+  }
+  memcpy(&p, (const void *)uparams, sizeof(p));
+
+  int fd = alloc_fd();
+  if (fd < 0) {
+    return -EMFILE;
+  }
+
+  struct file *f;
+  int ret = io_uring_create((uint32_t)entries, &p, &f);
+  if (ret < 0) {
+    free_fd(fd);
+    return ret;
+  }
+
+  memcpy((void *)uparams, &p, sizeof(p));
+  install_fd(fd, f, 1);
+  return fd;
+}
+
+static long sys_io_uring_enter(uint64_t fd, uint64_t to_submit,
+                               uint64_t min_complete, uint64_t flags,
+                               uint64_t sig, uint64_t sigsz) {
+  /* Signals are not delivered to sleepers, so there is nothing to mask */
+  (void)sig;
+  (void)sigsz;
+
+  if (flags & ~(uint64_t)IORING_ENTER_GETEVENTS) {
+    return -EINVAL;
+  }
 
   struct file *f = get_file((int)fd);
   if (!f) {
     return -EBADF;
   }
 
-  return vfs_lseek(f, (loff_t)offset, (int)whence);
+  int ret = io_uring_submit_and_wait(f, (uint32_t)to_submit,
+                                     (uint32_t)min_complete, (uint32_t)flags);
+  vfs_close(f);
+  return ret;
 }
 
 static long sys_exit(uint64_t error_code, uint64_t a1, uint64_t a2, uint64_t a3,
@@ -363,13 +738,42 @@ static long sys_gettid(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3,
   return current ? current->pid : -1;
 }
 
-/* Userspace heap management - dedicated region for userspace processes */
+/*
+ * Userspace heap management.
+ *
+ * Tasks with their own address space get lazily populated anonymous VMAs
+ * (see vmm_brk/vmm_mmap_anon). Tasks running in the shared kernel address
+ * space fall back to a dedicated identity-mapped region.
+ */
 #define USER_HEAP_START 0x10000000UL /* 256MB mark */
 #define USER_HEAP_SIZE 0x04000000UL  /* 64MB heap */
 static uint64_t user_brk_current = USER_HEAP_START;
 static uint64_t user_mmap_current =
     USER_HEAP_START + USER_HEAP_SIZE / 2; /* mmap from middle */
 
+/* mmap protection and flag bits (Linux ABI) */
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+static struct mm_struct *current_mm(void) {
+  struct task_struct *current = get_current();
+  return current ? current->mm : NULL;
+}
+
+static uint32_t prot_to_vm_flags(uint64_t prot) {
+  uint32_t vm_flags = 0;
+  if (prot & PROT_READ)
+    vm_flags |= VM_READ;
+  if (prot & PROT_WRITE)
+    vm_flags |= VM_WRITE | VM_READ;
+  if (prot & PROT_EXEC)
+    vm_flags |= VM_EXEC | VM_READ;
+  return vm_flags;
+}
+
 static long sys_brk(uint64_t brk, uint64_t a1, uint64_t a2, uint64_t a3,
                     uint64_t a4, uint64_t a5) {
   (void)a1;
@@ -378,6 +782,11 @@ static long sys_brk(uint64_t brk, uint64_t a1, uint64_t a2, uint64_t a3,
   (void)a4;
   (void)a5;
 
+  struct mm_struct *mm = current_mm();
+  if (mm) {
+    return (long)vmm_brk(mm, brk);
+  }
+
   /* If brk is 0 or less than start, return current brk */
   if (brk == 0 || brk < USER_HEAP_START) {
     return user_brk_current;
@@ -396,20 +805,38 @@ static long sys_brk(uint64_t brk, uint64_t a1, uint64_t a2, uint64_t a3,
 
 static long sys_mmap(uint64_t addr, uint64_t len, uint64_t prot, uint64_t flags,
                      uint64_t fd, uint64_t offset) {
-  (void)addr;
-  (void)prot;
   (void)offset;
 
-/* Only support anonymous mappings for now */
-#define MAP_ANONYMOUS 0x20
+  /* Only support anonymous mappings for now */
   if (!(flags & MAP_ANONYMOUS) || (int64_t)fd != -1) {
     printk(KERN_DEBUG "sys_mmap: only anonymous mappings supported\n");
     return -ENOSYS;
   }
 
-/* Align len to page size */
-#define PAGE_SIZE 4096UL
-  len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  if (len == 0) {
+    return -EINVAL;
+  }
+
+  /* Align len to page size */
+  len = PAGE_ALIGN(len);
+
+  struct mm_struct *mm = current_mm();
+  if (mm) {
+    if (flags & MAP_FIXED) {
+      if (addr & (PAGE_SIZE - 1)) {
+        return -EINVAL;
+      }
+      /* MAP_FIXED replaces whatever was mapped there before */
+      if (vmm_munmap(mm, addr, len) < 0) {
+        return -EINVAL;
+      }
+    }
+    virt_addr_t result = vmm_mmap_anon(mm, addr, len, prot_to_vm_flags(prot));
+    if (!result || ((flags & MAP_FIXED) && result != addr)) {
+      return -ENOMEM;
+    }
+    return (long)result;
+  }
 
   /* Check bounds */
   if (user_mmap_current + len > USER_HEAP_START + USER_HEAP_SIZE) {
@@ -421,25 +848,51 @@ static long sys_mmap(uint64_t addr, uint64_t len, uint64_t prot, uint64_t flags,
   uint64_t result = user_mmap_current;
   user_mmap_current += len;
 
-  /* Zero the memory */
-  uint8_t *p = (uint8_t *)result;
-  for (size_t i = 0; i < len; i++)
-    p[i] = 0;
+  /* Zero the memory - no demand paging without a private address space */
+  memset((void *)result, 0, len);
 
   return result;
 }
 
 static long sys_munmap(uint64_t addr, uint64_t len, uint64_t a2, uint64_t a3,
                        uint64_t a4, uint64_t a5) {
-  (void)addr;
-  (void)len;
   (void)a2;
   (void)a3;
   (void)a4;
   (void)a5;
 
-  /* For now, just no-op munmap - memory is not reclaimed */
-  return 0;
+  struct mm_struct *mm = current_mm();
+  if (!mm) {
+    /* Legacy shared region has no VMAs - memory is not reclaimed */
+    return 0;
+  }
+
+  if ((addr & (PAGE_SIZE - 1)) || len == 0) {
+    return -EINVAL;
+  }
+  return vmm_munmap(mm, addr, len) < 0 ? -EINVAL : 0;
+}
+
+static long sys_mprotect(uint64_t addr, uint64_t len, uint64_t prot,
+                         uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  struct mm_struct *mm = current_mm();
+  if (!mm) {
+    /* Legacy shared region is always read/write */
+    return 0;
+  }
+
+  if (addr & (PAGE_SIZE - 1)) {
+    return -EINVAL;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  return vmm_mprotect(mm, addr, len, prot_to_vm_flags(prot)) < 0 ? -ENOMEM
+                                                                  : 0;
 }
 
 static long sys_clone(uint64_t flags, uint64_t stack, uint64_t ptid,
@@ -544,6 +997,11 @@ static long sys_execve(uint64_t filename, uint64_t argv, uint64_t envp,
     current->flags |= PF_USER;
     current->flags &= ~PF_KTHREAD;
 
+    /* The old image is gone: drop the descriptors it marked close-on-exec */
+    if (current->files) {
+      files_close_on_exec(current->files);
+    }
+
     /* Update task name */
     int i = 0;
     while (path[i] && i < TASK_COMM_LEN - 1) {
@@ -620,20 +1078,165 @@ static long sys_sched_yield(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3,
   return 0;
 }
 
+/* PRIO_PROCESS only; who == 0 means the caller */
+#define PRIO_PROCESS 0
+
+static long sys_setpriority(uint64_t which, uint64_t who, uint64_t niceval,
+                            uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (which != PRIO_PROCESS)
+    return -EINVAL;
+
+  return sched_set_nice((pid_t)who, (int)niceval) < 0 ? -ESRCH : 0;
+}
+
+static long sys_getpriority(uint64_t which, uint64_t who, uint64_t a2,
+                            uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (which != PRIO_PROCESS)
+    return -EINVAL;
+
+  int nice;
+  if (sched_get_nice((pid_t)who, &nice) < 0)
+    return -ESRCH;
+
+  /* Like Linux, return 20 - nice so the result is never negative */
+  return 20 - nice;
+}
+
+struct kernel_timespec {
+  int64_t tv_sec;
+  int64_t tv_nsec;
+};
+
 static long sys_nanosleep(uint64_t req, uint64_t rem, uint64_t a2, uint64_t a3,
                           uint64_t a4, uint64_t a5) {
-  (void)rem;
   (void)a2;
   (void)a3;
   (void)a4;
   (void)a5;
 
-  /* Stub - sleep not implemented */
-  (void)req;
+  if (!is_valid_user_ptr(req, sizeof(struct kernel_timespec))) {
+    return -EFAULT;
+  }
+
+  struct kernel_timespec ts = *(struct kernel_timespec *)req;
+  if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= (int64_t)NSEC_PER_SEC) {
+    return -EINVAL;
+  }
+
+  int ret = hrtimer_sleep((ktime_t)ts.tv_sec * NSEC_PER_SEC + (ktime_t)ts.tv_nsec);
+
+  /* Only a dying process is interrupted, so there is never time left */
+  if (rem && is_valid_user_ptr(rem, sizeof(struct kernel_timespec))) {
+    struct kernel_timespec *left = (struct kernel_timespec *)rem;
+    left->tv_sec = 0;
+    left->tv_nsec = 0;
+  }
+
+  return ret < 0 ? -EINTR : 0;
+}
+
+/* Userspace normally reads the clocks from the vDSO page instead */
+static long sys_clock_gettime(uint64_t clock, uint64_t tp, uint64_t a2,
+                              uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  int64_t ns;
+  if (vdso_clock_gettime((int)clock, &ns) < 0) {
+    return -EINVAL;
+  }
+  if (!is_valid_user_ptr(tp, sizeof(struct kernel_timespec))) {
+    return -EFAULT;
+  }
+
+  struct kernel_timespec *ts = (struct kernel_timespec *)tp;
+  ts->tv_sec = ns / (int64_t)NSEC_PER_SEC;
+  ts->tv_nsec = ns % (int64_t)NSEC_PER_SEC;
+  return 0;
+}
+
+/* Only CLOCK_REALTIME can be set; there is no RTC, so it starts at 0 */
+static long sys_clock_settime(uint64_t clock, uint64_t tp, uint64_t a2,
+                              uint64_t a3, uint64_t a4, uint64_t a5) {
+  (void)a2;
+  (void)a3;
+  (void)a4;
+  (void)a5;
+
+  if (clock != CLOCK_REALTIME) {
+    return -EINVAL;
+  }
+  if (!is_valid_user_ptr(tp, sizeof(struct kernel_timespec))) {
+    return -EFAULT;
+  }
+
+  struct kernel_timespec ts = *(struct kernel_timespec *)tp;
+  if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= (int64_t)NSEC_PER_SEC) {
+    return -EINVAL;
+  }
 
+  vdso_set_realtime(ts.tv_sec * (int64_t)NSEC_PER_SEC + ts.tv_nsec);
   return 0;
 }
 
+/*
+ * futex(uaddr, op, val, timeout or val2, uaddr2, val3). For the requeue
+ * operations the fourth argument is the number of waiters to move.
+ */
+static long sys_futex(uint64_t uaddr, uint64_t op, uint64_t val, uint64_t utime,
+                      uint64_t uaddr2, uint64_t val3) {
+  if (!is_valid_user_ptr(uaddr, sizeof(uint32_t))) {
+    return -EFAULT;
+  }
+
+  int cmd = (int)op & FUTEX_CMD_MASK;
+  int flags = (int)op & FUTEX_PRIVATE_FLAG;
+  switch (cmd) {
+  case FUTEX_WAIT: {
+    ktime_t timeout = 0;
+    if (utime) {
+      if (!is_valid_user_ptr(utime, sizeof(struct kernel_timespec))) {
+        return -EFAULT;
+      }
+      struct kernel_timespec ts = *(struct kernel_timespec *)utime;
+      if (ts.tv_sec < 0 || ts.tv_nsec < 0 ||
+          ts.tv_nsec >= (int64_t)NSEC_PER_SEC) {
+        return -EINVAL;
+      }
+      timeout = (ktime_t)ts.tv_sec * NSEC_PER_SEC + (ktime_t)ts.tv_nsec;
+      if (timeout == 0) {
+        timeout = 1; /* 0 means no timeout to futex_wait() */
+      }
+    }
+    return futex_wait(uaddr, flags, (uint32_t)val, timeout);
+  }
+  case FUTEX_WAKE:
+    return futex_wake(uaddr, flags, (int)val);
+  case FUTEX_REQUEUE:
+  case FUTEX_CMP_REQUEUE: {
+    if (!is_valid_user_ptr(uaddr2, sizeof(uint32_t))) {
+      return -EFAULT;
+    }
+    uint32_t cmpval = (uint32_t)val3;
+    return futex_requeue(uaddr, uaddr2, flags, (int)val, (int)utime,
+                         cmd == FUTEX_CMP_REQUEUE ? &cmpval : NULL);
+  }
+  default:
+    return -ENOSYS;
+  }
+}
+
 static long sys_not_implemented(uint64_t a0, uint64_t a1, uint64_t a2,
                                 uint64_t a3, uint64_t a4, uint64_t a5) {
   (void)a0;
@@ -688,6 +1291,18 @@ void syscall_init(void) {
   syscall_table[SYS_openat] = sys_openat;
   syscall_table[SYS_close] = sys_close;
   syscall_table[SYS_lseek] = sys_lseek;
+  syscall_table[SYS_dup] = sys_dup;
+  syscall_table[SYS_dup3] = sys_dup3;
+  syscall_table[SYS_pipe2] = sys_pipe2;
+  syscall_table[SYS_fcntl] = sys_fcntl;
+  syscall_table[SYS_splice] = sys_splice;
+  syscall_table[SYS_tee] = sys_tee;
+  syscall_table[SYS_vmsplice] = sys_vmsplice;
+  syscall_table[SYS_epoll_create1] = sys_epoll_create1;
+  syscall_table[SYS_epoll_ctl] = sys_epoll_ctl;
+  syscall_table[SYS_epoll_pwait] = sys_epoll_pwait;
+  syscall_table[SYS_io_uring_setup] = sys_io_uring_setup;
+  syscall_table[SYS_io_uring_enter] = sys_io_uring_enter;
   syscall_table[SYS_exit] = sys_exit;
   syscall_table[SYS_exit_group] = sys_exit_group;
   syscall_table[SYS_getpid] = sys_getpid;
@@ -700,15 +1315,86 @@ void syscall_init(void) {
   syscall_table[SYS_brk] = sys_brk;
   syscall_table[SYS_mmap] = sys_mmap;
   syscall_table[SYS_munmap] = sys_munmap;
+  syscall_table[SYS_mprotect] = sys_mprotect;
   syscall_table[SYS_clone] = sys_clone;
   syscall_table[SYS_execve] = sys_execve;
   syscall_table[SYS_uname] = sys_uname;
   syscall_table[SYS_sched_yield] = sys_sched_yield;
   syscall_table[SYS_nanosleep] = sys_nanosleep;
+  syscall_table[SYS_clock_gettime] = sys_clock_gettime;
+  syscall_table[SYS_clock_settime] = sys_clock_settime;
+  syscall_table[SYS_futex] = sys_futex;
+  syscall_table[SYS_setpriority] = sys_setpriority;
+  syscall_table[SYS_getpriority] = sys_getpriority;
 
   printk(KERN_INFO "SYSCALL: System call table initialized\n");
 }
 
+/* ===================================================================== */
+/* Syscall statistics */
+/* ===================================================================== */
+
+#ifdef CONFIG_SYSCALL_STATS
+struct syscall_stat {
+  volatile uint64_t calls;
+  volatile uint64_t total_ns;
+  volatile uint64_t max_ns;
+  volatile uint64_t hist[SYSCALL_HIST_BUCKETS];
+};
+
+static struct syscall_stat syscall_stats[NR_syscalls];
+
+static inline uint64_t syscall_stat_start(void) { return vdso_clock_ns(); }
+
+static inline void syscall_stat_end(uint64_t nr, uint64_t start) {
+  struct syscall_stat *st = &syscall_stats[nr];
+  uint64_t ns = vdso_clock_ns() - start;
+  uint64_t max = st->max_ns;
+
+  /* Bucket i holds calls below SYSCALL_HIST_BASE_NS << i, the last the rest */
+  unsigned int b = 0;
+  while (b < SYSCALL_HIST_BUCKETS - 1 && ns >= (SYSCALL_HIST_BASE_NS << b)) {
+    b++;
+  }
+
+  __atomic_fetch_add(&st->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&st->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&st->hist[b], 1, __ATOMIC_RELAXED);
+  while (ns > max &&
+         !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+int syscall_get_stats(unsigned int nr, struct syscall_stat_info *info) {
+  if (nr >= NR_syscalls) {
+    return -1;
+  }
+
+  struct syscall_stat *st = &syscall_stats[nr];
+  info->calls = st->calls;
+  info->total_ns = st->total_ns;
+  info->max_ns = st->max_ns;
+  for (int i = 0; i < SYSCALL_HIST_BUCKETS; i++) {
+    info->hist[i] = st->hist[i];
+  }
+  return 0;
+}
+#else
+static inline uint64_t syscall_stat_start(void) { return 0; }
+
+static inline void syscall_stat_end(uint64_t nr, uint64_t start) {
+  (void)nr;
+  (void)start;
+}
+
+int syscall_get_stats(unsigned int nr, struct syscall_stat_info *info) {
+  (void)nr;
+  (void)info;
+  return -1;
+}
+#endif
+
 /* ===================================================================== */
 /* Syscall dispatcher */
 /* ===================================================================== */
@@ -729,15 +1415,64 @@ long handle_syscall(struct pt_regs *regs) {
   }
 
   syscall_fn_t fn = syscall_table[nr];
+  uint64_t start = syscall_stat_start();
+
+  long ret = fn(regs->regs[0], regs->regs[1], regs->regs[2], regs->regs[3],
+                regs->regs[4], regs->regs[5]);
 
-  return fn(regs->regs[0], regs->regs[1], regs->regs[2], regs->regs[3],
-            regs->regs[4], regs->regs[5]);
+  syscall_stat_end(nr, start);
+
+  /* Preemption point on the way back to user space */
+  if (need_resched())
+    schedule();
+
+  return ret;
 }
 
 /* ===================================================================== */
 /* Exception handler */
 /* ===================================================================== */
 
+#ifdef ARCH_ARM64
+/* ESR ISS bits for instruction/data aborts */
+#define ESR_ISS_WNR (1UL << 6) /* Write not Read */
+#define ESR_ISS_FSC 0x3F       /* Fault status code */
+#define FSC_TRANSLATION 0x04   /* Translation fault, levels 0-3 */
+#define FSC_ACCESS 0x08        /* Access flag fault, levels 0-3 */
+#define FSC_PERMISSION 0x0C    /* Permission fault, levels 0-3 */
+
+/*
+ * Try to resolve an abort against the current task's address space
+ * (demand paging). Returns 0 if the faulting access can be retried.
+ */
+static int handle_page_fault(uint64_t esr, uint32_t ec) {
+  struct mm_struct *mm = current_mm();
+  uint32_t fsc = esr & ESR_ISS_FSC & ~0x3;
+  uint32_t fault = 0;
+  uint64_t far;
+
+  if (!mm) {
+    return -1;
+  }
+  if (fsc != FSC_TRANSLATION && fsc != FSC_ACCESS && fsc != FSC_PERMISSION) {
+    return -1;
+  }
+
+  asm volatile("mrs %0, far_el1" : "=r"(far));
+
+  if (ec == 0x20 || ec == 0x21) {
+    fault |= FAULT_EXEC;
+  } else if (esr & ESR_ISS_WNR) {
+    fault |= FAULT_WRITE;
+  }
+  if (ec == 0x20 || ec == 0x24) {
+    fault |= FAULT_USER;
+  }
+
+  return vmm_handle_page_fault(mm, far, fault);
+}
+#endif
+
 void handle_sync_exception(struct pt_regs *regs) {
   /* Read exception syndrome register - architecture specific */
   uint32_t ec, iss;
@@ -761,6 +1496,11 @@ void handle_sync_exception(struct pt_regs *regs) {
 
   case 0x20: /* Instruction abort from lower EL */
   case 0x21: /* Instruction abort from same EL */
+#ifdef ARCH_ARM64
+    if (handle_page_fault(esr, ec) == 0) {
+      return;
+    }
+#endif
     printk(KERN_EMERG "Instruction abort at PC=0x%llx\n",
            (unsigned long long)arch_context_get_pc(regs));
     panic("Instruction abort");
@@ -770,6 +1510,9 @@ void handle_sync_exception(struct pt_regs *regs) {
   case 0x25: /* Data abort from same EL */
   {
 #ifdef ARCH_ARM64
+    if (handle_page_fault(esr, ec) == 0) {
+      return;
+    }
     uint64_t far;
     asm volatile("mrs %0, far_el1" : "=r"(far));
     printk(KERN_EMERG "Data abort at PC=0x%llx, FAR=0x%llx\n",
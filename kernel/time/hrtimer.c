@@ -0,0 +1,248 @@
+/*
+ * vib-OS Kernel - High-Resolution Timers
+ *
+ * Per-CPU red-black trees of pending timers keyed by expiry, with the
+ * earliest one cached. The hardware timer is programmed one-shot for the
+ * earliest expiry; its interrupt runs everything that is due and
+ * programs the next one.
+ */
+
+#include "time/hrtimer.h"
+#include "arch/arch.h"
+#include "core/process.h"
+#include "sync/spinlock.h"
+
+struct hrtimer_cpu_base {
+  spinlock_t lock;
+  struct rb_root active;   /* Queued timers, ordered by expiry */
+  struct rb_node *first;   /* Earliest expiry, cached */
+  struct hrtimer *running; /* Timer whose callback is executing */
+};
+
+static struct hrtimer_cpu_base hrtimer_bases[MAX_CPUS];
+
+/* Set once the architecture turns out to have no one-shot timer */
+static int hrtimer_no_events;
+
+/* ===================================================================== */
+/* Time conversion */
+/* ===================================================================== */
+
+ktime_t ktime_get(void) {
+  uint64_t cycles = arch_timer_get_ticks();
+  uint64_t freq = arch_timer_get_frequency();
+
+  /* Split so the multiplication can't overflow */
+  return (cycles / freq) * NSEC_PER_SEC + (cycles % freq) * NSEC_PER_SEC / freq;
+}
+
+/* Counter value at or just after @ns, so a timer never fires early */
+static uint64_t ktime_to_cycles(ktime_t ns) {
+  uint64_t freq = arch_timer_get_frequency();
+
+  return (ns / NSEC_PER_SEC) * freq +
+         ((ns % NSEC_PER_SEC) * freq + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
+
+/* ===================================================================== */
+/* Queue helpers */
+/* ===================================================================== */
+
+static inline struct hrtimer_cpu_base *this_base(void) {
+  return &hrtimer_bases[arch_cpu_id()];
+}
+
+/* base->lock held; returns 1 if the timer became the earliest */
+static int enqueue_hrtimer(struct hrtimer_cpu_base *base, struct hrtimer *timer) {
+  struct rb_node **link = &base->active.node;
+  struct rb_node *parent = NULL;
+  int leftmost = 1;
+
+  while (*link) {
+    parent = *link;
+    if (timer->expires < rb_entry(parent, struct hrtimer, node)->expires) {
+      link = &parent->left;
+    } else {
+      link = &parent->right;
+      leftmost = 0;
+    }
+  }
+
+  rb_link_node(&timer->node, parent, link);
+  rb_insert_color(&timer->node, &base->active);
+  if (leftmost) {
+    base->first = &timer->node;
+  }
+  timer->state |= HRTIMER_STATE_ENQUEUED;
+  return leftmost;
+}
+
+/* base->lock held */
+static void dequeue_hrtimer(struct hrtimer_cpu_base *base, struct hrtimer *timer) {
+  if (base->first == &timer->node) {
+    base->first = rb_next(&timer->node);
+  }
+  rb_erase(&timer->node, &base->active);
+  timer->state &= ~HRTIMER_STATE_ENQUEUED;
+}
+
+/* Program this CPU's timer for the earliest expiry; base->lock held */
+static void hrtimer_reprogram(struct hrtimer_cpu_base *base) {
+  uint64_t deadline = ~0ULL; /* Nothing queued: never */
+
+  if (base->first) {
+    deadline = ktime_to_cycles(rb_entry(base->first, struct hrtimer, node)->expires);
+  }
+  if (arch_timer_set_event(deadline) < 0) {
+    hrtimer_no_events = 1;
+  }
+}
+
+/* Take a timer off whatever queue it is on; interrupts disabled */
+static int remove_hrtimer(struct hrtimer *timer) {
+  struct hrtimer_cpu_base *base = &hrtimer_bases[timer->cpu];
+  int queued = 0;
+
+  spin_lock(&base->lock);
+  if (timer->state & HRTIMER_STATE_ENQUEUED) {
+    dequeue_hrtimer(base, timer);
+    queued = 1;
+  }
+  spin_unlock(&base->lock);
+  return queued;
+}
+
+/* ===================================================================== */
+/* Public API */
+/* ===================================================================== */
+
+void hrtimer_init(struct hrtimer *timer,
+                  enum hrtimer_restart (*function)(struct hrtimer *)) {
+  timer->function = function;
+  timer->expires = 0;
+  timer->cpu = arch_cpu_id();
+  timer->state = HRTIMER_STATE_INACTIVE;
+  timer->node.parent = timer->node.left = timer->node.right = NULL;
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t time, enum hrtimer_mode mode) {
+  if (mode == HRTIMER_MODE_REL) {
+    time += ktime_get();
+  }
+
+  /* Stay on this CPU from here: it is the one whose timer we program */
+  uint64_t flags = arch_irq_save();
+  remove_hrtimer(timer);
+
+  struct hrtimer_cpu_base *base = this_base();
+  spin_lock(&base->lock);
+  timer->expires = time;
+  timer->cpu = arch_cpu_id();
+  if (enqueue_hrtimer(base, timer)) {
+    hrtimer_reprogram(base);
+  }
+  spin_unlock(&base->lock);
+  arch_irq_restore(flags);
+}
+
+int hrtimer_cancel(struct hrtimer *timer) {
+  for (;;) {
+    uint64_t flags = arch_irq_save();
+    struct hrtimer_cpu_base *base = &hrtimer_bases[timer->cpu];
+    int queued = remove_hrtimer(timer);
+    int running = (base->running == timer);
+    arch_irq_restore(flags);
+
+    /* A queue left with a stale earliest expiry just takes a spurious
+     * interrupt, so there is no need to reprogram here */
+    if (queued || !running) {
+      return queued;
+    }
+
+    /* Callback in progress on another CPU: wait until it is done */
+    arch_barrier();
+  }
+}
+
+uint64_t hrtimer_forward_now(struct hrtimer *timer, ktime_t interval) {
+  ktime_t now = ktime_get();
+
+  if (timer->expires > now) {
+    return 0;
+  }
+
+  uint64_t overruns = (now - timer->expires) / interval + 1;
+  timer->expires += overruns * interval;
+  return overruns;
+}
+
+void hrtimer_interrupt(void) {
+  struct hrtimer_cpu_base *base = this_base();
+
+  spin_lock(&base->lock);
+
+  while (base->first) {
+    struct hrtimer *timer = rb_entry(base->first, struct hrtimer, node);
+    if (timer->expires > ktime_get()) {
+      break;
+    }
+
+    dequeue_hrtimer(base, timer);
+    timer->state |= HRTIMER_STATE_CALLBACK;
+    base->running = timer;
+
+    /* Callbacks may start and cancel timers themselves */
+    spin_unlock(&base->lock);
+    enum hrtimer_restart restart = timer->function(timer);
+    spin_lock(&base->lock);
+
+    if (restart == HRTIMER_RESTART && !(timer->state & HRTIMER_STATE_ENQUEUED)) {
+      enqueue_hrtimer(base, timer);
+    }
+    timer->state &= ~HRTIMER_STATE_CALLBACK;
+    base->running = NULL;
+  }
+
+  hrtimer_reprogram(base);
+  spin_unlock(&base->lock);
+}
+
+/* ===================================================================== */
+/* Sleeping */
+/* ===================================================================== */
+
+static enum hrtimer_restart hrtimer_wakeup(struct hrtimer *timer) {
+  struct hrtimer_sleeper *sl = container_of(timer, struct hrtimer_sleeper, timer);
+
+  sl->expired = 1;
+  wake_up(sl->wq);
+  return HRTIMER_NORESTART;
+}
+
+void hrtimer_sleeper_start(struct hrtimer_sleeper *sl, wait_queue_head_t *wq,
+                           ktime_t timeout) {
+  sl->wq = wq;
+  sl->expired = 0;
+  hrtimer_init(&sl->timer, hrtimer_wakeup);
+  hrtimer_start(&sl->timer, timeout, HRTIMER_MODE_REL);
+}
+
+int hrtimer_sleep(ktime_t ns) {
+  if (hrtimer_no_events) {
+    /* No one-shot timer to wake us: give the CPU away until it is time */
+    ktime_t deadline = ktime_get() + ns;
+    while (ktime_get() < deadline) {
+      process_yield();
+    }
+    return 0;
+  }
+
+  wait_queue_head_t wq;
+  struct hrtimer_sleeper sl;
+
+  init_waitqueue_head(&wq);
+  hrtimer_sleeper_start(&sl, &wq, ns);
+  int ret = wait_event_killable(wq, sl.expired);
+  hrtimer_cancel(&sl.timer);
+  return ret;
+}
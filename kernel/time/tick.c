@@ -0,0 +1,49 @@
+/*
+ * vib-OS Kernel - Scheduler Tick
+ */
+
+#include "time/tick.h"
+#include "arch/arch.h"
+#include "core/process.h"
+#include "sched/sched.h"
+
+static struct hrtimer tick_timers[MAX_CPUS];
+static volatile int tick_stopped[MAX_CPUS];
+
+static enum hrtimer_restart tick_sched_timer(struct hrtimer *timer) {
+  /* Run queue bookkeeping and periodic load balancing */
+  scheduler_tick();
+
+  /* Invoke scheduler for preemptive multitasking */
+  process_schedule_from_irq();
+
+  hrtimer_forward_now(timer, TICK_NSEC);
+  return HRTIMER_RESTART;
+}
+
+void tick_cpu_init(void) {
+  struct hrtimer *tick = &tick_timers[arch_cpu_id()];
+
+  hrtimer_init(tick, tick_sched_timer);
+  hrtimer_start(tick, TICK_NSEC, HRTIMER_MODE_REL);
+}
+
+void tick_nohz_idle_enter(void) {
+  uint32_t cpu = arch_cpu_id();
+
+  if (!tick_stopped[cpu]) {
+    tick_stopped[cpu] = 1;
+    hrtimer_cancel(&tick_timers[cpu]);
+  }
+}
+
+void tick_nohz_idle_exit(void) {
+  unsigned long flags = arch_irq_save();
+  uint32_t cpu = arch_cpu_id();
+
+  if (tick_stopped[cpu]) {
+    tick_stopped[cpu] = 0;
+    hrtimer_start(&tick_timers[cpu], TICK_NSEC, HRTIMER_MODE_REL);
+  }
+  arch_irq_restore(flags);
+}
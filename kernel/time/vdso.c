@@ -0,0 +1,114 @@
+/*
+ * vib-OS Kernel - vDSO Time Data
+ */
+
+#include "time/vdso.h"
+#include "arch/arch.h"
+#include "fs/vfs.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "printk.h"
+#include "string.h"
+#include "sync/spinlock.h"
+
+/* 32 fractional bits keep the rounding error below a nanosecond a day */
+#define VDSO_SHIFT 32
+
+static struct vdso_data *vdso_data;
+static phys_addr_t vdso_page;
+static DEFINE_SPINLOCK(vdso_lock); /* Serializes writers */
+
+int vdso_init(void) {
+  phys_addr_t page = pmm_alloc_page();
+  if (!page) {
+    return -1;
+  }
+
+  struct vdso_data *vd = (struct vdso_data *)page;
+  memset(vd, 0, PAGE_SIZE);
+
+  uint64_t freq = arch_timer_get_frequency();
+  vd->freq = freq;
+  vd->shift = VDSO_SHIFT;
+  vd->mult = freq ? (NSEC_PER_SEC << VDSO_SHIFT) / freq : 0;
+#ifdef ARCH_ARM64
+  /* The timer code lets EL0 read the virtual counter */
+  vd->clock_mode = VDSO_CLOCKMODE_CNTVCT;
+#else
+  vd->clock_mode = VDSO_CLOCKMODE_NONE;
+#endif
+
+  vdso_page = page;
+  __atomic_store_n(&vdso_data, vd, __ATOMIC_RELEASE);
+
+  printk(KERN_INFO "VDSO: %lu Hz counter, mult %lu >> %u\n",
+         (unsigned long)freq, (unsigned long)vd->mult, vd->shift);
+  return 0;
+}
+
+int vdso_map(struct mm_struct *mm) {
+  if (!mm || !vdso_page) {
+    return -1;
+  }
+  uint32_t flags = VM_READ | VM_USER | VM_SHARED;
+  if (vmm_add_vma(mm, VDSO_DATA_ADDR, VDSO_DATA_ADDR + PAGE_SIZE, flags) < 0) {
+    /* Already there, inherited from the parent */
+    return vmm_mm_virt_to_phys(mm, VDSO_DATA_ADDR) == vdso_page ? 0 : -1;
+  }
+  if (vmm_map_user_page(mm, VDSO_DATA_ADDR, vdso_page, flags) < 0) {
+    vmm_munmap(mm, VDSO_DATA_ADDR, PAGE_SIZE);
+    return -1;
+  }
+  /* Dropped again by munmap() or the end of the address space */
+  pmm_get_page(vdso_page);
+  return 0;
+}
+
+uint64_t vdso_clock_ns(void) {
+  const struct vdso_data *vd = __atomic_load_n(&vdso_data, __ATOMIC_ACQUIRE);
+
+  /* mult and shift never change once published */
+  if (!vd) {
+    return ktime_get();
+  }
+  return vdso_cycles_to_ns(vd, arch_timer_get_ticks());
+}
+
+int vdso_clock_gettime(int clock, int64_t *ns) {
+  const struct vdso_data *vd = __atomic_load_n(&vdso_data, __ATOMIC_ACQUIRE);
+  int64_t offset = 0;
+
+  switch (clock) {
+  case CLOCK_MONOTONIC:
+  case CLOCK_MONOTONIC_RAW:
+  case CLOCK_BOOTTIME:
+    break;
+  case CLOCK_REALTIME:
+    /* The sequence count is for userspace; here the writers' lock will do */
+    if (vd) {
+      spin_lock(&vdso_lock);
+      offset = vd->realtime_offset;
+      spin_unlock(&vdso_lock);
+    }
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  *ns = (int64_t)vdso_clock_ns() + offset;
+  return 0;
+}
+
+void vdso_set_realtime(int64_t ns) {
+  struct vdso_data *vd = vdso_data;
+  if (!vd) {
+    return;
+  }
+
+  spin_lock(&vdso_lock);
+  __atomic_store_n(&vd->seq, vd->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  vd->realtime_offset = ns - (int64_t)vdso_clock_ns();
+  __atomic_store_n(&vd->seq, vd->seq + 1, __ATOMIC_RELEASE);
+  spin_unlock(&vdso_lock);
+}
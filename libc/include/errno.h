@@ -49,5 +49,6 @@ extern int errno;
 #define ELOOP           40  /* Too many symbolic links */
 #define EWOULDBLOCK     EAGAIN
 #define ENOMSG          42  /* No message of desired type */
+#define ETIMEDOUT       110 /* Connection timed out */
 
 #endif /* _ERRNO_H */
@@ -6,6 +6,7 @@
 #define _FCNTL_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* Open flags */
 #define O_RDONLY    00000000
@@ -36,11 +37,26 @@
 #define F_GETLK     5
 #define F_SETLK     6
 #define F_SETLKW    7
+#define F_DUPFD_CLOEXEC 1030
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
 
 #define FD_CLOEXEC  1
 
+/* splice/tee/vmsplice flags */
+#define SPLICE_F_MOVE     1
+#define SPLICE_F_NONBLOCK 2
+#define SPLICE_F_MORE     4
+#define SPLICE_F_GIFT     8
+
 int open(const char *path, int flags, ...);
 int creat(const char *path, mode_t mode);
 int fcntl(int fd, int cmd, ...);
 
+ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+               size_t len, unsigned int flags);
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs,
+                 unsigned int flags);
+
 #endif /* _FCNTL_H */
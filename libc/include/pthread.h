@@ -0,0 +1,45 @@
+/*
+ * Vib-OS libc - pthread.h
+ *
+ * Mutexes and condition variables built on the futex system call. Locking
+ * and unlocking an uncontended mutex never enters the kernel.
+ */
+
+#ifndef _PTHREAD_H
+#define _PTHREAD_H
+
+#include <sys/types.h>
+
+typedef struct {
+    volatile int lock;          /* 0 unlocked, 1 locked, 2 locked with waiters */
+} pthread_mutex_t;
+
+typedef struct {
+    int type;
+} pthread_mutexattr_t;
+
+typedef struct {
+    volatile int seq;           /* Bumped by every signal and broadcast */
+    pthread_mutex_t *volatile mutex; /* Mutex the waiters last used */
+} pthread_cond_t;
+
+typedef struct {
+    int shared;
+} pthread_condattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+#define PTHREAD_COND_INITIALIZER  { 0, 0 }
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+
+#endif /* _PTHREAD_H */
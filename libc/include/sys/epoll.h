@@ -0,0 +1,57 @@
+/*
+ * Vib-OS libc - sys/epoll.h
+ */
+
+#ifndef _SYS_EPOLL_H
+#define _SYS_EPOLL_H
+
+#include <sys/types.h>
+#include <signal.h>
+#include <fcntl.h>
+
+#define EPOLL_CLOEXEC   O_CLOEXEC
+
+/* epoll_ctl() operations */
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+/* Events */
+#define EPOLLIN         0x001
+#define EPOLLPRI        0x002
+#define EPOLLOUT        0x004
+#define EPOLLERR        0x008
+#define EPOLLHUP        0x010
+#define EPOLLRDNORM     0x040
+#define EPOLLWRNORM     0x100
+#define EPOLLRDHUP      0x2000
+#define EPOLLEXCLUSIVE  (1U << 28)
+#define EPOLLWAKEUP     (1U << 29)
+#define EPOLLONESHOT    (1U << 30)
+#define EPOLLET         (1U << 31)
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    unsigned int u32;
+    unsigned long long u64;
+} epoll_data_t;
+
+struct epoll_event {
+    unsigned int events;
+    epoll_data_t data;
+}
+#ifdef __x86_64__
+__attribute__((packed))
+#endif
+;
+
+int epoll_create(int size);
+int epoll_create1(int flags);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+                int timeout, const sigset_t *sigmask);
+
+#endif /* _SYS_EPOLL_H */
@@ -0,0 +1,106 @@
+/*
+ * Vib-OS libc - sys/io_uring.h
+ *
+ * io_uring_setup() maps the rings itself: cq_off.user_addr in the
+ * returned parameters is the rings region and sq_off.user_addr the SQE
+ * array, so there is nothing to mmap().
+ */
+
+#ifndef _SYS_IO_URING_H
+#define _SYS_IO_URING_H
+
+#include <sys/types.h>
+#include <signal.h>
+
+struct io_uring_sqe {
+    unsigned char opcode;
+    unsigned char flags;
+    unsigned short ioprio;
+    int fd;
+    unsigned long long off;     /* -1 for the file position; TIMEOUT: count */
+    unsigned long long addr;
+    unsigned int len;
+    unsigned int op_flags;      /* OPENAT: open flags; TIMEOUT: flags */
+    unsigned long long user_data;
+    unsigned short buf_index;
+    unsigned short personality;
+    int splice_fd_in;
+    unsigned long long addr3;
+    unsigned long long __pad2[1];
+};
+
+struct io_uring_cqe {
+    unsigned long long user_data;
+    int res;
+    unsigned int flags;
+};
+
+/* Opcodes */
+#define IORING_OP_NOP       0
+#define IORING_OP_TIMEOUT   11
+#define IORING_OP_OPENAT    18
+#define IORING_OP_READ      22
+#define IORING_OP_WRITE     23
+#define IORING_OP_SEND      26
+#define IORING_OP_RECV      27
+
+/* sqe->flags */
+#define IOSQE_ASYNC         (1U << 4)
+
+/* sqe->op_flags for IORING_OP_TIMEOUT */
+#define IORING_TIMEOUT_ABS  (1U << 0)
+
+/* io_uring_params.flags */
+#define IORING_SETUP_CQSIZE (1U << 3)
+
+/* io_uring_params.features */
+#define IORING_FEAT_NODROP  (1U << 1)
+
+/* Ring flags */
+#define IORING_SQ_CQ_OVERFLOW (1U << 1)
+
+/* io_uring_enter() flags */
+#define IORING_ENTER_GETEVENTS (1U << 0)
+
+struct io_sqring_offsets {
+    unsigned int head;
+    unsigned int tail;
+    unsigned int ring_mask;
+    unsigned int ring_entries;
+    unsigned int flags;
+    unsigned int dropped;
+    unsigned int array;
+    unsigned int resv1;
+    unsigned long long user_addr;
+};
+
+struct io_cqring_offsets {
+    unsigned int head;
+    unsigned int tail;
+    unsigned int ring_mask;
+    unsigned int ring_entries;
+    unsigned int overflow;
+    unsigned int cqes;
+    unsigned int flags;
+    unsigned int resv1;
+    unsigned long long user_addr;
+};
+
+struct io_uring_params {
+    unsigned int sq_entries;
+    unsigned int cq_entries;
+    unsigned int flags;
+    unsigned int sq_thread_cpu;
+    unsigned int sq_thread_idle;
+    unsigned int features;
+    unsigned int wq_fd;
+    unsigned int resv[3];
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+};
+
+int io_uring_setup(unsigned int entries, struct io_uring_params *p);
+int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                   unsigned int flags, const sigset_t *sig);
+
+#endif /* _SYS_IO_URING_H */
@@ -0,0 +1,15 @@
+/*
+ * Vib-OS libc - sys/uio.h
+ */
+
+#ifndef _SYS_UIO_H
+#define _SYS_UIO_H
+
+#include <sys/types.h>
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+#endif /* _SYS_UIO_H */
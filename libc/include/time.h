@@ -0,0 +1,27 @@
+/*
+ * Vib-OS libc - time.h
+ */
+
+#ifndef _TIME_H
+#define _TIME_H
+
+#include <sys/types.h>
+
+typedef int clockid_t;
+
+struct timespec {
+    time_t tv_sec;
+    long   tv_nsec;
+};
+
+/* Clocks; all but CLOCK_REALTIME count from boot */
+#define CLOCK_REALTIME          0
+#define CLOCK_MONOTONIC         1
+#define CLOCK_MONOTONIC_RAW     4
+#define CLOCK_BOOTTIME          7
+
+/* Served from the kernel's vDSO page without a syscall */
+int clock_gettime(clockid_t clk, struct timespec *tp);
+int clock_settime(clockid_t clk, const struct timespec *tp);
+
+#endif /* _TIME_H */
@@ -51,8 +51,10 @@ int chdir(const char *path);
 char *getcwd(char *buf, size_t size);
 
 int pipe(int pipefd[2]);
+int pipe2(int pipefd[2], int flags);
 int dup(int oldfd);
 int dup2(int oldfd, int newfd);
+int dup3(int oldfd, int newfd, int flags);
 
 unsigned int sleep(unsigned int seconds);
 int usleep(unsigned int usec);
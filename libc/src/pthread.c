@@ -0,0 +1,147 @@
+/*
+ * UnixOS - Minimal C Library Implementation
+ * Mutexes and Condition Variables
+ *
+ * The mutex is the three-state futex lock from Drepper's "Futexes Are
+ * Tricky": 0 is unlocked, 1 locked, 2 locked with possible waiters. Only
+ * an unlock that sees 2 has to wake anyone.
+ *
+ * A condition variable is a sequence number. Waiters sleep on it until a
+ * signal or broadcast changes it, and then retake the mutex as contended.
+ */
+
+#include "../include/pthread.h"
+#include "../include/errno.h"
+
+#define FUTEX_WAIT_PRIVATE        (0 | 128)
+#define FUTEX_WAKE_PRIVATE        (1 | 128)
+#define FUTEX_CMP_REQUEUE_PRIVATE (4 | 128)
+
+#define INT_MAX 0x7fffffff
+
+/* Defined in syscall.c */
+long __futex(volatile int *uaddr, int op, int val, const void *timeout,
+             volatile int *uaddr2, int val3);
+
+static inline int cas(volatile int *p, int old, int new)
+{
+    __atomic_compare_exchange_n(p, &old, new, 0, __ATOMIC_ACQUIRE,
+                                __ATOMIC_RELAXED);
+    return old;
+}
+
+static inline int xchg(volatile int *p, int v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);
+}
+
+/* ===================================================================== */
+/* Mutexes */
+/* ===================================================================== */
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+    (void)attr;
+    mutex->lock = 0;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    return mutex->lock ? EBUSY : 0;
+}
+
+/* Take the mutex marked as contended, sleeping while someone else has it */
+static void mutex_lock_contended(pthread_mutex_t *mutex)
+{
+    while (xchg(&mutex->lock, 2) != 0) {
+        __futex(&mutex->lock, FUTEX_WAIT_PRIVATE, 2, 0, 0, 0);
+    }
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    int c = cas(&mutex->lock, 0, 1);
+
+    if (c != 0) {
+        mutex_lock_contended(mutex);
+    }
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    return cas(&mutex->lock, 0, 1) == 0 ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    if (xchg(&mutex->lock, 0) == 2) {
+        __futex(&mutex->lock, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+    }
+    return 0;
+}
+
+/* ===================================================================== */
+/* Condition variables */
+/* ===================================================================== */
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    (void)attr;
+    cond->seq = 0;
+    cond->mutex = 0;
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    (void)cond;
+    return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int seq = __atomic_load_n(&cond->seq, __ATOMIC_ACQUIRE);
+
+    cond->mutex = mutex;
+    pthread_mutex_unlock(mutex);
+
+    /* Returns at once if the sequence moved since we read it */
+    __futex(&cond->seq, FUTEX_WAIT_PRIVATE, seq, 0, 0, 0);
+
+    /*
+     * We may have been requeued onto the mutex by a broadcast. Locking it
+     * as contended makes our unlock wake the next one of those.
+     */
+    mutex_lock_contended(mutex);
+    return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    __atomic_fetch_add(&cond->seq, 1, __ATOMIC_RELEASE);
+    __futex(&cond->seq, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    pthread_mutex_t *mutex = cond->mutex;
+    int seq = __atomic_add_fetch(&cond->seq, 1, __ATOMIC_RELEASE);
+
+    if (!mutex) {
+        return 0;               /* Nobody has ever waited */
+    }
+
+    /*
+     * Wake one waiter and move the rest onto the mutex, where each unlock
+     * lets the next one in, instead of waking them all to fight over it.
+     * If the sequence moved again in the meantime, just wake everyone.
+     */
+    if (__futex(&cond->seq, FUTEX_CMP_REQUEUE_PRIVATE, 1, (const void *)(long)INT_MAX,
+                &mutex->lock, seq) < 0) {
+        __futex(&cond->seq, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+    }
+    return 0;
+}
@@ -10,12 +10,19 @@
 #include "../include/signal.h"
 #include "../include/fcntl.h"
 #include "../include/errno.h"
+#include "../include/sys/epoll.h"
+#include "../include/sys/io_uring.h"
+#include "../include/time.h"
+#include "../include/stdarg.h"
 
 /* ===================================================================== */
 /* ARM64 syscall numbers (Linux ABI) */
 /* ===================================================================== */
 
 #define __NR_getcwd         17
+#define __NR_epoll_create1  20
+#define __NR_epoll_ctl      21
+#define __NR_epoll_pwait    22
 #define __NR_dup            23
 #define __NR_dup3           24
 #define __NR_fcntl          25
@@ -36,6 +43,9 @@
 #define __NR_write          64
 #define __NR_readv          65
 #define __NR_writev         66
+#define __NR_vmsplice       75
+#define __NR_splice         76
+#define __NR_tee            77
 #define __NR_readlinkat     78
 #define __NR_fstatat        79
 #define __NR_fstat          80
@@ -44,7 +54,10 @@
 #define __NR_faccessat      48
 #define __NR_exit           93
 #define __NR_exit_group     94
+#define __NR_futex          98
 #define __NR_nanosleep      101
+#define __NR_clock_settime  112
+#define __NR_clock_gettime  113
 #define __NR_kill           129
 #define __NR_tgkill         131
 #define __NR_sigaction      134
@@ -69,6 +82,8 @@
 #define __NR_clone          220
 #define __NR_execve         221
 #define __NR_wait4          260
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
 
 /* AT_FDCWD for *at syscalls */
 #define AT_FDCWD            -100
@@ -347,6 +362,11 @@ int pipe(int pipefd[2])
     return __syscall_ret(__syscall2(__NR_pipe2, (long)pipefd, 0));
 }
 
+int pipe2(int pipefd[2], int flags)
+{
+    return __syscall_ret(__syscall2(__NR_pipe2, (long)pipefd, flags));
+}
+
 int dup(int oldfd)
 {
     return __syscall_ret(__syscall1(__NR_dup, oldfd));
@@ -354,14 +374,91 @@ int dup(int oldfd)
 
 int dup2(int oldfd, int newfd)
 {
-    if (oldfd == newfd) return newfd;
+    /* dup3() rejects this case, but oldfd must still be valid */
+    if (oldfd == newfd) {
+        return fcntl(oldfd, F_GETFD) < 0 ? -1 : newfd;
+    }
     return __syscall_ret(__syscall3(__NR_dup3, oldfd, newfd, 0));
 }
 
+int dup3(int oldfd, int newfd, int flags)
+{
+    return __syscall_ret(__syscall3(__NR_dup3, oldfd, newfd, flags));
+}
+
 int fcntl(int fd, int cmd, ...)
 {
-    /* Simplified: only handles commands without extra args */
-    return __syscall_ret(__syscall3(__NR_fcntl, fd, cmd, 0));
+    va_list ap;
+    va_start(ap, cmd);
+    long arg = va_arg(ap, long);
+    va_end(ap);
+    return __syscall_ret(__syscall3(__NR_fcntl, fd, cmd, arg));
+}
+
+ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+               size_t len, unsigned int flags)
+{
+    return __syscall_ret(__syscall6(__NR_splice, fd_in, (long)off_in, fd_out,
+                                    (long)off_out, (long)len, flags));
+}
+
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+    return __syscall_ret(__syscall4(__NR_tee, fd_in, fd_out, (long)len, flags));
+}
+
+ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs,
+                 unsigned int flags)
+{
+    return __syscall_ret(__syscall4(__NR_vmsplice, fd, (long)iov,
+                                    (long)nr_segs, flags));
+}
+
+int epoll_create1(int flags)
+{
+    return __syscall_ret(__syscall1(__NR_epoll_create1, flags));
+}
+
+int epoll_create(int size)
+{
+    /* The size hint is obsolete but must be positive */
+    if (size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    return __syscall_ret(__syscall4(__NR_epoll_ctl, epfd, op, fd, (long)event));
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+                int timeout, const sigset_t *sigmask)
+{
+    return __syscall_ret(__syscall6(__NR_epoll_pwait, epfd, (long)events,
+                                    maxevents, timeout, (long)sigmask,
+                                    sizeof(sigset_t)));
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout)
+{
+    return epoll_pwait(epfd, events, maxevents, timeout, NULL);
+}
+
+int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return __syscall_ret(__syscall2(__NR_io_uring_setup, entries, (long)p));
+}
+
+int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                   unsigned int flags, const sigset_t *sig)
+{
+    return __syscall_ret(__syscall6(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, (long)sig,
+                                    sizeof(sigset_t)));
 }
 
 int isatty(int fd)
@@ -498,3 +595,72 @@ int usleep(unsigned int usec)
     
     return __syscall_ret(__syscall2(__NR_nanosleep, (long)&ts, 0));
 }
+
+/*
+ * The kernel maps its time data read-only at a fixed address in every
+ * process; the layout must match kernel/include/time/vdso.h.
+ */
+#define VDSO_DATA_ADDR          0x00007FFFFFFFE000UL
+#define VDSO_CLOCKMODE_CNTVCT   1
+
+struct vdso_data {
+    volatile unsigned int seq;
+    unsigned int clock_mode;
+    unsigned long freq;
+    unsigned long mult;
+    unsigned int shift;
+    unsigned int __pad;
+    long realtime_offset;
+};
+
+int clock_gettime(clockid_t clk, struct timespec *tp)
+{
+    const struct vdso_data *vd = (const struct vdso_data *)VDSO_DATA_ADDR;
+    unsigned long cnt, ns;
+    unsigned int seq;
+    long offset;
+    
+    if (clk != CLOCK_REALTIME && clk != CLOCK_MONOTONIC &&
+        clk != CLOCK_MONOTONIC_RAW && clk != CLOCK_BOOTTIME) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (vd->clock_mode != VDSO_CLOCKMODE_CNTVCT) {
+        return __syscall_ret(__syscall2(__NR_clock_gettime, clk, (long)tp));
+    }
+    
+    do {
+        while ((seq = __atomic_load_n(&vd->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        offset = clk == CLOCK_REALTIME ? vd->realtime_offset : 0;
+        /* isb keeps the counter read from running ahead of the loads */
+        __asm__ volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(cnt) :: "memory");
+        ns = (unsigned long)(((unsigned __int128)cnt * vd->mult) >> vd->shift);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (vd->seq != seq);
+    
+    ns += offset;
+    tp->tv_sec = ns / 1000000000UL;
+    tp->tv_nsec = ns % 1000000000UL;
+    return 0;
+}
+
+int clock_settime(clockid_t clk, const struct timespec *tp)
+{
+    return __syscall_ret(__syscall2(__NR_clock_settime, clk, (long)tp));
+}
+
+/* ===================================================================== */
+/* Futex */
+/* ===================================================================== */
+
+/*
+ * Raw futex call for the pthread primitives. Returns the kernel's result
+ * as is, negative errno included, and leaves errno alone.
+ */
+long __futex(volatile int *uaddr, int op, int val, const void *timeout,
+             volatile int *uaddr2, int val3)
+{
+    return __syscall6(__NR_futex, (long)uaddr, op, val, (long)timeout,
+                      (long)uaddr2, val3);
+}
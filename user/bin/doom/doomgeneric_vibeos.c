@@ -21,7 +21,7 @@ extern void D_PostEvent(event_t *ev);
 kapi_t *doom_kapi = 0;
 
 /* Start time for DG_GetTicksMs */
-static uint64_t start_ticks = 0;
+static uint64_t start_ms = 0;
 
 /* Screen positioning - calculated at runtime to center on any resolution */
 static int screen_offset_x = 0;
@@ -175,7 +175,7 @@ static void poll_mouse(void) {
 
 void DG_Init(void) {
     /* Record start time */
-    start_ticks = doom_kapi->get_uptime_ticks();
+    start_ms = doom_kapi->get_uptime_ms();
 
     /* Force 2x scaling for fullscreen effect */
     int fb_w = doom_kapi->fb_width;
@@ -251,9 +251,7 @@ void DG_SleepMs(uint32_t ms) {
 }
 
 uint32_t DG_GetTicksMs(void) {
-    /* VibeOS ticks are 10ms each (100Hz timer) */
-    uint64_t now = doom_kapi->get_uptime_ticks();
-    return (uint32_t)((now - start_ticks) * 10);
+    return (uint32_t)(doom_kapi->get_uptime_ms() - start_ms);
 }
 
 int DG_GetKey(int *pressed, unsigned char *doomKey) {
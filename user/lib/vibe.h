@@ -213,6 +213,9 @@ typedef struct kapi {
 
     /* Input Polling (Direct) */
     void (*input_poll)(void);
+
+    // Monotonic clock in milliseconds (finer than get_uptime_ticks)
+    unsigned long (*get_uptime_ms)(void);
 } kapi_t;
 
 // TTF glyph info (returned by ttf_get_glyph)